@@ -25,6 +25,8 @@ elif [ "$server" = "fuse3" ]; then
 	plat_files="$plat_files ../src/tup/server/fuse*.c ../src/tup/server/master_fork.c ../src/tup/server/symlink.c"
 elif [ "$server" = "ldpreload" ]; then
 	plat_files="../src/tup/server/depfile.c ../src/tup/server/privs.c ../src/tup/server/symlink.c"
+elif [ "$server" = "seccomp" ]; then
+	plat_files="../src/tup/server/seccomp.c ../src/tup/server/privs.c ../src/tup/server/symlink.c"
 else
 	echo "Error: invalid TUP_SERVER \"$server\"" 1>&2
 	exit 1
@@ -44,6 +44,8 @@
 #include <dlfcn.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
 
 int __xstat(int vers, const char *name, struct stat *buf);
 int stat(const char *filename, struct stat *buf);
@@ -58,6 +60,8 @@ static char cwd[PATH_MAX];
 static int cwdlen = -1;
 static void handle_file(const char *file, const char *file2, int at);
 static void handle_file_dirfd(int dirfd, const char *file, const char *file2, int at);
+static void flush_events(void);
+static void flush_events_locked(void);
 static int ignore_file(const char *file);
 static int update_cwd(void);
 
@@ -93,6 +97,8 @@ static int (*s_stat64)(const char *name, struct stat64 *buf);
 static int (*s_xstat64)(int vers, const char *name, struct stat64 *buf);
 static int (*s_lxstat64)(int vers, const char *path, struct stat64 *buf);
 static void (*s_mcleanup)(void);
+static void (*s__exit)(int) __attribute__((noreturn));
+static void (*s__Exit)(int) __attribute__((noreturn));
 
 #define WRAP(ptr, name) \
 	if(!ptr) { \
@@ -118,9 +124,60 @@ static int errored = 0;
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 static int depfd = -1;
 
+/* Events are collected here and appended to the depfile in one write() rather
+ * than several write()s per event. Reads are by far the most common event, so
+ * only those are held back - anything that modifies the filesystem flushes
+ * the buffer right away so that its ordering relative to other processes in
+ * the job is preserved. The buffer is also flushed before fork() and exec(),
+ * and when the process exits.
+ *
+ * The buffer is a shared mapping of a spill file next to the depfile rather
+ * than plain memory, so that the events are not lost if the process is killed
+ * by a signal before it can flush them (eg: SIGPIPE in 'cat a b | head -1').
+ * The spill file is announced in the depfile with an ACCESS_SPILL event when
+ * it is created, and the server picks up whatever is left in it once the job
+ * is done. The header holds the number of bytes of complete events in the
+ * buffer, and is only updated after an event has been fully copied in.
+ */
+#define SPILL_SIZE (64 * 1024)
+struct spill_header {
+	int used;
+};
+static char depfile_name[PATH_MAX];
+static struct spill_header *spill = NULL;
+static char *event_buf = NULL;
+static int event_buflen = 0;
+#define EVENT_BUF_SIZE ((int)(SPILL_SIZE - sizeof(struct spill_header)))
+
+/* The paths this process has already reported reading, so that programs
+ * that stat or open the same header hundreds of times only send it once.
+ * Entries are looked up by hash, and the path itself is kept in read_paths so
+ * that a hash collision can't hide a read of a different file. Anything that
+ * changes the filesystem resets the set, since a read after a rename or
+ * unlink may refer to a different file. The set is simply cleared when it
+ * fills up.
+ */
+#define READ_SET_SIZE 4096
+#define READ_PATHS_SIZE (256 * 1024)
+struct read_entry {
+	uint64_t hash;
+	int offset;
+	int len;
+};
+static struct read_entry read_set[READ_SET_SIZE];
+static int read_set_count = 0;
+static char read_paths[READ_PATHS_SIZE];
+static int read_paths_len = 0;
+
+static void clear_read_set(void);
+
 static void prepare(void)
 {
 	pthread_mutex_lock(&mutex);
+	/* Otherwise the child would inherit a copy of the buffer and the
+	 * events would be written out twice.
+	 */
+	flush_events_locked();
 }
 
 static void parent(void)
@@ -136,6 +193,20 @@ static void parent(void)
 static void child(void)
 {
 	int rc;
+
+	/* The child has its own set of reads to report. */
+	clear_read_set();
+
+	/* The mapping is shared with the parent, so the child needs to
+	 * create its own spill file the next time it reads something. The
+	 * buffer was flushed in prepare(), so there is nothing to lose here.
+	 */
+	if(spill) {
+		munmap(spill, SPILL_SIZE);
+		spill = NULL;
+		event_buf = NULL;
+		event_buflen = 0;
+	}
 	rc = pthread_mutex_unlock(&mutex);
 	if(rc != 0) {
 		fprintf(stderr, "tup error: pthread_mutex_unlock() failed in child atfork handler with rc=%i\n", rc);
@@ -156,6 +227,10 @@ static void init_fd(void)
 		fprintf(stderr, "tup error: Unable to find dependency filename in the TUP_DEPFILE environment variable.\n");
 		goto out_error;
 	}
+	if(snprintf(depfile_name, sizeof(depfile_name), "%s", depfile) >= (int)sizeof(depfile_name)) {
+		fprintf(stderr, "tup error: Dependency filename is too long: %s\n", depfile);
+		goto out_error;
+	}
 	WRAP(s_open, "open");
 	if(depfd < 0) {
 		depfd = s_open(depfile, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
@@ -171,6 +246,12 @@ out_error:
 	errored = 1;
 }
 
+static void fini_fd(void) __attribute__((destructor));
+static void fini_fd(void)
+{
+	flush_events();
+}
+
 int open(const char *pathname, int flags, ...)
 {
 	int rc;
@@ -477,6 +558,7 @@ int execve(const char *filename, char *const argv[], char *const envp[])
 
 	WRAP(s_execve, "execve");
 	handle_file(filename, "", ACCESS_READ);
+	flush_events();
 	rc = s_execve(filename, argv, envp);
 	return rc;
 }
@@ -487,6 +569,7 @@ int execv(const char *path, char *const argv[])
 
 	WRAP(s_execv, "execv");
 	handle_file(path, "", ACCESS_READ);
+	flush_events();
 	rc = s_execv(path, argv);
 	return rc;
 }
@@ -527,10 +610,12 @@ int execvp(const char *file, char *const argv[])
 	for(p = file; *p; p++) {
 		if(*p == '/') {
 			handle_file(file, "", ACCESS_READ);
+			flush_events();
 			rc = s_execvp(file, argv);
 			return rc;
 		}
 	}
+	flush_events();
 	rc = s_execvp(file, argv);
 	return rc;
 }
@@ -618,6 +703,23 @@ void _mcleanup(void)
 	s_mcleanup();
 }
 
+/* _exit() skips the atexit handlers, so make sure any buffered events get out
+ * before the process goes away.
+ */
+void _exit(int status)
+{
+	WRAP(s__exit, "_exit");
+	flush_events();
+	s__exit(status);
+}
+
+void _Exit(int status)
+{
+	WRAP(s__Exit, "_Exit");
+	flush_events();
+	s__Exit(status);
+}
+
 static int write_all(int fd, const void *data, int size)
 {
 	if(write(fd, data, size) != size) {
@@ -628,11 +730,217 @@ static int write_all(int fd, const void *data, int size)
 	return 0;
 }
 
+static int write_locked(const void *data, int size)
+{
+	int rc = 0;
+
+	if(tup_flock(depfd) < 0) {
+		fprintf(stderr, "tup error: Unable to lock dependency file for writing [%i]\n", depfd);
+		return -1;
+	}
+	if(write_all(depfd, data, size) < 0)
+		rc = -1;
+	if(tup_unflock(depfd) < 0) {
+		fprintf(stderr, "tup error: Unable to unlock dependency file.\n");
+		rc = -1;
+	}
+	return rc;
+}
+
+static void set_spill_used(int used)
+{
+	event_buflen = used;
+	__atomic_store_n(&spill->used, used, __ATOMIC_RELEASE);
+}
+
+static int open_spill(void)
+{
+	char name[PATH_MAX];
+	char buf[sizeof(struct access_event) + PATH_MAX + 1];
+	struct access_event event;
+	void *map;
+	int fd;
+	int x;
+
+	WRAP(s_open, "open");
+	for(x=0; ; x++) {
+		if(snprintf(name, sizeof(name), "%s-%i-%i", depfile_name, (int)getpid(), x) >= (int)sizeof(name)) {
+			fprintf(stderr, "tup error: Spill filename is too long for '%s'\n", depfile_name);
+			return -1;
+		}
+		fd = s_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+		if(fd >= 0)
+			break;
+		if(errno != EEXIST) {
+			perror(name);
+			fprintf(stderr, "tup error: Unable to create a spill file for dependencies.\n");
+			return -1;
+		}
+	}
+	if(ftruncate(fd, SPILL_SIZE) < 0) {
+		perror("ftruncate");
+		fprintf(stderr, "tup error: Unable to size the dependency spill file.\n");
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, SPILL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) {
+		perror("mmap");
+		fprintf(stderr, "tup error: Unable to map the dependency spill file.\n");
+		return -1;
+	}
+
+	/* Announce the spill file before anything goes in it, so the server
+	 * always knows to look for it.
+	 */
+	event.at = ACCESS_SPILL;
+	event.len = strlen(name);
+	event.len2 = 0;
+	memcpy(buf, &event, sizeof(event));
+	memcpy(buf + sizeof(event), name, event.len + 1);
+	buf[sizeof(event) + event.len + 1] = 0;
+	if(write_locked(buf, sizeof(event) + event.len + 2) < 0) {
+		munmap(map, SPILL_SIZE);
+		return -1;
+	}
+
+	spill = map;
+	event_buf = (char*)(spill + 1);
+	set_spill_used(0);
+	return 0;
+}
+
+static void flush_events_locked(void)
+{
+	if(event_buflen == 0)
+		return;
+	if(errored)
+		goto out;
+
+	if(write_locked(event_buf, event_buflen) < 0)
+		errored = 1;
+out:
+	/* If we die between the write and this, the server sees the events
+	 * twice, which is harmless.
+	 */
+	set_spill_used(0);
+}
+
+static void flush_events(void)
+{
+	pthread_mutex_lock(&mutex);
+	flush_events_locked();
+	pthread_mutex_unlock(&mutex);
+}
+
+static uint64_t hash_path(uint64_t h, const char *s, int len)
+{
+	int x;
+
+	/* FNV-1a */
+	for(x=0; x<len; x++) {
+		h ^= (unsigned char)s[x];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static void clear_read_set(void)
+{
+	if(read_set_count) {
+		memset(read_set, 0, sizeof(read_set));
+		read_set_count = 0;
+		read_paths_len = 0;
+	}
+}
+
+static int read_entry_matches(const struct read_entry *re, const char *dirname, int dirlen,
+			      const char *file, int len, int prepend_dir)
+{
+	const char *p = read_paths + re->offset;
+
+	if(prepend_dir) {
+		if(re->len != dirlen + 1 + len)
+			return 0;
+		if(memcmp(p, dirname, dirlen) != 0 || p[dirlen] != '/')
+			return 0;
+		p += dirlen + 1;
+	} else {
+		if(re->len != len)
+			return 0;
+	}
+	return memcmp(p, file, len) == 0;
+}
+
+/* Returns 1 if this read was already reported, otherwise records it and
+ * returns 0.
+ */
+static int read_seen(const char *dirname, int dirlen, const char *file, int len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	int prepend_dir = !is_full_path(file);
+	int pathlen = len;
+	unsigned int slot;
+	char *p;
+
+	if(prepend_dir) {
+		h = hash_path(h, dirname, dirlen);
+		h = hash_path(h, "/", 1);
+		pathlen += dirlen + 1;
+	}
+	h = hash_path(h, file, len);
+	if(h == 0)
+		h = 1;
+
+	slot = h % READ_SET_SIZE;
+	while(read_set[slot].hash) {
+		if(read_set[slot].hash == h &&
+		   read_entry_matches(&read_set[slot], dirname, dirlen, file, len, prepend_dir))
+			return 1;
+		slot = (slot + 1) % READ_SET_SIZE;
+	}
+	if(pathlen > READ_PATHS_SIZE)
+		return 0;
+	if(read_set_count >= READ_SET_SIZE / 2 || pathlen > READ_PATHS_SIZE - read_paths_len) {
+		clear_read_set();
+		slot = h % READ_SET_SIZE;
+	}
+	p = read_paths + read_paths_len;
+	if(prepend_dir) {
+		memcpy(p, dirname, dirlen);
+		p[dirlen] = '/';
+		p += dirlen + 1;
+	}
+	memcpy(p, file, len);
+	read_set[slot].hash = h;
+	read_set[slot].offset = read_paths_len;
+	read_set[slot].len = pathlen;
+	read_paths_len += pathlen;
+	read_set_count++;
+	return 0;
+}
+
+static int add_event_path(int offset, const char *dirname, int dirlen,
+			  const char *file, int len, int prepend_dir)
+{
+	if(prepend_dir) {
+		memcpy(event_buf + offset, dirname, dirlen);
+		offset += dirlen;
+		event_buf[offset] = '/';
+		offset++;
+	}
+	memcpy(event_buf + offset, file, len + 1);
+	return offset + len + 1;
+}
+
 static void handle_file_locked(const char *dirname, int dirlen, const char *file, const char *file2, int at)
 {
 	struct access_event event;
 	int len;
 	int len2;
+	int size;
+	int offset;
 
 	if(errored)
 		return;
@@ -641,12 +949,14 @@ static void handle_file_locked(const char *dirname, int dirlen, const char *file
 	if(ignore_file(file2))
 		return;
 
-	if(tup_flock(depfd) < 0) {
-		fprintf(stderr, "tup error: Unable to lock dependency file for writing [%i]: (file event = %s)\n", depfd, file);
-		goto out_error;
-	}
 	len = strlen(file);
 	len2 = strlen(file2);
+	if(at == ACCESS_READ) {
+		if(read_seen(dirname, dirlen, file, len))
+			return;
+	} else {
+		clear_read_set();
+	}
 	event.at = at;
 	event.len = len;
 	event.len2 = len2;
@@ -654,32 +964,31 @@ static void handle_file_locked(const char *dirname, int dirlen, const char *file
 		event.len += dirlen + 1;
 	if(file2[0] && !is_full_path(file2))
 		event.len2 += dirlen + 1;
-	if(write_all(depfd, &event, sizeof(event)) < 0)
-		goto out_error;
-	if(!is_full_path(file)) {
-		if(write_all(depfd, dirname, dirlen) < 0)
-			goto out_error;
-		if(write_all(depfd, "/", 1) < 0)
-			goto out_error;
-	}
-	if(write_all(depfd, file, len + 1) < 0)
-		goto out_error;
-	if(file2[0] && !is_full_path(file2)) {
-		if(write_all(depfd, dirname, dirlen) < 0)
-			goto out_error;
-		if(write_all(depfd, "/", 1) < 0)
-			goto out_error;
+
+	size = sizeof(event) + event.len + 1 + event.len2 + 1;
+	if(size > EVENT_BUF_SIZE) {
+		fprintf(stderr, "tup error: File event is too large for the dependency buffer: %s\n", file);
+		errored = 1;
+		return;
 	}
-	if(write_all(depfd, file2, len2 + 1) < 0)
-		goto out_error;
-	if(tup_unflock(depfd) < 0) {
-		fprintf(stderr, "tup error: Unable to unlock dependency file.\n");
-		goto out_error;
+	if(!spill) {
+		if(open_spill() < 0) {
+			errored = 1;
+			return;
+		}
 	}
-	return;
-
-out_error:
-	errored = 1;
+	if(size > EVENT_BUF_SIZE - event_buflen)
+		flush_events_locked();
+
+	offset = event_buflen;
+	memcpy(event_buf + offset, &event, sizeof(event));
+	offset += sizeof(event);
+	offset = add_event_path(offset, dirname, dirlen, file, len, !is_full_path(file));
+	offset = add_event_path(offset, dirname, dirlen, file2, len2, file2[0] && !is_full_path(file2));
+	set_spill_used(offset);
+
+	if(at != ACCESS_READ)
+		flush_events_locked();
 }
 
 static void handle_file(const char *file, const char *file2, int at)
@@ -41,6 +41,10 @@ enum access_type {
 	ACCESS_RENAME,
 	ACCESS_UNLINK,
 	ACCESS_VAR,
+	/* Names a file of events that the ldpreload shim kept in shared
+	 * memory, which the server reads after the job finishes.
+	 */
+	ACCESS_SPILL,
 };
 
 /** Structure sent across the unix socket to notify the main wrapper of any
@@ -32,6 +32,9 @@
 #include <unistd.h>
 #include <errno.h>
 #include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 static char tup_wd[PATH_MAX];
 static int tup_wd_offset;
@@ -57,6 +60,7 @@ int find_tup_dir(void)
 
 	tup_top_len = strlen(tup_wd);
 	tup_sub_len = 0;
+	tup_sub_dir_dt = -1;
 	while(1) {
 		if(stat(".tup", &st) == 0 && S_ISDIR(st.st_mode)) {
 			tup_wd_offset = tup_top_len;
@@ -152,6 +156,67 @@ int tup_top_fd(void)
  * iserr=2 means stderr, for tup errors (eg: missing deps)
  * iserr=3 means stderr, for sub-processes that fail
  */
+static void display_header(FILE *out, int iserr, const char *name, int display_name)
+{
+	clear_active(out);
+	if(iserr == 2) {
+		/* For tup messages (eg: missing deps, verbose messages) */
+		fprintf(out, " *** tup messages ***\n");
+	}
+	if(iserr == 1) {
+		/* This is for run-scripts */
+		if(display_name) {
+			color_set(stderr);
+			fprintf(out, " *** tup: stderr from command '%s%s%s%s' ***\n", color_type(TUP_NODE_CMD), color_append_normal(), name, color_end());
+		}
+	}
+}
+
+#ifdef __linux__
+/* Output buffers are regular files (or memfds), so the kernel can copy them
+ * to the terminal directly. Returns 1 if the output was handled here, 0 if
+ * the caller should fall back to reading it, and -1 on error.
+ */
+static int display_output_sendfile(int fd, FILE *out, int iserr, const char *name,
+				   int display_name, int *displayed)
+{
+	struct stat st;
+	off_t cur;
+	off_t remaining;
+
+	if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return 0;
+	cur = lseek(fd, 0, SEEK_CUR);
+	if(cur < 0)
+		return 0;
+	remaining = st.st_size - cur;
+	if(remaining <= 0)
+		return 1;
+
+	display_header(out, iserr, name, display_name);
+	*displayed = 1;
+	fflush(out);
+	while(remaining > 0) {
+		ssize_t rc;
+
+		rc = sendfile(fileno(out), fd, NULL, remaining);
+		if(rc < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno == EINVAL || errno == ENOSYS)
+				return 0;
+			perror("display_output: sendfile");
+			fprintf(stderr, "tup internal error: Unable to display output from a sub-process.\n");
+			return -1;
+		}
+		if(rc == 0)
+			break;
+		remaining -= rc;
+	}
+	return 1;
+}
+#endif
+
 int display_output(int fd, int iserr, const char *name, int display_name, FILE *f)
 {
 	if(fd != -1) {
@@ -165,6 +230,13 @@ int display_output(int fd, int iserr, const char *name, int display_name, FILE *
 		if(f)
 			out = f;
 
+#ifdef __linux__
+		rc = display_output_sendfile(fd, out, iserr, name, display_name, &displayed);
+		if(rc < 0)
+			return -1;
+		if(rc == 1)
+			return 0;
+#endif
 		while(1) {
 			rc = read(fd, buf, sizeof(buf));
 			if(rc < 0) {
@@ -176,18 +248,7 @@ int display_output(int fd, int iserr, const char *name, int display_name, FILE *
 				break;
 			if(!displayed) {
 				displayed = 1;
-				clear_active(out);
-				if(iserr == 2) {
-					/* For tup messages (eg: missing deps, verbose messages) */
-					fprintf(out, " *** tup messages ***\n");
-				}
-				if(iserr == 1) {
-					/* This is for run-scripts */
-					if(display_name) {
-						color_set(stderr);
-						fprintf(out, " *** tup: stderr from command '%s%s%s%s' ***\n", color_type(TUP_NODE_CMD), color_append_normal(), name, color_end());
-					}
-				}
+				display_header(out, iserr, name, display_name);
 			}
 			fprintf(out, "%.*s", rc, buf);
 		}
@@ -29,6 +29,7 @@
 #include "variant.h"
 #include "config.h"
 #include "logging.h"
+#include "fslurp.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,6 +39,8 @@
 #include <sys/stat.h>
 
 static int ghost_to_file(struct tup_entry *tent);
+static int used_cb(void *arg, struct tup_entry *tent);
+static int parse_input_unchanged(struct tup_entry *tent, int *unchanged);
 
 static void (*rmdir_callback)(tupid_t tupid);
 
@@ -45,12 +48,29 @@ int create_name_file(tupid_t dt, const char *file, struct timespec mtime,
 		     struct tup_entry **entry)
 {
 	struct tup_entry *dtent;
+	struct tup_entry *tuptent;
 	if(tup_entry_add(dt, &dtent) < 0)
 		return -1;
-	if(tup_db_node_insert_tent(dtent, file, -1, TUP_NODE_FILE, mtime, -1, entry) < 0)
+	/* Every directory that has been parsed has a Tupfile node, even if
+	 * it is just a ghost.
+	 */
+	if(tup_db_select_tent(dtent, "Tupfile", &tuptent) < 0)
 		return -1;
-	if(tup_db_add_create_list(dt) < 0)
+	if(tup_db_node_insert_tent(dtent, file, -1, TUP_NODE_FILE, mtime, -1, entry) < 0)
 		return -1;
+	if(dtent->type == TUP_NODE_DIR && tuptent && strcmp(file, TUP_CONFIG) != 0) {
+		/* A new file can only change the parse of a Tupfile that
+		 * globbed this directory with a matching pattern, so we don't
+		 * need to re-parse for editor swap files and the like. A
+		 * directory that was never parsed, or a new tup.config that
+		 * sets up a variant (t8016), still needs a full parse.
+		 */
+		if(tup_db_set_glob_dir_flags(dt, file, -1) < 0)
+			return -1;
+	} else {
+		if(tup_db_add_create_list(dt) < 0)
+			return -1;
+	}
 	if(make_dirs_normal(dtent) < 0)
 		return -1;
 	return 0;
@@ -111,6 +131,7 @@ tupid_t tup_file_mod_mtime(tupid_t dt, const char *file, struct timespec mtime,
 	struct tup_entry *dtent;
 	int new = 0;
 	int changed = 0;
+	int ghost = 0;
 
 	if(tup_entry_add(dt, &dtent) < 0)
 		return -1;
@@ -137,6 +158,7 @@ tupid_t tup_file_mod_mtime(tupid_t dt, const char *file, struct timespec mtime,
 
 		if(tent->type == TUP_NODE_GHOST) {
 			log_debug_tent("Create(overwrite ghost)", tent, "\n");
+			ghost = 1;
 			if(ghost_to_file(tent) < 0)
 				return -1;
 		} else if(tent->type != TUP_NODE_FILE &&
@@ -163,6 +185,8 @@ tupid_t tup_file_mod_mtime(tupid_t dt, const char *file, struct timespec mtime,
 			}
 		}
 		if(changed) {
+			int unchanged;
+
 			if(tent->type == TUP_NODE_GENERATED) {
 				int tmp = 0;
 				if(tup_db_modify_cmds_by_output(tent->tnode.tupid, &tmp) < 0)
@@ -176,8 +200,23 @@ tupid_t tup_file_mod_mtime(tupid_t dt, const char *file, struct timespec mtime,
 			if(tup_db_add_modify_list(tent->tnode.tupid) < 0)
 				return -1;
 
-			if(tup_db_set_dependent_flags(tent->tnode.tupid) < 0)
-				return -1;
+			unchanged = 0;
+			if(tent->type == TUP_NODE_FILE && !ghost) {
+				if(parse_input_unchanged(tent, &unchanged) < 0)
+					return -1;
+			}
+			if(unchanged) {
+				/* The Tupfile or included file was only
+				 * touched, so the directories that read it
+				 * don't need to be parsed again.
+				 */
+				log_debug_tent("Unchanged parse input", tent, "\n");
+				if(tup_db_set_dependent_config_flags(tent->tnode.tupid) < 0)
+					return -1;
+			} else {
+				if(tup_db_set_dependent_flags(tent->tnode.tupid) < 0)
+					return -1;
+			}
 
 			if(!MTIME_EQ(tent->mtime, mtime))
 				if(tup_db_set_mtime(tent, mtime) < 0)
@@ -314,6 +353,8 @@ int tup_del_id_type(tupid_t tupid, enum TUP_NODE_TYPE type, int force, int *modi
 {
 	struct tup_entry *tent;
 	int dont_delete = 0;
+	int used = 0;
+	tupid_t dt;
 
 	if(tup_entry_add(tupid, &tent) < 0)
 		return -1;
@@ -482,14 +523,42 @@ int tup_del_id_type(tupid_t tupid, enum TUP_NODE_TYPE type, int force, int *modi
 
 		if(!force) {
 			/* Re-parse the current Tupfile (the updater
-			 * automatically parses any dependent directories).
+			 * automatically parses any dependent directories) if
+			 * the file was used by anything, since it may have
+			 * been named explicitly. Otherwise only the
+			 * directories that globbed a matching name need to be
+			 * re-parsed.
 			 */
-			if(tup_db_add_create_list(tent->dt) < 0)
+			if(tup_db_select_node_by_link(used_cb, &used, tupid) < 0)
+				return -1;
+			if(tup_db_select_node_by_sticky_link(used_cb, &used, tupid) < 0)
 				return -1;
+			if(used) {
+				if(tup_db_add_create_list(tent->dt) < 0)
+					return -1;
+			} else {
+				if(tup_db_set_glob_dir_flags(tent->dt, tent->name.s, tent->name.len) < 0)
+					return -1;
+			}
 		}
 	}
+	dt = tent->dt;
 	if(delete_name_file(tupid) < 0)
 		return -1;
+	if(type == TUP_NODE_FILE && !force && !used) {
+		int rc;
+
+		/* If that was the last normal file, the directory may need to
+		 * be converted to a generated directory, which happens when it
+		 * is parsed (t4122).
+		 */
+		rc = tup_db_is_generated_dir(dt);
+		if(rc < 0)
+			return -1;
+		if(rc == 1)
+			if(tup_db_add_create_list(dt) < 0)
+				return -1;
+	}
 	return 0;
 }
 
@@ -728,6 +797,44 @@ int gimme_tent(const char *name, struct tup_entry **entry)
 	return 0;
 }
 
+static int used_cb(void *arg, struct tup_entry *tent)
+{
+	int *used = arg;
+	if(tent) {/* unused */}
+	*used = 1;
+	return 0;
+}
+
+static int parse_input_unchanged(struct tup_entry *tent, int *unchanged)
+{
+	struct buf b;
+	uint64_t digest;
+	int found;
+	int fd;
+
+	*unchanged = 0;
+	if(tup_db_get_parse_digest(tent->tnode.tupid, &digest, &found) < 0)
+		return -1;
+	if(!found)
+		return 0;
+
+	/* If we can't read the file for some reason, just treat it as changed
+	 * and let the parser report the error.
+	 */
+	fd = tup_entry_open(tent);
+	if(fd < 0)
+		return 0;
+	if(fslurp(fd, &b) < 0) {
+		close(fd);
+		return 0;
+	}
+	close(fd);
+	if(buf_digest(&b) == digest)
+		*unchanged = 1;
+	free(b.s);
+	return 0;
+}
+
 static int ghost_to_file(struct tup_entry *tent)
 {
 	tup_db_del_ghost_tree(tent);
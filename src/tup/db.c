@@ -49,7 +49,7 @@
 #include <sys/stat.h>
 #include "sqlite3/sqlite3.h"
 
-#define DB_VERSION 19
+#define DB_VERSION 22
 #define PARSER_VERSION 16
 
 enum {
@@ -107,6 +107,16 @@ enum {
 	DB_MODIFY_CMDS_BY_OUTPUT,
 	DB_MODIFY_CMDS_BY_INPUT,
 	DB_SET_DEPENDENT_DIR_FLAGS,
+	DB_SET_GLOB_DIR_FLAGS,
+	DB_CLEAR_DIR_GLOBS,
+	DB_ADD_DIR_GLOB,
+	_DB_DELETE_DIR_GLOBS,
+	DB_SET_PARSE_DIGEST,
+	DB_GET_PARSE_DIGEST,
+	_DB_DELETE_PARSE_DIGEST,
+	DB_SET_RUN_SCRIPT,
+	DB_GET_RUN_SCRIPT,
+	DB_CLEAR_RUN_SCRIPTS,
 	DB_SET_SRCID_DIR_FLAGS,
 	DB_SET_DEPENDENT_CONFIG_FLAGS,
 	_DB_GET_OUTPUTS,
@@ -138,6 +148,9 @@ enum {
 	DB_GET_VARDB,
 	_DB_VAR_FLAG_DIRS,
 	_DB_DELETE_VAR_ENTRY,
+	_DB_HAS_LINKS,
+	_DB_GET_UNCACHED_NODES,
+	_DB_LOAD_DIR_ENTRIES,
 	DB_NUM_STATEMENTS
 };
 
@@ -153,6 +166,11 @@ struct timespec INVALID_MTIME = {-1, 0};
 struct timespec EXTERNAL_DIRECTORY_MTIME = {0, 0};
 
 static sqlite3 *tup_db = NULL;
+/* When running with db.memory, tup_db is an in-memory copy of the database and
+ * disk_db is the connection to .tup/db that it is written back to at close.
+ */
+static sqlite3 *disk_db = NULL;
+static int memory_writeback = 0;
 static sqlite3_stmt *stmts[DB_NUM_STATEMENTS];
 static struct tent_entries ghost_root = TENT_ENTRIES_INITIALIZER;
 static int tup_db_var_changed = 0;
@@ -164,6 +182,18 @@ static tupid_t local_env_dt = -1;
 static tupid_t local_exclusion_dt = -1;
 static tupid_t local_slash_dt = -1;
 
+/* Set during a cold build (no links exist in the database yet). In this mode
+ * every node in the database is kept in the tup_entry cache, so a cache miss
+ * in node_select() means the node doesn't exist and we can skip the query.
+ * Ghost reclamation is also deferred until tup_db_bulk_load_end().
+ */
+static int bulk_load = 0;
+
+/* Number of cache misses in a directory before node_select() loads the
+ * whole directory from the database and sets tent->entries_loaded.
+ */
+#define DIR_MISSES_BEFORE_LOAD 8
+
 /* Simple counter to invalidate the tent->stickies field. If
  * tent->retrieved_stickies is less than the sticky_count, then we need to
  * reload the stickies from the database. The sticky links can become stale
@@ -189,6 +219,9 @@ static int delete_group_links(tupid_t cmdid);
 static int get_normal_inputs(tupid_t cmdid, struct tent_entries *root, int ghost_check);
 static int node_has_ghosts(tupid_t tupid);
 static int load_existing_nodes(void);
+static int load_uncached_nodes(void);
+static int load_dir_entries(struct tup_entry *dtent);
+static int has_links(void);
 static int add_ghost_checks(tupid_t tupid);
 static int add_group_and_exclusion_checks(tupid_t tupid);
 static int reclaim_ghosts(void);
@@ -202,6 +235,7 @@ static int get_file_var_tree(struct vardb *vdb, int fd);
 static int var_flag_dirs(tupid_t tupid);
 static int delete_var_entry(tupid_t tupid);
 static int no_sync(void);
+static int db_size_pragmas(sqlite3 *db);
 static int delete_node(tupid_t tupid);
 static int db_print(FILE *stream, tupid_t tupid);
 static int get_dir_entries(tupid_t dt, struct half_entry_head *head);
@@ -268,6 +302,8 @@ static int db_open(void)
 	if(db_sync == 0)
 		if(no_sync() < 0)
 			return -1;
+	if(db_size_pragmas(tup_db) < 0)
+		return -1;
 	return 0;
 }
 
@@ -286,13 +322,115 @@ int tup_db_open(void)
 	return 0;
 }
 
-int tup_db_close(void)
+static void finalize_stmts(void)
 {
 	int x;
 
 	for(x=0; x<ARRAY_SIZE(stmts); x++) {
 		if(stmts[x])
 			sqlite3_finalize(stmts[x]);
+		stmts[x] = NULL;
+	}
+}
+
+static int db_copy(sqlite3 *dest, sqlite3 *src)
+{
+	sqlite3_backup *backup;
+	int rc;
+
+	/* The backup runs as a single write transaction on the destination,
+	 * so anyone else opening .tup/db sees either the old or the new
+	 * database, never a partial copy.
+	 */
+	backup = sqlite3_backup_init(dest, "main", src, "main");
+	if(!backup) {
+		fprintf(stderr, "tup error: Unable to start database copy: %s\n", sqlite3_errmsg(dest));
+		return -1;
+	}
+	rc = sqlite3_backup_step(backup, -1);
+	sqlite3_backup_finish(backup);
+	if(rc != SQLITE_DONE) {
+		fprintf(stderr, "tup error: Unable to copy database: %s\n", sqlite3_errmsg(dest));
+		return -1;
+	}
+	return 0;
+}
+
+int tup_db_use_memory(int writeback)
+{
+	sqlite3 *mem_db;
+
+	if(disk_db)
+		return 0;
+	if(transaction) {
+		fprintf(stderr, "tup internal error: Can't switch to an in-memory database during a transaction.\n");
+		return -1;
+	}
+	if(sqlite3_open(":memory:", &mem_db) != 0) {
+		fprintf(stderr, "tup error: Unable to create in-memory database: %s\n",
+			sqlite3_errmsg(mem_db));
+		sqlite3_close(mem_db);
+		return -1;
+	}
+	if(db_size_pragmas(mem_db) < 0) {
+		sqlite3_close(mem_db);
+		return -1;
+	}
+	if(db_copy(mem_db, tup_db) < 0) {
+		sqlite3_close(mem_db);
+		return -1;
+	}
+
+	/* Statements are prepared lazily against tup_db, so they all have to
+	 * be re-prepared against the in-memory connection.
+	 */
+	finalize_stmts();
+	disk_db = tup_db;
+	tup_db = mem_db;
+	memory_writeback = writeback;
+	return 0;
+}
+
+static int memory_db_close(void)
+{
+	int rc = 0;
+
+	/* Closing an on-disk database in the middle of a transaction rolls it
+	 * back, so make sure we don't write out any partial state either.
+	 */
+	if(!sqlite3_get_autocommit(tup_db)) {
+		char *errmsg;
+		if(sqlite3_exec(tup_db, "rollback", NULL, NULL, &errmsg) != 0) {
+			fprintf(stderr, "SQL error: %s\nQuery was: rollback\n", errmsg);
+			rc = -1;
+		}
+	}
+	if(rc == 0 && memory_writeback && sqlite3_total_changes(tup_db) > 0) {
+		if(db_copy(disk_db, tup_db) < 0) {
+			fprintf(stderr, "tup error: Unable to write the in-memory database back to '%s'.\n", TUP_DB_FILE);
+			rc = -1;
+		}
+	}
+	if(sqlite3_close(tup_db) != 0) {
+		fprintf(stderr, "Unable to close in-memory database: %s\n",
+			sqlite3_errmsg(tup_db));
+		rc = -1;
+	}
+	tup_db = disk_db;
+	disk_db = NULL;
+	memory_writeback = 0;
+	return rc;
+}
+
+int tup_db_close(void)
+{
+	int rc = 0;
+
+	finalize_stmts();
+
+	if(disk_db) {
+		if(memory_db_close() < 0)
+			rc = -1;
 	}
 
 	if(sqlite3_close(tup_db) != 0) {
@@ -301,7 +439,7 @@ int tup_db_close(void)
 		return -1;
 	}
 	tup_db = NULL;
-	return 0;
+	return rc;
 }
 
 int tup_db_create(int db_sync, int memory_db)
@@ -321,10 +459,14 @@ int tup_db_create(int db_sync, int memory_db)
 		"create table modify_list (id integer primary key not null)",
 		"create table variant_list (id integer primary key not null)",
 		"create table transient_list (id integer primary key not null)",
+		"create table dir_glob (dir integer, to_id integer, pattern varchar(4096), unique(dir, to_id, pattern))",
+		"create table parse_digest (id integer primary key not null, digest integer not null)",
+		"create table run_script (dir integer not null, cmdline varchar(4096) not null, digest integer not null, inputs text, rules text, unique(dir, cmdline))",
 		"create index normal_index2 on normal_link(to_id)",
 		"create index sticky_index2 on sticky_link(to_id)",
 		"create index group_index2 on group_link(cmdid)",
 		"create index srcid_index on node(srcid)",
+		"create index dir_glob_index2 on dir_glob(to_id)",
 		"insert into config values('db_version', 0)",
 		"insert into node values(1, 0, 2, -1, 0, -1, '.', NULL, NULL)",
 	};
@@ -662,6 +804,29 @@ static int version_check(void)
 				"alter table node add column mtime_ns integer default 0",
 			}
 		},
+		{
+			/* Upgrade to version 20 */
+			"Added a dir_glob table so that creating or deleting a file only re-parses the directories with a matching glob. All Tupfiles will be re-parsed.",
+			{
+				"create table dir_glob (dir integer, to_id integer, pattern varchar(4096), unique(dir, to_id, pattern))",
+				"create index dir_glob_index2 on dir_glob(to_id)",
+				"insert or replace into create_list select id from node where type=2",
+			}
+		},
+		{
+			/* Upgrade to version 21 */
+			"Added a parse_digest table so that touching a Tupfile without changing its contents doesn't re-parse it.",
+			{
+				"create table parse_digest (id integer primary key not null, digest integer not null)",
+			}
+		},
+		{
+			/* Upgrade to version 22 */
+			"Added a run_script table so that a run-script's output can be re-used when its inputs haven't changed.",
+			{
+				"create table run_script (dir integer not null, cmdline varchar(4096) not null, digest integer not null, inputs text, rules text, unique(dir, cmdline))",
+			}
+		},
 	};
 
 	if(tup_db_config_get_int("db_version", -1, &version) < 0)
@@ -775,8 +940,10 @@ int tup_db_commit(void)
 	sqlite3_stmt **stmt = &stmts[DB_COMMIT];
 	static char s[] = "commit";
 
-	if(reclaim_ghosts() < 0)
-		return -1;
+	if(!bulk_load) {
+		if(reclaim_ghosts() < 0)
+			return -1;
+	}
 
 	transaction_check("%s", s);
 	if(!*stmt) {
@@ -3526,6 +3693,120 @@ static int delete_normal_links(tupid_t tupid)
 	return 0;
 }
 
+static int delete_dir_globs(tupid_t tupid)
+{
+	int rc;
+	sqlite3_stmt **stmt = &stmts[_DB_DELETE_DIR_GLOBS];
+	static const char s[] = "delete from dir_glob where dir=? or to_id=?";
+
+	transaction_check("%s [%lli, %lli]", s, tupid, tupid);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+
+	if(sqlite3_bind_int64(*stmt, 1, tupid) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(sqlite3_bind_int64(*stmt, 2, tupid) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	rc = sqlite3_step(*stmt);
+	if(msqlite3_reset(*stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(rc != SQLITE_DONE) {
+		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	return 0;
+}
+
+int tup_db_clear_run_scripts(tupid_t dt)
+{
+	int rc;
+	sqlite3_stmt **stmt = &stmts[DB_CLEAR_RUN_SCRIPTS];
+	static const char s[] = "delete from run_script where dir=?";
+
+	transaction_check("%s [%lli]", s, dt);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+
+	if(sqlite3_bind_int64(*stmt, 1, dt) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	rc = sqlite3_step(*stmt);
+	if(msqlite3_reset(*stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		return -1;
+	}
+
+	if(rc != SQLITE_DONE) {
+		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	expected_changes += sqlite3_changes(tup_db);
+	return 0;
+}
+
+static int delete_parse_digest(tupid_t tupid)
+{
+	int rc;
+	sqlite3_stmt **stmt = &stmts[_DB_DELETE_PARSE_DIGEST];
+	static const char s[] = "delete from parse_digest where id=?";
+
+	transaction_check("%s [%lli]", s, tupid);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+
+	if(sqlite3_bind_int64(*stmt, 1, tupid) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	rc = sqlite3_step(*stmt);
+	if(msqlite3_reset(*stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(rc != SQLITE_DONE) {
+		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	return 0;
+}
+
 static int delete_normal_inputs(tupid_t tupid)
 {
 	int rc;
@@ -3706,6 +3987,12 @@ int tup_db_delete_links(tupid_t tupid)
 		return -1;
 	if(delete_group_links(tupid) < 0)
 		return -1;
+	if(delete_dir_globs(tupid) < 0)
+		return -1;
+	if(delete_parse_digest(tupid) < 0)
+		return -1;
+	if(tup_db_clear_run_scripts(tupid) < 0)
+		return -1;
 	return 0;
 }
 
@@ -4239,6 +4526,53 @@ int tup_db_set_dependent_dir_flags(tupid_t tupid)
 	return 0;
 }
 
+int tup_db_set_glob_dir_flags(tupid_t dt, const char *name, int len)
+{
+	int rc;
+	sqlite3_stmt **stmt = &stmts[DB_SET_GLOB_DIR_FLAGS];
+	static char s[] = "insert or ignore into create_list select to_id from dir_glob, node where dir_glob.dir=? and to_id=id and type=? and ? glob pattern" SQL_NAME_COLLATION;
+
+	transaction_check("%s [%lli, %i, '%.*s']", s, dt, TUP_NODE_DIR, len, name);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+
+	if(sqlite3_bind_int64(*stmt, 1, dt) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(sqlite3_bind_int(*stmt, 2, TUP_NODE_DIR) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(sqlite3_bind_text(*stmt, 3, name, len, SQLITE_STATIC) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	rc = sqlite3_step(*stmt);
+	if(msqlite3_reset(*stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	if(rc != SQLITE_DONE) {
+		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	return 0;
+}
+
 int tup_db_set_srcid_dir_flags(tupid_t tupid)
 {
 	int rc;
@@ -5381,8 +5715,11 @@ int tup_db_scan_begin(void)
 {
 	if(tup_db_begin() < 0)
 		return -1;
-	if(load_existing_nodes() < 0)
-		return -1;
+	/* A bulk load has already put every node in the cache. */
+	if(!bulk_load) {
+		if(load_existing_nodes() < 0)
+			return -1;
+	}
 	if(variant_load() < 0)
 		return -1;
 	return 0;
@@ -5481,20 +5818,170 @@ static int load_existing_nodes(void)
 	if(tup_entry_resolve_dirs() < 0)
 		return -1;
 
+	if(rc == 0 && bulk_load) {
+		if(load_uncached_nodes() < 0)
+			return -1;
+	}
+
 	return rc;
 }
 
-int tup_db_get_outputs(tupid_t cmdid, struct tent_entries *output_root,
-		       struct tent_entries *exclusion_root,
-		       struct tup_entry **group)
+static int load_uncached_nodes(void)
 {
-	struct tent_list *tl;
-	struct tent_list_head tent_list;
-	int rc = 0;
+	int rc = -1;
+	int dbrc;
+	sqlite3_stmt **stmt = &stmts[_DB_GET_UNCACHED_NODES];
+	static char s[] = "select id from node where not (type=? or type=? or type=? or type=?)";
+	struct tupid_list_head tupid_list;
+	struct tupid_list *tl;
 
-	tent_list_init(&tent_list);
+	transaction_check("%s [%i, %i, %i, %i]", s, TUP_NODE_FILE, TUP_NODE_DIR, TUP_NODE_GENERATED, TUP_NODE_GENERATED_DIR);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
 
-	if(get_outputs(cmdid, &tent_list) < 0)
+	if(sqlite3_bind_int(*stmt, 1, TUP_NODE_FILE) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(sqlite3_bind_int(*stmt, 2, TUP_NODE_DIR) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(sqlite3_bind_int(*stmt, 3, TUP_NODE_GENERATED) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(sqlite3_bind_int(*stmt, 4, TUP_NODE_GENERATED_DIR) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	tupid_list_init(&tupid_list);
+	while(1) {
+		dbrc = sqlite3_step(*stmt);
+		if(dbrc == SQLITE_DONE) {
+			rc = 0;
+			break;
+		}
+		if(dbrc != SQLITE_ROW) {
+			fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			break;
+		}
+		if(tupid_list_add_tail(&tupid_list, sqlite3_column_int64(*stmt, 0)) < 0)
+			break;
+	}
+
+	if(msqlite3_reset(*stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	if(rc == 0) {
+		tupid_list_foreach(tl, &tupid_list) {
+			struct tup_entry *tent;
+			if(tup_entry_add(tl->tupid, &tent) < 0) {
+				rc = -1;
+				break;
+			}
+		}
+	}
+	free_tupid_list(&tupid_list);
+	return rc;
+}
+
+static int has_links(void)
+{
+	int rc = -1;
+	int dbrc;
+	sqlite3_stmt **stmt = &stmts[_DB_HAS_LINKS];
+	static char s[] = "select exists(select 1 from normal_link)";
+
+	transaction_check("%s", s);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+
+	dbrc = sqlite3_step(*stmt);
+	if(dbrc == SQLITE_ROW) {
+		rc = sqlite3_column_int(*stmt, 0);
+	} else {
+		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+	}
+
+	if(msqlite3_reset(*stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	return rc;
+}
+
+int tup_db_bulk_load_begin(void)
+{
+	int rc;
+
+	if(tup_db_begin() < 0)
+		return -1;
+	rc = has_links();
+	if(rc < 0)
+		return -1;
+	if(rc == 0) {
+		/* No dependencies exist yet, so this is the first build.
+		 * Pull everything into the tup_entry cache so that node
+		 * lookups never need to go to the database.
+		 */
+		bulk_load = 1;
+		if(load_existing_nodes() < 0)
+			return -1;
+	}
+	if(tup_db_commit() < 0)
+		return -1;
+	return bulk_load;
+}
+
+int tup_db_bulk_load_end(void)
+{
+	if(!bulk_load)
+		return 0;
+	bulk_load = 0;
+
+	/* Catch up on the ghost reclamation that was skipped during the
+	 * bulk load.
+	 */
+	if(tup_db_begin() < 0)
+		return -1;
+	if(tup_db_commit() < 0)
+		return -1;
+	return 0;
+}
+
+int tup_db_get_outputs(tupid_t cmdid, struct tent_entries *output_root,
+		       struct tent_entries *exclusion_root,
+		       struct tup_entry **group)
+{
+	struct tent_list *tl;
+	struct tent_list_head tent_list;
+	int rc = 0;
+
+	tent_list_init(&tent_list);
+
+	if(get_outputs(cmdid, &tent_list) < 0)
 		return -1;
 	if(group)
 		*group = NULL;
@@ -5762,6 +6249,16 @@ int tup_db_get_inputs(tupid_t cmdid, struct tent_entries *sticky_root,
 	return 0;
 }
 
+void tup_db_release_stickies(struct tup_entry *tent)
+{
+	/* Drop the stickies cached by tup_db_get_inputs(), along with the
+	 * references they hold to the input nodes.
+	 */
+	free_tent_tree(&tent->stickies);
+	free_tent_tree(&tent->group_stickies);
+	tent->retrieved_stickies = 0;
+}
+
 static int compare_tent_trees(struct tent_entries *a, struct tent_entries *b,
 			      void *data,
 			      int (*extra_a)(struct tup_entry *tent, void *data),
@@ -5805,7 +6302,7 @@ struct actual_output_data {
 	FILE *f;
 	tupid_t cmdid;
 	int output_error;
-	struct mapping_head *mapping_list;
+	struct mapping_list *mapping_list;
 	struct tent_entries exclusion_root;
 	int do_unlink;
 };
@@ -5847,7 +6344,7 @@ static int extra_output(struct tup_entry *tent, void *data)
 	 * we want to avoid moving the file out of the tmp directory and into
 	 * the real fs, so delete the mapping (t4081).
 	 */
-	TAILQ_FOREACH(map, aod->mapping_list, list) {
+	TAILQ_FOREACH(map, &aod->mapping_list->entries, list) {
 		/* Easiest to check for the tent, since the tent is already set
 		 * in update_write_info().
 		 */
@@ -5885,7 +6382,7 @@ static int missing_output(struct tup_entry *tent, void *data)
 int tup_db_check_actual_outputs(FILE *f, tupid_t cmdid,
 				struct tent_entries *write_root,
 				struct tent_entries *output_root,
-				struct mapping_head *mapping_list,
+				struct mapping_list *mapping_list,
 				int *write_bork,
 				int do_unlink, int complain_missing)
 {
@@ -6515,6 +7012,322 @@ int tup_db_write_dir_inputs(FILE *f, tupid_t dt, struct tent_entries *root)
 	return 0;
 }
 
+int tup_db_clear_dir_globs(tupid_t dt)
+{
+	int rc;
+	sqlite3_stmt **stmt = &stmts[DB_CLEAR_DIR_GLOBS];
+	static char s[] = "delete from dir_glob where to_id=?";
+
+	transaction_check("%s [%lli]", s, dt);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+
+	if(sqlite3_bind_int64(*stmt, 1, dt) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	rc = sqlite3_step(*stmt);
+	if(msqlite3_reset(*stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	if(rc != SQLITE_DONE) {
+		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	/* Like directory-level dependencies, globs are expected to change
+	 * during refactoring.
+	 */
+	expected_changes += sqlite3_changes(tup_db);
+	return 0;
+}
+
+int tup_db_add_dir_glob(tupid_t dt, tupid_t dir, const char *pattern, int len)
+{
+	int rc;
+	sqlite3_stmt **stmt = &stmts[DB_ADD_DIR_GLOB];
+	static char s[] = "insert or ignore into dir_glob values(?, ?, ?)";
+
+	transaction_check("%s [%lli, %lli, '%.*s']", s, dir, dt, len, pattern);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+
+	if(sqlite3_bind_int64(*stmt, 1, dir) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(sqlite3_bind_int64(*stmt, 2, dt) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(sqlite3_bind_text(*stmt, 3, pattern, len, SQLITE_STATIC) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	rc = sqlite3_step(*stmt);
+	if(msqlite3_reset(*stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	if(rc != SQLITE_DONE) {
+		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	expected_changes += sqlite3_changes(tup_db);
+	return 0;
+}
+
+int tup_db_set_parse_digest(tupid_t tupid, uint64_t digest)
+{
+	int rc;
+	sqlite3_stmt **stmt = &stmts[DB_SET_PARSE_DIGEST];
+	static char s[] = "insert or replace into parse_digest values(?, ?)";
+
+	transaction_check("%s [%lli, %lli]", s, tupid, (sqlite3_int64)digest);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+
+	if(sqlite3_bind_int64(*stmt, 1, tupid) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(sqlite3_bind_int64(*stmt, 2, (sqlite3_int64)digest) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	rc = sqlite3_step(*stmt);
+	if(msqlite3_reset(*stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	if(rc != SQLITE_DONE) {
+		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	/* The digest is rewritten every time the file is read by the parser,
+	 * so this isn't a change in the build graph.
+	 */
+	expected_changes += sqlite3_changes(tup_db);
+	return 0;
+}
+
+int tup_db_get_parse_digest(tupid_t tupid, uint64_t *digest, int *found)
+{
+	int rc = -1;
+	int dbrc;
+	sqlite3_stmt **stmt = &stmts[DB_GET_PARSE_DIGEST];
+	static char s[] = "select digest from parse_digest where id=?";
+
+	transaction_check("%s [%lli]", s, tupid);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+
+	if(sqlite3_bind_int64(*stmt, 1, tupid) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	*found = 0;
+	dbrc = sqlite3_step(*stmt);
+	if(dbrc == SQLITE_DONE) {
+		rc = 0;
+		goto out_reset;
+	}
+	if(dbrc != SQLITE_ROW) {
+		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		goto out_reset;
+	}
+
+	*digest = (uint64_t)sqlite3_column_int64(*stmt, 0);
+	*found = 1;
+	rc = 0;
+
+out_reset:
+	if(msqlite3_reset(*stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	return rc;
+}
+
+int tup_db_set_run_script(tupid_t dt, const char *cmdline, uint64_t digest,
+			  const char *inputs, const char *rules)
+{
+	int rc;
+	sqlite3_stmt **stmt = &stmts[DB_SET_RUN_SCRIPT];
+	static char s[] = "insert or replace into run_script values(?, ?, ?, ?, ?)";
+
+	transaction_check("%s [%lli, '%s', %lli]", s, dt, cmdline, (sqlite3_int64)digest);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+
+	if(sqlite3_bind_int64(*stmt, 1, dt) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(sqlite3_bind_text(*stmt, 2, cmdline, -1, SQLITE_STATIC) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(sqlite3_bind_int64(*stmt, 3, (sqlite3_int64)digest) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(sqlite3_bind_text(*stmt, 4, inputs, -1, SQLITE_STATIC) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(sqlite3_bind_text(*stmt, 5, rules, -1, SQLITE_STATIC) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	rc = sqlite3_step(*stmt);
+	if(msqlite3_reset(*stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	if(rc != SQLITE_DONE) {
+		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	/* Like the parse digest, this is just a cache for the parser and not
+	 * part of the build graph.
+	 */
+	expected_changes += sqlite3_changes(tup_db);
+	return 0;
+}
+
+int tup_db_get_run_script(tupid_t dt, const char *cmdline, uint64_t *digest,
+			  char **inputs, char **rules, int *found)
+{
+	int rc = -1;
+	int dbrc;
+	const char *text;
+	sqlite3_stmt **stmt = &stmts[DB_GET_RUN_SCRIPT];
+	static char s[] = "select digest, inputs, rules from run_script where dir=? and cmdline=?";
+
+	transaction_check("%s [%lli, '%s']", s, dt, cmdline);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+
+	if(sqlite3_bind_int64(*stmt, 1, dt) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(sqlite3_bind_text(*stmt, 2, cmdline, -1, SQLITE_STATIC) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	*found = 0;
+	*inputs = NULL;
+	*rules = NULL;
+	dbrc = sqlite3_step(*stmt);
+	if(dbrc == SQLITE_DONE) {
+		rc = 0;
+		goto out_reset;
+	}
+	if(dbrc != SQLITE_ROW) {
+		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		goto out_reset;
+	}
+
+	*digest = (uint64_t)sqlite3_column_int64(*stmt, 0);
+	text = (const char*)sqlite3_column_text(*stmt, 1);
+	*inputs = strdup(text ? text : "");
+	if(!*inputs) {
+		perror("strdup");
+		goto out_reset;
+	}
+	text = (const char*)sqlite3_column_text(*stmt, 2);
+	*rules = strdup(text ? text : "");
+	if(!*rules) {
+		perror("strdup");
+		free(*inputs);
+		*inputs = NULL;
+		goto out_reset;
+	}
+	*found = 1;
+	rc = 0;
+
+out_reset:
+	if(msqlite3_reset(*stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	return rc;
+}
+
 static struct tup_entry *node_insert(struct tup_entry *dtent, const char *name, int namelen,
 				     const char *display, int displaylen, const char *flags, int flagslen,
 				     enum TUP_NODE_TYPE type, struct timespec mtime, tupid_t srcid)
@@ -6649,6 +7462,21 @@ static int node_select(struct tup_entry *dtent, const char *name, int len,
 		return -1;
 	if(*entry)
 		return 0;
+	if(bulk_load)
+		return 0;
+	if(dtent->entries_loaded)
+		return 0;
+
+	/* Commands tend to look for the same missing files (eg: include
+	 * paths) over and over. After a few misses in a directory, load the
+	 * rest of it so that later misses are answered from the cache.
+	 */
+	dtent->entry_misses++;
+	if(dtent->entry_misses >= DIR_MISSES_BEFORE_LOAD) {
+		if(load_dir_entries(dtent) < 0)
+			return -1;
+		return tup_entry_find_name_in_dir_dt(dtent, name, len, entry);
+	}
 
 	transaction_check("%s [%lli, '%.*s']", s, dtent->tnode.tupid, len, name);
 	if(!*stmt) {
@@ -6706,6 +7534,73 @@ out_reset:
 	return rc;
 }
 
+static int load_dir_entries(struct tup_entry *dtent)
+{
+	int rc = -1;
+	int dbrc;
+	sqlite3_stmt **stmt = &stmts[_DB_LOAD_DIR_ENTRIES];
+	static char s[] = "select id, type, mtime, mtime_ns, srcid, name, display, flags from node where dir=?";
+
+	transaction_check("%s [%lli]", s, dtent->tnode.tupid);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+
+	if(sqlite3_bind_int64(*stmt, 1, dtent->tnode.tupid) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	while(1) {
+		tupid_t tupid;
+		enum TUP_NODE_TYPE type;
+		struct timespec mtime;
+		tupid_t srcid;
+		const char *name;
+		const char *display;
+		const char *flags;
+
+		dbrc = sqlite3_step(*stmt);
+		if(dbrc == SQLITE_DONE) {
+			rc = 0;
+			break;
+		}
+		if(dbrc != SQLITE_ROW) {
+			fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			break;
+		}
+
+		tupid = sqlite3_column_int64(*stmt, 0);
+		if(tup_entry_find(tupid))
+			continue;
+		type = sqlite3_column_int(*stmt, 1);
+		mtime.tv_sec = sqlite3_column_int(*stmt, 2);
+		mtime.tv_nsec = sqlite3_column_int(*stmt, 3);
+		srcid = sqlite3_column_int64(*stmt, 4);
+		name = (const char*)sqlite3_column_text(*stmt, 5);
+		display = (const char*)sqlite3_column_text(*stmt, 6);
+		flags = (const char*)sqlite3_column_text(*stmt, 7);
+
+		if(tup_entry_add_to_dir(dtent, tupid, name, -1, display, -1, flags, -1, type, mtime, srcid, NULL) < 0)
+			break;
+	}
+
+	if(msqlite3_reset(*stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(rc == 0)
+		dtent->entries_loaded = 1;
+	return rc;
+}
+
 static int link_insert(tupid_t a, tupid_t b, int style)
 {
 	int rc;
@@ -7841,6 +8736,39 @@ static int delete_var_entry(tupid_t tupid)
 	return 0;
 }
 
+static int db_size_pragmas(sqlite3 *db)
+{
+	char *errmsg;
+	char sql[128];
+	int cache_size;
+	int mmap_size;
+
+	/* Both options are in megabytes. A negative cache_size tells SQLite
+	 * the size is in KiB rather than in pages.
+	 */
+	cache_size = tup_option_get_int("db.cache_size");
+	if(cache_size) {
+		snprintf(sql, sizeof(sql), "PRAGMA cache_size=-%lli", (long long)cache_size * 1024);
+		if(sql_debug) fprintf(stderr, "%s\n", sql);
+		if(sqlite3_exec(db, sql, NULL, NULL, &errmsg) != 0) {
+			fprintf(stderr, "SQL error: %s\nQuery was: %s\n",
+				errmsg, sql);
+			return -1;
+		}
+	}
+	mmap_size = tup_option_get_int("db.mmap_size");
+	if(mmap_size) {
+		snprintf(sql, sizeof(sql), "PRAGMA mmap_size=%lli", (long long)mmap_size * 1024 * 1024);
+		if(sql_debug) fprintf(stderr, "%s\n", sql);
+		if(sqlite3_exec(db, sql, NULL, NULL, &errmsg) != 0) {
+			fprintf(stderr, "SQL error: %s\nQuery was: %s\n",
+				errmsg, sql);
+			return -1;
+		}
+	}
+	return 0;
+}
+
 static int no_sync(void)
 {
 	char *errmsg;
@@ -27,6 +27,7 @@
 #include "bsd/queue.h"
 #include "estring.h"
 #include <stdio.h>
+#include <stdint.h>
 #include <time.h>
 
 #define TUP_CONFIG "tup.config"
@@ -39,7 +40,7 @@ extern struct timespec EXTERNAL_DIRECTORY_MTIME;
 struct tup_entry;
 struct tup_env;
 struct variant;
-struct mapping_head;
+struct mapping_list;
 struct vardb;
 struct var_entry;
 struct tent_entries;
@@ -49,6 +50,9 @@ struct tent_list_head;
 int tup_db_open(void);
 int tup_db_close(void);
 int tup_db_create(int db_sync, int memory_db);
+int tup_db_use_memory(int writeback);
+int tup_db_bulk_load_begin(void);
+int tup_db_bulk_load_end(void);
 int tup_db_begin(void);
 int tup_db_commit(void);
 int tup_db_changes(void);
@@ -146,9 +150,19 @@ int tup_db_write_inputs(FILE *f, tupid_t cmdid, struct tent_entries *input_root,
 			struct tup_entry *old_group,
 			int refactoring);
 int tup_db_write_dir_inputs(FILE *f, tupid_t dt, struct tent_entries *root);
+int tup_db_clear_dir_globs(tupid_t dt);
+int tup_db_add_dir_glob(tupid_t dt, tupid_t dir, const char *pattern, int len);
+int tup_db_set_parse_digest(tupid_t tupid, uint64_t digest);
+int tup_db_get_parse_digest(tupid_t tupid, uint64_t *digest, int *found);
+int tup_db_clear_run_scripts(tupid_t dt);
+int tup_db_set_run_script(tupid_t dt, const char *cmdline, uint64_t digest,
+			  const char *inputs, const char *rules);
+int tup_db_get_run_script(tupid_t dt, const char *cmdline, uint64_t *digest,
+			  char **inputs, char **rules, int *found);
 int tup_db_get_inputs(tupid_t cmdid, struct tent_entries *sticky_root,
 		      struct tent_entries *normal_root,
 		      struct tent_entries *group_sticky_root);
+void tup_db_release_stickies(struct tup_entry *tent);
 int tup_db_get_outputs(tupid_t cmdid, struct tent_entries *output_root,
 		       struct tent_entries *exclusion_root,
 		       struct tup_entry **group);
@@ -158,6 +172,7 @@ int tup_db_modify_cmds_by_output(tupid_t output, int *modified);
 int tup_db_modify_cmds_by_input(tupid_t input);
 int tup_db_set_dependent_flags(tupid_t tupid);
 int tup_db_set_dependent_dir_flags(tupid_t tupid);
+int tup_db_set_glob_dir_flags(tupid_t dt, const char *name, int len);
 int tup_db_set_srcid_dir_flags(tupid_t tupid);
 int tup_db_set_dependent_config_flags(tupid_t tupid);
 int tup_db_select_node_by_link(int (*callback)(void *, struct tup_entry *),
@@ -208,7 +223,7 @@ int tup_db_scan_end(void);
 int tup_db_check_actual_outputs(FILE *f, tupid_t cmdid,
 				struct tent_entries *write_root,
 				struct tent_entries *output_root,
-				struct mapping_head *mapping_list,
+				struct mapping_list *mapping_list,
 				int *write_bork,
 				int do_unlink, int complain_missing);
 int tup_db_check_actual_inputs(FILE *f, tupid_t cmdid,
@@ -38,7 +38,18 @@
 #include <pthread.h>
 #include <sys/stat.h>
 
+struct external_path {
+	struct string_tree st;
+	struct tup_entry *tent;
+};
+
 static struct tupid_entries tup_root = RB_INITIALIZER(&tup_root);
+/* Nodes outside of the tup hierarchy indexed by the full path that a
+ * sub-process used to reach them. With full_deps, every command reads the
+ * same system headers, so this lets them skip resolving the path one
+ * directory at a time. Entries are dropped along with their tup_entry.
+ */
+static struct string_entries external_root = RB_INITIALIZER(&external_root);
 static int do_verbose = 0;
 static pthread_mutex_t entry_openat_mutex = PTHREAD_MUTEX_INITIALIZER;
 static _Thread_local struct mempool pool = MEMPOOL_INITIALIZER(struct tup_entry);
@@ -51,6 +62,7 @@ static struct tup_entry *new_entry(tupid_t tupid, tupid_t dt,
 static int rm_entry(tupid_t tupid, int safe);
 static int resolve_parent(struct tup_entry *tent);
 static int change_name(struct tup_entry *tent, const char *new_name);
+static void del_external(struct tup_entry *tent);
 
 int tup_entry_add(tupid_t tupid, struct tup_entry **dest)
 {
@@ -117,6 +129,47 @@ int tup_entry_find_name_in_dir(struct tup_entry *tent, const char *name, int len
 	return 0;
 }
 
+struct tup_entry *tup_entry_find_external(const char *path)
+{
+	struct string_tree *st;
+
+	st = string_tree_search(&external_root, path, strlen(path));
+	if(!st)
+		return NULL;
+	return container_of(st, struct external_path, st)->tent;
+}
+
+int tup_entry_add_external(struct tup_entry *tent, const char *path)
+{
+	struct external_path *ep;
+
+	if(tent->external)
+		return 0;
+	if(string_tree_search(&external_root, path, strlen(path)) != NULL)
+		return 0;
+	ep = malloc(sizeof *ep);
+	if(!ep) {
+		perror("malloc");
+		return -1;
+	}
+	if(string_tree_add(&external_root, &ep->st, path) < 0) {
+		free(ep);
+		return -1;
+	}
+	ep->tent = tent;
+	tent->external = ep;
+	return 0;
+}
+
+static void del_external(struct tup_entry *tent)
+{
+	if(tent->external) {
+		string_tree_remove(&external_root, &tent->external->st);
+		free(tent->external);
+		tent->external = NULL;
+	}
+}
+
 int tup_entry_rm(tupid_t tupid)
 {
 	return rm_entry(tupid, 0);
@@ -150,6 +203,7 @@ static int rm_entry(tupid_t tupid, int safe)
 	if(tent->parent) {
 		string_tree_rm(&tent->parent->entries, &tent->name);
 	}
+	del_external(tent);
 	if(tent->re) {
 		pcre2_code_free(tent->re);
 	}
@@ -493,6 +547,9 @@ static struct tup_entry *new_entry(tupid_t tupid, tupid_t dt,
 	tent_tree_init(&tent->stickies);
 	tent_tree_init(&tent->group_stickies);
 	tent->retrieved_stickies = 0;
+	tent->entries_loaded = 0;
+	tent->entry_misses = 0;
+	tent->external = NULL;
 	tent->incoming = NULL;
 	tent->refcount = 0;
 	if(set_string(&tent->name.s, &tent->name.len, name, len) < 0)
@@ -513,6 +570,11 @@ static struct tup_entry *new_entry(tupid_t tupid, tupid_t dt,
 			fprintf(stderr, "tup error: Unable to compile regular expression '%s' at offset %zi: %s\n", tent->name.s, erroffset, buffer);
 			return NULL;
 		}
+		/* Exclusions are matched against every file a command reads or
+		 * writes, so JIT compile them when the pcre library supports it.
+		 * If it doesn't, pcre2_match() falls back to the interpreter.
+		 */
+		pcre2_jit_compile(tent->re, PCRE2_JIT_COMPLETE);
 	} else {
 		tent->re = NULL;
 	}
@@ -652,6 +714,7 @@ static int change_name(struct tup_entry *tent, const char *new_name)
 	if(tent->parent) {
 		string_tree_rm(&tent->parent->entries, &tent->name);
 	}
+	del_external(tent);
 	free(tent->name.s);
 
 	tent->name.len = strlen(new_name);
@@ -789,17 +852,133 @@ int is_compiledb_tent(struct tup_entry *tent)
 	return has_flag(tent, 'j');
 }
 
-int exclusion_match(FILE *f, struct tent_entries *exclusion_root, const char *s, struct tup_entry **match)
+static pthread_once_t match_data_once = PTHREAD_ONCE_INIT;
+static pthread_key_t match_data_key;
+static int match_data_key_rc;
+
+static void free_match_data(void *data)
+{
+	pcre2_match_data_free(data);
+}
+
+static void match_data_key_init(void)
+{
+	match_data_key_rc = pthread_key_create(&match_data_key, free_match_data);
+}
+
+/* exclusion_match() is called for every file a command reads or writes, from
+ * the updater threads as well as the FUSE threads, so each thread keeps its own
+ * match data around instead of allocating one per call.
+ */
+static pcre2_match_data *get_match_data(FILE *f)
+{
+	pcre2_match_data *re_match;
+
+	pthread_once(&match_data_once, match_data_key_init);
+	if(match_data_key_rc != 0) {
+		fprintf(f, "tup error: Unable to create the regex match data key.\n");
+		return NULL;
+	}
+	re_match = pthread_getspecific(match_data_key);
+	if(re_match)
+		return re_match;
+
+	/* We only care whether a pattern matches, not what it captured, so a
+	 * single ovector pair is enough and can be shared by every pattern.
+	 * pcre2_match() returns 0 rather than an error when the ovector is too
+	 * small to hold the captures.
+	 */
+	re_match = pcre2_match_data_create(1, NULL);
+	if(!re_match) {
+		fprintf(f, "tup error: Unable to allocate regex match data.\n");
+		return NULL;
+	}
+	if(pthread_setspecific(match_data_key, re_match) != 0) {
+		fprintf(f, "tup error: Unable to save the regex match data.\n");
+		pcre2_match_data_free(re_match);
+		return NULL;
+	}
+	return re_match;
+}
+
+/* Combine all of a command's exclusions into a single alternation, so that a
+ * file that matches none of them (which is nearly every file) is rejected with
+ * one pcre2_match() call instead of one per pattern. *re is left NULL if the
+ * patterns can't be combined, in which case exclusion_match() just checks them
+ * one at a time.
+ */
+int exclusion_compile(FILE *f, struct tent_entries *exclusion_root, pcre2_code **re)
 {
 	struct tent_tree *tt;
-	int len = strlen(s);
+	struct estring e;
+	int error;
+	size_t erroffset;
+
+	*re = NULL;
+	if(exclusion_root->count < 2)
+		return 0;
+
+	RB_FOREACH(tt, tent_entries, exclusion_root) {
+		uint32_t backrefmax;
+		/* Numbered backreferences would point at the wrong group once
+		 * the patterns are strung together.
+		 */
+		if(pcre2_pattern_info(tt->tent->re, PCRE2_INFO_BACKREFMAX, &backrefmax) < 0 || backrefmax > 0)
+			return 0;
+	}
+
+	if(estring_init(&e) < 0)
+		return -1;
+	RB_FOREACH(tt, tent_entries, exclusion_root) {
+		if(e.len && estring_append(&e, "|", 1) < 0)
+			goto err_out;
+		if(estring_append(&e, "(?:", 3) < 0)
+			goto err_out;
+		if(estring_append(&e, tt->tent->name.s, tt->tent->name.len) < 0)
+			goto err_out;
+		if(estring_append(&e, ")", 1) < 0)
+			goto err_out;
+	}
+	/* Each pattern compiled on its own, so a failure here just means
+	 * they don't combine cleanly (eg: duplicate group names).
+	 */
+	*re = pcre2_compile((PCRE2_SPTR)e.s, e.len, 0, &error, &erroffset, NULL);
+	if(*re)
+		pcre2_jit_compile(*re, PCRE2_JIT_COMPLETE);
+	free(e.s);
+	return 0;
+
+err_out:
+	fprintf(f, "tup error: Unable to combine the exclusion patterns.\n");
+	free(e.s);
+	return -1;
+}
+
+int exclusion_match(FILE *f, struct tent_entries *exclusion_root, pcre2_code *exclusion_re, const char *s, struct tup_entry **match)
+{
+	struct tent_tree *tt;
+	pcre2_match_data *re_match;
+	int len;
+	int rc = 0;
 
 	*match = NULL;
+	if(RB_EMPTY(exclusion_root))
+		return 0;
+
+	re_match = get_match_data(f);
+	if(!re_match)
+		return -1;
+	len = strlen(s);
+	if(exclusion_re) {
+		rc = pcre2_match(exclusion_re, (PCRE2_SPTR)s, len, 0, 0, re_match, NULL);
+		if(rc == PCRE2_ERROR_NOMATCH)
+			return 0;
+		/* Something matched (or the combined pattern failed), so go
+		 * through them individually to find out which one.
+		 */
+	}
 	RB_FOREACH(tt, tent_entries, exclusion_root) {
-		int rc;
-		pcre2_match_data *re_match = pcre2_match_data_create_from_pattern(tt->tent->re, NULL);
 		rc = pcre2_match(tt->tent->re, (PCRE2_SPTR)s, len, 0, 0, re_match, NULL);
-		pcre2_match_data_free(re_match);
 		if(rc >= 0) {
 			*match = tt->tent;
 			if(do_verbose) {
@@ -808,8 +987,10 @@ int exclusion_match(FILE *f, struct tent_entries *exclusion_root, const char *s,
 			break;
 		} else if(rc != PCRE2_ERROR_NOMATCH) {
 			fprintf(f, "tup error: Regex failed to execute: %s\n", tt->tent->name.s);
-			return -1;
+			break;
 		}
 	}
+	if(rc < 0 && rc != PCRE2_ERROR_NOMATCH)
+		return -1;
 	return 0;
 }
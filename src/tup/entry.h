@@ -32,6 +32,7 @@
 
 struct variant;
 struct estring;
+struct external_path;
 
 /* Local cache of the entries in the 'node' database table */
 struct tup_entry {
@@ -47,6 +48,13 @@ struct tup_entry {
 	struct tent_entries stickies;
 	struct tent_entries group_stickies;
 	int retrieved_stickies;
+	/* Set once every node in this directory has been loaded from the
+	 * database, so a miss in 'entries' means the node doesn't exist.
+	 */
+	int entries_loaded;
+	int entry_misses;
+	/* Set if the node is indexed by its full path in the external cache. */
+	struct external_path *external;
 	struct tup_entry *incoming;
 	_Atomic int refcount;
 
@@ -86,6 +94,8 @@ tupid_t tup_entry_vardt(struct tup_entry *tent);
 int tup_entry_rm(tupid_t tupid);
 struct tup_entry *tup_entry_get(tupid_t tupid);
 struct tup_entry *tup_entry_find(tupid_t tupid);
+struct tup_entry *tup_entry_find_external(const char *path);
+int tup_entry_add_external(struct tup_entry *tent, const char *path);
 int tup_entry_sym_follow(struct tup_entry *tent);
 void tup_entry_set_verbose(int verbose);
 void print_tup_entry(FILE *f, struct tup_entry *tent);
@@ -101,6 +111,7 @@ int get_relative_dir(FILE *f, struct estring *e, tupid_t start, tupid_t end);
 int get_relative_dir_sep(FILE *f, struct estring *e, tupid_t start, tupid_t end, char sep);
 int is_transient_tent(struct tup_entry *tent);
 int is_compiledb_tent(struct tup_entry *tent);
-int exclusion_match(FILE *f, struct tent_entries *exclusion_root, const char *s, struct tup_entry **match);
+int exclusion_compile(FILE *f, struct tent_entries *exclusion_root, pcre2_code **re);
+int exclusion_match(FILE *f, struct tent_entries *exclusion_root, pcre2_code *exclusion_re, const char *s, struct tup_entry **match);
 
 #endif
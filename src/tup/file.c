@@ -20,7 +20,7 @@
 
 #define _ATFILE_SOURCE
 #include "file.h"
-#include "mempool.h"
+#include "container.h"
 #include "debug.h"
 #include "db.h"
 #include "fileio.h"
@@ -33,28 +33,46 @@
 #include <errno.h>
 #include <sys/stat.h>
 
-static struct file_entry *new_entry(const char *filename);
-static void check_unlink_list(const char *filename, struct file_entry_head *u_head);
+static int file_list_add(struct file_info *info, struct file_list *fl,
+			 const char *filename);
+static struct file_entry *file_list_find(struct file_list *fl, const char *filename);
+static void check_unlink_list(const char *filename, struct file_list *u_list);
 static void handle_unlink(struct file_info *info);
 static int update_write_info(FILE *f, tupid_t cmdid, struct file_info *info,
 			     int *warnings, enum check_type_t check_only);
 static int update_read_info(FILE *f, tupid_t cmdid, struct file_info *info,
 			    int full_deps, tupid_t vardt,
 			    int *important_link_removed);
+static int add_tent_to_tree(struct tup_entry *tent, struct tent_entries *root);
+static int add_node_to_tree(tupid_t dt, const char *filename,
+			    struct tent_entries *root, int full_deps);
 static int add_config_files_locked(struct file_info *finfo, struct tup_entry *tent, int full_deps);
 static int add_parser_files_locked(struct file_info *finfo,
 				   struct tent_entries *root, tupid_t vardt,
 				   int full_deps);
 
-static _Thread_local struct mempool pool = MEMPOOL_INITIALIZER(struct file_entry);
+#define FILE_CHUNK_SIZE (64 * 1024)
+
+static void file_list_init(struct file_list *fl)
+{
+	TAILQ_INIT(&fl->entries);
+	RB_INIT(&fl->root);
+}
+
+static void mapping_list_init(struct mapping_list *ml)
+{
+	TAILQ_INIT(&ml->entries);
+	RB_INIT(&ml->root);
+}
 
 int init_file_info(struct file_info *info, int do_unlink)
 {
-	TAILQ_INIT(&info->read_list);
-	TAILQ_INIT(&info->write_list);
-	TAILQ_INIT(&info->unlink_list);
-	TAILQ_INIT(&info->var_list);
-	TAILQ_INIT(&info->mapping_list);
+	file_list_init(&info->read_list);
+	file_list_init(&info->write_list);
+	file_list_init(&info->unlink_list);
+	file_list_init(&info->var_list);
+	info->chunks = NULL;
+	mapping_list_init(&info->mapping_list);
 	TAILQ_INIT(&info->tmpdir_list);
 	tent_tree_init(&info->sticky_root);
 	tent_tree_init(&info->normal_root);
@@ -62,6 +80,7 @@ int init_file_info(struct file_info *info, int do_unlink)
 	tent_tree_init(&info->used_groups_root);
 	tent_tree_init(&info->output_root);
 	tent_tree_init(&info->exclusion_root);
+	info->exclusion_re = NULL;
 	pthread_mutex_init(&info->lock, NULL);
 	pthread_cond_init(&info->cond, NULL);
 	info->server_fail = 0;
@@ -72,7 +91,19 @@ int init_file_info(struct file_info *info, int do_unlink)
 
 void cleanup_file_info(struct file_info *info)
 {
+	while(info->chunks) {
+		struct file_chunk *chunk = info->chunks;
+		info->chunks = chunk->next;
+		free(chunk);
+	}
+	file_list_init(&info->read_list);
+	file_list_init(&info->write_list);
+	file_list_init(&info->unlink_list);
+	file_list_init(&info->var_list);
+	mapping_list_init(&info->mapping_list);
 	free_tent_tree(&info->exclusion_root);
+	pcre2_code_free(info->exclusion_re);
+	info->exclusion_re = NULL;
 	free_tent_tree(&info->output_root);
 	free_tent_tree(&info->used_groups_root);
 	free_tent_tree(&info->group_sticky_root);
@@ -197,29 +228,24 @@ int handle_file(enum access_type at, const char *filename, const char *file2,
 int handle_open_file(enum access_type at, const char *filename,
 		     struct file_info *info)
 {
-	struct file_entry *fent;
 	int rc = 0;
 
-	fent = new_entry(filename);
-	if(!fent) {
-		return -1;
-	}
-
 	switch(at) {
 		case ACCESS_READ:
-			TAILQ_INSERT_TAIL(&info->read_list, fent, list);
+			rc = file_list_add(info, &info->read_list, filename);
 			break;
 		case ACCESS_WRITE:
 			check_unlink_list(filename, &info->unlink_list);
-			TAILQ_INSERT_TAIL(&info->write_list, fent, list);
+			rc = file_list_add(info, &info->write_list, filename);
 			break;
 		case ACCESS_UNLINK:
-			TAILQ_INSERT_TAIL(&info->unlink_list, fent, list);
+			rc = file_list_add(info, &info->unlink_list, filename);
 			break;
 		case ACCESS_VAR:
-			TAILQ_INSERT_TAIL(&info->var_list, fent, list);
+			rc = file_list_add(info, &info->var_list, filename);
 			break;
 		case ACCESS_RENAME:
+		case ACCESS_SPILL:
 		default:
 			fprintf(stderr, "Invalid event type: %i\n", at);
 			rc = -1;
@@ -246,7 +272,7 @@ int write_files(FILE *f, tupid_t cmdid, struct file_info *info, int *warnings,
 			struct tup_entry *match = NULL;
 
 			tmpdir = TAILQ_FIRST(&info->tmpdir_list);
-			if(exclusion_match(f, &info->exclusion_root, tmpdir->dirname, &match) < 0)
+			if(exclusion_match(f, &info->exclusion_root, info->exclusion_re, tmpdir->dirname, &match) < 0)
 				return -1;
 			if(match) {
 				if(mkdir(tmpdir->dirname, 0777) < 0) {
@@ -331,6 +357,69 @@ int add_parser_files(struct file_info *finfo, struct tent_entries *root,
 	return rc;
 }
 
+static void file_list_move(struct file_list *dst, struct file_list *src)
+{
+	struct file_entry *fent;
+
+	while(!TAILQ_EMPTY(&src->entries)) {
+		fent = TAILQ_FIRST(&src->entries);
+		del_file_entry(src, fent);
+		if(file_list_find(dst, fent->name.s))
+			continue;
+		/* Can't fail, since we just checked that the name isn't in
+		 * the tree.
+		 */
+		string_tree_insert(&dst->root, &fent->name);
+		TAILQ_INSERT_TAIL(&dst->entries, fent, list);
+	}
+}
+
+void finfo_stash(struct file_info *finfo, struct file_stash *stash)
+{
+	finfo_lock(finfo);
+	file_list_init(&stash->read_list);
+	file_list_init(&stash->var_list);
+	file_list_move(&stash->read_list, &finfo->read_list);
+	file_list_move(&stash->var_list, &finfo->var_list);
+	finfo_unlock(finfo);
+}
+
+int finfo_unstash(struct file_info *finfo, struct file_stash *stash,
+		  struct tent_entries *root, int full_deps, int *used_vars)
+{
+	struct file_entry *r;
+	struct tent_entries tmproot = TENT_ENTRIES_INITIALIZER;
+	struct tent_tree *tt;
+	int rc = 0;
+
+	finfo_lock(finfo);
+	*used_vars = !TAILQ_EMPTY(&finfo->var_list.entries);
+	TAILQ_FOREACH(r, &finfo->read_list.entries, list) {
+		if(add_node_to_tree(DOT_DT, r->name.s, &tmproot, full_deps) < 0) {
+			rc = -1;
+			break;
+		}
+	}
+	if(rc == 0) {
+		RB_FOREACH(tt, tent_entries, &tmproot) {
+			if(strcmp(tt->tent->name.s, ".gitignore") != 0)
+				if(tent_tree_add_dup(root, tt->tent) < 0) {
+					rc = -1;
+					break;
+				}
+		}
+	}
+	free_tent_tree(&tmproot);
+
+	/* The stashed entries go back in either way, so that they still end
+	 * up as inputs of the directory in add_parser_files().
+	 */
+	file_list_move(&finfo->read_list, &stash->read_list);
+	file_list_move(&finfo->var_list, &stash->var_list);
+	finfo_unlock(finfo);
+	return rc;
+}
+
 static int add_node_to_tree(tupid_t dt, const char *filename,
 			    struct tent_entries *root, int full_deps)
 {
@@ -339,9 +428,17 @@ static int add_node_to_tree(tupid_t dt, const char *filename,
 	struct pel_group pg;
 	struct tup_entry *tent;
 	struct tup_entry *new_dtent;
+	int outside_tup;
+
+	if(full_deps && dt == DOT_DT && is_full_path(filename)) {
+		tent = tup_entry_find_external(filename);
+		if(tent)
+			return add_tent_to_tree(tent, root);
+	}
 
 	if(get_path_elements(filename, &pg) < 0)
 		return -1;
+	outside_tup = pg.pg_flags & PG_OUTSIDE_TUP;
 
 	new_dt = find_dir_tupid_dt_pg(dt, &pg, &pel, 1, full_deps);
 	if(new_dt < 0)
@@ -363,7 +460,7 @@ static int add_node_to_tree(tupid_t dt, const char *filename,
 	if(!tent) {
 		struct timespec mtime = INVALID_MTIME;
 		int type = TUP_NODE_GHOST;
-		if(full_deps && (pg.pg_flags & PG_OUTSIDE_TUP)) {
+		if(full_deps && outside_tup) {
 			if(get_outside_tup_mtime(new_dtent, pel, &mtime) < 0)
 				return -1;
 		}
@@ -379,6 +476,18 @@ static int add_node_to_tree(tupid_t dt, const char *filename,
 	free_pel(pel);
 	del_pel_group(&pg);
 
+	/* External nodes only change during the scan at startup, so the
+	 * next command that reads this path can use the same entry.
+	 */
+	if(full_deps && outside_tup && dt == DOT_DT) {
+		if(tup_entry_add_external(tent, filename) < 0)
+			return -1;
+	}
+	return add_tent_to_tree(tent, root);
+}
+
+static int add_tent_to_tree(struct tup_entry *tent, struct tent_entries *root)
+{
 	if(tent->type == TUP_NODE_DIR || tent->type == TUP_NODE_GENERATED_DIR || tent->mtime.tv_sec == 0) {
 		/* We don't track dependencies on directory nodes for commands. Note that
 		 * some directory accesses may create ghost nodes as placeholders for the
@@ -473,10 +582,10 @@ static int add_config_files_locked(struct file_info *finfo, struct tup_entry *te
 	struct file_entry *r;
 	struct tent_entries root = TENT_ENTRIES_INITIALIZER;
 
-	while(!TAILQ_EMPTY(&finfo->read_list)) {
-		r = TAILQ_FIRST(&finfo->read_list);
+	while(!TAILQ_EMPTY(&finfo->read_list.entries)) {
+		r = TAILQ_FIRST(&finfo->read_list.entries);
 
-		if(add_node_to_tree(DOT_DT, r->filename, &root, full_deps) < 0)
+		if(add_node_to_tree(DOT_DT, r->name.s, &root, full_deps) < 0)
 			return -1;
 
 		del_file_entry(&finfo->read_list, r);
@@ -503,16 +612,16 @@ static int add_parser_files_locked(struct file_info *finfo,
 	struct tent_tree *tt;
 	int map_bork = 0;
 
-	while(!TAILQ_EMPTY(&finfo->read_list)) {
-		r = TAILQ_FIRST(&finfo->read_list);
-		if(add_node_to_tree(DOT_DT, r->filename, &tmproot, full_deps) < 0)
+	while(!TAILQ_EMPTY(&finfo->read_list.entries)) {
+		r = TAILQ_FIRST(&finfo->read_list.entries);
+		if(add_node_to_tree(DOT_DT, r->name.s, &tmproot, full_deps) < 0)
 			return -1;
 		del_file_entry(&finfo->read_list, r);
 	}
-	while(!TAILQ_EMPTY(&finfo->var_list)) {
-		r = TAILQ_FIRST(&finfo->var_list);
+	while(!TAILQ_EMPTY(&finfo->var_list.entries)) {
+		r = TAILQ_FIRST(&finfo->var_list.entries);
 
-		if(add_node_to_tree(vardt, r->filename, &tmproot, 0) < 0)
+		if(add_node_to_tree(vardt, r->name.s, &tmproot, 0) < 0)
 			return -1;
 		del_file_entry(&finfo->var_list, r);
 	}
@@ -524,18 +633,18 @@ static int add_parser_files_locked(struct file_info *finfo,
 	free_tent_tree(&tmproot);
 
 	/* TODO: write_list not needed here? */
-	while(!TAILQ_EMPTY(&finfo->write_list)) {
-		r = TAILQ_FIRST(&finfo->write_list);
+	while(!TAILQ_EMPTY(&finfo->write_list.entries)) {
+		r = TAILQ_FIRST(&finfo->write_list.entries);
 		del_file_entry(&finfo->write_list, r);
 	}
 
-	while(!TAILQ_EMPTY(&finfo->mapping_list)) {
-		map = TAILQ_FIRST(&finfo->mapping_list);
+	while(!TAILQ_EMPTY(&finfo->mapping_list.entries)) {
+		map = TAILQ_FIRST(&finfo->mapping_list.entries);
 
-		if(gimme_tent(map->realname, &tent) < 0)
+		if(gimme_tent(map->realname.s, &tent) < 0)
 			return -1;
 		if(!tent) {
-			fprintf(stderr, "tup error: Writing to file '%s' while parsing is not allowed\n", map->realname);
+			fprintf(stderr, "tup error: Writing to file '%s' while parsing is not allowed\n", map->realname.s);
 			map_bork = 1;
 		}
 		del_map(&finfo->mapping_list, map);
@@ -545,98 +654,226 @@ static int add_parser_files_locked(struct file_info *finfo,
 	return 0;
 }
 
-static struct file_entry *new_entry(const char *filename)
+static void *file_alloc(struct file_info *info, size_t size)
 {
-	struct file_entry *fent;
+	struct file_chunk *chunk = info->chunks;
+	const size_t align = _Alignof(struct file_entry);
+	void *mem;
+
+	size = (size + align - 1) & ~(align - 1);
+	if(!chunk || chunk->size - chunk->used < size) {
+		size_t chunk_size = FILE_CHUNK_SIZE;
+		if(size > chunk_size)
+			chunk_size = size;
+		chunk = malloc(sizeof *chunk + chunk_size);
+		if(!chunk) {
+			perror("malloc");
+			return NULL;
+		}
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		chunk->next = info->chunks;
+		info->chunks = chunk;
+	}
+	mem = chunk->mem + chunk->used;
+	chunk->used += size;
+	return mem;
+}
 
-	fent = mempool_alloc(&pool);
-	if(!fent) {
+static char *file_strdup(struct file_info *info, const char *s, int len)
+{
+	char *copy;
+
+	copy = file_alloc(info, len + 1);
+	if(!copy)
 		return NULL;
-	}
+	memcpy(copy, s, len + 1);
+	return copy;
+}
+
+static struct file_entry *file_list_find(struct file_list *fl, const char *filename)
+{
+	struct string_tree *st;
 
-	fent->filename = strdup(filename);
-	if(!fent->filename) {
-		perror("strdup");
-		mempool_free(&pool, fent);
+	st = string_tree_search(&fl->root, filename, strlen(filename));
+	if(!st)
 		return NULL;
+	return container_of(st, struct file_entry, name);
+}
+
+static int file_list_add(struct file_info *info, struct file_list *fl,
+			 const char *filename)
+{
+	struct file_entry *fent;
+	int len;
+
+	/* Commands tend to access the same files over and over, but we only
+	 * need to process each one once.
+	 */
+	if(file_list_find(fl, filename))
+		return 0;
+
+	len = strlen(filename);
+	fent = file_alloc(info, sizeof *fent);
+	if(!fent)
+		return -1;
+	fent->name.s = file_strdup(info, filename, len);
+	if(!fent->name.s)
+		return -1;
+	fent->name.len = len;
+	if(string_tree_insert(&fl->root, &fent->name) < 0) {
+		fprintf(stderr, "tup internal error: Unable to insert '%s' into the file list.\n", filename);
+		return -1;
 	}
-	return fent;
+	TAILQ_INSERT_TAIL(&fl->entries, fent, list);
+	return 0;
 }
 
-void del_file_entry(struct file_entry_head *head, struct file_entry *fent)
+void del_file_entry(struct file_list *fl, struct file_entry *fent)
 {
-	TAILQ_REMOVE(head, fent, list);
-	free(fent->filename);
-	mempool_free(&pool, fent);
+	/* The memory itself stays in the file_info chunks until
+	 * cleanup_file_info().
+	 */
+	TAILQ_REMOVE(&fl->entries, fent, list);
+	string_tree_rm(&fl->root, &fent->name);
 }
 
-int handle_rename(const char *from, const char *to, struct file_info *info)
+static int rename_file_entry(struct file_info *info, struct file_list *fl,
+			     const char *from, const char *to)
 {
 	struct file_entry *fent;
+	int len;
 
-	TAILQ_FOREACH(fent, &info->write_list, list) {
-		if(name_cmp(fent->filename, from) == 0) {
-			free(fent->filename);
-
-			fent->filename = strdup(to);
-			if(!fent->filename) {
-				perror("strdup");
-				return -1;
-			}
-		}
+	fent = file_list_find(fl, from);
+	if(!fent)
+		return 0;
+	if(file_list_find(fl, to)) {
+		del_file_entry(fl, fent);
+		return 0;
 	}
-	TAILQ_FOREACH(fent, &info->read_list, list) {
-		if(name_cmp(fent->filename, from) == 0) {
-			free(fent->filename);
 
-			fent->filename = strdup(to);
-			if(!fent->filename) {
-				perror("strdup");
-				return -1;
-			}
-		}
+	/* Keep the entry's place in the list, so only the index needs to
+	 * change.
+	 */
+	string_tree_rm(&fl->root, &fent->name);
+	len = strlen(to);
+	fent->name.s = file_strdup(info, to, len);
+	if(!fent->name.s)
+		return -1;
+	fent->name.len = len;
+	if(string_tree_insert(&fl->root, &fent->name) < 0) {
+		fprintf(stderr, "tup internal error: Unable to insert '%s' into the file list.\n", to);
+		return -1;
 	}
+	return 0;
+}
+
+int handle_rename(const char *from, const char *to, struct file_info *info)
+{
+	if(rename_file_entry(info, &info->write_list, from, to) < 0)
+		return -1;
+	if(rename_file_entry(info, &info->read_list, from, to) < 0)
+		return -1;
 
 	check_unlink_list(to, &info->unlink_list);
 	return 0;
 }
 
-void del_map(struct mapping_head *head, struct mapping *map)
+struct mapping *find_map(struct mapping_list *ml, const char *realname)
 {
-	TAILQ_REMOVE(head, map, list);
-	free(map->tmpname);
-	free(map->realname);
-	free(map);
+	struct string_tree *st;
+
+	st = string_tree_search(&ml->root, realname, strlen(realname));
+	if(!st)
+		return NULL;
+	return container_of(st, struct mapping, realname);
 }
 
-static void check_unlink_list(const char *filename, struct file_entry_head *u_head)
+/* Returns the existing mapping if the file has already been mapped, so that
+ * repeated writes to one file all go to the same place.
+ */
+struct mapping *add_map(struct file_info *info, const char *realname,
+			const char *tmpname)
 {
-	struct file_entry *fent, *tmp;
+	struct mapping *map;
+	int len;
 
-	TAILQ_FOREACH_SAFE(fent, u_head, list, tmp) {
-		if(name_cmp(filename, fent->filename) == 0) {
-			del_file_entry(u_head, fent);
-		}
+	map = find_map(&info->mapping_list, realname);
+	if(map)
+		return map;
+
+	len = strlen(realname);
+	map = file_alloc(info, sizeof *map);
+	if(!map)
+		return NULL;
+	map->realname.s = file_strdup(info, realname, len);
+	if(!map->realname.s)
+		return NULL;
+	map->realname.len = len;
+	map->tmpname = file_strdup(info, tmpname, strlen(tmpname));
+	if(!map->tmpname)
+		return NULL;
+	map->tent = NULL; /* This is used when saving dependencies */
+	if(string_tree_insert(&info->mapping_list.root, &map->realname) < 0) {
+		fprintf(stderr, "tup internal error: Unable to insert '%s' into the mapping list.\n", realname);
+		return NULL;
+	}
+	TAILQ_INSERT_TAIL(&info->mapping_list.entries, map, list);
+	return map;
+}
+
+int rename_map(struct file_info *info, struct mapping *map, const char *realname)
+{
+	int len;
+
+	if(find_map(&info->mapping_list, realname)) {
+		fprintf(stderr, "tup internal error: Unable to rename mapping '%s' to '%s' since it already exists.\n", map->realname.s, realname);
+		return -1;
 	}
+	string_tree_rm(&info->mapping_list.root, &map->realname);
+	len = strlen(realname);
+	map->realname.s = file_strdup(info, realname, len);
+	if(!map->realname.s)
+		return -1;
+	map->realname.len = len;
+	if(string_tree_insert(&info->mapping_list.root, &map->realname) < 0) {
+		fprintf(stderr, "tup internal error: Unable to insert '%s' into the mapping list.\n", realname);
+		return -1;
+	}
+	return 0;
+}
+
+void del_map(struct mapping_list *ml, struct mapping *map)
+{
+	/* Like file entries, the mapping stays in the file_info chunks until
+	 * cleanup_file_info().
+	 */
+	TAILQ_REMOVE(&ml->entries, map, list);
+	string_tree_rm(&ml->root, &map->realname);
+}
+
+static void check_unlink_list(const char *filename, struct file_list *u_list)
+{
+	struct file_entry *fent;
+
+	fent = file_list_find(u_list, filename);
+	if(fent)
+		del_file_entry(u_list, fent);
 }
 
 static void handle_unlink(struct file_info *info)
 {
-	struct file_entry *u, *fent, *tmp;
+	struct file_entry *u, *fent;
 
-	while(!TAILQ_EMPTY(&info->unlink_list)) {
-		u = TAILQ_FIRST(&info->unlink_list);
+	while(!TAILQ_EMPTY(&info->unlink_list.entries)) {
+		u = TAILQ_FIRST(&info->unlink_list.entries);
 
-		TAILQ_FOREACH_SAFE(fent, &info->write_list, list, tmp) {
-			if(name_cmp(fent->filename, u->filename) == 0) {
-				del_file_entry(&info->write_list, fent);
-			}
-		}
-		TAILQ_FOREACH_SAFE(fent, &info->read_list, list, tmp) {
-			if(name_cmp(fent->filename, u->filename) == 0) {
-				del_file_entry(&info->read_list, fent);
-			}
-		}
+		fent = file_list_find(&info->write_list, u->name.s);
+		if(fent)
+			del_file_entry(&info->write_list, fent);
+		fent = file_list_find(&info->read_list, u->name.s);
+		if(fent)
+			del_file_entry(&info->read_list, fent);
 
 		del_file_entry(&info->unlink_list, u);
 	}
@@ -651,7 +888,7 @@ static int create_ignored_file(FILE *f, struct file_entry *w)
 	int type = TUP_NODE_FILE;
 	tupid_t dt;
 
-	if(get_path_elements(w->filename, &pg) < 0)
+	if(get_path_elements(w->name.s, &pg) < 0)
 		return -1;
 	if(pg.pg_flags & PG_OUTSIDE_TUP) {
 		type = TUP_NODE_GHOST;
@@ -659,11 +896,11 @@ static int create_ignored_file(FILE *f, struct file_entry *w)
 
 	dt = find_dir_tupid_dt_pg(DOT_DT, &pg, &pel, SOTGV_IGNORE_DIRS, 1);
 	if(dt < 0) {
-		fprintf(f, "tup error: Unable to create directory tree for ignored file: %s\n", w->filename);
+		fprintf(f, "tup error: Unable to create directory tree for ignored file: %s\n", w->name.s);
 		return -1;
 	}
 	if(!pel) {
-		fprintf(f, "tup internal error: create_ignored_file() didn't get a final pel pointer for file: %s\n", w->filename);
+		fprintf(f, "tup internal error: create_ignored_file() didn't get a final pel pointer for file: %s\n", w->name.s);
 		return -1;
 	}
 	if(tup_entry_add(dt, &dtent) < 0) {
@@ -694,36 +931,34 @@ static int update_write_info(FILE *f, tupid_t cmdid, struct file_info *info,
 			     int *warnings, enum check_type_t check_only)
 {
 	struct file_entry *w;
-	struct file_entry *r;
-	struct file_entry *tmp;
 	struct tup_entry *tent;
 	struct tent_entries root = TENT_ENTRIES_INITIALIZER;
 	int write_bork = 0;
 
-	while(!TAILQ_EMPTY(&info->write_list)) {
+	while(!TAILQ_EMPTY(&info->write_list.entries)) {
 		tupid_t newdt;
 		struct path_element *pel = NULL;
 		struct pel_group pg;
 		struct tup_entry *match = NULL;
 
-		w = TAILQ_FIRST(&info->write_list);
+		w = TAILQ_FIRST(&info->write_list.entries);
 
-		if(get_path_elements(w->filename, &pg) < 0)
+		if(get_path_elements(w->name.s, &pg) < 0)
 			return -1;
 		if(pg.pg_flags & PG_HIDDEN) {
 			if(warnings) {
-				fprintf(f, "tup warning: Writing to hidden file '%s'\n", w->filename);
+				fprintf(f, "tup warning: Writing to hidden file '%s'\n", w->name.s);
 				(*warnings)++;
 			}
 			del_pel_group(&pg);
 			goto out_skip;
 		}
 
-		if(exclusion_match(f, &info->exclusion_root, w->filename, &match) < 0)
+		if(exclusion_match(f, &info->exclusion_root, info->exclusion_re, w->name.s, &match) < 0)
 			return -1;
 		if(match) {
 			if(create_ignored_file(f, w) < 0) {
-				fprintf(f, "tup error: Failed to create ignored file. The filename '%s' matched an exclusion pattern: ", w->filename);
+				fprintf(f, "tup error: Failed to create ignored file. The filename '%s' matched an exclusion pattern: ", w->name.s);
 				print_tup_entry(f, match);
 				fprintf(f, "\n");
 				return -1;
@@ -731,13 +966,6 @@ static int update_write_info(FILE *f, tupid_t cmdid, struct file_info *info,
 			goto out_skip;
 		}
 
-		/* Remove duplicate write entries */
-		TAILQ_FOREACH_SAFE(r, &info->write_list, list, tmp) {
-			if(r != w && (name_cmp(w->filename, r->filename) == 0)) {
-				del_file_entry(&info->write_list, r);
-			}
-		}
-
 		tent = NULL;
 		newdt = find_dir_tupid_dt_pg(DOT_DT, &pg, &pel, 0, 0);
 		del_pel_group(&pg);
@@ -746,7 +974,7 @@ static int update_write_info(FILE *f, tupid_t cmdid, struct file_info *info,
 			if(tup_entry_add(newdt, &dtent) < 0)
 				return -1;
 			if(!pel) {
-				fprintf(f, "tup internal error: find_dir_tupid_dt_pg() in write_files() didn't get a final pel pointer for file: %s\n", w->filename);
+				fprintf(f, "tup internal error: find_dir_tupid_dt_pg() in write_files() didn't get a final pel pointer for file: %s\n", w->name.s);
 				return -1;
 			}
 
@@ -757,51 +985,26 @@ static int update_write_info(FILE *f, tupid_t cmdid, struct file_info *info,
 		if(!tent) {
 			struct mapping *map;
 
-			fprintf(f, "tup error: File '%s' was written to, but is not in .tup/db. You probably should specify it as an output\n", w->filename);
+			fprintf(f, "tup error: File '%s' was written to, but is not in .tup/db. You probably should specify it as an output\n", w->name.s);
 			write_bork = 1;
 			if(info->do_unlink) {
-				fprintf(f, " -- Delete: %s\n", w->filename);
-				unlink(w->filename);
+				fprintf(f, " -- Delete: %s\n", w->name.s);
+				unlink(w->name.s);
 			}
 
-			TAILQ_FOREACH(map, &info->mapping_list, list) {
-				if(strcmp(map->realname, w->filename) == 0) {
-					del_map(&info->mapping_list, map);
-					break;
-				}
-			}
+			map = find_map(&info->mapping_list, w->name.s);
+			if(map)
+				del_map(&info->mapping_list, map);
 		} else {
 			struct mapping *map;
-			int mapping_set = 0;
 
 			if(tent_tree_add_dup(&root, tent) < 0)
 				return -1;
 
-			TAILQ_FOREACH(map, &info->mapping_list, list) {
-				if(strcmp(map->realname, w->filename) == 0) {
-					map->tent = tent;
-					mapping_set = 1;
-				}
-			}
-			if(!mapping_set) {
-				map = malloc(sizeof *map);
-				if(!map) {
-					perror("malloc");
-					return -1;
-				}
-				map->realname = strdup(w->filename);
-				if(!map->realname) {
-					perror("strdup");
-					return -1;
-				}
-				map->tmpname = strdup(w->filename);
-				if(!map->tmpname) {
-					perror("strdup");
-					return -1;
-				}
-				map->tent = tent;
-				TAILQ_INSERT_TAIL(&info->mapping_list, map, list);
-			}
+			map = add_map(info, w->name.s, w->name.s);
+			if(!map)
+				return -1;
+			map->tent = tent;
 		}
 
 out_skip:
@@ -811,22 +1014,22 @@ out_skip:
 	if(tup_db_check_actual_outputs(f, cmdid, &root, &info->output_root, &info->mapping_list, &write_bork, info->do_unlink, check_only==CHECK_SUCCESS) < 0)
 		return -1;
 
-	while(!TAILQ_EMPTY(&info->mapping_list)) {
+	while(!TAILQ_EMPTY(&info->mapping_list.entries)) {
 		struct mapping *map;
 
-		map = TAILQ_FIRST(&info->mapping_list);
+		map = TAILQ_FIRST(&info->mapping_list.entries);
 
 		/* TODO: strcmp only here for win32 support */
-		if(strcmp(map->tmpname, map->realname) != 0) {
-			if(renameat(tup_top_fd(), map->tmpname, tup_top_fd(), map->realname) < 0) {
-				perror(map->realname);
-				fprintf(f, "tup error: Unable to rename temporary file '%s' to destination '%s'\n", map->tmpname, map->realname);
+		if(strcmp(map->tmpname, map->realname.s) != 0) {
+			if(renameat(tup_top_fd(), map->tmpname, tup_top_fd(), map->realname.s) < 0) {
+				perror(map->realname.s);
+				fprintf(f, "tup error: Unable to rename temporary file '%s' to destination '%s'\n", map->tmpname, map->realname.s);
 				write_bork = 1;
 			}
 		}
 		if(map->tent) {
 			/* tent may not be set (in the case of hidden files) */
-			if(file_set_mtime(map->tent, map->realname) < 0)
+			if(file_set_mtime(map->tent, map->realname.s) < 0)
 				return -1;
 		}
 		del_map(&info->mapping_list, map);
@@ -846,23 +1049,23 @@ static int update_read_info(FILE *f, tupid_t cmdid, struct file_info *info,
 	struct file_entry *r;
 	struct tent_entries root = TENT_ENTRIES_INITIALIZER;
 
-	while(!TAILQ_EMPTY(&info->read_list)) {
+	while(!TAILQ_EMPTY(&info->read_list.entries)) {
 		struct tup_entry *match = NULL;
-		r = TAILQ_FIRST(&info->read_list);
+		r = TAILQ_FIRST(&info->read_list.entries);
 
-		if(exclusion_match(f, &info->exclusion_root, r->filename, &match) < 0)
+		if(exclusion_match(f, &info->exclusion_root, info->exclusion_re, r->name.s, &match) < 0)
 			return -1;
 		if(!match) {
-			if(add_node_to_tree(DOT_DT, r->filename, &root, full_deps) < 0)
+			if(add_node_to_tree(DOT_DT, r->name.s, &root, full_deps) < 0)
 				return -1;
 		}
 		del_file_entry(&info->read_list, r);
 	}
 
-	while(!TAILQ_EMPTY(&info->var_list)) {
-		r = TAILQ_FIRST(&info->var_list);
+	while(!TAILQ_EMPTY(&info->var_list.entries)) {
+		r = TAILQ_FIRST(&info->var_list.entries);
 
-		if(add_node_to_tree(vardt, r->filename, &root, 0) < 0)
+		if(add_node_to_tree(vardt, r->name.s, &root, 0) < 0)
 			return -1;
 		del_file_entry(&info->var_list, r);
 	}
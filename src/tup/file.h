@@ -26,6 +26,7 @@
 #include "bsd/queue.h"
 #include "tupid_tree.h"
 #include "tent_tree.h"
+#include "string_tree.h"
 #include "thread_tree.h"
 #include "pel_group.h"
 #include "entry.h"
@@ -36,12 +37,21 @@ struct tup_entry;
 
 struct mapping {
 	TAILQ_ENTRY(mapping) list;
-	char *realname;
+	struct string_tree realname;
 	char *tmpname;
 	struct tup_entry *tent;
 };
 TAILQ_HEAD(mapping_head, mapping);
 
+/* As with file_list, the list keeps the mappings in the order they were made
+ * and the tree indexes them by realname, since the FUSE server has to find the
+ * mapping for a path on nearly every callback.
+ */
+struct mapping_list {
+	struct mapping_head entries;
+	struct string_entries root;
+};
+
 struct tmpdir {
 	TAILQ_ENTRY(tmpdir) list;
 	char *dirname;
@@ -50,19 +60,39 @@ TAILQ_HEAD(tmpdir_head, tmpdir);
 
 struct file_entry {
 	TAILQ_ENTRY(file_entry) list;
-	char *filename;
+	struct string_tree name;
 };
 TAILQ_HEAD(file_entry_head, file_entry);
 
+/* The list keeps the events in the order they arrived, and the tree indexes
+ * the same entries by name so that duplicates can be dropped on insertion and
+ * renames/unlinks don't need to walk the whole list.
+ */
+struct file_list {
+	struct file_entry_head entries;
+	struct string_entries root;
+};
+
+/* File entries, mappings, and their names are carved out of these chunks,
+ * which are only released all at once in cleanup_file_info().
+ */
+struct file_chunk {
+	struct file_chunk *next;
+	size_t size;
+	size_t used;
+	char mem[];
+};
+
 struct file_info {
 	pthread_mutex_t lock;
 	pthread_cond_t cond;
 	struct thread_tree tnode;
-	struct file_entry_head read_list;
-	struct file_entry_head write_list;
-	struct file_entry_head unlink_list;
-	struct file_entry_head var_list;
-	struct mapping_head mapping_list;
+	struct file_list read_list;
+	struct file_list write_list;
+	struct file_list unlink_list;
+	struct file_list var_list;
+	struct file_chunk *chunks;
+	struct mapping_list mapping_list;
 	struct tmpdir_head tmpdir_list;
 	struct tent_entries sticky_root;
 	struct tent_entries normal_root;
@@ -70,6 +100,7 @@ struct file_info {
 	struct tent_entries used_groups_root;
 	struct tent_entries output_root;
 	struct tent_entries exclusion_root;
+	pcre2_code *exclusion_re;
 	int server_fail;
 	int open_count;
 	int do_unlink;
@@ -81,6 +112,14 @@ enum check_type_t {
 	CHECK_SIGNALLED,
 };
 
+/* Holds the reads that a file_info has collected so far, so that the ones
+ * made afterward (eg: by a run-script) can be resolved on their own.
+ */
+struct file_stash {
+	struct file_list read_list;
+	struct file_list var_list;
+};
+
 int init_file_info(struct file_info *info, int do_unlink);
 void cleanup_file_info(struct file_info *info);
 void finfo_lock(struct file_info *info);
@@ -99,7 +138,14 @@ int write_files(FILE *f, tupid_t cmdid, struct file_info *info, int *warnings,
 int add_config_files(struct file_info *finfo, struct tup_entry *tent, int full_deps);
 int add_parser_files(struct file_info *finfo, struct tent_entries *root,
 		     tupid_t vardt, int full_deps);
-void del_map(struct mapping_head *head, struct mapping *map);
-void del_file_entry(struct file_entry_head *head, struct file_entry *fent);
+void finfo_stash(struct file_info *finfo, struct file_stash *stash);
+int finfo_unstash(struct file_info *finfo, struct file_stash *stash,
+		  struct tent_entries *root, int full_deps, int *used_vars);
+struct mapping *add_map(struct file_info *info, const char *realname,
+			const char *tmpname);
+struct mapping *find_map(struct mapping_list *ml, const char *realname);
+int rename_map(struct file_info *info, struct mapping *map, const char *realname);
+void del_map(struct mapping_list *ml, struct mapping *map);
+void del_file_entry(struct file_list *fl, struct file_entry *fent);
 
 #endif
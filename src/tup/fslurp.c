@@ -44,6 +44,22 @@ int fslurp_null(int fd, struct buf *b)
 	return rc;
 }
 
+/* 64-bit FNV-1a over the buffer contents. This is only used to tell whether a
+ * file that the parser read has actually changed, so it doesn't need to be
+ * cryptographically strong.
+ */
+uint64_t buf_digest(const struct buf *b)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	int x;
+
+	for(x=0; x<b->len; x++) {
+		h ^= (unsigned char)b->s[x];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
 static int do_slurp(int fd, struct buf *b, int extra)
 {
 	struct stat st;
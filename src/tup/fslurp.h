@@ -21,6 +21,8 @@
 #ifndef tup_fslurp_h
 #define tup_fslurp_h
 
+#include <stdint.h>
+
 struct buf {
 	char *s;
 	int len;
@@ -28,5 +30,6 @@ struct buf {
 
 int fslurp(int fd, struct buf *b);
 int fslurp_null(int fd, struct buf *b);
+uint64_t buf_digest(const struct buf *b);
 
 #endif
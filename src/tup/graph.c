@@ -769,7 +769,7 @@ static void mark_nodes(struct node *n)
 	}
 }
 
-static int prune_node(struct graph *g, struct node *n, int *num_pruned, enum graph_prune_type gpt, int verbose)
+static int prune_node(struct graph *g, struct node *n, int *num_pruned, enum graph_prune_type gpt, int add_modify, int verbose)
 {
 	struct edge *e;
 	if(n->counted) {
@@ -781,8 +781,9 @@ static int prune_node(struct graph *g, struct node *n, int *num_pruned, enum gra
 		 * still executed on the next update (since we won't hit the
 		 * logic that normally adds them in update_work())
 		 */
-		if(tup_db_add_modify_list(n->tent->tnode.tupid) < 0)
-			return -1;
+		if(add_modify)
+			if(tup_db_add_modify_list(n->tent->tnode.tupid) < 0)
+				return -1;
 
 		g->num_nodes--;
 		if(g->total_mtime != -1) {
@@ -894,7 +895,7 @@ int prune_graph(struct graph *g, int argc, char **argv, int *num_pruned,
 
 		TAILQ_FOREACH_SAFE(n, &g->node_list, list, tmp) {
 			if(!n->marked && n != g->root)
-				if(prune_node(g, n, num_pruned, gpt, verbose) < 0)
+				if(prune_node(g, n, num_pruned, gpt, 1, verbose) < 0)
 					goto out_err;
 		}
 	}
@@ -907,6 +908,49 @@ out_err:
 	return -1;
 }
 
+int prune_graph_commands(struct graph *g, struct tent_entries *keep_root,
+			 int *num_pruned)
+{
+	struct node *n;
+	struct node *tmp;
+
+	*num_pruned = 0;
+
+	/* Keep each listed command along with everything up the PDAG from it.
+	 * Everything else is pruned. Marks left over from an earlier
+	 * prune_graph() are cleared first.
+	 */
+	TAILQ_FOREACH(n, &g->node_list, list) {
+		n->marked = 0;
+	}
+	TAILQ_FOREACH(n, &g->node_list, list) {
+		if(n->tent->type == TUP_NODE_CMD &&
+		   tent_tree_search(keep_root, n->tent) != NULL) {
+			mark_nodes(n);
+		}
+	}
+	TAILQ_FOREACH_SAFE(n, &g->node_list, list, tmp) {
+		if(!n->marked && n != g->root) {
+			struct edge *e;
+			int add_modify = 0;
+
+			/* A pruned command only needs to be flagged if
+			 * something it depends on is kept, since then
+			 * update_work() won't be able to flag it. Otherwise
+			 * it keeps whatever flags it had, which matters for
+			 * ^o commands that skip their dependents (t4149).
+			 */
+			LIST_FOREACH(e, &n->incoming, destlist) {
+				if(e->src->marked)
+					add_modify = 1;
+			}
+			if(prune_node(g, n, num_pruned, GRAPH_PRUNE_ALL, add_modify, 0) < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
 void trim_graph(struct graph *g)
 {
 	struct node *n;
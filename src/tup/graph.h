@@ -116,6 +116,8 @@ int graph_empty(struct graph *g);
 int add_graph_stickies(struct graph *g);
 int prune_graph(struct graph *g, int argc, char **argv, int *num_pruned,
 		enum graph_prune_type gpt, int verbose);
+int prune_graph_commands(struct graph *g, struct tent_entries *keep_root,
+			 int *num_pruned);
 int nodes_are_connected(struct tup_entry *src, struct tent_entries *valid_root,
 			int *connected);
 void trim_graph(struct graph *g);
@@ -77,13 +77,19 @@ out_err:
 
 int tup_cleanup(void)
 {
-	tup_db_close();
+	int rc = 0;
+
+	/* With db.memory this is where the update is written back to disk,
+	 * so a failure here means the update was lost.
+	 */
+	if(tup_db_close() < 0)
+		rc = -1;
 	tup_option_exit();
 	tup_lock_exit();
 	if(close(tup_top_fd()) < 0)
 		perror("close(tup_top_fd())");
 	if(server_post_exit() < 0)
-		return -1;
+		rc = -1;
 	logging_shutdown();
 
 #ifdef __linux__
@@ -108,7 +114,7 @@ int tup_cleanup(void)
 		nanosleep(&ts, NULL);
 	}
 #endif
-	return 0;
+	return rc;
 }
 
 void tup_valgrind_cleanup(void)
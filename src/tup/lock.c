@@ -123,6 +123,21 @@ void tup_lock_closeall(void)
 	tup_lock_close(sh_lock);
 }
 
+int tup_lock_takeover(tup_lock_t obj)
+{
+	tup_lock_closeall();
+	if(tup_lock_open(tup_top_fd(), TUP_SHARED_LOCK, &sh_lock) < 0)
+		return -1;
+
+	obj_lock = obj;
+	if(tup_flock(obj_lock) < 0)
+		return -1;
+
+	if(tup_lock_open(tup_top_fd(), TUP_TRI_LOCK, &tri_lock) < 0)
+		return -1;
+	return 0;
+}
+
 tup_lock_t tup_sh_lock(void)
 {
 	return sh_lock;
@@ -43,6 +43,13 @@ void tup_lock_exit(void);
 /** Just closes the locks. This should by called by any forked processes. */
 void tup_lock_closeall(void);
 
+/** Used by a build server process forked from the monitor. The monitor holds
+ * the shared lock on our behalf, so here we just close the inherited
+ * descriptors and lock the object lock using the descriptor that the monitor
+ * opened for us.
+ */
+int tup_lock_takeover(tup_lock_t obj);
+
 /* Tri-lock functions */
 tup_lock_t tup_sh_lock(void);
 tup_lock_t tup_obj_lock(void);
@@ -114,6 +114,9 @@ void logging_enable(int argc, char **argv)
 	if(rotate("update.dot") < 0) {
 		return;
 	}
+	if(rotate("pipeline.dot") < 0) {
+		return;
+	}
 	if(mkdirat(tup_top_fd(), LOG_DIR, 0777) < 0) {
 		if(errno != EEXIST) {
 			perror(LOG_DIR);
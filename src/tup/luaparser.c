@@ -529,6 +529,10 @@ static int tuplua_function_glob(lua_State *ls)
 		free_path_list(&plist);
 		return lua_error(ls);
 	}
+	if(parser_add_dir_glob(tf, dtent->tnode.tupid, pl->pel->path, pl->pel->len) < 0) {
+		free_path_list(&plist);
+		return luaL_error(ls, "Failed to save glob pattern '%s'.", pattern);
+	}
 
 	if(variant_get_srctent(tf->variant, dtent, &srctent) < 0) {
 		lua_pushfstring(ls, "Failed to find src tup entry while processing pattern '%s'.", pattern);
@@ -541,6 +545,10 @@ static int tuplua_function_glob(lua_State *ls)
 			free_path_list(&plist);
 			return lua_error(ls);
 		}
+		if(parser_add_dir_glob(tf, srctent->tnode.tupid, pl->pel->path, pl->pel->len) < 0) {
+			free_path_list(&plist);
+			return luaL_error(ls, "Failed to save glob pattern '%s'.", pattern);
+		}
 	}
 
 	free_path_list(&plist);
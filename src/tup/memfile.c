@@ -0,0 +1,92 @@
+/* vim: set ts=8 sw=8 sts=8 noet tw=78:
+ *
+ * tup - A file-based build system
+ *
+ * Copyright (C) 2024  Mike Shal <marfey@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#endif
+#include "memfile.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+static int linux_memfd(const char *name)
+{
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+	int fd;
+
+	fd = memfd_create(name, MFD_CLOEXEC);
+	if(fd < 0 && errno != ENOSYS) {
+		perror("memfd_create");
+		return -2;
+	}
+	return fd;
+#else
+	if(name) {}
+	return -1;
+#endif
+}
+
+int memfile_fd(const char *name)
+{
+	FILE *f;
+	int fd;
+
+	fd = linux_memfd(name);
+	if(fd >= 0)
+		return fd;
+	if(fd == -2)
+		return -1;
+
+	f = tmpfile();
+	if(!f) {
+		perror("tmpfile");
+		return -1;
+	}
+	fd = dup(fileno(f));
+	if(fd < 0)
+		perror("dup");
+	fclose(f);
+	return fd;
+}
+
+FILE *memfile_open(const char *name)
+{
+	FILE *f;
+	int fd;
+
+	fd = linux_memfd(name);
+	if(fd == -2)
+		return NULL;
+	if(fd < 0) {
+		f = tmpfile();
+		if(!f)
+			perror("tmpfile");
+		return f;
+	}
+
+	f = fdopen(fd, "w+");
+	if(!f) {
+		perror("fdopen");
+		close(fd);
+		return NULL;
+	}
+	return f;
+}
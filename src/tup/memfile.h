@@ -0,0 +1,34 @@
+/* vim: set ts=8 sw=8 sts=8 noet tw=78:
+ *
+ * tup - A file-based build system
+ *
+ * Copyright (C) 2024  Mike Shal <marfey@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef tup_memfile_h
+#define tup_memfile_h
+
+#include <stdio.h>
+
+/* Anonymous files used to buffer output from sub-processes and tup's own
+ * messages for a command. On Linux these live only in memory (memfd), so a
+ * command that prints nothing never touches the disk and the buffer goes away
+ * when it is closed. Elsewhere they fall back to tmpfile().
+ */
+int memfile_fd(const char *name);
+FILE *memfile_open(const char *name);
+
+#endif
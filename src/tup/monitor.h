@@ -23,12 +23,25 @@
 
 #define AUTOUPDATE_PID "autoupdate pid"
 #define MONITOR_PID_FILE ".tup/monitor.pid"
+#define MONITOR_SOCKET_FILE ".tup/monitor.sock"
 
 int monitor_supported(void);
 int monitor(int argc, char **argv);
 int stop_monitor(int restarting);
 int monitor_get_pid(int restarting, int *pid);
 
+/* Asks a monitor running with monitor.build_server enabled to run the update
+ * for us. The first upd_arg arguments are ones that came before the 'upd'
+ * command. Returns the exit code of the update, or -1 if there is no build
+ * server (or it is busy) and the update should run here instead.
+ */
+int monitor_build(int argc, char **argv, int upd_arg);
+
+/* Asks the monitor which paths changed since the clock given in argv[0] (if
+ * any), and prints its reply to stdout.
+ */
+int monitor_changes(int argc, char **argv);
+
 enum {
 	TUP_MONITOR_SHUTDOWN=0,
 	TUP_MONITOR_RESTARTING=1,
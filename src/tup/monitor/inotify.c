@@ -49,6 +49,9 @@
 #include <sys/time.h>
 #include <errno.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <limits.h>
 #include "tup/dircache.h"
 #include "tup/debug.h"
 #include "tup/fileio.h"
@@ -66,28 +69,117 @@
 #include "tup/variant.h"
 #include "tup/init.h"
 #include "tup/pel_group.h"
+#include "tup/updater.h"
+#include "tup/colors.h"
+#include "tup/estring.h"
 
 #define MONITOR_LOOP_RETRY -2
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVE)
 
 struct moved_from_event;
 struct monitor_event {
 	/* from_event is valid if mask is IN_MOVED_TO or IN_MOVED_FROM */
 	TAILQ_ENTRY(monitor_event) list;
 	struct moved_from_event *from_event;
+	/* The next queued event on the same file */
+	struct monitor_event *path_next;
 	int mem;
 	struct inotify_event e;
 };
 TAILQ_HEAD(monitor_event_head, monitor_event);
 
+/* Queued events are indexed by watch descriptor and then by file name, so
+ * that a new event only needs to be compared against earlier events on the
+ * same file rather than the whole queue.
+ */
+struct event_dir {
+	struct tupid_tree tnode;
+	struct string_entries paths;
+};
+
+struct event_path {
+	struct string_tree name;
+	struct monitor_event *first;
+	struct monitor_event *last;
+};
+
+/* Sent by a 'tup' client to the monitor socket. For a build request, this is
+ * followed by the argv strings, the working directory, and the environment
+ * strings (each nul-terminated) for a total of len bytes, and the client's
+ * stdin, stdout, and stderr are passed along as ancillary data. For a changes
+ * request, it is followed by the nul-terminated clock from a previous query
+ * (which may be empty).
+ */
+enum {
+	MONITOR_REQUEST_BUILD,
+	MONITOR_REQUEST_CHANGES,
+};
+struct monitor_request {
+	int type;
+	int argc;
+	int upd_arg;
+	int envc;
+	int len;
+};
+#define BUILD_REQUEST_MAX (16 * 1024 * 1024)
+
+/* A 'tup' process connected to our socket. The request is read in as it
+ * arrives, and the reply to a changes request is written out the same way,
+ * so a slow or stuck client never blocks the event loop. A client that takes
+ * longer than CLIENT_TIMEOUT seconds is dropped, unless its build request is
+ * just waiting for the current build server process to finish.
+ */
+struct monitor_client {
+	TAILQ_ENTRY(monitor_client) list;
+	int fd;
+	time_t start;
+	struct monitor_request req;
+	int req_len;
+	int got_fds;
+	int fds[3];
+	char *data;
+	int data_len;
+	char *out;
+	int out_len;
+	int out_pos;
+};
+TAILQ_HEAD(monitor_client_head, monitor_client);
+#define MAX_CLIENTS 16
+#define CLIENT_TIMEOUT 5
+
+/* Each path that changed is kept in the journal once, in the order of its
+ * last change. The clock is that of the flush which saw the change.
+ */
+struct journal_entry {
+	TAILQ_ENTRY(journal_entry) list;
+	struct string_tree path;
+	long long clock;
+};
+TAILQ_HEAD(journal_head, journal_entry);
+
+/* Durations are kept as histograms for monitor.metrics_file. The buckets are
+ * upper bounds in seconds, and each one counts only its own range (they are
+ * made cumulative when written out).
+ */
+#define METRIC_BUCKETS 8
+static const double metric_bounds[METRIC_BUCKETS] = {0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1.0, 5.0};
+struct histogram {
+	long long buckets[METRIC_BUCKETS + 1];
+	long long count;
+	double sum;
+};
+
+/* Unclaimed IN_MOVED_FROM events are indexed by their cookie */
 struct moved_from_event {
-	LIST_ENTRY(moved_from_event) list;
+	struct tupid_tree tnode;
 	struct monitor_event *m;
 };
-LIST_HEAD(moved_from_event_head, moved_from_event);
 
 static int monitor_set_pid(int pid);
 static int monitor_loop(void);
 static int wp_callback(tupid_t newdt, const char *file, int *skip);
+static int wt_watch(const char *path, int *wd);
+static int wt_callback(tupid_t newdt, int wd);
 static int events_queued(void);
 static int queue_event(struct inotify_event *e);
 static int flush_queue(int do_autoupdate);
@@ -96,14 +188,26 @@ static void *wait_thread(void *arg);
 static int skip_event(struct inotify_event *e);
 static int eventcmp(struct inotify_event *e1, struct inotify_event *e2);
 static int same_event(struct inotify_event *e1, struct inotify_event *e2);
-static int ephemeral_event(struct inotify_event *e);
+static int ephemeral_event(struct inotify_event *e, struct event_path *ep);
 static struct moved_from_event *add_from_event(struct monitor_event *m);
 static struct moved_from_event *check_from_events(struct inotify_event *e);
+static void del_from_event(struct moved_from_event *mfe);
+static struct event_path *get_event_path(struct inotify_event *e);
+static void free_event_paths(void);
 static void monitor_rmdir_cb(tupid_t dt);
 static int handle_event(struct monitor_event *m, int *modified);
 static void pinotify(void);
 static int dump_dircache(void);
 static void sighandler(int sig);
+static int monitor_listen(void);
+static int serve_clients(fd_set *rfds, fd_set *wfds, int *locked);
+static void free_clients(void);
+static int serve_changes(struct monitor_client *client, int locked);
+static int journal_add(tupid_t dt, const char *name);
+static void journal_reset(void);
+static void histogram_add(struct histogram *h, struct timespan *ts);
+static void write_metrics(int locked);
+static void remove_metrics(void);
 
 static int inot_fd;
 static int tup_wd;
@@ -114,7 +218,7 @@ static struct sigaction sigact = {
 	.sa_flags = 0,
 };
 static struct monitor_event_head event_list;
-static struct monitor_event *queue_last_e = NULL;
+static struct tupid_entries event_dir_root = {NULL};
 static char **update_argv;
 static int update_argc;
 static int autoupdate_flag = -1;
@@ -126,7 +230,36 @@ static pthread_cond_t autoupdate_cond = PTHREAD_COND_INITIALIZER;
 static pid_t autoupdate_pid = AUTOUPDATE_NONE;
 static volatile sig_atomic_t dircache_debug = 0;
 static volatile sig_atomic_t monitor_quit = 0;
-static struct moved_from_event_head moved_from_list = LIST_HEAD_INITIALIZER(&moved_from_list);
+static struct tupid_entries moved_from_root = {NULL};
+static int bs_fd = -1;
+static struct monitor_client_head client_list = TAILQ_HEAD_INITIALIZER(client_list);
+static int num_clients = 0;
+static int serving_build = 0;
+static volatile sig_atomic_t build_pid = -1;
+static struct journal_head journal_list = TAILQ_HEAD_INITIALIZER(journal_list);
+static struct string_entries journal_root = {NULL};
+static int journal_size = 0;
+static int journal_count = 0;
+static int journal_pending = 0;
+static long long journal_clock = 0;
+static long long journal_start = 0;
+static time_t journal_epoch;
+static int total_mem = 0;
+static const char *metrics_file = NULL;
+static time_t metrics_written = 0;
+static struct {
+	long long events_received;
+	long long events_skipped;
+	long long events_coalesced;
+	long long events_queued;
+	long long overflows;
+	long long builds_served;
+	struct histogram flush_time;
+	struct histogram commit_time;
+	/* Protected by autoupdate_lock, since the wait thread fills it in */
+	struct histogram autoupdate_time;
+} metrics;
+extern char **environ;
 
 int monitor_supported(void)
 {
@@ -262,6 +395,21 @@ int monitor(int argc, char **argv)
 		}
 	}
 
+	/* The socket has to be ready before we write out our pid, since
+	 * 'tup waitmon' uses the pid to tell that the monitor is up.
+	 */
+	journal_size = tup_option_get_int("monitor.journal_size");
+	metrics_file = tup_option_get_string("monitor.metrics_file");
+	if(!metrics_file[0])
+		metrics_file = NULL;
+	journal_epoch = time(NULL);
+	if(tup_option_get_flag("monitor.build_server") || journal_size > 0) {
+		if(monitor_listen() < 0) {
+			rc = -1;
+			goto close_inot;
+		}
+	}
+
 	if(monitor_set_pid(getpid()) < 0) {
 		rc = -1;
 		goto close_inot;
@@ -281,6 +429,7 @@ int monitor(int argc, char **argv)
 		if(rc == MONITOR_LOOP_RETRY) {
 			struct tupid_tree *tt;
 			struct timeval tv = {0, 0};
+			int reopen_db;
 			int ret;
 			fd_set rfds;
 
@@ -291,6 +440,7 @@ int monitor(int argc, char **argv)
 			 * we return from tup_lock_init(). Then we should be
 			 * good to go.
 			 */
+			metrics.overflows++;
 			while((tt = RB_ROOT(&droot.wd_root)) != NULL) {
 				struct dircache *dc = container_of(tt, struct dircache, wd_node);
 				inotify_rm_watch(inot_fd, dc->wd_node.tupid);
@@ -302,6 +452,9 @@ int monitor(int argc, char **argv)
 			if(monitor_set_pid(-1) < 0)
 				return -1;
 			tup_lock_closeall();
+			reopen_db = serving_build;
+			serving_build = 0;
+			journal_reset();
 
 			if(fchdir(tup_top_fd()) < 0) {
 				perror("fchdir tup_top");
@@ -309,6 +462,9 @@ int monitor(int argc, char **argv)
 			}
 			if(tup_lock_init() < 0)
 				return -1;
+			/* The database was closed for a build server process. */
+			if(reopen_db && tup_db_open() < 0)
+				return -1;
 
 			/* Flush the inotify queue */
 			while(1) {
@@ -344,6 +500,13 @@ int monitor(int argc, char **argv)
 	pthread_join(autoupdate_thread, NULL);
 
 close_inot:
+	remove_metrics();
+	free_clients();
+	if(bs_fd >= 0) {
+		unlinkat(tup_top_fd(), MONITOR_SOCKET_FILE, 0);
+		close(bs_fd);
+		bs_fd = -1;
+	}
 	if(close(inot_fd) < 0) {
 		perror("close(inot_fd)");
 		rc = -1;
@@ -488,7 +651,10 @@ static int monitor_loop(void)
 
 	if(tup_db_scan_begin() < 0)
 		return -1;
-	if(watch_path(0, ".", wp_callback) < 0)
+	rc = watch_tree(wt_watch, wt_callback);
+	if(rc == -2)
+		rc = watch_path(0, ".", wp_callback);
+	if(rc < 0)
 		return -1;
 	if(tup_db_scan_end() < 0)
 		return -1;
@@ -532,18 +698,39 @@ static int monitor_loop(void)
 		struct inotify_event *e;
 		int offset = 0;
 		struct timeval tv = {0, 100000};
+		struct monitor_client *client;
 		int ret;
+		int maxfd = inot_fd;
 		fd_set rfds;
+		fd_set wfds;
 
 		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
 		FD_SET(inot_fd, &rfds);
-		ret = select(inot_fd+1, &rfds, NULL, NULL, &tv);
+		if(bs_fd >= 0 && num_clients < MAX_CLIENTS) {
+			FD_SET(bs_fd, &rfds);
+			if(bs_fd > maxfd)
+				maxfd = bs_fd;
+		}
+		TAILQ_FOREACH(client, &client_list, list) {
+			if(client->out)
+				FD_SET(client->fd, &wfds);
+			else if(!client->data || client->data_len < client->req.len)
+				FD_SET(client->fd, &rfds);
+			if(client->fd > maxfd)
+				maxfd = client->fd;
+		}
+		ret = select(maxfd+1, &rfds, &wfds, NULL, &tv);
 		if(ret < 0) {
 			if(errno == EINTR)
 				continue;
 			perror("select");
 			return -1;
 		}
+		write_metrics(locked);
+		rc = serve_clients(&rfds, &wfds, &locked);
+		if(rc != 0)
+			return rc;
 		if(ret == 0) {
 			if(events_queued() && locked) {
 				/* Timeout, flush queue */
@@ -553,6 +740,8 @@ static int monitor_loop(void)
 			}
 			x = 0;
 		} else {
+			if(!FD_ISSET(inot_fd, &rfds))
+				continue;
 			x = read(inot_fd, buf, sizeof(buf));
 			if(x < 0) {
 				if(errno == EINTR) {
@@ -652,6 +841,12 @@ static int monitor_loop(void)
 					if(tup_entry_clear() < 0)
 						return -1;
 
+					/* The database was closed while a build server
+					 * process had it, so we get a fresh connection.
+					 */
+					if(serving_build && tup_db_open() < 0)
+						return -1;
+
 					/* Reload the variants, since we may have new ones or
 					 * deleted old ones during the update.
 					 */
@@ -662,6 +857,15 @@ static int monitor_loop(void)
 						return -1;
 					if(tup_db_commit() < 0)
 						return -1;
+
+					/* We were holding the shared lock for a
+					 * build server process, which is now done.
+					 */
+					if(serving_build) {
+						if(tup_unflock(tup_sh_lock()) < 0)
+							return -1;
+						serving_build = 0;
+					}
 					locked = 1;
 					DEBUGP("monitor ON\n");
 				}
@@ -708,15 +912,1018 @@ int stop_monitor(int restarting)
 	return 0;
 }
 
+static int sock_write_all(int sd, const void *data, int size)
+{
+	const char *p = data;
+
+	while(size > 0) {
+		int rc = send(sd, p, size, MSG_NOSIGNAL);
+		if(rc < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += rc;
+		size -= rc;
+	}
+	return 0;
+}
+
+static int sock_read_all(int sd, void *dest, int size)
+{
+	char *p = dest;
+
+	while(size > 0) {
+		int rc = read(sd, p, size);
+		if(rc < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		if(rc == 0)
+			return -1;
+		p += rc;
+		size -= rc;
+	}
+	return 0;
+}
+
+static void build_sighandler(int sig)
+{
+	if(build_pid > 0)
+		kill(build_pid, sig);
+}
+
+/* Connects to the socket of the monitor for the tup hierarchy we are in the
+ * top of.
+ */
+static int monitor_connect(void)
+{
+	struct sockaddr_un addr;
+	int sd;
+
+	sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(sd < 0)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, MONITOR_SOCKET_FILE);
+	if(connect(sd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		close(sd);
+		return -1;
+	}
+	return sd;
+}
+
+int monitor_build(int argc, char **argv, int upd_arg)
+{
+	struct monitor_request req;
+	struct sigaction sa;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(3 * sizeof(int))];
+	int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+	char cwd[PATH_MAX];
+	char *data;
+	char *p;
+	pid_t pid;
+	int cur_dir;
+	int sd;
+	int rc;
+	int x;
+
+	if(getcwd(cwd, sizeof(cwd)) == NULL)
+		return -1;
+	cur_dir = open(".", O_RDONLY | O_CLOEXEC);
+	if(cur_dir < 0)
+		return -1;
+	sd = -1;
+	if(find_tup_dir() == 0)
+		sd = monitor_connect();
+	if(fchdir(cur_dir) < 0) {
+		perror("fchdir");
+		exit(1);
+	}
+	close(cur_dir);
+	if(sd < 0) {
+		/* No build server, so the update runs here as usual. */
+		return -1;
+	}
+
+	req.type = MONITOR_REQUEST_BUILD;
+	req.argc = argc;
+	req.upd_arg = upd_arg;
+	req.len = strlen(cwd) + 1;
+	for(x=0; x<argc; x++)
+		req.len += strlen(argv[x]) + 1;
+	for(req.envc=0; environ[req.envc]; req.envc++)
+		req.len += strlen(environ[req.envc]) + 1;
+	data = malloc(req.len);
+	if(!data) {
+		perror("malloc");
+		goto err_close;
+	}
+	p = data;
+	for(x=0; x<argc; x++)
+		p = stpcpy(p, argv[x]) + 1;
+	p = stpcpy(p, cwd) + 1;
+	for(x=0; x<req.envc; x++)
+		p = stpcpy(p, environ[x]) + 1;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	do {
+		rc = sendmsg(sd, &msg, MSG_NOSIGNAL);
+	} while(rc < 0 && errno == EINTR);
+	if(rc != sizeof(req) || sock_write_all(sd, data, req.len) < 0) {
+		free(data);
+		goto err_close;
+	}
+	free(data);
+
+	/* If the monitor is busy it just drops the connection, and we fall
+	 * back to a regular update.
+	 */
+	if(sock_read_all(sd, &pid, sizeof(pid)) < 0)
+		goto err_close;
+
+	/* The build runs in a different process group, so it won't see a ^C
+	 * from the terminal unless we pass it along.
+	 */
+	build_pid = pid;
+	sa.sa_handler = build_sighandler;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+
+	if(sock_read_all(sd, &rc, sizeof(rc)) < 0) {
+		fprintf(stderr, "tup error: Lost the connection to the build server (pid %i).\n", pid);
+		rc = 1;
+	}
+	close(sd);
+	return rc;
+
+err_close:
+	close(sd);
+	return -1;
+}
+
+int monitor_changes(int argc, char **argv)
+{
+	struct monitor_request req;
+	const char *since = "";
+	char buf[4096];
+	int got = 0;
+	int sd;
+	int rc;
+
+	if(argc > 1) {
+		fprintf(stderr, "tup error: The 'changes' command takes at most one argument: the clock from the last query.\n");
+		return -1;
+	}
+	if(argc == 1)
+		since = argv[0];
+
+	sd = monitor_connect();
+	if(sd < 0) {
+		fprintf(stderr, "tup error: Unable to connect to the monitor. Make sure it is running with the monitor.journal_size option set.\n");
+		return -1;
+	}
+	memset(&req, 0, sizeof(req));
+	req.type = MONITOR_REQUEST_CHANGES;
+	req.len = strlen(since) + 1;
+	if(sock_write_all(sd, &req, sizeof(req)) < 0 ||
+	   sock_write_all(sd, since, req.len) < 0) {
+		perror("write");
+		close(sd);
+		return -1;
+	}
+	while(1) {
+		rc = read(sd, buf, sizeof(buf));
+		if(rc < 0) {
+			if(errno == EINTR)
+				continue;
+			perror("read");
+			close(sd);
+			return -1;
+		}
+		if(rc == 0)
+			break;
+		if(fwrite(buf, 1, rc, stdout) != (size_t)rc) {
+			perror("fwrite");
+			close(sd);
+			return -1;
+		}
+		got += rc;
+	}
+	close(sd);
+	if(!got) {
+		fprintf(stderr, "tup error: The monitor isn't keeping a change journal. Set the monitor.journal_size option and restart the monitor.\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int monitor_listen(void)
+{
+	struct sockaddr_un addr;
+
+	bs_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if(bs_fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, MONITOR_SOCKET_FILE);
+	if(unlink(MONITOR_SOCKET_FILE) < 0 && errno != ENOENT) {
+		perror(MONITOR_SOCKET_FILE);
+		return -1;
+	}
+	if(bind(bs_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+	   listen(bs_fd, 16) < 0) {
+		perror(MONITOR_SOCKET_FILE);
+		fprintf(stderr, "tup error: Unable to create the monitor socket.\n");
+		return -1;
+	}
+	return 0;
+}
+
+static void close_fds(int fds[3])
+{
+	int x;
+
+	for(x=0; x<3; x++) {
+		if(fds[x] >= 0)
+			close(fds[x]);
+	}
+}
+
+static int accept_client(void)
+{
+	struct monitor_client *client;
+	int conn;
+
+	conn = accept(bs_fd, NULL, NULL);
+	if(conn < 0) {
+		if(errno == EINTR || errno == EAGAIN || errno == ECONNABORTED)
+			return 0;
+		perror("accept");
+		return -1;
+	}
+	if(fcntl(conn, F_SETFD, FD_CLOEXEC) < 0 || fcntl(conn, F_SETFL, O_NONBLOCK) < 0) {
+		perror("fcntl");
+		close(conn);
+		return -1;
+	}
+	client = calloc(1, sizeof(*client));
+	if(!client) {
+		perror("calloc");
+		close(conn);
+		return -1;
+	}
+	client->fd = conn;
+	client->start = time(NULL);
+	client->fds[0] = client->fds[1] = client->fds[2] = -1;
+	TAILQ_INSERT_TAIL(&client_list, client, list);
+	num_clients++;
+	return 0;
+}
+
+static void free_client(struct monitor_client *client)
+{
+	TAILQ_REMOVE(&client_list, client, list);
+	num_clients--;
+	close(client->fd);
+	close_fds(client->fds);
+	free(client->data);
+	free(client->out);
+	free(client);
+}
+
+static void free_clients(void)
+{
+	while(!TAILQ_EMPTY(&client_list))
+		free_client(TAILQ_FIRST(&client_list));
+}
+
+static int client_has_request(struct monitor_client *client)
+{
+	return client->data && client->data_len == client->req.len;
+}
+
+/* Checks the request header once it is all in. A build request has to come
+ * with the client's stdin, stdout, and stderr, and a changes request can't
+ * have any file descriptors.
+ */
+static int check_request(struct monitor_client *client)
+{
+	struct monitor_request *req = &client->req;
+
+	if(req->type == MONITOR_REQUEST_BUILD) {
+		if(!client->got_fds || req->argc < 0 || req->envc < 0 || req->upd_arg < 0 ||
+		   req->upd_arg > req->argc)
+			return -1;
+	} else if(req->type == MONITOR_REQUEST_CHANGES) {
+		if(client->got_fds)
+			return -1;
+	} else {
+		return -1;
+	}
+	if(req->len <= 0 || req->len > BUILD_REQUEST_MAX)
+		return -1;
+	client->data = malloc(req->len);
+	if(!client->data) {
+		perror("malloc");
+		return -1;
+	}
+	return 0;
+}
+
+/* Reads as much of the request as the client has sent so far. Returns 1 if
+ * the client should be dropped, or 0 to keep it.
+ */
+static int client_read(struct monitor_client *client)
+{
+	int rc;
+
+	while(client->req_len < (int)sizeof(client->req)) {
+		struct msghdr msg;
+		struct iovec iov;
+		struct cmsghdr *cmsg;
+		char control[CMSG_SPACE(3 * sizeof(int))];
+		int flags = 0;
+
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = (char*)&client->req + client->req_len;
+		iov.iov_len = sizeof(client->req) - client->req_len;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+#ifdef MSG_CMSG_CLOEXEC
+		flags = MSG_CMSG_CLOEXEC;
+#endif
+		rc = recvmsg(client->fd, &msg, flags);
+		if(rc < 0) {
+			if(errno == EINTR || errno == EAGAIN)
+				return 0;
+			return 1;
+		}
+		if(rc == 0)
+			return 1;
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if(cmsg) {
+			if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+				return 1;
+			if(client->got_fds || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+				int *cfds = (int*)CMSG_DATA(cmsg);
+				int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+				while(n > 0)
+					close(cfds[--n]);
+				return 1;
+			}
+			memcpy(client->fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+			client->got_fds = 1;
+		}
+		client->req_len += rc;
+		if(client->req_len == sizeof(client->req) && check_request(client) < 0)
+			return 1;
+	}
+
+	while(client->data_len < client->req.len) {
+		rc = read(client->fd, client->data + client->data_len, client->req.len - client->data_len);
+		if(rc < 0) {
+			if(errno == EINTR || errno == EAGAIN)
+				return 0;
+			return 1;
+		}
+		if(rc == 0)
+			return 1;
+		client->data_len += rc;
+	}
+	if(client->data[client->req.len-1] != 0)
+		return 1;
+	return 0;
+}
+
+/* Writes out as much of the reply as the client will take. Returns 1 once
+ * the client is done, either because it has the whole reply or because it
+ * went away.
+ */
+static int client_write(struct monitor_client *client)
+{
+	while(client->out_pos < client->out_len) {
+		int rc = send(client->fd, client->out + client->out_pos,
+			      client->out_len - client->out_pos, MSG_NOSIGNAL);
+		if(rc < 0) {
+			if(errno == EINTR || errno == EAGAIN)
+				return 0;
+			return 1;
+		}
+		client->out_pos += rc;
+	}
+	return 1;
+}
+
+/* Splits the nul-terminated strings from a build request into an array. */
+static char **split_strings(char **p, const char *end, int num)
+{
+	char **strs;
+	int x;
+
+	strs = malloc(sizeof(*strs) * (num + 1));
+	if(!strs) {
+		perror("malloc");
+		return NULL;
+	}
+	for(x=0; x<num; x++) {
+		if(*p >= end) {
+			free(strs);
+			return NULL;
+		}
+		strs[x] = *p;
+		*p += strlen(*p) + 1;
+	}
+	strs[num] = NULL;
+	return strs;
+}
+
+static int build_server_update(struct monitor_request *req, char *data, int fds[3])
+{
+	char *p = data;
+	const char *end = data + req->len;
+	const char *cwd;
+	char **argv;
+	char **envp;
+	char *top;
+	int rc;
+	int x;
+
+	for(x=0; x<3; x++) {
+		if(dup2(fds[x], x) < 0) {
+			perror("dup2");
+			return -1;
+		}
+		if(fds[x] != x)
+			close(fds[x]);
+	}
+
+	argv = split_strings(&p, end, req->argc);
+	if(!argv || p >= end)
+		return -1;
+	cwd = p;
+	p += strlen(p) + 1;
+	envp = split_strings(&p, end, req->envc);
+	if(!envp)
+		return -1;
+	environ = envp;
+
+	for(x=0; x<req->argc; x++) {
+		if(strcmp(argv[x], "--debug-sql") == 0) {
+			tup_db_enable_sql_debug();
+		} else if(strcmp(argv[x], "--debug-fuse") == 0) {
+			server_enable_debug();
+		}
+	}
+
+	top = strdup(get_tup_top());
+	if(!top) {
+		perror("strdup");
+		return -1;
+	}
+	if(chdir(cwd) < 0) {
+		perror(cwd);
+		return -1;
+	}
+	if(find_tup_dir() != 0 || strcmp(top, get_tup_top()) != 0) {
+		fprintf(stderr, "tup error: The build server for '%s' can't update from '%s'.\n", top, cwd);
+		return -1;
+	}
+	free(top);
+
+	/* Options and colors are based on the client's command-line and
+	 * terminal rather than the monitor's.
+	 */
+	tup_option_exit();
+	if(tup_option_init(req->argc, argv) < 0)
+		return -1;
+	color_init();
+	if(server_pre_init() < 0)
+		return -1;
+
+	/* The monitor closed its database connection before forking, so we
+	 * open our own. The tup_entry cache is still valid since nobody else
+	 * has touched the database since the monitor flushed its queue.
+	 */
+	if(tup_db_open() < 0)
+		return -1;
+	tup_register_rmdir_callback(NULL);
+	variants_free();
+
+	rc = updater(req->argc - req->upd_arg, argv + req->upd_arg, 0);
+	if(tup_cleanup() < 0)
+		rc = 1;
+	if(rc < 0)
+		rc = 1;
+	return rc;
+}
+
+static void build_server_child(struct monitor_client *client, tup_lock_t obj)
+{
+	struct monitor_client *other;
+	struct sigaction sa;
+	pid_t pid = getpid();
+	int conn = client->fd;
+	int flags;
+	int rc = 1;
+
+	close(inot_fd);
+	close(bs_fd);
+	TAILQ_FOREACH(other, &client_list, list) {
+		if(other != client) {
+			close(other->fd);
+			close_fds(other->fds);
+		}
+	}
+	debug_disable();
+	sa.sa_handler = SIG_DFL;
+	sa.sa_flags = 0;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+
+	/* Unlike the monitor, we can just wait for the client to take our
+	 * replies.
+	 */
+	flags = fcntl(conn, F_GETFL);
+	if(flags < 0 || fcntl(conn, F_SETFL, flags & ~O_NONBLOCK) < 0)
+		exit(1);
+	if(sock_write_all(conn, &pid, sizeof(pid)) < 0)
+		exit(1);
+	if(tup_lock_takeover(obj) == 0)
+		rc = build_server_update(&client->req, client->data, client->fds);
+	sock_write_all(conn, &rc, sizeof(rc));
+	exit(0);
+}
+
+/* For a build request, the update runs in a process forked from the monitor,
+ * so it starts with our tup_entry cache and variants instead of reading them
+ * in from the database again. To keep that cache valid, we flush the queue
+ * first and then hold the shared lock on behalf of the child, so nobody else
+ * can change the database before it gets the object lock. If we don't run
+ * the update, the client sees the connection close and runs it itself.
+ */
+static int serve_build(struct monitor_client *client, int *locked)
+{
+	tup_lock_t obj;
+	pid_t pid;
+	int rc;
+
+	if(!tup_option_get_flag("monitor.build_server"))
+		return 0;
+
+	/* If another tup process has the database, the client runs the update
+	 * itself and waits in line like usual.
+	 */
+	if(!*locked || tup_try_flock(tup_sh_lock()) != 0)
+		return 0;
+	rc = flush_queue(0);
+	if(rc != 0) {
+		tup_unflock(tup_sh_lock());
+		return rc;
+	}
+
+	/* The child's object lock is opened here, so we are sure to get the
+	 * close event even if the child dies before it gets the lock.
+	 */
+	if(tup_lock_open(tup_top_fd(), TUP_OBJECT_LOCK, &obj) < 0)
+		return -1;
+	*locked = 0;
+	serving_build = 1;
+	if(tup_flock(tup_tri_lock()) < 0)
+		return -1;
+	if(tup_unflock(tup_obj_lock()) < 0)
+		return -1;
+	DEBUGP("monitor off (build server)\n");
+
+	/* An SQLite connection can't be used on both sides of a fork, so
+	 * the child opens a new one. We open ours again once the child is
+	 * done and we have the object lock back.
+	 */
+	if(tup_db_close() < 0)
+		return -1;
+	fflush(stdout);
+	fflush(stderr);
+	pid = fork();
+	if(pid < 0) {
+		perror("fork");
+		return -1;
+	}
+	if(pid == 0) {
+		/* Fork again so the build server process doesn't need to be
+		 * reaped by us.
+		 */
+		pid = fork();
+		if(pid == 0)
+			build_server_child(client, obj);
+		_exit(pid < 0);
+	}
+	if(waitpid(pid, NULL, 0) < 0) {
+		perror("waitpid");
+		return -1;
+	}
+	tup_lock_close(obj);
+	metrics.builds_served++;
+	return 0;
+}
+
+/* Accepts new clients, moves each one along as far as it can go without
+ * blocking, and answers the requests that are all in. A changes request is
+ * answered from the journal right here. A build request waits while our last
+ * build server process still has the database, rather than having the client
+ * fall back to running the update itself.
+ */
+static int serve_clients(fd_set *rfds, fd_set *wfds, int *locked)
+{
+	struct monitor_client *client;
+	struct monitor_client *tmp;
+	time_t now = time(NULL);
+	int rc;
+
+	if(bs_fd >= 0 && FD_ISSET(bs_fd, rfds)) {
+		if(accept_client() < 0)
+			return -1;
+	}
+	TAILQ_FOREACH_SAFE(client, &client_list, list, tmp) {
+		int done = 0;
+
+		if(client->out) {
+			if(FD_ISSET(client->fd, wfds))
+				done = client_write(client);
+		} else if(!client_has_request(client)) {
+			if(FD_ISSET(client->fd, rfds))
+				done = client_read(client);
+		}
+		if(!done && !client->out && client_has_request(client)) {
+			if(client->req.type == MONITOR_REQUEST_BUILD && serving_build)
+				continue;
+			if(client->req.type == MONITOR_REQUEST_CHANGES)
+				rc = serve_changes(client, *locked);
+			else
+				rc = serve_build(client, locked);
+			if(rc != 0)
+				return rc;
+			if(client->out)
+				done = client_write(client);
+			else
+				done = 1;
+		}
+		if(!done && now - client->start >= CLIENT_TIMEOUT)
+			done = 1;
+		if(done)
+			free_client(client);
+	}
+	return 0;
+}
+
+/* Writes the path of tent relative to the top of the tup hierarchy. */
+static int journal_path(char *dest, int len, struct tup_entry *tent)
+{
+	int rc;
+
+	if(!tent || tent->tnode.tupid == DOT_DT)
+		return 0;
+	rc = journal_path(dest, len, tent->parent);
+	if(rc >= len)
+		return rc;
+	rc += snprintf(dest + rc, len - rc, "%s%s", rc ? "/" : "", tent->name.s);
+	return rc;
+}
+
+static int journal_add(tupid_t dt, const char *name)
+{
+	struct tup_entry *dtent;
+	struct journal_entry *je;
+	struct string_tree *st;
+	char path[PATH_MAX];
+	int len;
+
+	if(journal_size <= 0)
+		return 0;
+	if(tup_entry_add(dt, &dtent) < 0)
+		return -1;
+	len = journal_path(path, sizeof(path), dtent);
+	if(len < (int)sizeof(path) && name[0])
+		len += snprintf(path + len, sizeof(path) - len, "%s%s", len ? "/" : "", name);
+	if(len >= (int)sizeof(path)) {
+		/* We can't say what changed, so nobody gets a partial list. */
+		journal_start = journal_clock + 1;
+		return 0;
+	}
+	if(len == 0)
+		len = snprintf(path, sizeof(path), ".");
+
+	st = string_tree_search(&journal_root, path, len);
+	if(st) {
+		je = container_of(st, struct journal_entry, path);
+		TAILQ_REMOVE(&journal_list, je, list);
+	} else {
+		if(journal_count >= journal_size) {
+			/* Anyone whose clock is older than the change we are
+			 * forgetting about has to start over.
+			 */
+			je = TAILQ_FIRST(&journal_list);
+			TAILQ_REMOVE(&journal_list, je, list);
+			string_tree_rm(&journal_root, &je->path);
+			free(je->path.s);
+			journal_start = je->clock;
+		} else {
+			je = malloc(sizeof *je);
+			if(!je) {
+				perror("malloc");
+				return -1;
+			}
+			journal_count++;
+		}
+		if(string_tree_add(&journal_root, &je->path, path) < 0) {
+			free(je);
+			journal_count--;
+			return -1;
+		}
+	}
+	je->clock = journal_clock + 1;
+	TAILQ_INSERT_TAIL(&journal_list, je, list);
+	journal_pending = 1;
+	return 0;
+}
+
+/* Called when the monitor restarts, since any events from before that are
+ * lost.
+ */
+static void journal_reset(void)
+{
+	struct journal_entry *je;
+
+	while(!TAILQ_EMPTY(&journal_list)) {
+		je = TAILQ_FIRST(&journal_list);
+		TAILQ_REMOVE(&journal_list, je, list);
+		string_tree_rm(&journal_root, &je->path);
+		free(je->path.s);
+		free(je);
+	}
+	journal_count = 0;
+	journal_pending = 0;
+	journal_clock++;
+	journal_start = journal_clock;
+}
+
+/* Replies with our current clock, followed by each path that changed since
+ * the clock the client gave us. If we can't answer that (the clock is from a
+ * different monitor, or the journal has since dropped some of the changes),
+ * the reply is just a '*' after the clock, and the client must assume that
+ * everything changed.
+ */
+static int serve_changes(struct monitor_client *client, int locked)
+{
+	const char *since = client->data;
+	struct journal_entry *je;
+	struct estring e;
+	char buf[128];
+	long long epoch;
+	long long clock;
+	int pid;
+	int valid = 0;
+	int rc;
+
+	if(journal_size <= 0)
+		return 0;
+
+	/* Make sure anything that happened before the client asked is in the
+	 * journal. If an update is running, the events are held until it is
+	 * done, and will show up under a later clock.
+	 */
+	if(locked && events_queued()) {
+		rc = flush_queue(1);
+		if(rc != 0)
+			return rc;
+	}
+
+	if(sscanf(since, "c:%lli:%i:%lli", &epoch, &pid, &clock) == 3 &&
+	   epoch == (long long)journal_epoch && pid == getpid() &&
+	   clock >= journal_start && clock <= journal_clock)
+		valid = 1;
+
+	if(estring_init(&e) < 0)
+		return -1;
+	snprintf(buf, sizeof(buf), "c:%lli:%i:%lli\n", (long long)journal_epoch, getpid(), journal_clock);
+	if(estring_append(&e, buf, strlen(buf)) < 0)
+		return -1;
+	if(!valid) {
+		if(estring_append(&e, "*\n", 2) < 0)
+			return -1;
+	} else {
+		je = TAILQ_LAST(&journal_list, journal_head);
+		while(je && je->clock > clock) {
+			struct journal_entry *prev = TAILQ_PREV(je, journal_head, list);
+			if(!prev || prev->clock <= clock)
+				break;
+			je = prev;
+		}
+		for(; je && je->clock > clock; je = TAILQ_NEXT(je, list)) {
+			if(estring_append(&e, je->path.s, je->path.len) < 0)
+				return -1;
+			if(estring_append(&e, "\n", 1) < 0)
+				return -1;
+		}
+	}
+
+	client->out = e.s;
+	client->out_len = e.len;
+	return 0;
+}
+
+static void histogram_add(struct histogram *h, struct timespan *ts)
+{
+	double secs = timespan_seconds(ts);
+	int x;
+
+	for(x=0; x<METRIC_BUCKETS; x++) {
+		if(secs <= metric_bounds[x])
+			break;
+	}
+	h->buckets[x]++;
+	h->count++;
+	h->sum += secs;
+}
+
+static void print_counter(FILE *f, const char *label, const char *name,
+			  const char *help, long long value)
+{
+	fprintf(f, "# HELP %s %s\n", name, help);
+	fprintf(f, "# TYPE %s counter\n", name);
+	fprintf(f, "%s{%s} %lli\n", name, label, value);
+}
+
+static void print_gauge(FILE *f, const char *label, const char *name,
+			const char *help, long long value)
+{
+	fprintf(f, "# HELP %s %s\n", name, help);
+	fprintf(f, "# TYPE %s gauge\n", name);
+	fprintf(f, "%s{%s} %lli\n", name, label, value);
+}
+
+static void print_histogram(FILE *f, const char *label, const char *name,
+			    const char *help, const struct histogram *h)
+{
+	long long total = 0;
+	int x;
+
+	fprintf(f, "# HELP %s %s\n", name, help);
+	fprintf(f, "# TYPE %s histogram\n", name);
+	for(x=0; x<METRIC_BUCKETS; x++) {
+		total += h->buckets[x];
+		fprintf(f, "%s_bucket{%s,le=\"%g\"} %lli\n", name, label, metric_bounds[x], total);
+	}
+	fprintf(f, "%s_bucket{%s,le=\"+Inf\"} %lli\n", name, label, h->count);
+	fprintf(f, "%s_sum{%s} %f\n", name, label, h->sum);
+	fprintf(f, "%s_count{%s} %lli\n", name, label, h->count);
+}
+
+/* Writes out our metrics in the Prometheus text format, at most once a
+ * second. The file is written under a temporary name and then renamed, so a
+ * collector never sees half of it.
+ */
+static void write_metrics(int locked)
+{
+	static int warned = 0;
+	struct histogram autoupdate_time;
+	struct tupid_tree *tt;
+	char label[PATH_MAX * 2 + 16];
+	char tmpfile[PATH_MAX];
+	const char *p;
+	char *l;
+	long long watches = 0;
+	long long max_watches = -1;
+	time_t now;
+	FILE *f;
+	int fd;
+
+	if(!metrics_file)
+		return;
+	now = time(NULL);
+	if(now == metrics_written)
+		return;
+	metrics_written = now;
+
+	/* Several monitors can share a textfile collector directory, so each
+	 * one is labeled with its tup hierarchy.
+	 */
+	l = stpcpy(label, "top=\"");
+	for(p=get_tup_top(); *p; p++) {
+		if(*p == '\\' || *p == '"') {
+			*l++ = '\\';
+			*l++ = *p;
+		} else if(*p == '\n') {
+			*l++ = '\\';
+			*l++ = 'n';
+		} else {
+			*l++ = *p;
+		}
+	}
+	strcpy(l, "\"");
+
+	RB_FOREACH(tt, tupid_entries, &droot.wd_root)
+		watches++;
+	f = fopen("/proc/sys/fs/inotify/max_user_watches", "r");
+	if(f) {
+		if(fscanf(f, "%lli", &max_watches) != 1)
+			max_watches = -1;
+		fclose(f);
+	}
+	pthread_mutex_lock(&autoupdate_lock);
+	autoupdate_time = metrics.autoupdate_time;
+	pthread_mutex_unlock(&autoupdate_lock);
+
+	if(snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", metrics_file) >= (int)sizeof(tmpfile))
+		goto err_out;
+	fd = openat(tup_top_fd(), tmpfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if(fd < 0)
+		goto err_out;
+	f = fdopen(fd, "w");
+	if(!f) {
+		close(fd);
+		goto err_out;
+	}
+	print_counter(f, label, "tup_monitor_events_received_total",
+		      "Inotify events read by the monitor.", metrics.events_received);
+	print_counter(f, label, "tup_monitor_events_skipped_total",
+		      "Events for files that tup ignores, such as hidden files.", metrics.events_skipped);
+	print_counter(f, label, "tup_monitor_events_coalesced_total",
+		      "Events merged with or cancelled by another event in the queue.", metrics.events_coalesced);
+	print_gauge(f, label, "tup_monitor_queue_events",
+		    "Events waiting to be written to the database.", metrics.events_queued);
+	print_gauge(f, label, "tup_monitor_queue_bytes",
+		    "Memory used by the events in the queue.", total_mem);
+	print_gauge(f, label, "tup_monitor_locked",
+		    "1 if the monitor has the database, or 0 while another tup process is using it.", locked);
+	print_gauge(f, label, "tup_monitor_watches",
+		    "Directories watched by the monitor.", watches);
+	print_gauge(f, label, "tup_monitor_max_user_watches",
+		    "The system limit on inotify watches for this user.", max_watches);
+	print_counter(f, label, "tup_monitor_overflow_restarts_total",
+		      "Times the monitor restarted after the inotify queue overflowed.", metrics.overflows);
+	print_counter(f, label, "tup_monitor_builds_served_total",
+		      "Updates run by the build server for a 'tup upd' client.", metrics.builds_served);
+	print_histogram(f, label, "tup_monitor_flush_seconds",
+			"Time taken to write queued events to the database.", &metrics.flush_time);
+	print_histogram(f, label, "tup_monitor_db_commit_seconds",
+			"Time taken by the database commit at the end of each flush.", &metrics.commit_time);
+	print_histogram(f, label, "tup_monitor_autoupdate_seconds",
+			"Duration of autoupdate and autoparse runs.", &autoupdate_time);
+	if(fclose(f) != 0)
+		goto err_out;
+	if(renameat(tup_top_fd(), tmpfile, tup_top_fd(), metrics_file) < 0)
+		goto err_out;
+	return;
+
+err_out:
+	if(!warned) {
+		perror(metrics_file);
+		fprintf(stderr, "tup warning: Unable to write the monitor metrics file.\n");
+		warned = 1;
+	}
+}
+
+static void remove_metrics(void)
+{
+	if(metrics_file)
+		unlinkat(tup_top_fd(), metrics_file, 0);
+}
+
 static int wp_callback(tupid_t newdt, const char *file, int *skip)
 {
 	int wd;
-	uint32_t mask;
 
 	DEBUGP("add watch: '%s'\n", file);
 
-	mask = IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVE;
-	wd = inotify_add_watch(inot_fd, file, mask);
+	wd = inotify_add_watch(inot_fd, file, WATCH_MASK);
 	if(wd < 0) {
 		if(errno == ENOENT) {
 			*skip = 1;
@@ -730,23 +1937,68 @@ static int wp_callback(tupid_t newdt, const char *file, int *skip)
 	return 0;
 }
 
+/* Called from the scanner threads in watch_tree() */
+static int wt_watch(const char *path, int *wd)
+{
+	DEBUGP("add watch: '%s'\n", path);
+
+	*wd = inotify_add_watch(inot_fd, path, WATCH_MASK);
+	if(*wd < 0) {
+		if(errno == ENOENT)
+			return 0;
+		pinotify();
+		return -1;
+	}
+	return 0;
+}
+
+static int wt_callback(tupid_t newdt, int wd)
+{
+	dircache_add(&droot, wd, newdt);
+	return 0;
+}
+
 static int events_queued(void)
 {
 	return !TAILQ_EMPTY(&event_list);
 }
 
-static int total_mem = 0;
 static int queue_event(struct inotify_event *e)
 {
 	struct moved_from_event *mfe = NULL;
 	struct monitor_event *m;
+	struct event_path *ep;
 
-	if(skip_event(e))
-		return 0;
-	if(queue_last_e && eventcmp(&queue_last_e->e, e) == 0)
+	metrics.events_received++;
+	if(skip_event(e)) {
+		metrics.events_skipped++;
 		return 0;
-	if(ephemeral_event(e) == 0)
+	}
+	ep = get_event_path(e);
+	if(!ep)
+		return -1;
+	if(ep->last) {
+		struct inotify_event *qe = &ep->last->e;
+		int modflags = IN_MODIFY | IN_ATTRIB;
+
+		if(eventcmp(qe, e) == 0) {
+			metrics.events_coalesced++;
+			return 0;
+		}
+		/* A file being written gets a stream of IN_MODIFY events, but
+		 * we only need to look at it once per flush.
+		 */
+		if(qe->mask && !(qe->mask & ~modflags) &&
+		   e->mask && !(e->mask & ~modflags)) {
+			qe->mask |= e->mask;
+			metrics.events_coalesced++;
+			return 0;
+		}
+	}
+	if(ephemeral_event(e, ep) == 0) {
+		metrics.events_coalesced++;
 		return 0;
+	}
 
 	if(e->mask & IN_IGNORED) {
 		struct dircache *dc;
@@ -779,16 +2031,21 @@ static int queue_event(struct inotify_event *e)
 	m->mem = sizeof(*m) + e->len;
 	total_mem += m->mem;
 
-	queue_last_e = m;
-
 	memcpy(&m->e, e, sizeof(*e));
 	memcpy(m->e.name, e->name, e->len);
 	m->from_event = mfe;
+	m->path_next = NULL;
+	if(ep->last)
+		ep->last->path_next = m;
+	else
+		ep->first = m;
+	ep->last = m;
 
 	if(e->mask & IN_MOVED_FROM) {
 		m->from_event = add_from_event(m);
 	}
 	TAILQ_INSERT_TAIL(&event_list, m, list);
+	metrics.events_queued++;
 
 	return 0;
 }
@@ -797,8 +2054,11 @@ static int flush_queue(int do_autoupdate)
 {
 	static int events_handled = 0;
 	struct monitor_event *m;
+	struct timespan flush_ts;
+	struct timespan commit_ts;
 	int overflow = 0;
 
+	timespan_start(&flush_ts);
 	tup_db_begin();
 
 	DEBUGP("[36mFlush[%i]: mem=%i events_handled=%i[0m\n", do_autoupdate, total_mem, events_handled);
@@ -824,6 +2084,14 @@ static int flush_queue(int do_autoupdate)
 		}
 	}
 
+	/* Any IN_MOVED_FROM events left here were cancelled out by a later
+	 * event on the same file.
+	 */
+	while(!RB_EMPTY(&moved_from_root)) {
+		struct tupid_tree *tt = RB_ROOT(&moved_from_root);
+		del_from_event(container_of(tt, struct moved_from_event, tnode));
+	}
+
 	/* Free the events separately, since some events may point to earlier
 	 * events in the queue with a moved_from_event pointer.
 	 */
@@ -833,10 +2101,19 @@ static int flush_queue(int do_autoupdate)
 		total_mem -= m->mem;
 		free(m);
 	}
+	free_event_paths();
+	metrics.events_queued = 0;
 
-	queue_last_e = NULL;
-
+	timespan_start(&commit_ts);
 	tup_db_commit();
+	timespan_end(&commit_ts);
+	histogram_add(&metrics.commit_time, &commit_ts);
+	timespan_end(&flush_ts);
+	histogram_add(&metrics.flush_time, &flush_ts);
+	if(journal_pending) {
+		journal_pending = 0;
+		journal_clock++;
+	}
 	if(overflow) {
 		fprintf(stderr, "Received overflow event - restarting monitor.\n");
 		return MONITOR_LOOP_RETRY;
@@ -942,6 +2219,7 @@ static void *wait_thread(void *arg)
 	}
 
 	while(1) {
+		struct timespan ts;
 		pid_t mypid;
 		pthread_mutex_lock(&autoupdate_lock);
 		while(autoupdate_pid == AUTOUPDATE_NONE) {
@@ -954,9 +2232,14 @@ static void *wait_thread(void *arg)
 		if(mypid == AUTOUPDATE_EXIT) {
 			break;
 		}
+		timespan_start(&ts);
 		if(waitpid(mypid, NULL, 0) < 0) {
 			perror("waitpid");
 		}
+		timespan_end(&ts);
+		pthread_mutex_lock(&autoupdate_lock);
+		histogram_add(&metrics.autoupdate_time, &ts);
+		pthread_mutex_unlock(&autoupdate_lock);
 	}
 	return NULL;
 }
@@ -1000,7 +2283,7 @@ static int same_event(struct inotify_event *e1, struct inotify_event *e2)
 	return 0;
 }
 
-static int ephemeral_event(struct inotify_event *e)
+static int ephemeral_event(struct inotify_event *e, struct event_path *ep)
 {
 	struct monitor_event *m;
 	struct inotify_event *qe;
@@ -1021,7 +2304,7 @@ static int ephemeral_event(struct inotify_event *e)
 		return -1;
 	}
 
-	TAILQ_FOREACH(m, &event_list, list) {
+	for(m = ep->first; m; m = m->path_next) {
 		qe = &m->e;
 
 		if(same_event(qe, e) == 0) {
@@ -1070,10 +2353,17 @@ static struct moved_from_event *add_from_event(struct monitor_event *m)
 	}
 
 	mfe->m = m;
-	/* The mfe is removed from the list in either check_from_events, or in
+	mfe->tnode.tupid = m->e.cookie;
+	/* The mfe is removed from the tree in either check_from_events, or in
 	 * handle_event if this event is never claimed.
 	 */
-	LIST_INSERT_HEAD(&moved_from_list, mfe, list);
+	if(tupid_tree_insert(&moved_from_root, &mfe->tnode) < 0) {
+		/* Another move with the same cookie is still pending, so
+		 * treat this one as a delete.
+		 */
+		free(mfe);
+		return NULL;
+	}
 
 	return mfe;
 }
@@ -1081,14 +2371,78 @@ static struct moved_from_event *add_from_event(struct monitor_event *m)
 static struct moved_from_event *check_from_events(struct inotify_event *e)
 {
 	struct moved_from_event *mfe;
-	LIST_FOREACH(mfe, &moved_from_list, list) {
-		if(mfe->m->e.cookie == e->cookie) {
-			mfe->m->e.mask = 0;
-			LIST_REMOVE(mfe, list);
-			return mfe;
+	struct tupid_tree *tt;
+
+	tt = tupid_tree_search(&moved_from_root, e->cookie);
+	if(!tt)
+		return NULL;
+	mfe = container_of(tt, struct moved_from_event, tnode);
+	mfe->m->e.mask = 0;
+	tupid_tree_rm(&moved_from_root, &mfe->tnode);
+	return mfe;
+}
+
+static void del_from_event(struct moved_from_event *mfe)
+{
+	tupid_tree_rm(&moved_from_root, &mfe->tnode);
+	mfe->m->from_event = NULL;
+	free(mfe);
+}
+
+static struct event_path *get_event_path(struct inotify_event *e)
+{
+	struct tupid_tree *tt;
+	struct event_dir *ed;
+	struct string_tree *st;
+	struct event_path *ep;
+	const char *name = e->len ? e->name : "";
+
+	tt = tupid_tree_search(&event_dir_root, e->wd);
+	if(tt) {
+		ed = container_of(tt, struct event_dir, tnode);
+	} else {
+		ed = malloc(sizeof *ed);
+		if(!ed) {
+			perror("malloc");
+			return NULL;
 		}
+		ed->tnode.tupid = e->wd;
+		RB_INIT(&ed->paths);
+		tupid_tree_insert(&event_dir_root, &ed->tnode);
+	}
+
+	st = string_tree_search(&ed->paths, name, strlen(name));
+	if(st)
+		return container_of(st, struct event_path, name);
+	ep = malloc(sizeof *ep);
+	if(!ep) {
+		perror("malloc");
+		return NULL;
+	}
+	if(string_tree_add(&ed->paths, &ep->name, name) < 0) {
+		free(ep);
+		return NULL;
+	}
+	ep->first = NULL;
+	ep->last = NULL;
+	return ep;
+}
+
+static void free_event_paths(void)
+{
+	struct tupid_tree *tt;
+
+	while((tt = RB_ROOT(&event_dir_root)) != NULL) {
+		struct event_dir *ed = container_of(tt, struct event_dir, tnode);
+		struct string_tree *st;
+
+		while((st = RB_ROOT(&ed->paths)) != NULL) {
+			string_tree_remove(&ed->paths, st);
+			free(container_of(st, struct event_path, name));
+		}
+		tupid_tree_rm(&event_dir_root, tt);
+		free(ed);
 	}
-	return NULL;
 }
 
 static void monitor_rmdir_cb(tupid_t dt)
@@ -1131,6 +2485,8 @@ static int handle_event(struct monitor_event *m, int *modified)
 		 */
 		return 0;
 	}
+	if(journal_add(dc->dt_node.tupid, m->e.len ? m->e.name : "") < 0)
+		return -1;
 
 	if(m->e.mask & IN_MOVED_TO && m->from_event) {
 		struct moved_from_event *mfe = m->from_event;
@@ -1145,6 +2501,8 @@ static int handle_event(struct monitor_event *m, int *modified)
 		}
 		if(tup_entry_add(from_dc->dt_node.tupid, &from_dtent) < 0)
 			return -1;
+		if(journal_add(from_dc->dt_node.tupid, mfe->m->e.name) < 0)
+			return -1;
 		if(tup_entry_add(dc->dt_node.tupid, &dtent) < 0)
 			return -1;
 		if(m->e.mask & IN_ISDIR) {
@@ -1258,8 +2616,8 @@ static int handle_event(struct monitor_event *m, int *modified)
 			return -1;
 
 		/* An IN_MOVED_FROM event points to itself */
-		LIST_REMOVE(m->from_event, list);
-		free(m->from_event);
+		if(m->from_event)
+			del_from_event(m->from_event);
 	}
 	return 0;
 }
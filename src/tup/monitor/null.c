@@ -47,3 +47,19 @@ int monitor_get_pid(int restarting, int *pid)
 	*pid = -1;
 	return 0;
 }
+
+int monitor_build(int argc, char **argv, int upd_arg)
+{
+	if(argc) {}
+	if(argv) {}
+	if(upd_arg) {}
+	return -1;
+}
+
+int monitor_changes(int argc, char **argv)
+{
+	if(argc) {}
+	if(argv) {}
+	fprintf(stderr, "tup error: The file monitor is not supported on this platform.\n");
+	return -1;
+}
@@ -72,6 +72,8 @@ static int init_home_loc(void);
 static const char *is_number(const char *value);
 static const char *is_flag(const char *value);
 static const char *is_color(const char *value);
+static const char *is_memory_mode(const char *value);
+static const char *is_string(const char *value);
 
 static struct option {
 	const char *name;
@@ -84,6 +86,10 @@ static struct option {
 	{"updater.keep_going", "0", NULL, is_flag},
 	{"updater.full_deps", "0", NULL, is_flag},
 	{"updater.warnings", "1", NULL, is_flag},
+	{"updater.commit_interval", "60", NULL, is_number},
+	{"updater.commit_jobs", "0", NULL, is_number},
+	{"updater.pipeline", "0", NULL, is_flag},
+	{"updater.fuse_cache_timeout", "60", NULL, is_number},
 	{"display.color", "auto", NULL, is_color},
 	{"display.width", NULL, get_console_width, is_number},
 	{"display.progress", NULL, stdout_isatty, is_flag},
@@ -93,7 +99,13 @@ static struct option {
 	{"monitor.autoupdate", "0", NULL, is_flag},
 	{"monitor.autoparse", "0", NULL, is_flag},
 	{"monitor.foreground", "0", NULL, is_flag},
+	{"monitor.build_server", "0", NULL, is_flag},
+	{"monitor.journal_size", "0", NULL, is_number},
+	{"monitor.metrics_file", "", NULL, is_string},
 	{"db.sync", "1", NULL, is_flag},
+	{"db.memory", "0", NULL, is_memory_mode},
+	{"db.cache_size", "0", NULL, is_number},
+	{"db.mmap_size", "0", NULL, is_number},
 	{"graph.dirs", "0", NULL, is_flag},
 	{"graph.ghosts", "0", NULL, is_flag},
 	{"graph.environment", "0", NULL, is_flag},
@@ -498,6 +510,21 @@ static const char *is_color(const char *value)
 	return NULL;
 }
 
+static const char *is_memory_mode(const char *value)
+{
+	if(strcmp(value, "readonly") == 0)
+		return NULL;
+	if(is_flag(value) == NULL)
+		return NULL;
+	return "a boolean value {0|false|no|1|true|yes} or 'readonly'";
+}
+
+static const char *is_string(const char *value)
+{
+	if(value) {}
+	return NULL;
+}
+
 static const char *cpu_number(void)
 {
 	static char buf[10];
@@ -36,6 +36,7 @@
 #include "server.h"
 #include "variant.h"
 #include "estring.h"
+#include "memfile.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -71,6 +72,31 @@ struct bang_list {
 };
 TAILQ_HEAD(bang_list_head, bang_list);
 
+/* The results of an include at the top of a Tupfile (normally the
+ * Tuprules.tup files from include_rules) are kept for the rest of the parse.
+ * Another directory that reaches the same include with the same includes
+ * before it, the same variant, and the same $(TUP_CWD) gets the recorded
+ * variables, !-macros, and dependencies instead of reading and evaluating the
+ * file again.
+ */
+struct include_bang {
+	TAILQ_ENTRY(include_bang) list;
+	char *line;
+};
+TAILQ_HEAD(include_bang_head, include_bang);
+
+struct include_cache {
+	struct string_tree st;
+	int cacheable;
+	char ign;
+	struct vardb vars;
+	struct include_bang_head bangs;
+	struct tent_entries input_root;
+	struct tent_entries read_root;
+};
+
+static struct string_entries include_cache_root = RB_INITIALIZER(&include_cache_root);
+
 struct build_name_list_args {
 	struct name_list *nl;
 	const char *globstr;  /* Pointer to the basename of the filename in the tupfile */
@@ -81,7 +107,8 @@ struct build_name_list_args {
 };
 
 static int open_tupfile(struct tupfile *tf, struct tup_entry *tent,
-			char *path, int *parser_lua, int *fd);
+			char *path, int *parser_lua, int *fd,
+			struct tup_entry **tupfile_tent);
 static int parse_tupfile(struct tupfile *tf, struct buf *b, const char *filename);
 static int split_roots(struct tent_entries *root, struct graph *g);
 static int parse_internal_definitions(struct tupfile *tf);
@@ -93,6 +120,7 @@ static int run_script(struct tupfile *tf, char *cmdline, int lno);
 static int remove_tup_gitignore(struct tupfile *tf, struct tup_entry *tent);
 static int gitignore(struct tupfile *tf, struct tup_entry *dtent);
 static int check_toplevel_gitignore(struct tupfile *tf);
+static void include_uncacheable(struct tupfile *tf);
 static int parse_rule(struct tupfile *tf, char *p, int lno);
 static int parse_bang_definition(struct tupfile *tf, char *p, int lno);
 static int set_variable(struct tupfile *tf, char *line);
@@ -102,6 +130,11 @@ static int parse_bang_rule(struct tupfile *tf, struct rule *r,
 static void free_bang_rule(struct string_entries *root, struct bang_rule *br);
 static void free_bang_tree(struct string_entries *root);
 static void free_dir_lists(struct string_entries *root);
+static int add_dir_name(struct tupfile *tf, tupid_t dt, const char *name);
+static int write_dir_globs(struct tupfile *tf);
+static void free_dir_globs(struct tupid_entries *root);
+static int write_run_scripts(struct tupfile *tf);
+static void free_run_scripts(struct string_entries *root);
 static int split_input_pattern(struct tupfile *tf, char *p, char **o_input,
 			       char **o_cmd, int *o_cmdlen, char **o_output,
 			       char **o_bin);
@@ -143,6 +176,7 @@ static char *tup_printf(struct tupfile *tf, const char *cmd, int cmd_len,
 static int glob_parse(const char *base, int baselen, char *expanded, int *globidx);
 
 static int debug_run = 0;
+static pthread_mutex_t *display_mutex = NULL;
 
 void parser_debug_run(void)
 {
@@ -150,6 +184,11 @@ void parser_debug_run(void)
 	lua_parser_debug_run();
 }
 
+void parser_display_mutex(pthread_mutex_t *mutex)
+{
+	display_mutex = mutex;
+}
+
 int parse(struct node *n, struct graph *g, struct timespan *retts, int refactoring, int use_server, int full_deps)
 {
 	struct tupfile tf;
@@ -157,6 +196,7 @@ int parse(struct node *n, struct graph *g, struct timespan *retts, int refactori
 	int rc = -1;
 	int parser_lua = 0;
 	struct buf b = {NULL, 0};
+	struct tup_entry *tupfile_tent = NULL;
 	struct parser_server ps;
 	struct timeval orig_start;
 	char path[PATH_MAX];
@@ -176,9 +216,9 @@ int parse(struct node *n, struct graph *g, struct timespan *retts, int refactori
 
 	tf.variant = tup_entry_variant(n->tent);
 	tf.ps = &ps;
-	tf.f = tmpfile();
+	tf.f = memfile_open("tup-parser");
 	if(!tf.f) {
-		perror("tmpfile");
+		fprintf(stderr, "tup error: Unable to open the parser error log.\n");
 		return -1;
 	}
 	tf.luaerror = TUPLUA_NOERROR;
@@ -201,6 +241,8 @@ int parse(struct node *n, struct graph *g, struct timespan *retts, int refactori
 	RB_INIT(&tf.bang_root);
 	tent_tree_init(&tf.input_root);
 	RB_INIT(&tf.directory_root);
+	RB_INIT(&tf.dir_glob_root);
+	RB_INIT(&tf.run_script_root);
 	RB_INIT(&ps.directories);
 	tent_tree_init(&tf.refactoring_cmd_delete_root);
 
@@ -219,6 +261,10 @@ int parse(struct node *n, struct graph *g, struct timespan *retts, int refactori
 	tf.refactoring = refactoring;
 	tf.full_deps = full_deps;
 	tf.including_rules = 0;
+	tf.include_depth = 0;
+	tf.include_cache_ok = 1;
+	tf.include_chain = NULL;
+	tf.include_recording = NULL;
 	tf.ign = 0;
 	tf.circular_dep_error = 0;
 	LIST_INIT(&tf.bin_list);
@@ -257,7 +303,7 @@ int parse(struct node *n, struct graph *g, struct timespan *retts, int refactori
 		goto out_close_vdb;
 	}
 
-	if(open_tupfile(&tf, n->tent, path, &parser_lua, &fd) < 0)
+	if(open_tupfile(&tf, n->tent, path, &parser_lua, &fd, &tupfile_tent) < 0)
 		goto out_close_dfd;
 	if(fd < 0) {
 		/* No Tupfile means we have nothing to do */
@@ -279,10 +325,17 @@ int parse(struct node *n, struct graph *g, struct timespan *retts, int refactori
 		}
 		if(tmprc < 0)
 			goto out_free_bs;
+		if(tup_db_set_parse_digest(tupfile_tent->tnode.tupid, buf_digest(&b)) < 0)
+			goto out_free_bs;
 		if(!parser_lua) {
 			if(parse_tupfile(&tf, &b, "Tupfile") < 0)
 				goto out_free_bs;
 		} else {
+			/* A Tupfile.lua can change variables in ways we don't
+			 * track, so only share includes between plain
+			 * Tupfiles.
+			 */
+			tf.include_cache_ok = 0;
 			if(parse_lua_include_rules(&tf) < 0)
 				goto out_free_bs;
 			if(parse_lua_tupfile(&tf, &b, path) < 0)
@@ -349,7 +402,12 @@ out_server_stop:
 			rc = -1;
 		if(tup_db_write_dir_inputs(tf.f, tf.tent->tnode.tupid, &tf.input_root) < 0)
 			rc = -1;
+		if(write_dir_globs(&tf) < 0)
+			rc = -1;
+		if(write_run_scripts(&tf) < 0)
+			rc = -1;
 	}
+	cleanup_file_info(&ps.s.finfo);
 
 	pthread_mutex_lock(&ps.lock);
 	free_dir_lists(&ps.directories);
@@ -358,6 +416,8 @@ out_server_stop:
 	free_tent_tree(&tf.env_root);
 	free_tupid_tree(&tf.cmd_root);
 	free_tupid_tree(&tf.directory_root);
+	free_dir_globs(&tf.dir_glob_root);
+	free_run_scripts(&tf.run_script_root);
 	free_bang_tree(&tf.bang_root);
 	free_tent_tree(&tf.input_root);
 
@@ -371,6 +431,8 @@ out_server_stop:
 		memcpy(&retts->start, &orig_start, sizeof(retts->start));
 		memcpy(&retts->end, &tf.ts.end, sizeof(retts->end));
 	}
+	if(display_mutex)
+		pthread_mutex_lock(display_mutex);
 	show_result(n->tent, rc != 0, &tf.ts, NULL, 0);
 	if(fflush(tf.f) != 0) {
 		/* Use perror, since we're trying to flush the tf.f output */
@@ -379,6 +441,8 @@ out_server_stop:
 	}
 	rewind(tf.f);
 	display_output(fileno(tf.f), rc == 0 ? 0 : 3, NULL, 0, NULL);
+	if(display_mutex)
+		pthread_mutex_unlock(display_mutex);
 	if(fclose(tf.f) != 0) {
 		/* Use perror, since we're trying to close the tf.f output */
 		perror("fclose");
@@ -390,7 +454,8 @@ out_server_stop:
 	return rc;
 }
 
-static int open_if_entry(struct tupfile *tf, struct tup_entry *dtent, const char *fullpath, const char *path, int *fd)
+static int open_if_entry(struct tupfile *tf, struct tup_entry *dtent, const char *fullpath, const char *path, int *fd,
+			 struct tup_entry **ftent)
 {
 	struct tup_entry *tupfile_tent;
 	if(handle_file_dtent(ACCESS_READ, dtent, path, &tf->ps->s.finfo) < 0)
@@ -415,6 +480,7 @@ static int open_if_entry(struct tupfile *tf, struct tup_entry *dtent, const char
 		parser_error(tf, fullpath);
 		return -1;
 	}
+	*ftent = tupfile_tent;
 	return 0;
 }
 
@@ -434,7 +500,8 @@ static int parser_entry_open(struct tupfile *tf, struct tup_entry *tent)
 }
 
 static int open_tupfile(struct tupfile *tf, struct tup_entry *tent,
-			char *path, int *parser_lua, int *fd)
+			char *path, int *parser_lua, int *fd,
+			struct tup_entry **tupfile_tent)
 {
 	struct tup_entry *dtent;
 	int n = 0;
@@ -453,14 +520,14 @@ static int open_tupfile(struct tupfile *tf, struct tup_entry *tent,
 	}
 
 	strcpy(path, TUPFILE);
-	if(open_if_entry(tf, dtent, path, TUPFILE, fd) < 0)
+	if(open_if_entry(tf, dtent, path, TUPFILE, fd, tupfile_tent) < 0)
 		return -1;
 	if(*fd >= 0) {
 		return 0;
 	}
 
 	strcpy(path, TUPFILE_LUA);
-	if(open_if_entry(tf, dtent, path, TUPFILE_LUA, fd) < 0)
+	if(open_if_entry(tf, dtent, path, TUPFILE_LUA, fd, tupfile_tent) < 0)
 		return -1;
 	if(*fd >= 0) {
 		*parser_lua = 1;
@@ -469,14 +536,14 @@ static int open_tupfile(struct tupfile *tf, struct tup_entry *tent,
 	do {
 		int x;
 		strcpy(path + n*3, TUPDEFAULT);
-		if(open_if_entry(tf, dtent, path, TUPDEFAULT, fd) < 0)
+		if(open_if_entry(tf, dtent, path, TUPDEFAULT, fd, tupfile_tent) < 0)
 			return -1;
 		if(*fd >= 0) {
 			return 0;
 		}
 
 		strcpy(path + n*3, TUPDEFAULT_LUA);
-		if(open_if_entry(tf, dtent, path, TUPDEFAULT_LUA, fd) < 0)
+		if(open_if_entry(tf, dtent, path, TUPDEFAULT_LUA, fd, tupfile_tent) < 0)
 			return -1;
 		if(*fd >= 0) {
 			*parser_lua = 1;
@@ -612,6 +679,15 @@ static int parse_tupfile(struct tupfile *tf, struct buf *b, const char *filename
 		strncpy(line_debug, line, sizeof(line_debug) - 1);
 		memcpy(line_debug + sizeof(line_debug) - 4, "...", 4);
 
+		if(tf->include_depth == 0 &&
+		   strcmp(line, "include_rules") != 0 &&
+		   strncmp(line, "include ", 8) != 0) {
+			/* Anything else in the Tupfile can change the state
+			 * that later includes see.
+			 */
+			tf->include_cache_ok = 0;
+		}
+
 		rc = 0;
 		if(strcmp(line, "else") == 0) {
 			rc = if_else(&ifs);
@@ -659,18 +735,42 @@ static int parse_tupfile(struct tupfile *tf, struct buf *b, const char *filename
 		} else if(strcmp(line, "include_rules") == 0) {
 			rc = parser_include_rules(tf, "Tuprules.tup");
 		} else if(strncmp(line, "preload ", 8) == 0) {
+			include_uncacheable(tf);
 			rc = preload(tf, line+8);
 		} else if(strncmp(line, "run ", 4) == 0) {
+			include_uncacheable(tf);
 			rc = run_script(tf, line+4, lno);
 		} else if(strncmp(line, "export ", 7) == 0) {
+			include_uncacheable(tf);
 			rc = export(tf, line+7);
 		} else if(strncmp(line, "import ", 7) == 0) {
+			include_uncacheable(tf);
 			rc = import(tf, line+7, NULL, NULL);
 		} else if(strcmp(line, ".gitignore") == 0) {
 			tf->ign = 1;
 		} else if(line[0] == ':') {
+			include_uncacheable(tf);
 			rc = parse_rule(tf, line+1, lno);
 		} else if(line[0] == '!') {
+			if(tf->include_recording) {
+				struct include_bang *ib;
+
+				/* parse_bang_definition() modifies the line,
+				 * so save a copy to replay later.
+				 */
+				ib = malloc(sizeof *ib);
+				if(!ib) {
+					parser_error(tf, "malloc");
+					return -1;
+				}
+				ib->line = strdup(line);
+				if(!ib->line) {
+					parser_error(tf, "strdup");
+					free(ib);
+					return -1;
+				}
+				TAILQ_INSERT_TAIL(&tf->include_recording->bangs, ib, list);
+			}
 			rc = parse_bang_definition(tf, line, lno);
 		} else {
 			rc = set_variable(tf, line);
@@ -839,12 +939,14 @@ out_free:
 
 struct readdir_parser_params {
 	struct string_entries *root;
+	uint64_t digest;
 };
 
 static int readdir_parser_cb(void *arg, struct tup_entry *tent)
 {
 	struct readdir_parser_params *rpp = arg;
 	struct string_tree *st;
+	struct buf b;
 
 	if(is_virtual_tent(tent))
 		return 0;
@@ -855,7 +957,12 @@ static int readdir_parser_cb(void *arg, struct tup_entry *tent)
 		 * free our st and return.
 		 */
 		free(st);
+		return 0;
 	}
+	/* Summed so that the order of the entries doesn't matter. */
+	b.s = tent->name.s;
+	b.len = tent->name.len;
+	rpp->digest += buf_digest(&b);
 	return 0;
 }
 
@@ -877,6 +984,122 @@ static void free_dir_lists(struct string_entries *root)
 	}
 }
 
+struct dir_glob {
+	struct tupid_tree tnode;
+	struct string_entries patterns;
+};
+
+int parser_add_dir_glob(struct tupfile *tf, tupid_t dt, const char *pattern, int len)
+{
+	struct tupid_tree *tt;
+	struct dir_glob *dg;
+	struct string_tree *st;
+
+	if(len < 0)
+		len = strlen(pattern);
+
+	tt = tupid_tree_search(&tf->dir_glob_root, dt);
+	if(tt) {
+		dg = container_of(tt, struct dir_glob, tnode);
+	} else {
+		dg = malloc(sizeof *dg);
+		if(!dg) {
+			perror("malloc");
+			return -1;
+		}
+		dg->tnode.tupid = dt;
+		RB_INIT(&dg->patterns);
+		if(tupid_tree_insert(&tf->dir_glob_root, &dg->tnode) < 0) {
+			free(dg);
+			return -1;
+		}
+	}
+
+	if(string_tree_search(&dg->patterns, pattern, len) != NULL)
+		return 0;
+	st = malloc(sizeof *st);
+	if(!st) {
+		perror("malloc");
+		return -1;
+	}
+	st->s = malloc(len + 1);
+	if(!st->s) {
+		perror("malloc");
+		free(st);
+		return -1;
+	}
+	memcpy(st->s, pattern, len);
+	st->s[len] = 0;
+	st->len = len;
+	if(string_tree_insert(&dg->patterns, st) < 0) {
+		free(st->s);
+		free(st);
+		return -1;
+	}
+	return 0;
+}
+
+static int add_dir_name(struct tupfile *tf, tupid_t dt, const char *name)
+{
+	/* Match a single name by escaping any glob characters in it. */
+	struct estring e;
+	int rc;
+
+	if(estring_init(&e) < 0)
+		return -1;
+	for(; *name; name++) {
+		if(*name == '*' || *name == '?' || *name == '[') {
+			if(estring_append(&e, "[", 1) < 0)
+				return -1;
+			if(estring_append(&e, name, 1) < 0)
+				return -1;
+			if(estring_append(&e, "]", 1) < 0)
+				return -1;
+		} else {
+			if(estring_append(&e, name, 1) < 0)
+				return -1;
+		}
+	}
+	rc = parser_add_dir_glob(tf, dt, e.s, e.len);
+	free(e.s);
+	return rc;
+}
+
+static int write_dir_globs(struct tupfile *tf)
+{
+	/* Save every pattern that we matched against a directory listing, so
+	 * that creating or deleting a file only causes us to be re-parsed if
+	 * the name matches one of them.
+	 */
+	struct tupid_tree *tt;
+
+	if(tup_db_clear_dir_globs(tf->tent->tnode.tupid) < 0)
+		return -1;
+	RB_FOREACH(tt, tupid_entries, &tf->dir_glob_root) {
+		struct dir_glob *dg = container_of(tt, struct dir_glob, tnode);
+		struct string_tree *st;
+
+		RB_FOREACH(st, string_entries, &dg->patterns) {
+			if(tup_db_add_dir_glob(tf->tent->tnode.tupid, tt->tupid, st->s, st->len) < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+static void free_dir_globs(struct tupid_entries *root)
+{
+	struct tupid_tree *tt;
+
+	while((tt = RB_ROOT(root)) != NULL) {
+		struct dir_glob *dg = container_of(tt, struct dir_glob, tnode);
+
+		free_string_tree(&dg->patterns);
+		tupid_tree_rm(root, tt);
+		free(dg);
+	}
+}
+
 static int gen_dir_list(struct tupfile *tf, tupid_t dt)
 {
 	char path[PATH_MAX];
@@ -896,6 +1119,7 @@ static int gen_dir_list(struct tupfile *tf, tupid_t dt)
 	RB_INIT(&pd->files);
 
 	rpp.root = &pd->files;
+	rpp.digest = 0;
 
 	if(snprint_tup_entry(path, sizeof(path), variant_tent_to_srctent(tent)) >= (signed)sizeof(path)) {
 		fprintf(tf->f, "tup internal error: ps.path is sized incorrectly in gen_dir_list()\n");
@@ -904,14 +1128,20 @@ static int gen_dir_list(struct tupfile *tf, tupid_t dt)
 	if(tup_db_select_node_dir_glob(readdir_parser_cb, &rpp, tent,
 				       "*", -1, &tf->g->gen_delete_root, 1) < 0)
 		return -EIO;
+	if(parser_add_dir_glob(tf, tent->tnode.tupid, "*", 1) < 0)
+		return -1;
 	if(variant_get_srctent(tf->variant, tent, &srctent) < 0)
 		return -1;
 	if(srctent) {
 		if(tup_db_select_node_dir_glob(readdir_parser_cb, &rpp, srctent,
 					       "*", -1, &tf->g->gen_delete_root, 1) < 0)
 			return -EIO;
+		if(parser_add_dir_glob(tf, srctent->tnode.tupid, "*", 1) < 0)
+			return -1;
 	}
 
+	pd->digest = rpp.digest;
+
 	st = string_tree_search(&tf->ps->directories, path, strlen(path));
 	if(st)
 		free_dir_list(&tf->ps->directories, container_of(st, struct parser_directory, st));
@@ -992,6 +1222,300 @@ static int run_script(struct tupfile *tf, char *cmdline, int lno)
 	return rc;
 }
 
+/* The run-scripts that ran during this parse, along with what is needed to
+ * skip them next time. These replace the directory's rows in the run_script
+ * table once the parse succeeds, so scripts that were removed from the
+ * Tupfile, or whose command line changed, don't leave stale rows behind.
+ */
+struct run_script_entry {
+	struct string_tree st;
+	uint64_t digest;
+	char *inputs;
+	char *rules;
+};
+
+/* Takes over inputs, and copies rules since the caller still needs to parse
+ * them.
+ */
+static int add_run_script(struct tupfile *tf, const char *cmdline, uint64_t digest,
+			  char *inputs, const char *rules)
+{
+	struct run_script_entry *rse;
+	struct string_tree *st;
+
+	/* If the same command runs twice in a Tupfile, the last one wins. */
+	st = string_tree_search(&tf->run_script_root, cmdline, strlen(cmdline));
+	if(st) {
+		rse = container_of(st, struct run_script_entry, st);
+		string_tree_remove(&tf->run_script_root, st);
+		free(rse->inputs);
+		free(rse->rules);
+		free(rse);
+	}
+
+	rse = malloc(sizeof *rse);
+	if(!rse) {
+		perror("malloc");
+		free(inputs);
+		return -1;
+	}
+	rse->digest = digest;
+	rse->inputs = inputs;
+	rse->rules = strdup(rules);
+	if(!rse->rules) {
+		perror("strdup");
+		free(inputs);
+		free(rse);
+		return -1;
+	}
+	if(string_tree_add(&tf->run_script_root, &rse->st, cmdline) < 0) {
+		free(rse->inputs);
+		free(rse->rules);
+		free(rse);
+		return -1;
+	}
+	return 0;
+}
+
+static int write_run_scripts(struct tupfile *tf)
+{
+	struct string_tree *st;
+
+	if(tup_db_clear_run_scripts(tf->tent->tnode.tupid) < 0)
+		return -1;
+	RB_FOREACH(st, string_entries, &tf->run_script_root) {
+		struct run_script_entry *rse = container_of(st, struct run_script_entry, st);
+
+		if(tup_db_set_run_script(tf->tent->tnode.tupid, st->s, rse->digest,
+					 rse->inputs, rse->rules) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void free_run_scripts(struct string_entries *root)
+{
+	struct string_tree *st;
+
+	while((st = RB_ROOT(root)) != NULL) {
+		struct run_script_entry *rse = container_of(st, struct run_script_entry, st);
+
+		string_tree_remove(root, st);
+		free(rse->inputs);
+		free(rse->rules);
+		free(rse);
+	}
+}
+
+static int run_script_digest(struct tupfile *tf, const char *cmdline,
+			     struct tent_entries *inputs, uint64_t *digest)
+{
+	struct estring e;
+	struct tup_env te;
+	struct string_tree *st;
+	struct tent_tree *tt;
+	struct buf b;
+	char tmp[128];
+	int len;
+	int rc = 0;
+
+	if(estring_init(&e) < 0)
+		return -1;
+	if(estring_append(&e, cmdline, strlen(cmdline) + 1) < 0)
+		goto out_err;
+
+	/* The script sees the exported environment... */
+	if(tup_db_get_environ(&tf->env_root, NULL, &te) < 0)
+		goto out_err;
+	rc = estring_append(&e, te.envblock, te.block_size);
+	environ_free(&te);
+	if(rc < 0)
+		goto out_err;
+
+	/* ...the listings of the directories it is allowed to readdir()... */
+	pthread_mutex_lock(&tf->ps->lock);
+	RB_FOREACH(st, string_entries, &tf->ps->directories) {
+		struct parser_directory *pd = container_of(st, struct parser_directory, st);
+
+		len = snprintf(tmp, sizeof(tmp), "%llu ", (unsigned long long)pd->digest);
+		if(estring_append(&e, st->s, st->len + 1) < 0 ||
+		   estring_append(&e, tmp, len) < 0) {
+			rc = -1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&tf->ps->lock);
+	if(rc < 0)
+		goto out_err;
+
+	/* ...and the files that it read. */
+	RB_FOREACH(tt, tent_entries, inputs) {
+		len = snprintf(tmp, sizeof(tmp), "%lli %i %lli %li\n",
+			       tt->tent->tnode.tupid, tt->tent->type,
+			       (long long)tt->tent->mtime.tv_sec, (long)tt->tent->mtime.tv_nsec);
+		if(estring_append(&e, tmp, len) < 0)
+			goto out_err;
+	}
+
+	b.s = e.s;
+	b.len = e.len;
+	*digest = buf_digest(&b);
+	free(e.s);
+	return 0;
+
+out_err:
+	free(e.s);
+	return -1;
+}
+
+/* Returns the output of a previous run of the script if none of its inputs
+ * have changed, or NULL in *rules if it needs to be run again.
+ */
+static int cached_run_script(struct tupfile *tf, const char *cmdline, char **rules)
+{
+	struct tent_entries inputs = TENT_ENTRIES_INITIALIZER;
+	struct tent_tree *tt;
+	uint64_t old_digest = 0;
+	uint64_t digest;
+	char *input_list;
+	char *p;
+	int found;
+
+	*rules = NULL;
+	if(tup_db_get_run_script(tf->tent->tnode.tupid, cmdline, &old_digest, &input_list, rules, &found) < 0)
+		return -1;
+	if(!found)
+		return 0;
+
+	p = input_list;
+	while(*p) {
+		struct tup_entry *tent;
+		tupid_t tupid;
+		char *end;
+		int exists;
+
+		tupid = strtoll(p, &end, 10);
+		if(end == p)
+			break;
+		p = end;
+
+		/* An input that is no longer a dependency of the directory
+		 * may have been deleted, so we can't trust the tupid anymore.
+		 */
+		if(tup_db_link_exists(tupid, tf->tent->tnode.tupid, TUP_LINK_NORMAL, &exists) < 0)
+			goto out_err;
+		if(!exists)
+			goto out_miss;
+		if(tup_entry_add(tupid, &tent) < 0)
+			goto out_err;
+		if(tent_tree_add_dup(&inputs, tent) < 0)
+			goto out_err;
+	}
+
+	if(run_script_digest(tf, cmdline, &inputs, &digest) < 0)
+		goto out_err;
+	if(digest != old_digest)
+		goto out_miss;
+
+	/* The script isn't run, so we have to keep its inputs as dependencies
+	 * of the directory ourselves.
+	 */
+	RB_FOREACH(tt, tent_entries, &inputs) {
+		if(tent_tree_add_dup(&tf->input_root, tt->tent) < 0)
+			goto out_err;
+	}
+	free_tent_tree(&inputs);
+	if(add_run_script(tf, cmdline, digest, input_list, *rules) < 0) {
+		free(*rules);
+		*rules = NULL;
+		return -1;
+	}
+	return 0;
+
+out_miss:
+	free(*rules);
+	*rules = NULL;
+	free_tent_tree(&inputs);
+	free(input_list);
+	return 0;
+
+out_err:
+	free(*rules);
+	*rules = NULL;
+	free_tent_tree(&inputs);
+	free(input_list);
+	return -1;
+}
+
+static int server_run_script_cached(struct tupfile *tf, const char *cmdline, char **rules)
+{
+	struct file_stash stash;
+	struct tent_entries inputs = TENT_ENTRIES_INITIALIZER;
+	struct tent_tree *tt;
+	struct estring e;
+	uint64_t digest;
+	int used_vars;
+	int rc;
+
+	if(cached_run_script(tf, cmdline, rules) < 0)
+		return -1;
+	if(*rules) {
+		if(debug_run)
+			fprintf(tf->f, " --- re-using run script output from a previous parse\n");
+		return 0;
+	}
+
+	/* Only the files read by the script itself make up its inputs, not
+	 * the ones the parser read before it.
+	 */
+	finfo_stash(&tf->ps->s.finfo, &stash);
+	rc = server_run_script(tf->f, tf->tent->tnode.tupid, cmdline, &tf->env_root, rules);
+	if(finfo_unstash(&tf->ps->s.finfo, &stash, &inputs, tf->full_deps, &used_vars) < 0) {
+		if(rc == 0)
+			free(*rules);
+		rc = -1;
+	}
+	if(rc < 0) {
+		free_tent_tree(&inputs);
+		return -1;
+	}
+
+	/* Reading @-variables isn't captured by the digest, so these scripts
+	 * are always run.
+	 */
+	if(used_vars) {
+		free_tent_tree(&inputs);
+		return 0;
+	}
+
+	if(estring_init(&e) < 0)
+		goto out_err;
+	RB_FOREACH(tt, tent_entries, &inputs) {
+		char tmp[32];
+		int len;
+
+		len = snprintf(tmp, sizeof(tmp), "%lli ", tt->tent->tnode.tupid);
+		if(estring_append(&e, tmp, len) < 0) {
+			free(e.s);
+			goto out_err;
+		}
+	}
+	if(run_script_digest(tf, cmdline, &inputs, &digest) < 0) {
+		free(e.s);
+		goto out_err;
+	}
+	if(add_run_script(tf, cmdline, digest, e.s, *rules) < 0)
+		goto out_err;
+	free_tent_tree(&inputs);
+	return 0;
+
+out_err:
+	free(*rules);
+	*rules = NULL;
+	free_tent_tree(&inputs);
+	return -1;
+}
+
 int exec_run_script(struct tupfile *tf, const char *cmdline, int lno)
 {
 	char *rules;
@@ -1017,7 +1541,7 @@ int exec_run_script(struct tupfile *tf, const char *cmdline, int lno)
 			return -1;
 	}
 	if (tf->use_server)
-		rc = server_run_script(tf->f, tf->tent->tnode.tupid, cmdline, &tf->env_root, &rules);
+		rc = server_run_script_cached(tf, cmdline, &rules);
 	else
 		rc = serverless_run_script(tf->f, cmdline, &tf->env_root, &rules);
 	if(rc < 0)
@@ -1356,11 +1880,180 @@ out_close:
 	return rc;
 }
 
+static void include_uncacheable(struct tupfile *tf)
+{
+	if(tf->include_recording)
+		tf->include_recording->cacheable = 0;
+}
+
+static int include_cache_key(struct tupfile *tf, struct tup_entry *tent,
+			     struct estring *e)
+{
+	char buf[96];
+
+	/* tf->curtent is the directory of the include file at this point, so
+	 * the relative dir is what $(TUP_CWD) evaluates to.
+	 */
+	if(estring_init(e) < 0)
+		return -1;
+	snprintf(buf, sizeof(buf), "%p %lli %p ", (void*)tf->include_chain,
+		 tent->tnode.tupid, (void*)tf->variant);
+	buf[sizeof(buf)-1] = 0;
+	if(estring_append(e, buf, strlen(buf)) < 0)
+		return -1;
+	if(get_relative_dir(NULL, e, tf->tent->tnode.tupid, tf->curtent->tnode.tupid) < 0)
+		return -1;
+	return 0;
+}
+
+static struct include_cache *include_cache_alloc(void)
+{
+	struct include_cache *ic;
+
+	ic = malloc(sizeof *ic);
+	if(!ic) {
+		perror("malloc");
+		return NULL;
+	}
+	ic->cacheable = 1;
+	ic->ign = 0;
+	vardb_init(&ic->vars);
+	TAILQ_INIT(&ic->bangs);
+	tent_tree_init(&ic->input_root);
+	tent_tree_init(&ic->read_root);
+	return ic;
+}
+
+static void include_cache_free(struct include_cache *ic)
+{
+	struct include_bang *ib;
+
+	while(!TAILQ_EMPTY(&ic->bangs)) {
+		ib = TAILQ_FIRST(&ic->bangs);
+		TAILQ_REMOVE(&ic->bangs, ib, list);
+		free(ib->line);
+		free(ib);
+	}
+	vardb_close(&ic->vars);
+	free_tent_tree(&ic->input_root);
+	free_tent_tree(&ic->read_root);
+	free(ic);
+}
+
+void parser_include_cache_free(void)
+{
+	struct string_tree *st;
+
+	while((st = RB_ROOT(&include_cache_root)) != NULL) {
+		struct include_cache *ic = container_of(st, struct include_cache, st);
+		string_tree_remove(&include_cache_root, st);
+		include_cache_free(ic);
+	}
+}
+
+static int include_cache_finish(struct tupfile *tf, struct include_cache *ic,
+				struct tent_entries *saved_input_root,
+				const char *key, int rc)
+{
+	struct tent_tree *tt;
+	struct string_tree *st;
+
+	/* Everything added to the input_root during the include belongs to
+	 * the cache entry, but the Tupfile still needs it too.
+	 */
+	tf->include_recording = NULL;
+	ic->input_root = tf->input_root;
+	tf->input_root = *saved_input_root;
+	RB_FOREACH(tt, tent_entries, &ic->input_root) {
+		if(tent_tree_add_dup(&tf->input_root, tt->tent) < 0)
+			return -1;
+	}
+
+	if(rc < 0 || !ic->cacheable)
+		goto out_uncached;
+
+	RB_FOREACH(st, string_entries, &ic->vars.root) {
+		struct estring e;
+
+		if(estring_init(&e) < 0)
+			return -1;
+		if(st->s[0] == '&') {
+			struct var_entry *ve;
+			ve = vardb_get(&tf->node_db, st->s+1, st->len-1);
+			if(ve && ve->value) {
+				if(estring_append(&e, ve->value, ve->vallen) < 0)
+					return -1;
+			}
+		} else {
+			if(luadb_copy(st->s, st->len, &e) < 0)
+				return -1;
+		}
+		if(vardb_set(&ic->vars, st->s, e.s, NULL) < 0)
+			return -1;
+		free(e.s);
+	}
+	ic->ign = tf->ign;
+	if(string_tree_add(&include_cache_root, &ic->st, key) < 0)
+		goto out_uncached;
+	tf->include_chain = ic;
+	return 0;
+
+out_uncached:
+	include_cache_free(ic);
+	tf->include_cache_ok = 0;
+	return 0;
+}
+
+static int include_cache_replay(struct tupfile *tf, struct include_cache *ic)
+{
+	struct tent_tree *tt;
+	struct string_tree *st;
+	struct include_bang *ib;
+
+	RB_FOREACH(tt, tent_entries, &ic->read_root) {
+		if(handle_file_dtent(ACCESS_READ, tt->tent->parent, tt->tent->name.s, &tf->ps->s.finfo) < 0)
+			return -1;
+	}
+	RB_FOREACH(tt, tent_entries, &ic->input_root) {
+		if(tent_tree_add_dup(&tf->input_root, tt->tent) < 0)
+			return -1;
+	}
+	RB_FOREACH(st, string_entries, &ic->vars.root) {
+		struct var_entry *ve = container_of(st, struct var_entry, var);
+		if(st->s[0] == '&') {
+			if(vardb_set(&tf->node_db, st->s+1, ve->value, NULL) < 0)
+				return -1;
+		} else {
+			if(luadb_set(st->s, ve->value) < 0)
+				return -1;
+		}
+	}
+	TAILQ_FOREACH(ib, &ic->bangs, list) {
+		char *line;
+		int rc;
+
+		line = strdup(ib->line);
+		if(!line) {
+			parser_error(tf, "strdup");
+			return -1;
+		}
+		rc = parse_bang_definition(tf, line, 0);
+		free(line);
+		if(rc < 0)
+			return -1;
+	}
+	if(ic->ign)
+		tf->ign = 1;
+	tf->include_chain = ic;
+	return 0;
+}
+
 int parser_include_file(struct tupfile *tf, const char *file)
 {
 	struct buf incb;
 	int fd;
 	int rc = -1;
+	int prc;
 	struct pel_group pg;
 	struct path_element *pel = NULL;
 	struct tup_entry *tent = NULL;
@@ -1369,7 +2062,11 @@ int parser_include_file(struct tupfile *tf, const char *file)
 	int old_dfd = tf->cur_dfd;
 	struct tup_entry *srctent = NULL;
 	struct tup_entry *newtent;
+	struct include_cache *ic = NULL;
+	struct tent_entries saved_input_root;
+	struct estring key = {0, 0, NULL};
 	char *lua;
+	int is_lua;
 
 	if(get_path_elements(file, &pg) < 0)
 		goto out_err;
@@ -1405,10 +2102,48 @@ int parser_include_file(struct tupfile *tf, const char *file)
 		goto out_free_pel;
 	}
 
+	lua = strstr(file, ".lua");
+	/* strcmp is to make sure .lua is at the end of the filename */
+	is_lua = lua && strcmp(lua, ".lua") == 0;
+
+	if(tf->include_depth == 0) {
+		if(tf->include_cache_ok && !is_lua) {
+			struct string_tree *st;
+
+			if(include_cache_key(tf, tent, &key) < 0)
+				goto out_free_pel;
+			st = string_tree_search(&include_cache_root, key.s, key.len);
+			if(st) {
+				ic = container_of(st, struct include_cache, st);
+				if(include_cache_replay(tf, ic) < 0)
+					goto out_free_pel;
+				rc = 0;
+				goto out_free_pel;
+			}
+			ic = include_cache_alloc();
+			if(!ic)
+				goto out_free_pel;
+			if(tent_tree_add(&ic->read_root, tent) < 0) {
+				include_cache_free(ic);
+				goto out_free_pel;
+			}
+			saved_input_root = tf->input_root;
+			tent_tree_init(&tf->input_root);
+			tf->include_recording = ic;
+		} else {
+			tf->include_cache_ok = 0;
+		}
+	} else if(tf->include_recording) {
+		if(is_lua)
+			include_uncacheable(tf);
+		if(tent_tree_add_dup(&tf->include_recording->read_root, tent) < 0)
+			goto out_free_pel;
+	}
+
 	tf->cur_dfd = tup_entry_openat(tf->root_fd, tent->parent);
 	if(tf->cur_dfd < 0) {
 		parser_error(tf, file);
-		goto out_free_pel;
+		goto out_finish;
 	}
 	fd = parser_entry_open(tf, tent);
 	if(fd < 0) {
@@ -1416,16 +2151,18 @@ int parser_include_file(struct tupfile *tf, const char *file)
 	}
 	if(fslurp_null(fd, &incb) < 0)
 		goto out_close;
+	if(tup_db_set_parse_digest(tent->tnode.tupid, buf_digest(&incb)) < 0)
+		goto out_free;
 
-	lua = strstr(file, ".lua");
-	/* strcmp is to make sure .lua is at the end of the filename */
-	if(lua && strcmp(lua, ".lua") == 0) {
-		if(parse_lua_tupfile(tf, &incb, file) < 0)
-			goto out_free;
+	tf->include_depth++;
+	if(is_lua) {
+		prc = parse_lua_tupfile(tf, &incb, file);
 	} else {
-		if(parse_tupfile(tf, &incb, file) < 0)
-			goto out_free;
+		prc = parse_tupfile(tf, &incb, file);
 	}
+	tf->include_depth--;
+	if(prc < 0)
+		goto out_free;
 	rc = 0;
 out_free:
 	free(incb.s);
@@ -1439,7 +2176,13 @@ out_close_dfd:
 		parser_error(tf, "close(tf->cur_dfd)");
 		rc = -1;
 	}
+out_finish:
+	if(ic && tf->include_recording == ic) {
+		if(include_cache_finish(tf, ic, &saved_input_root, key.s, rc) < 0)
+			rc = -1;
+	}
 out_free_pel:
+	free(key.s);
 	free_pel(pel);
 out_del_pg:
 	del_pel_group(&pg);
@@ -1814,6 +2557,11 @@ static int set_variable(struct tupfile *tf, char *line)
 		fprintf(tf->f, "tup internal error: Error setting variable '%s'\n", var);
 		return -1;
 	}
+	if(tf->include_recording) {
+		/* The final value is filled in when the include finishes. */
+		if(vardb_set(&tf->include_recording->vars, var, "", NULL) < 0)
+			return -1;
+	}
 	free(var);
 	free(value);
 	return 0;
@@ -2787,9 +3535,13 @@ static int nl_add_path(struct tupfile *tf, struct path_list *pl,
 		args.wildcard = 1;
 		if(tup_db_select_node_dir_glob(build_name_list_cb, &args, dtent, pl->pel->path, pl->pel->len, &tf->g->gen_delete_root, 0) < 0)
 			return -1;
+		if(parser_add_dir_glob(tf, dtent->tnode.tupid, pl->pel->path, pl->pel->len) < 0)
+			return -1;
 		if(srctent) {
 			if(tup_db_select_node_dir_glob(build_name_list_cb, &args, srctent, pl->pel->path, pl->pel->len, &tf->g->gen_delete_root, 0) < 0)
 				return -1;
+			if(parser_add_dir_glob(tf, srctent->tnode.tupid, pl->pel->path, pl->pel->len) < 0)
+				return -1;
 		}
 	}
 	return 0;
@@ -3330,6 +4082,12 @@ static int do_rule_outputs(struct tupfile *tf, struct path_list_head *oplist, st
 			if(srctent && !is_variant_copy) {
 				if(tup_db_select_tent(srctent, onle->path, &tent) < 0)
 					return -1;
+				/* Creating this file in the srctree later on
+				 * needs to re-parse us so we can report the
+				 * error (t8030).
+				 */
+				if(add_dir_name(tf, srctent->tnode.tupid, onle->path) < 0)
+					return -1;
 				if(tent && tent->type != TUP_NODE_GHOST) {
 					fprintf(tf->f, "tup error: Attempting to insert '%s' as a generated node when it already exists as a different type (%s) in the source directory. You can do one of two things to fix this:\n  1) If this file is really supposed to be created from the command, delete the file from the filesystem and try again.\n  2) Change your rule in the Tupfile so you aren't trying to overwrite the file.\n", onle->path, tup_db_type(tent->type));
 					return -1;
@@ -4241,6 +4999,7 @@ char *eval(struct tupfile *tf, const char *string, int expand_nodes)
 						return NULL;
 				} else if(rparen-var == 21 &&
 					  strncmp(var, "TUP_VARIANT_OUTPUTDIR", 21) == 0) {
+					include_uncacheable(tf);
 					if(get_relative_dir(NULL, &e, tf->srctent->tnode.tupid, tf->tent->tnode.tupid) < 0) {
 						fprintf(tf->f, "tup internal error: Unable to find relative directory from ID %lli -> %lli\n", tf->srctent->tnode.tupid, tf->tent->tnode.tupid);
 						tup_db_print(tf->f, tf->srctent->tnode.tupid);
@@ -27,6 +27,7 @@
 #include "bin.h"
 #include "vardb.h"
 #include "tup_pcre.h"
+#include <pthread.h>
 
 #define TUPLUA_NOERROR 0
 #define TUPLUA_PENDINGERROR 1
@@ -43,6 +44,7 @@ struct tup_entry;
 struct graph;
 struct parser_server;
 struct lua_State;
+struct include_cache;
 
 struct tupfile {
 	struct tup_entry *tent;
@@ -60,6 +62,8 @@ struct tupfile {
 	struct string_entries bang_root;
 	struct tent_entries input_root;
 	struct tupid_entries directory_root;
+	struct tupid_entries dir_glob_root;
+	struct string_entries run_script_root;
 	struct tent_entries refactoring_cmd_delete_root;
 	FILE *f;
 	struct parser_server *ps;
@@ -71,6 +75,10 @@ struct tupfile {
 	int use_server;
 	int full_deps;
 	int including_rules;
+	int include_depth;
+	int include_cache_ok;
+	struct include_cache *include_chain;
+	struct include_cache *include_recording;
 
 	SLIST_ENTRY(tupfile) list;
 };
@@ -175,12 +183,15 @@ void init_rule(struct rule *r);
 int execute_rule(struct tupfile *tf, struct rule *r, struct name_list *output_nl);
 int parser_include_file(struct tupfile *tf, const char *file);
 int parser_include_rules(struct tupfile *tf, const char *tuprules);
+int parser_add_dir_glob(struct tupfile *tf, tupid_t dt, const char *pattern, int len);
 
 struct node;
 struct graph;
 struct timespan;
 
 void parser_debug_run(void);
+void parser_display_mutex(pthread_mutex_t *mutex);
+void parser_include_cache_free(void);
 int parse(struct node *n, struct graph *g, struct timespan *ts, int refactoring, int use_server, int full_deps);
 char *eval(struct tupfile *tf, const char *string, int allow_nodes);
 
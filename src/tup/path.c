@@ -31,6 +31,7 @@
 #include "pel_group.h"
 #include "logging.h"
 #include "tent_list.h"
+#include "container.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,6 +39,11 @@
 #include <unistd.h>
 #include <errno.h>
 #include <sys/stat.h>
+#ifndef _WIN32
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#endif
 
 static int watch_path_internal(tupid_t dt, const char *file,
 			       int (*callback)(tupid_t newdt, const char *file, int *skip))
@@ -168,6 +174,639 @@ int watch_path(tupid_t dt, const char *file,
 	return rc;
 }
 
+#ifndef _WIN32
+/* The parallel scanner splits watch_path() in two. A pool of threads reads
+ * each directory relative to its fd and stats the entries, and the calling
+ * thread then walks the results in the same depth-first order as
+ * watch_path() to apply them to the database. Only the calling thread
+ * touches the database or the tup_entry cache.
+ */
+enum scan_type {
+	SCAN_FILE,
+	SCAN_UNCHANGED,
+	SCAN_DIR,
+	SCAN_MISSING,
+	SCAN_IGNORED,
+	SCAN_OTHER,
+};
+
+struct scan_dir;
+struct known_dir;
+
+/* What the database had for a directory when the monitor's scan started. The
+ * directory node's mtime is the directory's own mtime from the last scan, so
+ * if that still matches then nothing has been added to or removed from the
+ * directory since. In that case the scanner just stats the entries listed
+ * here rather than reading the directory again, and files that still have
+ * the same mtime don't need to be looked at by the calling thread at all.
+ */
+struct known_entry {
+	char *name;
+	int is_dir;
+	struct timespec mtime;
+	struct known_dir *kd;
+};
+
+struct known_dir {
+	struct timespec mtime;
+	struct known_entry *entries;
+	int num_entries;
+};
+
+struct scan_entry {
+	char *name;
+	enum scan_type type;
+	struct timespec mtime;
+	struct scan_dir *sd;
+};
+
+struct scan_dir {
+	struct scan_dir *next;
+	struct scan_dir *all_next;
+	char *path;
+	struct scan_entry *entries;
+	int num_entries;
+	struct known_dir *known;
+	struct timespec mtime;
+	int validated;
+	int wd;
+	int missing;
+	int done;
+};
+
+struct scanner {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct scan_dir *stack;
+	struct scan_dir *all;
+	int pending;
+	int failed;
+	int quit;
+	int dfd;
+	time_t racy_sec;
+	int (*watch)(const char *path, int *wd);
+};
+
+static int known_entry_cmp(const void *a, const void *b)
+{
+	const struct known_entry *ke1 = a;
+	const struct known_entry *ke2 = b;
+	return strcmp(ke1->name, ke2->name);
+}
+
+static void free_known_dir(struct known_dir *kd)
+{
+	int x;
+
+	if(!kd)
+		return;
+	for(x=0; x<kd->num_entries; x++) {
+		free(kd->entries[x].name);
+		free_known_dir(kd->entries[x].kd);
+	}
+	free(kd->entries);
+	free(kd);
+}
+
+static struct known_dir *load_known_dir(struct tup_entry *tent)
+{
+	struct known_dir *kd;
+	struct string_tree *st;
+	int num = 0;
+
+	kd = calloc(1, sizeof *kd);
+	if(!kd) {
+		perror("calloc");
+		return NULL;
+	}
+	kd->mtime = tent->mtime;
+	RB_FOREACH(st, string_entries, &tent->entries) {
+		num++;
+	}
+	if(num == 0)
+		return kd;
+	kd->entries = malloc(num * sizeof(*kd->entries));
+	if(!kd->entries) {
+		perror("malloc");
+		free(kd);
+		return NULL;
+	}
+	RB_FOREACH(st, string_entries, &tent->entries) {
+		struct tup_entry *subtent = container_of(st, struct tup_entry, name);
+		struct known_entry *ke;
+
+		if(subtent->type != TUP_NODE_FILE &&
+		   subtent->type != TUP_NODE_GENERATED &&
+		   subtent->type != TUP_NODE_DIR &&
+		   subtent->type != TUP_NODE_GENERATED_DIR)
+			continue;
+		if(is_virtual_tent(subtent))
+			continue;
+		ke = &kd->entries[kd->num_entries];
+		ke->name = strdup(subtent->name.s);
+		ke->is_dir = subtent->type == TUP_NODE_DIR || subtent->type == TUP_NODE_GENERATED_DIR;
+		ke->mtime = subtent->mtime;
+		ke->kd = NULL;
+		kd->num_entries++;
+		if(!ke->name) {
+			perror("strdup");
+			goto err_out;
+		}
+		if(subtent->type == TUP_NODE_DIR) {
+			ke->kd = load_known_dir(subtent);
+			if(!ke->kd)
+				goto err_out;
+		}
+	}
+	qsort(kd->entries, kd->num_entries, sizeof(*kd->entries), known_entry_cmp);
+	return kd;
+
+err_out:
+	free_known_dir(kd);
+	return NULL;
+}
+
+static int known_name_cmp(const void *key, const void *b)
+{
+	const struct known_entry *ke = b;
+	return strcmp(key, ke->name);
+}
+
+static struct known_dir *find_known_dir(struct known_dir *kd, const char *name)
+{
+	struct known_entry *ke;
+
+	if(!kd)
+		return NULL;
+	ke = bsearch(name, kd->entries, kd->num_entries, sizeof(*kd->entries), known_name_cmp);
+	if(!ke)
+		return NULL;
+	return ke->kd;
+}
+
+static struct scan_dir *new_scan_dir(struct scanner *sc, const char *parent, const char *name)
+{
+	struct scan_dir *sd;
+
+	sd = calloc(1, sizeof *sd);
+	if(!sd) {
+		perror("calloc");
+		return NULL;
+	}
+	sd->wd = -1;
+	sd->mtime = INVALID_MTIME;
+	if(parent == NULL) {
+		sd->path = strdup(name);
+	} else if(strcmp(parent, ".") == 0) {
+		sd->path = strdup(name);
+	} else {
+		int len = strlen(parent) + strlen(name) + 2;
+		sd->path = malloc(len);
+		if(sd->path)
+			snprintf(sd->path, len, "%s/%s", parent, name);
+	}
+	if(!sd->path) {
+		perror("malloc");
+		free(sd);
+		return NULL;
+	}
+	sd->all_next = sc->all;
+	sc->all = sd;
+	return sd;
+}
+
+static int add_scan_entry(struct scan_dir *sd, int *alloc, const char *name)
+{
+	struct scan_entry *se;
+
+	if(sd->num_entries == *alloc) {
+		*alloc = *alloc ? *alloc * 2 : 16;
+		se = realloc(sd->entries, *alloc * sizeof(*se));
+		if(!se) {
+			perror("realloc");
+			return -1;
+		}
+		sd->entries = se;
+	}
+	se = &sd->entries[sd->num_entries];
+	se->name = strdup(name);
+	if(!se->name) {
+		perror("strdup");
+		return -1;
+	}
+	se->type = SCAN_OTHER;
+	se->mtime = INVALID_MTIME;
+	se->sd = NULL;
+	sd->num_entries++;
+	return 0;
+}
+
+/* Reads one directory, and returns the list of subdirectories that still need
+ * to be scanned through *subdirs.
+ */
+static int scan_one_dir(struct scanner *sc, struct scan_dir *sd, struct scan_dir **subdirs)
+{
+	DIR *d = NULL;
+	struct dirent *ent;
+	struct stat buf;
+	int fd;
+	int alloc = 0;
+	int x;
+
+	if(sc->watch) {
+		/* Watch before reading so that anything created in between
+		 * shows up as an event (same as watch_path()).
+		 */
+		if(sc->watch(sd->path, &sd->wd) < 0)
+			return -1;
+		if(sd->wd < 0) {
+			sd->missing = 1;
+			return 0;
+		}
+	}
+	fd = openat(sc->dfd, sd->path, O_RDONLY | O_DIRECTORY);
+	if(fd < 0) {
+		if(errno == ENOENT) {
+			sd->missing = 1;
+			return 0;
+		}
+		perror(sd->path);
+		fprintf(stderr, "tup error: Unable to open directory for scanning.\n");
+		return -1;
+	}
+	if(sc->watch) {
+		if(fstat(fd, &buf) < 0) {
+			perror(sd->path);
+			goto err_out;
+		}
+		sd->mtime = MTIME(buf);
+	}
+	if(sd->known && MTIME_EQ(sd->mtime, sd->known->mtime)) {
+		sd->validated = 1;
+		for(x=0; x<sd->known->num_entries; x++) {
+			struct known_entry *ke = &sd->known->entries[x];
+
+			if(add_scan_entry(sd, &alloc, ke->name) < 0)
+				goto err_out;
+			if(ke->is_dir)
+				sd->entries[sd->num_entries-1].type = SCAN_DIR;
+		}
+	} else {
+		d = fdopendir(fd);
+		if(!d) {
+			perror("fdopendir");
+			goto err_out;
+		}
+		while((ent = readdir(d)) != NULL) {
+			if(add_scan_entry(sd, &alloc, ent->d_name) < 0)
+				goto err_out;
+			if(ent->d_name[0] == '.' && pel_ignored(ent->d_name, -1)) {
+				sd->entries[sd->num_entries-1].type = SCAN_IGNORED;
+				continue;
+			}
+#ifdef DT_DIR
+			if(ent->d_type == DT_DIR) {
+				sd->entries[sd->num_entries-1].type = SCAN_DIR;
+				continue;
+			}
+#endif
+		}
+	}
+	for(x=0; x<sd->num_entries; x++) {
+		struct scan_entry *se = &sd->entries[x];
+
+		if(se->type == SCAN_IGNORED)
+			continue;
+		if(se->type != SCAN_DIR) {
+			if(fstatat(fd, se->name, &buf, AT_SYMLINK_NOFOLLOW) < 0) {
+				if(errno == ENOENT) {
+					/* Removed since we read the
+					 * directory (t7037).
+					 */
+					se->type = SCAN_MISSING;
+					continue;
+				}
+				perror(se->name);
+				fprintf(stderr, "tup error: lstat failed\n");
+				goto err_out;
+			}
+			if(S_ISREG(buf.st_mode) || S_ISLNK(buf.st_mode)) {
+				se->type = SCAN_FILE;
+				se->mtime = MTIME(buf);
+				if(sd->validated && MTIME_EQ(se->mtime, sd->known->entries[x].mtime))
+					se->type = SCAN_UNCHANGED;
+				continue;
+			}
+			if(!S_ISDIR(buf.st_mode)) {
+				/* Ignore block devices, fifofs, and sockets */
+				se->type = SCAN_OTHER;
+				continue;
+			}
+			se->type = SCAN_DIR;
+		}
+		se->sd = new_scan_dir(sc, sd->path, se->name);
+		if(!se->sd)
+			goto err_out;
+		se->sd->known = find_known_dir(sd->known, se->name);
+	}
+	/* Push in reverse so the first subdirectory is popped first, which is
+	 * the order they are applied in.
+	 */
+	for(x=sd->num_entries-1; x>=0; x--) {
+		struct scan_dir *sub = sd->entries[x].sd;
+		if(sub) {
+			sub->next = *subdirs;
+			*subdirs = sub;
+		}
+	}
+	if(d)
+		closedir(d);
+	else
+		close(fd);
+	return 0;
+
+err_out:
+	if(d)
+		closedir(d);
+	else
+		close(fd);
+	return -1;
+}
+
+static void *scan_thread(void *arg)
+{
+	struct scanner *sc = arg;
+
+	pthread_mutex_lock(&sc->lock);
+	while(1) {
+		struct scan_dir *sd;
+		struct scan_dir *subdirs = NULL;
+		int rc;
+
+		while(!sc->stack && sc->pending && !sc->quit)
+			pthread_cond_wait(&sc->cond, &sc->lock);
+		if(!sc->stack || sc->quit)
+			break;
+		sd = sc->stack;
+		sc->stack = sd->next;
+		pthread_mutex_unlock(&sc->lock);
+
+		rc = scan_one_dir(sc, sd, &subdirs);
+
+		pthread_mutex_lock(&sc->lock);
+		if(rc < 0)
+			sc->failed = 1;
+		while(subdirs) {
+			struct scan_dir *tmp = subdirs->next;
+			subdirs->next = sc->stack;
+			sc->stack = subdirs;
+			sc->pending++;
+			subdirs = tmp;
+		}
+		sd->done = 1;
+		sc->pending--;
+		pthread_cond_broadcast(&sc->cond);
+	}
+	pthread_mutex_unlock(&sc->lock);
+	return NULL;
+}
+
+static int apply_scan_dir(struct scanner *sc, tupid_t dt, const char *name,
+			  struct scan_dir *sd,
+			  int (*callback)(tupid_t newdt, int wd))
+{
+	struct tupid_entries root = {NULL};
+	struct tup_entry *tent;
+	struct tup_entry *dtent;
+	int x;
+
+	if(dt == 0) {
+		if(tup_entry_add(DOT_DT, &tent) < 0)
+			return -1;
+	} else {
+		if(tup_entry_add(dt, &dtent) < 0)
+			return -1;
+		tent = tup_db_create_node(dtent, name, TUP_NODE_DIR);
+		if(!tent)
+			return -1;
+	}
+
+	pthread_mutex_lock(&sc->lock);
+	while(!sd->done && !sc->failed)
+		pthread_cond_wait(&sc->cond, &sc->lock);
+	pthread_mutex_unlock(&sc->lock);
+	if(!sd->done)
+		return -1;
+
+	if(callback && sd->wd >= 0) {
+		if(callback(tent->tnode.tupid, sd->wd) < 0)
+			return -1;
+	}
+	if(sd->missing) {
+		/* The directory was removed while we were scanning
+		 * (t7037).
+		 */
+		if(tup_file_missing(tent) < 0)
+			return -1;
+		return 0;
+	}
+
+	/* If the directory was validated, the entries are exactly the ones in
+	 * the database, so anything that has gone missing is marked as such
+	 * below rather than being found through the dir tree.
+	 */
+	if(!sd->validated) {
+		if(tup_entry_get_dir_tree(tent, &root) < 0)
+			return -1;
+	}
+
+	for(x=0; x<sd->num_entries; x++) {
+		struct scan_entry *se = &sd->entries[x];
+		struct tup_entry *subtent;
+
+		if(se->type == SCAN_UNCHANGED) {
+			free(se->name);
+			se->name = NULL;
+			continue;
+		}
+		if(tup_entry_find_name_in_dir(tent, se->name, -1, &subtent) < 0)
+			return -1;
+		if(subtent) {
+			if(sd->validated) {
+				if(se->type == SCAN_MISSING || se->type == SCAN_OTHER) {
+					if(tup_file_missing(subtent) < 0)
+						return -1;
+				}
+			} else {
+				tupid_tree_remove(&root, subtent->tnode.tupid);
+			}
+		}
+		if(se->type == SCAN_FILE) {
+			if(tup_file_mod_mtime(tent->tnode.tupid, se->name, se->mtime, 0, 0, NULL) < 0)
+				return -1;
+		} else if(se->type == SCAN_DIR) {
+			if(apply_scan_dir(sc, tent->tnode.tupid, se->name, se->sd, callback) < 0)
+				return -1;
+		}
+		free(se->name);
+		se->name = NULL;
+	}
+	free(sd->entries);
+	sd->entries = NULL;
+	sd->num_entries = 0;
+
+	{
+		struct tupid_tree *tt;
+		while((tt = RB_ROOT(&root)) != NULL) {
+			struct tup_entry *subtent;
+
+			subtent = tup_entry_get(tt->tupid);
+			if(tup_file_missing(subtent) < 0)
+				return -1;
+			tupid_tree_rm(&root, tt);
+			free(tt);
+		}
+	}
+
+	/* Save the directory's mtime for the next time the monitor starts.
+	 * If it changed right around the time we read it, something else may
+	 * still change within the same timestamp, so leave it invalid to make
+	 * sure it gets read again.
+	 */
+	if(sc->watch && tent->type == TUP_NODE_DIR) {
+		struct timespec mtime = sd->mtime;
+
+		if(mtime.tv_sec >= sc->racy_sec)
+			mtime = INVALID_MTIME;
+		if(!MTIME_EQ(tent->mtime, mtime)) {
+			if(tup_db_set_mtime(tent, mtime) < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+static int scan_threads(void)
+{
+	int num;
+
+	num = tup_option_get_int("updater.num_jobs");
+	if(num > 8)
+		num = 8;
+	return num;
+}
+
+int watch_tree(int (*watch)(const char *path, int *wd),
+	       int (*callback)(tupid_t newdt, int wd))
+{
+	struct scanner sc;
+	struct scan_dir *top;
+	pthread_t *tids;
+	int num_threads;
+	int started;
+	int rc;
+	int x;
+
+	num_threads = scan_threads();
+	if(num_threads < 2) {
+		if(!watch)
+			return -2;
+		num_threads = 1;
+	}
+
+	tids = malloc(num_threads * sizeof(*tids));
+	if(!tids) {
+		perror("malloc");
+		return -1;
+	}
+	pthread_mutex_init(&sc.lock, NULL);
+	pthread_cond_init(&sc.cond, NULL);
+	sc.stack = NULL;
+	sc.all = NULL;
+	sc.pending = 1;
+	sc.failed = 0;
+	sc.quit = 0;
+	sc.dfd = tup_top_fd();
+	sc.racy_sec = time(NULL) - 1;
+	sc.watch = watch;
+
+	top = new_scan_dir(&sc, NULL, ".");
+	if(!top) {
+		free(tids);
+		return -1;
+	}
+	sc.stack = top;
+
+	if(watch) {
+		struct tup_entry *tent;
+
+		if(tup_entry_add(DOT_DT, &tent) < 0) {
+			rc = -1;
+			goto out_free;
+		}
+		top->known = load_known_dir(tent);
+		if(!top->known) {
+			rc = -1;
+			goto out_free;
+		}
+	}
+
+	/* Paths handed to the watch callback are relative to the top of the
+	 * tup hierarchy.
+	 */
+	if(fchdir(tup_top_fd()) < 0) {
+		perror("fchdir");
+		rc = -1;
+		goto out_free;
+	}
+
+	for(started=0; started<num_threads; started++) {
+		if(pthread_create(&tids[started], NULL, scan_thread, &sc) != 0) {
+			perror("pthread_create");
+			break;
+		}
+	}
+	if(started == 0) {
+		rc = -1;
+		goto out_free;
+	}
+
+	rc = apply_scan_dir(&sc, 0, ".", top, callback);
+
+	pthread_mutex_lock(&sc.lock);
+	sc.quit = 1;
+	pthread_cond_broadcast(&sc.cond);
+	pthread_mutex_unlock(&sc.lock);
+	for(x=0; x<started; x++)
+		pthread_join(tids[x], NULL);
+	if(sc.failed)
+		rc = -1;
+
+out_free:
+	free_known_dir(top->known);
+	while(sc.all) {
+		struct scan_dir *sd = sc.all;
+		sc.all = sd->all_next;
+		for(x=0; x<sd->num_entries; x++)
+			free(sd->entries[x].name);
+		free(sd->entries);
+		free(sd->path);
+		free(sd);
+	}
+	pthread_mutex_destroy(&sc.lock);
+	pthread_cond_destroy(&sc.cond);
+	free(tids);
+	return rc;
+}
+#else
+int watch_tree(int (*watch)(const char *path, int *wd),
+	       int (*callback)(tupid_t newdt, int wd))
+{
+	if(watch || callback) {}
+	return -2;
+}
+#endif
+
 static int full_scan_cb(void *arg, struct tup_entry *tent)
 {
 	struct tent_list_head *head = arg;
@@ -315,9 +954,14 @@ static int scan_full_deps(void)
 
 int tup_scan(void)
 {
+	int rc;
+
 	if(tup_db_scan_begin() < 0)
 		return -1;
-	if(watch_path(0, ".", NULL) < 0)
+	rc = watch_tree(NULL, NULL);
+	if(rc == -2)
+		rc = watch_path(0, ".", NULL);
+	if(rc < 0)
 		return -1;
 	if(scan_full_deps() < 0)
 		return -1;
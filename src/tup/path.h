@@ -26,6 +26,17 @@
 
 int watch_path(tupid_t dt, const char *file,
 	       int (*callback)(tupid_t newdt, const char *file, int *skip));
+/* Scans the whole tup hierarchy like watch_path(0, ".", ...), but reads the
+ * directories from multiple threads. The watch function is called from those
+ * threads with the directory's path relative to the top before it is read,
+ * and sets *wd to a negative value if the directory is gone. The callback is
+ * called from the calling thread with the node and wd for each directory.
+ * When watching, directories whose mtime hasn't changed since the last scan
+ * aren't read again - only the entries already in the database are checked.
+ * Returns -2 if the scan should be done with watch_path() instead.
+ */
+int watch_tree(int (*watch)(const char *path, int *wd),
+	       int (*callback)(tupid_t newdt, int wd));
 int tup_scan(void);
 int tup_external_scan(void);
 
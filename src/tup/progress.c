@@ -175,6 +175,11 @@ void skip_result(struct tup_entry *tent)
 	}
 }
 
+void skip_remaining(void)
+{
+	sum = total;
+}
+
 static int percent_complete(void)
 {
 	if(!total)
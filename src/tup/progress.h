@@ -32,6 +32,7 @@ void tup_show_message(const char *s);
 void tup_main_progress(const char *s);
 void start_progress(int new_total, int new_total_time, int new_max_jobs);
 void skip_result(struct tup_entry *tent);
+void skip_remaining(void);
 void show_result(struct tup_entry *tent, int is_error, struct timespan *ts, const char *extra_text, int always_display);
 void show_progress(int active, enum TUP_NODE_TYPE type);
 void clear_active(FILE *f);
@@ -25,6 +25,7 @@
 #include "bsd/queue.h"
 #include "string_tree.h"
 #include <pthread.h>
+#include <stdint.h>
 
 struct tent_entries;
 struct tup_entry;
@@ -42,6 +43,7 @@ struct server {
 	int need_namespacing;
 	int run_in_bash;
 	int streaming_mode;
+	int trust_depfile;
 	pthread_mutex_t *error_mutex;
 };
 
@@ -49,6 +51,11 @@ struct parser_directory {
 	/* parser_server gets one of these for each directory that is preloaded with files. */
 	struct string_tree st;
 	struct string_entries files;
+	/* Combined digest of every name in files, for the run-script cache.
+	 * This includes the outputs of rules parsed so far, since a script
+	 * can see those too.
+	 */
+	uint64_t digest;
 };
 
 struct parser_server {
@@ -73,6 +80,7 @@ int server_exec(struct server *s, int dfd, const char *cmd, struct tup_env *newe
 		struct tup_entry *dtent);
 int server_postexec(struct server *s);
 int server_unlink(void);
+int server_pipeline_safe(void);
 int server_is_dead(void);
 int server_parser_start(struct parser_server *ps);
 int server_parser_stop(struct parser_server *ps);
@@ -26,10 +26,12 @@
 #include "tup/variant.h"
 #include "tup/lock.h"
 #include "tup/progress.h"
+#include "tup/memfile.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -287,11 +289,9 @@ int server_exec(struct server *s, int dfd, const char *cmd, struct tup_env *newe
 	}
 	int output_fd;
 	if(!s->streaming_mode) {
-		char buf[64];
-		snprintf(buf, sizeof(buf), ".tup/tmp/output-%i", s->id);
-		s->output_fd = open(buf, O_CREAT | O_RDWR | O_CLOEXEC | O_TRUNC, 0600);
+		s->output_fd = memfile_fd("tup-output");
 		if(s->output_fd < 0) {
-			perror(buf);
+			fprintf(stderr, "tup error: Unable to create a buffer for sub-process output.\n");
 			return -1;
 		}
 		output_fd = s->output_fd;
@@ -331,18 +331,7 @@ int server_exec(struct server *s, int dfd, const char *cmd, struct tup_env *newe
 
 int server_postexec(struct server *s)
 {
-	if(!s->streaming_mode) {
-		char buf[64];
-		snprintf(buf, sizeof(buf), ".tup/tmp/output-%i", s->id);
-		buf[sizeof(buf)-1] = 0;
-		if(unlinkat(tup_top_fd(), buf, 0) < 0) {
-			server_lock(s);
-			perror(buf);
-			fprintf(stderr, "tup error: Unable to unlink sub-process output file.\n");
-			server_unlock(s);
-			return -1;
-		}
-	}
+	if(s) {}
 	return 0;
 }
 
@@ -354,6 +343,15 @@ int server_unlink(void)
 	return 1;
 }
 
+int server_pipeline_safe(void)
+{
+	/* Sub-processes are forked with their own working directory, and the
+	 * server has no per-phase state, so commands can run while the parser
+	 * is active.
+	 */
+	return 1;
+}
+
 int server_is_dead(void)
 {
 	return sig_quit;
@@ -387,72 +385,84 @@ int serverless_run_script(FILE *f, const char *cmdline,
 	return -1;
 }
 
-static int process_depfile(struct server *s, int fd)
+/* Matches struct spill_header in the ldpreload shim. */
+struct spill_header {
+	int used;
+};
+
+struct spill_list {
+	struct spill_list *next;
+	char *name;
+};
+
+static int process_events(struct server *s, const char *buf, size_t size,
+			  struct spill_list **spills)
 {
-	char event1[PATH_MAX];
-	char event2[PATH_MAX];
+	size_t offset = 0;
 
-	while(1) {
+	while(offset < size) {
 		struct access_event event;
-		int rc;
+		const char *event1;
+		const char *event2;
 
-		rc = read(fd, &event, sizeof(event));
-		if(rc == 0) {
-			break;
-		} else if(rc != sizeof(event)) {
-			perror("read");
+		if(size - offset < sizeof(event)) {
 			fprintf(stderr, "tup error: Unable to read the access_event structure from the dependency file.\n");
 			return -1;
 		}
+		memcpy(&event, buf + offset, sizeof(event));
+		offset += sizeof(event);
 
-		if(!event.len)
-			continue;
-
-		if(event.len >= PATH_MAX - 1) {
+		if(event.len < 0 || event.len >= PATH_MAX - 1) {
 			fprintf(stderr, "tup error: Size of %i bytes is longer than the max filesize\n", event.len);
 			return -1;
 		}
-		if(event.len2 >= PATH_MAX - 1) {
+		if(event.len2 < 0 || event.len2 >= PATH_MAX - 1) {
 			fprintf(stderr, "tup error: Size of %i bytes is longer than the max filesize\n", event.len2);
 			return -1;
 		}
-
-		if(read(fd, &event1, event.len + 1) != event.len + 1) {
-			perror("read");
-			fprintf(stderr, "tup error: Unable to read the first event from the dependency file.\n");
-			return -1;
-		}
-		if(read(fd, &event2, event.len2 + 1) != event.len2 + 1) {
-			perror("read");
-			fprintf(stderr, "tup error: Unable to read the second event from the dependency file.\n");
+		if(size - offset < (size_t)event.len + 1 + (size_t)event.len2 + 1) {
+			fprintf(stderr, "tup error: Unable to read the file names from the dependency file.\n");
 			return -1;
 		}
+		event1 = buf + offset;
+		offset += event.len + 1;
+		event2 = buf + offset;
+		offset += event.len2 + 1;
 
 		if(event1[event.len] != '\0' || event2[event.len2] != '\0') {
 			fprintf(stderr, "tup error: Missing null terminator in access_event\n");
 			return -1;
 		}
 
-		if(event.at == ACCESS_WRITE) {
-			struct mapping *map;
+		if(!event.len)
+			continue;
 
-			map = malloc(sizeof *map);
-			if(!map) {
-				perror("malloc");
+		if(event.at == ACCESS_SPILL) {
+			struct spill_list *sl;
+
+			if(!spills) {
+				fprintf(stderr, "tup error: Unexpected spill file event in a spill file: %s\n", event1);
 				return -1;
 			}
-			map->realname = strdup(event1);
-			if(!map->realname) {
-				perror("strdup");
+			sl = malloc(sizeof *sl);
+			if(!sl) {
+				perror("malloc");
 				return -1;
 			}
-			map->tmpname = strdup(event1);
-			if(!map->tmpname) {
+			sl->name = strdup(event1);
+			if(!sl->name) {
 				perror("strdup");
+				free(sl);
 				return -1;
 			}
-			map->tent = NULL; /* This is used when saving deps */
-			TAILQ_INSERT_TAIL(&s->finfo.mapping_list, map, list);
+			sl->next = *spills;
+			*spills = sl;
+			continue;
+		}
+
+		if(event.at == ACCESS_WRITE) {
+			if(!add_map(&s->finfo, event1, event1))
+				return -1;
 		}
 		if(handle_file(event.at, event1, event2, &s->finfo) < 0) {
 			fprintf(stderr, "tup error: Failed to call handle_file on event '%s'\n", event1);
@@ -462,6 +472,107 @@ static int process_depfile(struct server *s, int fd)
 	return 0;
 }
 
+/* Picks up the events that a process left in its spill file, which only
+ * happens if it was killed before it could flush them to the depfile.
+ */
+static int process_spill(struct server *s, const char *name)
+{
+	struct stat st;
+	struct spill_header hdr;
+	char *buf;
+	int fd;
+	int rc = -1;
+
+	fd = open(name, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) {
+		perror(name);
+		fprintf(stderr, "tup error: Unable to open the dependency spill file.\n");
+		return -1;
+	}
+	if(fstat(fd, &st) < 0) {
+		perror("fstat");
+		fprintf(stderr, "tup error: Unable to stat the dependency spill file.\n");
+		goto out_close;
+	}
+	if((size_t)st.st_size < sizeof(hdr)) {
+		/* The process died before it sized the file. */
+		rc = 0;
+		goto out_close;
+	}
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if(buf == MAP_FAILED) {
+		perror("mmap");
+		fprintf(stderr, "tup error: Unable to map the dependency spill file.\n");
+		goto out_close;
+	}
+	memcpy(&hdr, buf, sizeof(hdr));
+	if(hdr.used < 0 || (size_t)hdr.used > st.st_size - sizeof(hdr)) {
+		fprintf(stderr, "tup error: Dependency spill file '%s' is corrupt.\n", name);
+	} else {
+		rc = process_events(s, buf + sizeof(hdr), hdr.used, NULL);
+	}
+	if(munmap(buf, st.st_size) < 0) {
+		perror("munmap");
+		rc = -1;
+	}
+out_close:
+	close(fd);
+	return rc;
+}
+
+static int process_depfile(struct server *s, int fd)
+{
+	struct stat st;
+	char *buf;
+	struct spill_list *spills = NULL;
+	int rc = -1;
+
+	if(fstat(fd, &st) < 0) {
+		perror("fstat");
+		fprintf(stderr, "tup error: Unable to stat the dependency file.\n");
+		return -1;
+	}
+	if(st.st_size == 0)
+		return 0;
+
+	/* Map the whole file and parse the events in place, rather than
+	 * reading each piece of each event separately.
+	 */
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(buf == MAP_FAILED) {
+		perror("mmap");
+		fprintf(stderr, "tup error: Unable to map the dependency file.\n");
+		return -1;
+	}
+
+	rc = process_events(s, buf, st.st_size, &spills);
+
+	/* The leftovers in the spill files came after everything that their
+	 * processes flushed to the depfile, so they are handled last.
+	 */
+	while(spills) {
+		struct spill_list *sl = spills;
+
+		spills = sl->next;
+		if(rc == 0)
+			if(process_spill(s, sl->name) < 0)
+				rc = -1;
+		if(unlink(sl->name) < 0) {
+			perror(sl->name);
+			fprintf(stderr, "tup error: Unable to unlink the dependency spill file.\n");
+			rc = -1;
+		}
+		free(sl->name);
+		free(sl);
+	}
+
+	if(munmap(buf, st.st_size) < 0) {
+		perror("munmap");
+		rc = -1;
+	}
+	return rc;
+}
+
 static void sighandler(int sig)
 {
 	if(sig_quit == 0) {
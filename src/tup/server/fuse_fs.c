@@ -47,6 +47,18 @@ static int server_mode = 0;
 static pid_t ourpgid;
 static int max_open_files = 128;
 
+/* Paths outside of the tup hierarchy that a job has found to be missing (eg:
+ * a compiler searching through system include directories with
+ * updater.full_deps). tup doesn't put files out there, so later jobs can be
+ * told the path is missing without another stat(). The access is still
+ * recorded for each job. Anything a job creates goes through a mapping and may
+ * be moved into place after the job finishes, so those paths go in
+ * created_root and are never cached.
+ */
+static struct string_entries absent_root = RB_INITIALIZER(&absent_root);
+static struct string_entries created_root = RB_INITIALIZER(&created_root);
+static pthread_mutex_t absent_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void tup_fuse_fs_init(void)
 {
 	struct rlimit rlim;
@@ -162,16 +174,111 @@ static const char *peel(const char *path)
 	return path;
 }
 
+static int ignore_file(const char *path)
+{
+	if(strncmp(path, "/dev", 4) == 0)
+		return 1;
+	if(strncmp(path, "/sys", 4) == 0)
+		return 1;
+	if(strncmp(path, "/proc", 5) == 0)
+		return 1;
+	if(is_ccache_path(path))
+		return 1;
+	return 0;
+}
+
+static int outside_tup(const char *peeled)
+{
+	if(peeled[0] != '/')
+		return 0;
+	if(strncmp(peeled, get_tup_top(), get_tup_top_len()) == 0 &&
+	   (peeled[get_tup_top_len()] == '/' || peeled[get_tup_top_len()] == 0))
+		return 0;
+	return 1;
+}
+
+static int known_absent(const char *peeled)
+{
+	int rc;
+
+	if(!outside_tup(peeled))
+		return 0;
+	pthread_mutex_lock(&absent_lock);
+	rc = string_tree_search(&absent_root, peeled, strlen(peeled)) != NULL;
+	pthread_mutex_unlock(&absent_lock);
+	return rc;
+}
+
+static void set_absent(const char *peeled)
+{
+	struct string_tree *st;
+
+	if(!outside_tup(peeled) || ignore_file(peeled))
+		return;
+	pthread_mutex_lock(&absent_lock);
+	if(!string_tree_search(&created_root, peeled, strlen(peeled)) &&
+	   !string_tree_search(&absent_root, peeled, strlen(peeled))) {
+		st = malloc(sizeof *st);
+		if(st) {
+			if(string_tree_add(&absent_root, st, peeled) < 0)
+				free(st);
+		}
+	}
+	pthread_mutex_unlock(&absent_lock);
+}
+
+static void set_created(const char *peeled)
+{
+	struct string_tree *st;
+
+	if(!outside_tup(peeled))
+		return;
+	pthread_mutex_lock(&absent_lock);
+	st = string_tree_search(&absent_root, peeled, strlen(peeled));
+	if(st) {
+		string_tree_remove(&absent_root, st);
+		free(st);
+	}
+	if(!string_tree_search(&created_root, peeled, strlen(peeled))) {
+		st = malloc(sizeof *st);
+		if(st) {
+			if(string_tree_add(&created_root, st, peeled) < 0)
+				free(st);
+		}
+	}
+	pthread_mutex_unlock(&absent_lock);
+}
+
+static void free_path_tree(struct string_entries *root)
+{
+	struct string_tree *st;
+
+	while(!RB_EMPTY(root)) {
+		st = RB_ROOT(root);
+		string_tree_remove(root, st);
+		free(st);
+	}
+}
+
+void tup_fuse_fs_quit(void)
+{
+	pthread_mutex_lock(&absent_lock);
+	free_path_tree(&absent_root);
+	free_path_tree(&created_root);
+	pthread_mutex_unlock(&absent_lock);
+}
+
 static struct mapping *add_mapping_internal(struct file_info *finfo, const char *path)
 {
 	static int filenum = 0;
 	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-	struct mapping *map = NULL;
-	int size;
+	struct mapping *map;
+	char tmpname[sizeof(int) * 2 + sizeof(TUP_TMP) + 1];
 	int myfile;
 	const char *peeled;
 
 	peeled = peel(path);
+	set_created(peeled);
 
 	if(!is_hidden(peeled)) {
 		if(handle_open_file(ACCESS_WRITE, peeled, finfo) < 0) {
@@ -181,36 +288,21 @@ static struct mapping *add_mapping_internal(struct file_info *finfo, const char
 		}
 	}
 
-	map = malloc(sizeof *map);
-	if(!map) {
-		perror("malloc");
-		return NULL;
-	}
-	map->realname = strdup(peeled);
-	if(!map->realname) {
-		perror("strdup");
-		return NULL;
-	}
-	size = sizeof(int) * 2 + sizeof(TUP_TMP) + 1;
-	map->tmpname = malloc(size);
-	if(!map->tmpname) {
-		perror("malloc");
-		return NULL;
-	}
-	map->tent = NULL; /* This is used when saving dependencies */
+	map = find_map(&finfo->mapping_list, peeled);
+	if(map)
+		return map;
 
 	pthread_mutex_lock(&lock);
 	myfile = filenum;
 	filenum++;
 	pthread_mutex_unlock(&lock);
 
-	if(snprintf(map->tmpname, size, TUP_TMP "/%x", myfile) >= size) {
+	if(snprintf(tmpname, sizeof(tmpname), TUP_TMP "/%x", myfile) >= (int)sizeof(tmpname)) {
 		fprintf(stderr, "tup internal error: mapping tmpname is sized incorrectly.\n");
 		return NULL;
 	}
 
-	TAILQ_INSERT_TAIL(&finfo->mapping_list, map, list);
-	return map;
+	return add_map(finfo, peeled, tmpname);
 }
 
 static struct mapping *add_mapping(const char *path)
@@ -228,16 +320,7 @@ static struct mapping *add_mapping(const char *path)
 
 static struct mapping *find_mapping(struct file_info *finfo, const char *path)
 {
-	const char *peeled;
-	struct mapping *map;
-
-	peeled = peel(path);
-	TAILQ_FOREACH(map, &finfo->mapping_list, list) {
-		if(strcmp(peeled, map->realname) == 0) {
-			return map;
-		}
-	}
-	return NULL;
+	return find_map(&finfo->mapping_list, peel(path));
 }
 
 static int context_check(void)
@@ -280,19 +363,6 @@ static int context_check(void)
 	return 0;
 }
 
-static int ignore_file(const char *path)
-{
-	if(strncmp(path, "/dev", 4) == 0)
-		return 1;
-	if(strncmp(path, "/sys", 4) == 0)
-		return 1;
-	if(strncmp(path, "/proc", 5) == 0)
-		return 1;
-	if(is_ccache_path(path))
-		return 1;
-	return 0;
-}
-
 static void tup_fuse_handle_file(const char *path, const char *stripped, enum access_type at)
 {
 	struct file_info *finfo;
@@ -423,11 +493,17 @@ static int tup_fs_getattr(const char *path, struct stat *stbuf)
 		}
 	}
 
-	res = fstatat(tup_top_fd(), peeled, stbuf, AT_SYMLINK_NOFOLLOW);
-	if (res == -1) {
-		rc = -errno;
+	if(known_absent(peeled)) {
+		rc = -ENOENT;
 	} else {
-		rc = 0;
+		res = fstatat(tup_top_fd(), peeled, stbuf, AT_SYMLINK_NOFOLLOW);
+		if (res == -1) {
+			rc = -errno;
+			if(rc == -ENOENT)
+				set_absent(peeled);
+		} else {
+			rc = 0;
+		}
 	}
 	tup_fuse_handle_file(path, stripped, ACCESS_READ);
 
@@ -641,7 +717,7 @@ static int tup_fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		 * we need to add to the list in addition to whatever we
 		 * get from the real opendir/readdir (if applicable).
 		 */
-		TAILQ_FOREACH(map, &finfo->mapping_list, list) {
+		TAILQ_FOREACH(map, &finfo->mapping_list.entries, list) {
 			const char *realname;
 
 			/* Get the 'real' realname of the file. Eg: sub/bar.txt
@@ -649,15 +725,15 @@ static int tup_fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 			 */
 			if(peeled[0] == '.') {
 				/* TODO: ?? */
-				realname = map->realname;
+				realname = map->realname.s;
 			} else {
 				int len;
 				len = strlen(peeled);
-				if(strncmp(peeled, map->realname, len) != 0)
+				if(strncmp(peeled, map->realname.s, len) != 0)
 					continue;
-				if(map->realname[len] != '/')
+				if(map->realname.s[len] != '/')
 					continue;
-				realname = &map->realname[len+1];
+				realname = &map->realname.s[len+1];
 			}
 			/* Make sure we don't include "sub/dir/bar.txt" if
 			 * we are just doing readdir("sub").
@@ -817,6 +893,7 @@ static int tup_fs_mkdir(const char *path, mode_t mode)
 		return -EPERM;
 
 	peeled = peel(path);
+	set_created(peeled);
 	if(ignore_file(peeled)) {
 		int rc;
 
@@ -912,8 +989,8 @@ static int tup_fs_rmdir(const char *path)
 			}
 		}
 		// Ensure that there are no files in the directory
-		TAILQ_FOREACH(map, &finfo->mapping_list, list) {
-			if (strncmp(map->realname, peeled, len) == 0 && map->realname[len] == '/') {
+		TAILQ_FOREACH(map, &finfo->mapping_list.entries, list) {
+			if (strncmp(map->realname.s, peeled, len) == 0 && map->realname.s[len] == '/') {
 				put_finfo(finfo);
 				return -ENOTEMPTY;
 			}
@@ -973,6 +1050,7 @@ static int tup_fs_rename(const char *from, const char *to)
 
 	peelfrom = peel(from);
 	peelto = peel(to);
+	set_created(peelto);
 
 	finfo = get_finfo(to);
 	if(finfo) {
@@ -1022,10 +1100,7 @@ static int tup_fs_rename(const char *from, const char *to)
 			put_finfo(finfo);
 			tup_fuse_handle_file(from, NULL, ACCESS_UNLINK);
 		} else {
-			free(map->realname);
-			map->realname = strdup(peelto);
-			if(!map->realname) {
-				perror("strdup");
+			if(rename_map(finfo, map, peelto) < 0) {
 				put_finfo(finfo);
 				return -ENOMEM;
 			}
@@ -1164,7 +1239,7 @@ static int tup_fs_truncate(const char *path, off_t size)
 			put_finfo(finfo);
 			return rc;
 		} else {
-			if(exclusion_match(stderr, &finfo->exclusion_root, peeled, &match) < 0) {
+			if(exclusion_match(stderr, &finfo->exclusion_root, finfo->exclusion_re, peeled, &match) < 0) {
 				put_finfo(finfo);
 				return -ENOSYS;
 			}
@@ -1213,7 +1288,7 @@ static int tup_fs_utimens(const char *path, const struct timespec ts[2])
 			return rc;
 		} else {
 			struct tmpdir *tmpdir;
-			if(exclusion_match(stderr, &finfo->exclusion_root, peeled, &match) < 0) {
+			if(exclusion_match(stderr, &finfo->exclusion_root, finfo->exclusion_re, peeled, &match) < 0) {
 				put_finfo(finfo);
 				return -ENOSYS;
 			}
@@ -1284,7 +1359,7 @@ static int tup_fs_open(const char *path, struct fuse_file_info *fi)
 		} else {
 #ifdef FUSE3
 			struct tup_entry *match = NULL;
-			if(exclusion_match(stderr, &finfo->exclusion_root, path, &match) < 0) {
+			if(exclusion_match(stderr, &finfo->exclusion_root, finfo->exclusion_re, path, &match) < 0) {
 				put_finfo(finfo);
 				return -ENOSYS;
 			}
@@ -33,6 +33,7 @@
 #include "tup/option.h"
 #include "tup/variant.h"
 #include "tup/container.h"
+#include "tup/memfile.h"
 #include "tup_fuse_fs.h"
 #include "master_fork.h"
 #include <stdio.h>
@@ -66,9 +67,14 @@ static uid_t original_euid;
 static pthread_mutex_t curps_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_t fuse_tid;
 
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tupid_entries job_ids = RB_INITIALIZER(&job_ids);
+static unsigned int job_generation = 0;
+
 static void *fuse_thread(void *arg)
 {
 	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	char cache_opts[64];
 	if(arg) {}
 
 	/* Need a garbage arg first to count as the process name */
@@ -80,6 +86,16 @@ static void *fuse_thread(void *arg)
 		return NULL;
 	if(fuse_opt_add_arg(&args, TUP_MNT) < 0)
 		return NULL;
+	/* Lookups and attributes may be cached by the kernel, since every job
+	 * gets a fresh directory in the mount (see job_name()). The first
+	 * access to a path in each job still reaches us and is recorded.
+	 */
+	snprintf(cache_opts, sizeof(cache_opts), "-oentry_timeout=%i,attr_timeout=%i,negative_timeout=%i",
+		 tup_option_get_int("updater.fuse_cache_timeout"),
+		 tup_option_get_int("updater.fuse_cache_timeout"),
+		 tup_option_get_int("updater.fuse_cache_timeout"));
+	if(fuse_opt_add_arg(&args, cache_opts) < 0)
+		return NULL;
 	if(server_debug_enabled()) {
 		if(fuse_opt_add_arg(&args, "-d") < 0)
 			return NULL;
@@ -358,9 +374,40 @@ int server_quit(void)
 	if(tup_unmount() < 0)
 		return -1;
 	pthread_join(fuse_tid, NULL);
+	tup_fuse_fs_quit();
+	free_tupid_tree(&job_ids);
 	return 0;
 }
 
+/* The kernel caches entries and attributes by path, so a job must never reuse
+ * the directory of an earlier job. Otherwise a job with the same id could see
+ * stale data, and its accesses would not be recorded. Without namespacing the
+ * job directory is also what the command sees as its working directory, so it
+ * should be the same from one run to the next. Each id gets the plain
+ * @tupjob-<id> the first time it is used in this mount, and only an id that
+ * comes back (eg: a run-script in the directory that was just parsed) gets a
+ * counter appended. The id stays first so that get_finfo() can still find the
+ * job.
+ */
+static int job_name(char *dest, int len, const char *prefix, int id)
+{
+	unsigned int gen = 0;
+	int reused = 0;
+
+	pthread_mutex_lock(&job_lock);
+	if(tupid_tree_search(&job_ids, id) != NULL) {
+		reused = 1;
+		gen = job_generation++;
+	} else if(tupid_tree_add(&job_ids, id) < 0) {
+		pthread_mutex_unlock(&job_lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&job_lock);
+	if(reused)
+		return snprintf(dest, len, "%s" TUP_JOB "%i-%u", prefix, id, gen);
+	return snprintf(dest, len, "%s" TUP_JOB "%i", prefix, id);
+}
+
 static int re_openat(int fd, const char *path)
 {
 	int newfd;
@@ -388,7 +435,10 @@ static int virt_tup_open(struct parser_server *ps)
 		return -1;
 	}
 
-	snprintf(virtdir, sizeof(virtdir), TUP_JOB "%i", ps->s.id);
+	if(job_name(virtdir, sizeof(virtdir), "", ps->s.id) < 0) {
+		close(fd);
+		return -1;
+	}
 	virtdir[sizeof(virtdir)-1] = 0;
 	fd = re_openat(fd, virtdir);
 	if(fd < 0) {
@@ -476,9 +526,13 @@ static int exec_internal(struct server *s, const char *cmd, struct tup_env *newe
 	em.need_namespacing = s->need_namespacing;
 	em.run_in_bash = s->run_in_bash;
 	em.streaming_mode = s->streaming_mode;
+	em.trust_depfile = s->trust_depfile;
 	em.envlen = newenv->block_size;
 	em.num_env_entries = newenv->num_entries;
-	em.joblen = snprintf(job, sizeof(job), TUP_MNT "/" TUP_JOB "%i", s->id) + 1;
+	em.joblen = job_name(job, sizeof(job), TUP_MNT "/", s->id);
+	if(em.joblen < 0)
+		return -1;
+	em.joblen++;
 
 	/* dirlen includes the \0, which snprintf does not count. Hence the -1/+1
 	 * adjusting.
@@ -498,56 +552,45 @@ static int exec_internal(struct server *s, const char *cmd, struct tup_env *newe
 	em.cmdlen = strlen(cmd) + 1;
 	variant = tup_entry_variant(dtent);
 	em.vardictlen = variant->vardict_len;
-	if(master_fork_exec(&em, job, dir, cmd, newenv->envblock, variant->vardict_file, &status) < 0) {
-		server_lock(s);
-		fprintf(stderr, "tup error: Unable to fork sub-process.\n");
-		server_unlock(s);
-		return -1;
-	}
-
-	if(finfo_wait_open_count(s) < 0)
-		return -1;
-
 	if(!s->streaming_mode) {
-		char buf[64];
-		snprintf(buf, sizeof(buf), ".tup/tmp/output-%i", s->id);
-		buf[sizeof(buf)-1] = 0;
-		s->output_fd = openat(tup_top_fd(), buf, O_RDONLY);
+		s->output_fd = memfile_fd("tup-output");
 		if(s->output_fd < 0) {
 			server_lock(s);
-			perror(buf);
-			fprintf(stderr, "tup error: Unable to open sub-process output file.\n");
-			server_unlock(s);
-			return -1;
-		}
-		if(unlinkat(tup_top_fd(), buf, 0) < 0) {
-			server_lock(s);
-			perror(buf);
-			fprintf(stderr, "tup error: Unable to unlink sub-process output file.\n");
+			fprintf(stderr, "tup error: Unable to create a buffer for sub-process output.\n");
 			server_unlock(s);
 			return -1;
 		}
-
 		if(!single_output) {
-			snprintf(buf, sizeof(buf), ".tup/tmp/errors-%i", s->id);
-			buf[sizeof(buf)-1] = 0;
-			s->error_fd = openat(tup_top_fd(), buf, O_RDWR);
+			s->error_fd = memfile_fd("tup-errors");
 			if(s->error_fd < 0) {
 				server_lock(s);
-				perror(buf);
-				fprintf(stderr, "tup error: Unable to open sub-process errors file.\n");
-				server_unlock(s);
-				return -1;
-			}
-			if(unlinkat(tup_top_fd(), buf, 0) < 0) {
-				server_lock(s);
-				perror(buf);
-				fprintf(stderr, "tup error: Unable to unlink sub-process errors file.\n");
+				fprintf(stderr, "tup error: Unable to create a buffer for sub-process errors.\n");
 				server_unlock(s);
 				return -1;
 			}
 		}
 	}
+	if(master_fork_exec(&em, job, dir, cmd, newenv->envblock, variant->vardict_file, s->output_fd, s->error_fd, &status) < 0) {
+		server_lock(s);
+		fprintf(stderr, "tup error: Unable to fork sub-process.\n");
+		server_unlock(s);
+		return -1;
+	}
+
+	if(finfo_wait_open_count(s) < 0)
+		return -1;
+
+	/* The sub-process shares our file offsets, so rewind the buffers
+	 * before they are read back.
+	 */
+	if(s->output_fd >= 0 && lseek(s->output_fd, 0, SEEK_SET) < 0) {
+		perror("lseek");
+		return -1;
+	}
+	if(s->error_fd >= 0 && lseek(s->error_fd, 0, SEEK_SET) < 0) {
+		perror("lseek");
+		return -1;
+	}
 
 	if(WIFEXITED(status)) {
 		s->exited = 1;
@@ -571,6 +614,13 @@ int server_exec(struct server *s, int dfd, const char *cmd, struct tup_env *newe
 
 	if(dfd) {/* TODO */}
 
+	/* Commands that report their own dependencies in a depfile run
+	 * directly in the source tree, so there is no file-system group to
+	 * collect accesses.
+	 */
+	if(s->trust_depfile)
+		return exec_internal(s, cmd, newenv, dtent, 1);
+
 	if(tup_fuse_add_group(s->id, &s->finfo) < 0)
 		return -1;
 
@@ -596,6 +646,14 @@ int server_unlink(void)
 	return 0;
 }
 
+int server_pipeline_safe(void)
+{
+	/* The FUSE filesystem has a single global mode for parsing or
+	 * updating, so we can't run commands while parsing.
+	 */
+	return 0;
+}
+
 int server_run_script(FILE *f, tupid_t tupid, const char *cmdline,
 		      struct tent_entries *env_root, char **rules)
 {
@@ -621,6 +679,7 @@ int server_run_script(FILE *f, tupid_t tupid, const char *cmdline,
 	if(exec_internal(&s, cmdline, &te, tent, 0) < 0)
 		return -1;
 	environ_free(&te);
+	cleanup_file_info(&s.finfo);
 
 	if(display_output(s.error_fd, 1, cmdline, 1, f) < 0)
 		return -1;
@@ -664,16 +723,14 @@ int serverless_run_script(FILE *f, const char *cmdline,
 	FILE *ofile;
 	FILE *efile;
 
-	ofile = tmpfile();
+	ofile = memfile_open("tup-output");
 	if(!ofile) {
-		perror("tmpfile");
 		fprintf(stderr, "tup error: Unable to create temporary file for sub-process output.\n");
 		return -1;
 	}
 
-	efile = tmpfile();
+	efile = memfile_open("tup-errors");
 	if(!efile) {
-		perror("tmpfile");
 		fprintf(stderr, "tup error: Unable to create temporary file for sub-process errors.\n");
 		return -1;
 	}
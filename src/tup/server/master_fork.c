@@ -228,7 +228,7 @@ read_rc_again:
 int server_post_exit(void)
 {
 	int status;
-	struct execmsg em = {-1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+	struct execmsg em = {-1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 
 	if(!inited)
 		return 0;
@@ -268,9 +268,59 @@ static int write_all(const void *data, int size)
 	return 0;
 }
 
+/* The output buffers are created by tup and handed to the master fork along
+ * with the execmsg, so the sub-process writes straight into them rather than
+ * into files under .tup/tmp.
+ */
+static int send_execmsg(struct execmsg *em, int output_fd, int error_fd)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	int fds[2];
+	int nfds = 0;
+	int rc;
+
+	if(output_fd >= 0)
+		fds[nfds++] = output_fd;
+	if(error_fd >= 0)
+		fds[nfds++] = error_fd;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = em;
+	iov.iov_len = sizeof(*em);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if(nfds) {
+		memset(control, 0, sizeof(control));
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	}
+	do {
+		rc = sendmsg(msd[1], &msg, 0);
+	} while(rc < 0 && errno == EINTR);
+	if(rc < 0) {
+		perror("sendmsg");
+		fprintf(stderr, "tup error: Unable to write the exec message to the master fork socket.\n");
+		return -1;
+	}
+	if(rc != sizeof(*em)) {
+		if(write_all((char*)em + rc, sizeof(*em) - rc) < 0)
+			return -1;
+	}
+	return 0;
+}
+
 int master_fork_exec(struct execmsg *em, const char *job, const char *dir,
 		     const char *cmd, const char *envstring,
-		     const char *vardict_file, int *status)
+		     const char *vardict_file, int output_fd, int error_fd,
+		     int *status)
 {
 	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 	struct status_tree st;
@@ -292,7 +342,7 @@ int master_fork_exec(struct execmsg *em, const char *job, const char *dir,
 	pthread_mutex_unlock(&statuslock);
 
 	pthread_mutex_lock(&lock);
-	if(write_all(em, sizeof(*em)) < 0)
+	if(send_execmsg(em, output_fd, error_fd) < 0)
 		goto err_out;
 	if(write_all(job, em->joblen) < 0)
 		goto err_out;
@@ -337,45 +387,72 @@ static int read_all_internal(int sd, void *dest, int size, int line)
 	return 0;
 }
 
+static int recv_execmsg(struct execmsg *em, int *ofd, int *efd)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	int fds[2];
+	int nfds = 0;
+	int flags = 0;
+	int rc;
+
+	*ofd = -1;
+	*efd = -1;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = em;
+	iov.iov_len = sizeof(*em);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+#ifdef MSG_CMSG_CLOEXEC
+	flags = MSG_CMSG_CLOEXEC;
+#endif
+	do {
+		rc = recvmsg(msd[0], &msg, flags);
+	} while(rc < 0 && errno == EINTR);
+	if(rc < 0) {
+		perror("recvmsg");
+		fprintf(stderr, "tup error: Unable to read the exec message from the master fork socket.\n");
+		return -1;
+	}
+	if(rc == 0) {
+		DEBUGP("tup error: The master fork socket closed before an exec message was read.\n");
+		return -1;
+	}
+	for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			if(nfds > 2)
+				nfds = 2;
+			memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+		}
+	}
+	if(nfds > 0)
+		*ofd = fds[0];
+	if(nfds > 1)
+		*efd = fds[1];
+	if(rc != sizeof(*em)) {
+		if(read_all(msd[0], (char*)em + rc, sizeof(*em) - rc) < 0)
+			return -1;
+	}
+	return 0;
+}
+
 static int setup_subprocess(struct execmsg *em, const char *job, const char *dir,
-			    const char *dev, const char *proc)
+			    const char *dev, const char *proc, int ofd, int efd)
 {
 	int do_chroot;
 
 	if(!em->streaming_mode) {
-		int ofd, efd;
-		char buf[64];
-		snprintf(buf, sizeof(buf), ".tup/tmp/output-%lli", em->sid);
-		buf[sizeof(buf)-1] = 0;
-		ofd = creat(buf, 0600);
-		if(ofd < 0) {
-			perror(buf);
-			fprintf(stderr, "tup error: Unable to create temporary file for sub-process output.\n");
+		if(ofd < 0 || (!em->single_output && efd < 0)) {
+			fprintf(stderr, "tup internal error: No output buffer was sent for sub-process %lli.\n", em->sid);
 			return -1;
 		}
-		if(fchown(ofd, getuid(), getgid()) < 0) {
-			perror("fchown");
-			fprintf(stderr, "tup error: Unable to create temporary file for sub-process output.\n");
-			return -1;
-		}
-
-		if(em->single_output) {
+		if(em->single_output)
 			efd = ofd;
-		} else {
-			snprintf(buf, sizeof(buf), ".tup/tmp/errors-%lli", em->sid);
-			buf[sizeof(buf)-1] = 0;
-			efd = creat(buf, 0600);
-			if(efd < 0) {
-				perror(buf);
-				fprintf(stderr, "tup error: Unable to create temporary file for sub-process errors.\n");
-				return -1;
-			}
-			if(fchown(efd, getuid(), getgid()) < 0) {
-				perror("fchown");
-				fprintf(stderr, "tup error: Unable to create temporary file for sub-process errors.\n");
-				return -1;
-			}
-		}
 		if(dup2(ofd, STDOUT_FILENO) < 0) {
 			perror("dup2");
 			fprintf(stderr, "tup error: Unable to dup stdout for the child process.\n");
@@ -398,6 +475,25 @@ static int setup_subprocess(struct execmsg *em, const char *job, const char *dir
 		}
 	}
 
+	if(em->trust_depfile) {
+		/* The command reports its own dependencies, so it runs in the
+		 * real directory rather than through the fuse file-system.
+		 */
+		if(tup_drop_privs() < 0)
+			return -1;
+		if(chdir("/") < 0) {
+			perror("chdir");
+			fprintf(stderr, "tup error: Unable to chdir to root directory.\n");
+			return -1;
+		}
+		if(chdir(dir) < 0) {
+			perror("chdir");
+			fprintf(stderr, "tup error: Unable to chdir to '%s'\n", dir);
+			return -1;
+		}
+		return 0;
+	}
+
 #ifdef __linux__
 	if(use_namespacing) {
 		if(unshare(CLONE_NEWNS) < 0) {
@@ -585,8 +681,9 @@ static int master_fork_loop(void)
 	while(1) {
 		struct child_wait_info *waiter;
 		pid_t pid;
+		int ofd, efd;
 
-		if(read_all(msd[0], &em, sizeof(em)) < 0)
+		if(recv_execmsg(&em, &ofd, &efd) < 0)
 			return -1;
 
 		/* See if we get the shutdown message. */
@@ -685,7 +782,7 @@ static int master_fork_loop(void)
 			curp++;
 			*curp = NULL;
 
-			if(setup_subprocess(&em, job, dir, waiter->dev, waiter->proc) < 0)
+			if(setup_subprocess(&em, job, dir, waiter->dev, waiter->proc, ofd, efd) < 0)
 				exit(1);
 
 			if(em.run_in_bash) {
@@ -697,6 +794,14 @@ static int master_fork_loop(void)
 			perror("execl");
 			exit(1);
 		}
+		if(ofd >= 0 && close(ofd) < 0) {
+			perror("close(ofd)");
+			exit(1);
+		}
+		if(efd >= 0 && close(efd) < 0) {
+			perror("close(efd)");
+			exit(1);
+		}
 		waiter->pid = pid;
 		waiter->sid = em.sid;
 		waiter->tnode.id = pid;
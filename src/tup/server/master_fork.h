@@ -36,12 +36,14 @@ struct execmsg {
 	int need_namespacing;
 	int run_in_bash;
 	int streaming_mode;
+	int trust_depfile;
 };
 
 #define JOB_MAX 64
 
 int master_fork_exec(struct execmsg *em, const char *job, const char *dir,
 		     const char *cmd, const char *newenv,
-		     const char *vardict_file, int *status);
+		     const char *vardict_file, int output_fd, int error_fd,
+		     int *status);
 
 #endif
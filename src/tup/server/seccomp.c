@@ -0,0 +1,1709 @@
+/* vim: set ts=8 sw=8 sts=8 noet tw=78:
+ *
+ * tup - A file-based build system
+ *
+ * Copyright (C) 2024  Mike Shal <marfey@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Dependency tracking with seccomp user notifications. The sub-process
+ * installs a filter that sends the path-based syscalls (open, stat, rename,
+ * unlink, exec, etc) of the whole process tree to tup. We read the path
+ * arguments out of the process' memory, record them in the server's
+ * file_info, and then let the kernel carry on with the syscall. Unlike
+ * ldpreload this also sees statically linked programs, and unlike FUSE the
+ * file data never goes through tup.
+ *
+ * The notification arrives before the syscall runs, so we don't know whether
+ * it succeeded. Anything that creates or removes a file (opens for writing,
+ * rename, unlink, mkdir, etc) is therefore performed here on behalf of the
+ * process, so that only successful ones are recorded. Reads are recorded
+ * either way, like the ldpreload shim does.
+ */
+
+#define _GNU_SOURCE
+#include "tup/server.h"
+#include "tup/config.h"
+#include "tup/flist.h"
+#include "tup/environ.h"
+#include "tup/entry.h"
+#include "tup/ccache.h"
+#include "tup/lock.h"
+#include "tup/progress.h"
+#include "tup/memfile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <ftw.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/openat2.h>
+#include <linux/seccomp.h>
+
+#if defined(__x86_64__)
+#define SECCOMP_AUDIT_ARCH AUDIT_ARCH_X86_64
+#elif defined(__i386__)
+#define SECCOMP_AUDIT_ARCH AUDIT_ARCH_I386
+#elif defined(__aarch64__)
+#define SECCOMP_AUDIT_ARCH AUDIT_ARCH_AARCH64
+#else
+#error "The seccomp server does not know the audit arch for this platform."
+#endif
+
+#ifndef SECCOMP_USER_NOTIF_FLAG_CONTINUE
+#define SECCOMP_USER_NOTIF_FLAG_CONTINUE (1UL << 0)
+#endif
+
+#define TUP_TMP ".tup/tmp"
+
+struct notify_state {
+	struct server *s;
+	int listener;
+	/* The /proc/<pid>/mem file of the last process we read from, since
+	 * consecutive notifications almost always come from the same one.
+	 */
+	int mem_fd;
+	pid_t mem_pid;
+	struct seccomp_notif *req;
+	struct seccomp_notif_resp *resp;
+	/* Set when the syscall was already answered with ADDFD. */
+	int responded;
+	/* Set when a syscall couldn't be tracked, which fails the job. */
+	int failed;
+};
+
+static void sighandler(int sig);
+static int supervise(struct server *s, int listener, pid_t pid, int *status);
+static int server_inited = 0;
+static int null_fd = -1;
+static mode_t tup_umask;
+static struct seccomp_notif_sizes notif_sizes;
+
+static struct sigaction sigact = {
+	.sa_handler = sighandler,
+	.sa_flags = SA_RESTART,
+};
+static volatile sig_atomic_t sig_quit = 0;
+
+int server_pre_init(void)
+{
+	if(getpid() != getpgid(0) && setpgid(0, 0) < 0) {
+		perror("setpgid");
+		fprintf(stderr, "tup error: Unable to set process group for tup's subprocesses.\n");
+		return -1;
+	}
+	if(syscall(SYS_seccomp, SECCOMP_GET_NOTIF_SIZES, 0, &notif_sizes) < 0) {
+		perror("seccomp");
+		fprintf(stderr, "tup error: This kernel does not support seccomp user notifications, which are required by the seccomp server.\n");
+		return -1;
+	}
+	return 0;
+}
+
+int server_post_exit(void)
+{
+	return 0;
+}
+
+static char vardict_env[] = TUP_VARDICT_NAME "=-1";
+
+static char **server_setenv(struct tup_env *env)
+{
+	char **envp;
+	char **curp;
+	char *curenv;
+
+	/* +2 for the vardict variable, which also tells tup that it is running
+	 * as a sub-process, and the terminating NULL pointer.
+	 */
+	envp = malloc((env->num_entries + 2) * sizeof(*envp));
+	if(!envp) {
+		perror("malloc");
+		return NULL;
+	}
+	/* Convert from Windows-style environment to Linux-style.
+	 */
+	curp = envp;
+	curenv = env->envblock;
+	while(*curenv) {
+		*curp = curenv;
+		curp++;
+		curenv += strlen(curenv) + 1;
+	}
+	*curp = vardict_env;
+	curp++;
+	*curp = NULL;
+	return envp;
+}
+
+int server_init(enum server_mode mode)
+{
+	struct flist f = {0, 0, 0};
+
+	if(mode) {/* unused */}
+
+	if(server_inited)
+		return 0;
+
+	if(fchdir(tup_top_fd()) < 0) {
+		perror("fchdir");
+		return -1;
+	}
+	if(mkdir(TUP_TMP, 0777) < 0) {
+		if(errno != EEXIST) {
+			perror(TUP_TMP);
+			fprintf(stderr, "tup error: Unable to create temporary working directory.\n");
+			return -1;
+		}
+	}
+	tup_umask = umask(0);
+	umask(tup_umask);
+	null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	if(null_fd < 0) {
+		perror("/dev/null");
+		fprintf(stderr, "tup error: Unable to open /dev/null for dup'ing stdin\n");
+		return -1;
+	}
+
+	/* Go into the tmp directory and remove any files that may have been
+	 * left over from a previous tup invocation.
+	 */
+	if(chdir(TUP_TMP) < 0) {
+		perror(TUP_TMP);
+		fprintf(stderr, "tup error: Unable to chdir to the tmp directory.\n");
+		return -1;
+	}
+	flist_foreach(&f, ".") {
+		if(f.filename[0] != '.') {
+			if(unlink(f.filename) != 0) {
+				perror(f.filename);
+				fprintf(stderr, "tup error: Unable to clean out a file in .tup/tmp directory. Please try cleaning this directory manually.\n");
+				return -1;
+			}
+		}
+	}
+	if(sigemptyset(&sigact.sa_mask) < 0) {
+		perror("sigemptyset");
+		return -1;
+	}
+	if(sigaction(SIGINT, &sigact, NULL) < 0) {
+		perror("sigaction");
+		return -1;
+	}
+	if(sigaction(SIGTERM, &sigact, NULL) < 0) {
+		perror("sigaction");
+		return -1;
+	}
+	if(sigaction(SIGHUP, &sigact, NULL) < 0) {
+		perror("sigaction");
+		return -1;
+	}
+	if(sigaction(SIGUSR1, &sigact, NULL) < 0) {
+		perror("sigaction");
+		return -1;
+	}
+	if(sigaction(SIGUSR2, &sigact, NULL) < 0) {
+		perror("sigaction");
+		return -1;
+	}
+	if(fchdir(tup_top_fd()) < 0) {
+		perror("fchdir");
+		return -1;
+	}
+
+	server_inited = 1;
+	return 0;
+}
+
+int server_quit(void)
+{
+	close(null_fd);
+	return 0;
+}
+
+#define TRACE_SYSCALL(nr) \
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (nr), 0, 1), \
+	BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_USER_NOTIF)
+
+static int install_filter(void)
+{
+	struct sock_filter filter[] = {
+		/* Syscalls from a different ABI (eg: 32-bit or x32 programs
+		 * on x86_64) use different numbers, which we don't track.
+		 * Fail them rather than let their file accesses go unseen.
+		 */
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch)),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SECCOMP_AUDIT_ARCH, 1, 0),
+		BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | EPERM),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+#ifdef __X32_SYSCALL_BIT
+		BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, __X32_SYSCALL_BIT, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | EPERM),
+#endif
+#ifdef __NR_open
+		TRACE_SYSCALL(__NR_open),
+#endif
+#ifdef __NR_creat
+		TRACE_SYSCALL(__NR_creat),
+#endif
+		TRACE_SYSCALL(__NR_openat),
+#ifdef __NR_openat2
+		TRACE_SYSCALL(__NR_openat2),
+#endif
+#ifdef __NR_stat
+		TRACE_SYSCALL(__NR_stat),
+#endif
+#ifdef __NR_lstat
+		TRACE_SYSCALL(__NR_lstat),
+#endif
+#ifdef __NR_stat64
+		TRACE_SYSCALL(__NR_stat64),
+#endif
+#ifdef __NR_lstat64
+		TRACE_SYSCALL(__NR_lstat64),
+#endif
+#ifdef __NR_newfstatat
+		TRACE_SYSCALL(__NR_newfstatat),
+#endif
+#ifdef __NR_fstatat64
+		TRACE_SYSCALL(__NR_fstatat64),
+#endif
+#ifdef __NR_statx
+		TRACE_SYSCALL(__NR_statx),
+#endif
+		TRACE_SYSCALL(__NR_statfs),
+#ifdef __NR_statfs64
+		TRACE_SYSCALL(__NR_statfs64),
+#endif
+#ifdef __NR_access
+		TRACE_SYSCALL(__NR_access),
+#endif
+		TRACE_SYSCALL(__NR_faccessat),
+#ifdef __NR_faccessat2
+		TRACE_SYSCALL(__NR_faccessat2),
+#endif
+#ifdef __NR_readlink
+		TRACE_SYSCALL(__NR_readlink),
+#endif
+		TRACE_SYSCALL(__NR_readlinkat),
+		TRACE_SYSCALL(__NR_execve),
+#ifdef __NR_execveat
+		TRACE_SYSCALL(__NR_execveat),
+#endif
+#ifdef __NR_rename
+		TRACE_SYSCALL(__NR_rename),
+#endif
+#ifdef __NR_renameat
+		TRACE_SYSCALL(__NR_renameat),
+#endif
+#ifdef __NR_renameat2
+		TRACE_SYSCALL(__NR_renameat2),
+#endif
+#ifdef __NR_unlink
+		TRACE_SYSCALL(__NR_unlink),
+#endif
+		TRACE_SYSCALL(__NR_unlinkat),
+#ifdef __NR_symlink
+		TRACE_SYSCALL(__NR_symlink),
+#endif
+		TRACE_SYSCALL(__NR_symlinkat),
+#ifdef __NR_mkdir
+		TRACE_SYSCALL(__NR_mkdir),
+#endif
+		TRACE_SYSCALL(__NR_mkdirat),
+#ifdef __NR_rmdir
+		TRACE_SYSCALL(__NR_rmdir),
+#endif
+#ifdef __NR_mknod
+		TRACE_SYSCALL(__NR_mknod),
+#endif
+		TRACE_SYSCALL(__NR_mknodat),
+#ifdef __NR_link
+		TRACE_SYSCALL(__NR_link),
+#endif
+		TRACE_SYSCALL(__NR_linkat),
+		TRACE_SYSCALL(__NR_truncate),
+#ifdef __NR_chmod
+		TRACE_SYSCALL(__NR_chmod),
+#endif
+		TRACE_SYSCALL(__NR_fchmodat),
+#ifdef __NR_fchmodat2
+		TRACE_SYSCALL(__NR_fchmodat2),
+#endif
+#ifdef __NR_chown
+		TRACE_SYSCALL(__NR_chown),
+#endif
+#ifdef __NR_lchown
+		TRACE_SYSCALL(__NR_lchown),
+#endif
+		TRACE_SYSCALL(__NR_fchownat),
+#ifdef __NR_utime
+		TRACE_SYSCALL(__NR_utime),
+#endif
+#ifdef __NR_utimes
+		TRACE_SYSCALL(__NR_utimes),
+#endif
+#ifdef __NR_futimesat
+		TRACE_SYSCALL(__NR_futimesat),
+#endif
+		TRACE_SYSCALL(__NR_utimensat),
+		BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+	};
+	struct sock_fprog prog = {
+		.len = sizeof(filter) / sizeof(filter[0]),
+		.filter = filter,
+	};
+	int listener;
+
+	/* Required to install a filter without CAP_SYS_ADMIN */
+	if(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0) {
+		perror("prctl(PR_SET_NO_NEW_PRIVS)");
+		return -1;
+	}
+	listener = syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, SECCOMP_FILTER_FLAG_NEW_LISTENER, &prog);
+	if(listener < 0) {
+		perror("seccomp(SECCOMP_SET_MODE_FILTER)");
+		return -1;
+	}
+	return listener;
+}
+
+static int send_fd(int sock, int fd)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	char c = 0;
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} u;
+	struct cmsghdr *cmsg;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = u.buf;
+	msg.msg_controllen = sizeof(u.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	if(sendmsg(sock, &msg, 0) != 1) {
+		perror("sendmsg");
+		return -1;
+	}
+	return 0;
+}
+
+static int recv_fd(int sock)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	char c;
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} u;
+	struct cmsghdr *cmsg;
+	int fd;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = u.buf;
+	msg.msg_controllen = sizeof(u.buf);
+	if(recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1) {
+		/* The child already printed why it failed. */
+		return -1;
+	}
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if(!cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+		fprintf(stderr, "tup error: Didn't get the seccomp listener from the sub-process.\n");
+		return -1;
+	}
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
+
+static int run_subprocess(struct server *s, int ofd, int dfd, const char *cmd, struct tup_env *env, int run_in_bash, int *status)
+{
+	int pid;
+	int sv[2];
+	int listener;
+	int rc;
+
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+		perror("socketpair");
+		return -1;
+	}
+	pid = fork();
+	if(pid == 0) {
+		char **envp;
+		tup_lock_closeall();
+		close(sv[0]);
+		if(dup2(ofd, STDOUT_FILENO) < 0) {
+			perror("dup2");
+			fprintf(stderr, "tup error: Unable to dup stdout for the child process.\n");
+			exit(1);
+		}
+		if(dup2(ofd, STDERR_FILENO) < 0) {
+			perror("dup2");
+			fprintf(stderr, "tup error: Unable to dup stderr for the child process.\n");
+			exit(1);
+		}
+		if(dup2(null_fd, STDIN_FILENO) < 0) {
+			perror("dup2");
+			fprintf(stderr, "tup error: Unable to dup stdin for child processes.\n");
+			exit(1);
+		}
+
+		if(fchdir(dfd) < 0) {
+			perror("fchdir");
+			exit(1);
+		}
+		envp = server_setenv(env);
+		if(!envp) {
+			exit(1);
+		}
+
+		/* Everything from here on, including the exec of the shell,
+		 * is reported to tup.
+		 */
+		listener = install_filter();
+		if(listener < 0) {
+			fprintf(stderr, "tup error: Unable to install the seccomp filter for the sub-process.\n");
+			exit(1);
+		}
+		if(send_fd(sv[1], listener) < 0) {
+			fprintf(stderr, "tup error: Unable to pass the seccomp listener back to tup.\n");
+			exit(1);
+		}
+		close(listener);
+		close(sv[1]);
+		if(run_in_bash) {
+			execle("/usr/bin/env", "/usr/bin/env", "bash", "-e", "-o", "pipefail", "-c", cmd, NULL, envp);
+		} else {
+			execle("/bin/sh", "/bin/sh", "-e", "-c", cmd, NULL, envp);
+		}
+		perror("execl");
+		exit(1);
+	}
+	close(sv[1]);
+	if(pid < 0) {
+		perror("fork");
+		close(sv[0]);
+		return -1;
+	}
+	listener = recv_fd(sv[0]);
+	close(sv[0]);
+	if(listener < 0) {
+		if(waitpid(pid, status, 0) < 0) {
+			perror("waitpid");
+		}
+		return -1;
+	}
+	rc = supervise(s, listener, pid, status);
+	close(listener);
+	return rc;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	if(st || flag || ftw) {}
+	/* Keep going, so that as much as possible is cleaned up. */
+	if(remove(path) < 0) {}
+	return 0;
+}
+
+/* Unlike with FUSE, the directories that a command made really exist. The
+ * ones it should have removed are taken out again here, and stay in the
+ * tmpdir_list so that write_files() still reports them.
+ */
+static int remove_tmpdirs(struct server *s)
+{
+	struct tmpdir *tmpdir;
+	int rc = 0;
+
+	finfo_lock(&s->finfo);
+	TAILQ_FOREACH_REVERSE(tmpdir, &s->finfo.tmpdir_list, tmpdir_head, list) {
+		struct tup_entry *match = NULL;
+
+		if(exclusion_match(stderr, &s->finfo.exclusion_root, s->finfo.exclusion_re, tmpdir->dirname, &match) < 0) {
+			rc = -1;
+			break;
+		}
+		/* Everything inside was made by the command too, since
+		 * the directory didn't exist before.
+		 */
+		if(!match)
+			nftw(tmpdir->dirname, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	}
+	finfo_unlock(&s->finfo);
+	return rc;
+}
+
+static void server_lock(struct server *s)
+{
+	if(s->error_mutex)
+		pthread_mutex_lock(s->error_mutex);
+}
+
+static void server_unlock(struct server *s)
+{
+	if(s->error_mutex)
+		pthread_mutex_unlock(s->error_mutex);
+}
+
+int server_exec(struct server *s, int dfd, const char *cmd, struct tup_env *newenv,
+		struct tup_entry *dtent)
+{
+	int status;
+
+	if(dtent) {}
+
+	int output_fd;
+	if(!s->streaming_mode) {
+		s->output_fd = memfile_fd("tup-output");
+		if(s->output_fd < 0) {
+			fprintf(stderr, "tup error: Unable to create a buffer for sub-process output.\n");
+			return -1;
+		}
+		output_fd = s->output_fd;
+	} else {
+		output_fd = STDOUT_FILENO;
+	}
+	if(run_subprocess(s, output_fd, dfd, cmd, newenv, s->run_in_bash, &status) < 0)
+		return -1;
+	if(remove_tmpdirs(s) < 0)
+		return -1;
+
+	if(WIFEXITED(status)) {
+		s->exited = 1;
+		s->exit_status = WEXITSTATUS(status);
+	} else if(WIFSIGNALED(status)) {
+		s->signalled = 1;
+		s->exit_sig = WTERMSIG(status);
+	} else {
+		server_lock(s);
+		fprintf(stderr, "tup error: Expected exit status to be WIFEXITED or WIFSIGNALED. Got: %i\n", status);
+		server_unlock(s);
+		return -1;
+	}
+	return 0;
+}
+
+int server_postexec(struct server *s)
+{
+	if(s) {}
+	return 0;
+}
+
+int server_unlink(void)
+{
+	/* Commands write directly to the real filesystem, so errant files need
+	 * to be unlinked.
+	 */
+	return 1;
+}
+
+int server_pipeline_safe(void)
+{
+	/* Each command is traced in its own child process, independent of
+	 * whatever the parser is doing.
+	 */
+	return 1;
+}
+
+int server_is_dead(void)
+{
+	return sig_quit;
+}
+
+int server_parser_start(struct parser_server *ps)
+{
+	ps->root_fd = tup_top_fd();
+	return 0;
+}
+
+int server_parser_stop(struct parser_server *ps)
+{
+	if(ps) {}
+	return 0;
+}
+
+int server_run_script(FILE *f, tupid_t tupid, const char *cmdline,
+		      struct tent_entries *env_root, char **rules)
+{
+	if(f || tupid || cmdline || env_root || rules) {/* unsupported */}
+	fprintf(stderr, "tup error: Run scripts are not yet supported on this platform.\n");
+	return -1;
+}
+
+int serverless_run_script(FILE *f, const char *cmdline,
+		          struct tent_entries *env_root, char **rules)
+{
+	if(f || cmdline || env_root || rules) {/* unsupported */}
+	fprintf(stderr, "tup error: Run scripts are not yet supported on this platform.\n");
+	return -1;
+}
+
+static int ignore_file(const char *file)
+{
+	if(strncmp(file, "/dev/", 5) == 0)
+		return 1;
+	if(strncmp(file, "/sys/", 5) == 0)
+		return 1;
+	if(strncmp(file, "/proc/", 6) == 0)
+		return 1;
+	if(is_ccache_path(file))
+		return 1;
+	return 0;
+}
+
+static int is_hidden(const char *path)
+{
+	if(strstr(path, "/.git") != NULL)
+		return 1;
+	if(strstr(path, "/.tup") != NULL)
+		return 1;
+	if(strstr(path, "/.hg") != NULL)
+		return 1;
+	if(strstr(path, "/.svn") != NULL)
+		return 1;
+	if(strstr(path, "/.bzr") != NULL)
+		return 1;
+	return 0;
+}
+
+/* Returns the part of 'full' relative to the top of the tup hierarchy, or
+ * NULL if it is somewhere else.
+ */
+static const char *tree_path(const char *full)
+{
+	int len = get_tup_top_len();
+
+	if(strncmp(full, get_tup_top(), len) != 0 || full[len] != '/')
+		return NULL;
+	return full + len + 1;
+}
+
+/* The syscall fails with 'err' instead of running. */
+static void deny(struct notify_state *ns, int err)
+{
+	ns->resp->flags = 0;
+	ns->resp->error = -err;
+	ns->resp->val = 0;
+}
+
+/* Report the result of a syscall that we performed for the process. */
+static void set_result(struct notify_state *ns, int rc)
+{
+	if(rc < 0) {
+		deny(ns, errno);
+	} else {
+		ns->resp->flags = 0;
+		ns->resp->error = 0;
+		ns->resp->val = 0;
+	}
+}
+
+static int notif_valid(struct notify_state *ns)
+{
+	return ioctl(ns->listener, SECCOMP_IOCTL_NOTIF_ID_VALID, &ns->req->id) == 0;
+}
+
+/* The helpers below that look at the notifying process return 0 on success,
+ * 1 if the syscall can't touch a file (it has already been denied with the
+ * right errno, or the process is gone), and -1 if something went wrong on our
+ * side, which fails the job since its dependencies would be incomplete.
+ */
+static int open_mem(struct notify_state *ns)
+{
+	char procbuf[64];
+
+	if(ns->mem_fd >= 0)
+		close(ns->mem_fd);
+	snprintf(procbuf, sizeof(procbuf), "/proc/%u/mem", ns->req->pid);
+	ns->mem_fd = open(procbuf, O_RDONLY | O_CLOEXEC);
+	if(ns->mem_fd < 0) {
+		ns->mem_pid = 0;
+		if(!notif_valid(ns))
+			return 1;
+		perror(procbuf);
+		fprintf(stderr, "tup error: Unable to read the memory of a sub-process.\n");
+		return -1;
+	}
+	ns->mem_pid = ns->req->pid;
+	return 0;
+}
+
+static int read_mem(struct notify_state *ns, uint64_t addr, void *buf, int size, ssize_t *got)
+{
+	ssize_t rc;
+	int reopened = 0;
+
+	if(!addr) {
+		deny(ns, EFAULT);
+		return 1;
+	}
+	if(ns->mem_pid != (pid_t)ns->req->pid) {
+		rc = open_mem(ns);
+		if(rc != 0)
+			return rc;
+		reopened = 1;
+	}
+	rc = pread(ns->mem_fd, buf, size, addr);
+	if(rc <= 0 && !reopened) {
+		/* The mem file is tied to the address space it was opened
+		 * with, so it stops working once the process execs.
+		 */
+		reopened = open_mem(ns);
+		if(reopened != 0)
+			return reopened;
+		rc = pread(ns->mem_fd, buf, size, addr);
+	}
+
+	/* Make sure the pid wasn't recycled while we were reading. */
+	if(!notif_valid(ns))
+		return 1;
+	if(rc <= 0) {
+		/* Reading an unmapped address gives EIO, and the syscall
+		 * would fail with EFAULT.
+		 */
+		deny(ns, EFAULT);
+		return 1;
+	}
+	*got = rc;
+	return 0;
+}
+
+/* Copy a nul-terminated string out of the notifying process. */
+static int read_string(struct notify_state *ns, uint64_t addr, char *buf, int size)
+{
+	ssize_t got;
+	int rc;
+
+	rc = read_mem(ns, addr, buf, size, &got);
+	if(rc != 0)
+		return rc;
+	if(!memchr(buf, 0, got)) {
+		/* A short read means the string ran into unmapped memory. */
+		deny(ns, got == size ? ENAMETOOLONG : EFAULT);
+		return 1;
+	}
+	return 0;
+}
+
+/* Turn 'path' (relative to 'dirfd' in the notifying process) into a full
+ * path, the same way the ldpreload shim reports them.
+ */
+static int full_path(struct notify_state *ns, int dirfd, const char *path, char *buf, int size)
+{
+	char procbuf[64];
+	ssize_t len;
+
+	if(is_full_path(path)) {
+		if(snprintf(buf, size, "%s", path) >= size) {
+			deny(ns, ENAMETOOLONG);
+			return 1;
+		}
+		return 0;
+	}
+	if(dirfd == AT_FDCWD) {
+		snprintf(procbuf, sizeof(procbuf), "/proc/%u/cwd", ns->req->pid);
+	} else {
+		snprintf(procbuf, sizeof(procbuf), "/proc/%u/fd/%i", ns->req->pid, dirfd);
+	}
+	len = readlink(procbuf, buf, size);
+	if(len < 0) {
+		if(!notif_valid(ns))
+			return 1;
+		if(dirfd != AT_FDCWD && errno == ENOENT) {
+			deny(ns, EBADF);
+			return 1;
+		}
+		perror(procbuf);
+		fprintf(stderr, "tup error: Unable to find the directory of a path accessed by a sub-process: %s\n", path);
+		return -1;
+	}
+	if(len >= size || snprintf(buf + len, size - len, "/%s", path) >= size - len) {
+		deny(ns, ENAMETOOLONG);
+		return 1;
+	}
+	return 0;
+}
+
+/* Read the path argument at 'addr' and resolve it against 'dirfd'. An empty
+ * path (eg: fstatat(fd, "", AT_EMPTY_PATH)) doesn't name a new file, so the
+ * syscall is left alone.
+ */
+static int get_path(struct notify_state *ns, int dirfd, uint64_t addr, char *path, char *full)
+{
+	int rc;
+
+	rc = read_string(ns, addr, path, PATH_MAX);
+	if(rc != 0)
+		return rc;
+	if(path[0] == 0)
+		return 1;
+	return full_path(ns, dirfd, path, full, PATH_MAX);
+}
+
+/* Open a directory fd equivalent to 'dirfd' in the notifying process, so we
+ * can run the syscall ourselves.
+ */
+static int open_dirfd(struct notify_state *ns, int dirfd)
+{
+	char procbuf[64];
+	int fd;
+
+	if(dirfd == AT_FDCWD) {
+		snprintf(procbuf, sizeof(procbuf), "/proc/%u/cwd", ns->req->pid);
+	} else {
+		snprintf(procbuf, sizeof(procbuf), "/proc/%u/fd/%i", ns->req->pid, dirfd);
+	}
+	fd = open(procbuf, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if(fd < 0) {
+		if(!notif_valid(ns))
+			return -1;
+		deny(ns, errno == ENOENT ? EBADF : errno);
+	}
+	return fd;
+}
+
+static int get_umask(struct notify_state *ns, mode_t *mask)
+{
+	char procbuf[64];
+	char buf[512];
+	char *p;
+	ssize_t len;
+	int fd;
+
+	snprintf(procbuf, sizeof(procbuf), "/proc/%u/status", ns->req->pid);
+	fd = open(procbuf, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) {
+		if(!notif_valid(ns))
+			return 1;
+		perror(procbuf);
+		return -1;
+	}
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if(len < 0) {
+		perror(procbuf);
+		return -1;
+	}
+	buf[len] = 0;
+	p = strstr(buf, "\nUmask:");
+	if(!p) {
+		fprintf(stderr, "tup error: Unable to find the umask of a sub-process in %s\n", procbuf);
+		return -1;
+	}
+	*mask = strtol(p + 7, NULL, 8);
+	return 0;
+}
+
+/* Files we create get our umask applied by the kernel, so put back any bits
+ * that the process' own umask would have allowed. If 'path' is NULL then 'fd'
+ * is the file itself, otherwise it is the directory containing 'path'.
+ */
+static void fix_mode(int fd, const char *path, mode_t mode)
+{
+	if(!(mode & tup_umask))
+		return;
+	/* The file is already there either way, so this isn't worth failing
+	 * the syscall over.
+	 */
+	if(!path) {
+		if(fchmod(fd, mode) < 0) {}
+	} else {
+		if(fchmodat(fd, path, mode, 0) < 0) {}
+	}
+}
+
+static int record(struct notify_state *ns, enum access_type at, const char *file, const char *file2)
+{
+	if(ignore_file(file) || ignore_file(file2))
+		return 0;
+	if(handle_file(at, file, file2, &ns->s->finfo) < 0) {
+		fprintf(stderr, "tup error: Failed to call handle_file on event '%s'\n", file);
+		return -1;
+	}
+	return 0;
+}
+
+static int record_path(struct notify_state *ns, enum access_type at, int dirfd, uint64_t addr)
+{
+	char path[PATH_MAX];
+	char full[PATH_MAX];
+	int rc;
+
+	rc = get_path(ns, dirfd, addr, path, full);
+	if(rc != 0)
+		return rc < 0 ? -1 : 0;
+	return record(ns, at, full, "");
+}
+
+static int do_open(int dfd, const char *path, int flags, mode_t mode, uint64_t resolve)
+{
+	struct open_how how;
+
+	if(!resolve)
+		return openat(dfd, path, flags, mode);
+	memset(&how, 0, sizeof(how));
+	how.flags = flags;
+	how.mode = mode;
+	how.resolve = resolve;
+	return syscall(SYS_openat2, dfd, path, &how, sizeof(how));
+}
+
+/* Open the file like the process asked, and tell whether we created it.
+ * Without O_EXCL there is no other way to know, so try exclusively first.
+ */
+static int open_for_process(int dfd, const char *path, int flags, mode_t mode,
+			    uint64_t resolve, int *created)
+{
+	int fd;
+
+	*created = 0;
+	if((flags & O_CREAT) && !(flags & O_EXCL)) {
+		fd = do_open(dfd, path, flags | O_EXCL, mode, resolve);
+		if(fd >= 0) {
+			*created = 1;
+			return fd;
+		}
+		if(errno != EEXIST)
+			return -1;
+		fd = do_open(dfd, path, flags & ~O_CREAT, mode, resolve);
+		/* Eg: a dangling symlink, which O_EXCL refuses to follow. */
+		if(fd < 0 && errno == ENOENT)
+			fd = do_open(dfd, path, flags, mode, resolve);
+		return fd;
+	}
+	fd = do_open(dfd, path, flags, mode, resolve);
+	if(fd >= 0 && (flags & O_CREAT))
+		*created = 1;
+	return fd;
+}
+
+/* Opens for writing are performed here and the file is handed to the process
+ * with SECCOMP_IOCTL_NOTIF_ADDFD, so that we only record writes that actually
+ * happened. Otherwise a failed open of an existing file (eg: O_EXCL, or no
+ * write permission) would look like the command overwrote it.
+ */
+static int emulate_open(struct notify_state *ns, int dirfd, uint64_t addr,
+			uint64_t flags, uint64_t mode, uint64_t resolve)
+{
+	struct seccomp_notif_addfd addfd;
+	char path[PATH_MAX];
+	char full[PATH_MAX];
+	mode_t mask = 0;
+	int created;
+	int dfd;
+	int fd;
+	int rc;
+
+	/* O_PATH doesn't open the file for anything. */
+	if(!(flags & (O_WRONLY | O_RDWR)) || (flags & O_PATH))
+		return record_path(ns, ACCESS_READ, dirfd, addr);
+	/* An anonymous file doesn't have a name to record. */
+	if((flags & O_TMPFILE) == O_TMPFILE)
+		return 0;
+
+	rc = get_path(ns, dirfd, addr, path, full);
+	if(rc != 0)
+		return rc < 0 ? -1 : 0;
+	if(ignore_file(full))
+		return 0;
+	if(flags & O_CREAT) {
+		rc = get_umask(ns, &mask);
+		if(rc != 0)
+			return rc < 0 ? -1 : 0;
+		mode &= 07777 & ~mask;
+	}
+	dfd = open_dirfd(ns, dirfd);
+	if(dfd < 0)
+		return 0;
+
+	/* A FIFO without a reader would block us rather than the process. */
+	fd = open_for_process(dfd, path, (flags & ~O_CLOEXEC) | O_CLOEXEC | O_NONBLOCK,
+			      mode, resolve, &created);
+	if(fd < 0 && errno == ENXIO && !(flags & O_NONBLOCK)) {
+		close(dfd);
+		return record(ns, ACCESS_WRITE, full, "");
+	}
+	if(fd < 0) {
+		deny(ns, errno);
+		close(dfd);
+		return 0;
+	}
+	close(dfd);
+	if(!(flags & O_NONBLOCK)) {
+		int fl = fcntl(fd, F_GETFL);
+		if(fl < 0 || fcntl(fd, F_SETFL, fl & ~O_NONBLOCK) < 0) {
+			perror("fcntl");
+			close(fd);
+			return -1;
+		}
+	}
+	if(created)
+		fix_mode(fd, NULL, mode);
+
+	memset(&addfd, 0, sizeof(addfd));
+	addfd.id = ns->req->id;
+	addfd.flags = SECCOMP_ADDFD_FLAG_SEND;
+	addfd.srcfd = fd;
+	addfd.newfd_flags = flags & O_CLOEXEC;
+	if(ioctl(ns->listener, SECCOMP_IOCTL_NOTIF_ADDFD, &addfd) < 0) {
+		if(errno == EINVAL || errno == ENOTTY) {
+			perror("ioctl(SECCOMP_IOCTL_NOTIF_ADDFD)");
+			fprintf(stderr, "tup error: The seccomp server needs SECCOMP_ADDFD_FLAG_SEND, which requires Linux 5.14 or later.\n");
+			close(fd);
+			return -1;
+		}
+		/* If the process went away there's nobody to answer, and
+		 * otherwise it gets the error (eg: EMFILE).
+		 */
+		if(errno == ENOENT) {
+			ns->responded = 1;
+		} else {
+			deny(ns, errno);
+		}
+	} else {
+		ns->responded = 1;
+	}
+	close(fd);
+
+	/* The file was opened, so it may have been created or truncated even
+	 * if the process didn't get it.
+	 */
+	return record(ns, ACCESS_WRITE, full, "");
+}
+
+static struct tmpdir *find_tmpdir(struct file_info *finfo, const char *name)
+{
+	struct tmpdir *tmpdir;
+
+	TAILQ_FOREACH(tmpdir, &finfo->tmpdir_list, list) {
+		if(strcmp(tmpdir->dirname, name) == 0)
+			return tmpdir;
+	}
+	return NULL;
+}
+
+/* Keep track of temporary directories that are moved, including the ones
+ * inside of a directory that is moved.
+ */
+static int rename_tmpdirs(struct notify_state *ns, const char *oldfull, const char *newfull)
+{
+	struct tmpdir *tmpdir;
+	int oldlen = strlen(oldfull);
+	int rc = 0;
+
+	finfo_lock(&ns->s->finfo);
+	TAILQ_FOREACH(tmpdir, &ns->s->finfo.tmpdir_list, list) {
+		char *name;
+
+		if(strncmp(tmpdir->dirname, oldfull, oldlen) != 0)
+			continue;
+		if(tmpdir->dirname[oldlen] != 0 && tmpdir->dirname[oldlen] != '/')
+			continue;
+		if(asprintf(&name, "%s%s", newfull, tmpdir->dirname + oldlen) < 0) {
+			perror("asprintf");
+			rc = -1;
+			break;
+		}
+		free(tmpdir->dirname);
+		tmpdir->dirname = name;
+	}
+	finfo_unlock(&ns->s->finfo);
+	return rc;
+}
+
+/* Perform the rename for the process, so that we only record it if it
+ * actually happened.
+ */
+static int emulate_rename(struct notify_state *ns, int olddirfd, uint64_t oldaddr,
+			  int newdirfd, uint64_t newaddr, unsigned int flags)
+{
+	char oldpath[PATH_MAX];
+	char newpath[PATH_MAX];
+	char oldfull[PATH_MAX];
+	char newfull[PATH_MAX];
+	int oldfd;
+	int newfd;
+	int rc;
+
+	rc = get_path(ns, olddirfd, oldaddr, oldpath, oldfull);
+	if(rc != 0)
+		return rc < 0 ? -1 : 0;
+	rc = get_path(ns, newdirfd, newaddr, newpath, newfull);
+	if(rc != 0)
+		return rc < 0 ? -1 : 0;
+	oldfd = open_dirfd(ns, olddirfd);
+	if(oldfd < 0)
+		return 0;
+	newfd = open_dirfd(ns, newdirfd);
+	if(newfd < 0) {
+		close(oldfd);
+		return 0;
+	}
+
+	if(flags) {
+		rc = renameat2(oldfd, oldpath, newfd, newpath, flags);
+	} else {
+		rc = renameat(oldfd, oldpath, newfd, newpath);
+	}
+	set_result(ns, rc);
+	close(oldfd);
+	close(newfd);
+	if(rc == 0) {
+		if(rename_tmpdirs(ns, oldfull, newfull) < 0)
+			return -1;
+		return record(ns, ACCESS_RENAME, oldfull, newfull);
+	}
+	return 0;
+}
+
+/* Directories made in the tree are tracked like the FUSE server's temporary
+ * directories, so the command has to remove them again unless they are
+ * excluded outputs.
+ */
+static int emulate_mkdir(struct notify_state *ns, int dirfd, uint64_t addr, uint64_t mode)
+{
+	char path[PATH_MAX];
+	char full[PATH_MAX];
+	struct tmpdir *tmpdir;
+	mode_t mask;
+	int dfd;
+	int rc;
+
+	rc = get_path(ns, dirfd, addr, path, full);
+	if(rc != 0)
+		return rc < 0 ? -1 : 0;
+	if(!tree_path(full) || ignore_file(full))
+		return 0;
+	rc = get_umask(ns, &mask);
+	if(rc != 0)
+		return rc < 0 ? -1 : 0;
+	mode &= 07777 & ~mask;
+	dfd = open_dirfd(ns, dirfd);
+	if(dfd < 0)
+		return 0;
+	rc = mkdirat(dfd, path, mode);
+	set_result(ns, rc);
+	if(rc == 0)
+		fix_mode(dfd, path, mode);
+	close(dfd);
+	if(rc < 0)
+		return 0;
+
+	tmpdir = malloc(sizeof *tmpdir);
+	if(!tmpdir) {
+		perror("malloc");
+		return -1;
+	}
+	tmpdir->dirname = strdup(full);
+	if(!tmpdir->dirname) {
+		perror("strdup");
+		free(tmpdir);
+		return -1;
+	}
+	finfo_lock(&ns->s->finfo);
+	TAILQ_INSERT_TAIL(&ns->s->finfo.tmpdir_list, tmpdir, list);
+	finfo_unlock(&ns->s->finfo);
+	return 0;
+}
+
+static int emulate_rmdir(struct notify_state *ns, int dirfd, const char *path, const char *full)
+{
+	struct tmpdir *tmpdir;
+	const char *name;
+	int dfd;
+	int rc;
+
+	name = tree_path(full);
+	if(!name || ignore_file(full))
+		return 0;
+	finfo_lock(&ns->s->finfo);
+	tmpdir = find_tmpdir(&ns->s->finfo, full);
+	finfo_unlock(&ns->s->finfo);
+	if(!tmpdir) {
+		fprintf(stderr, "tup error: Unable to rmdir a directory not created during this job: %s\n", name);
+		deny(ns, EPERM);
+		return 0;
+	}
+	dfd = open_dirfd(ns, dirfd);
+	if(dfd < 0)
+		return 0;
+	rc = unlinkat(dfd, path, AT_REMOVEDIR);
+	set_result(ns, rc);
+	close(dfd);
+	if(rc == 0) {
+		finfo_lock(&ns->s->finfo);
+		TAILQ_REMOVE(&ns->s->finfo.tmpdir_list, tmpdir, list);
+		finfo_unlock(&ns->s->finfo);
+		free(tmpdir->dirname);
+		free(tmpdir);
+	}
+	return 0;
+}
+
+static int emulate_unlink(struct notify_state *ns, int dirfd, uint64_t addr, int flags)
+{
+	char path[PATH_MAX];
+	char full[PATH_MAX];
+	int fd;
+	int rc;
+
+	rc = get_path(ns, dirfd, addr, path, full);
+	if(rc != 0)
+		return rc < 0 ? -1 : 0;
+	if(flags & AT_REMOVEDIR)
+		return emulate_rmdir(ns, dirfd, path, full);
+	fd = open_dirfd(ns, dirfd);
+	if(fd < 0)
+		return 0;
+	rc = unlinkat(fd, path, flags);
+	set_result(ns, rc);
+	close(fd);
+	if(rc == 0)
+		return record(ns, ACCESS_UNLINK, full, "");
+	return 0;
+}
+
+static int emulate_symlink(struct notify_state *ns, uint64_t targetaddr, int dirfd, uint64_t addr)
+{
+	char target[PATH_MAX];
+	char path[PATH_MAX];
+	char full[PATH_MAX];
+	int dfd;
+	int rc;
+
+	rc = read_string(ns, targetaddr, target, sizeof(target));
+	if(rc != 0)
+		return rc < 0 ? -1 : 0;
+	rc = get_path(ns, dirfd, addr, path, full);
+	if(rc != 0)
+		return rc < 0 ? -1 : 0;
+	dfd = open_dirfd(ns, dirfd);
+	if(dfd < 0)
+		return 0;
+	rc = symlinkat(target, dfd, path);
+	set_result(ns, rc);
+	close(dfd);
+	if(rc == 0)
+		return record(ns, ACCESS_WRITE, full, "");
+	return 0;
+}
+
+/* Regular files, FIFOs and sockets are outputs like any other file. Device
+ * nodes are not allowed, the same as with the FUSE server.
+ */
+static int emulate_mknod(struct notify_state *ns, int dirfd, uint64_t addr, uint64_t mode, uint64_t dev)
+{
+	char path[PATH_MAX];
+	char full[PATH_MAX];
+	mode_t type = mode & S_IFMT;
+	mode_t mask;
+	int dfd;
+	int rc;
+
+	rc = get_path(ns, dirfd, addr, path, full);
+	if(rc != 0)
+		return rc < 0 ? -1 : 0;
+	if(!tree_path(full) || ignore_file(full))
+		return 0;
+	if(type != 0 && type != S_IFREG && type != S_IFIFO && type != S_IFSOCK) {
+		fprintf(stderr, "tup error: mknod() with mode 0x%x is not permitted.\n", (unsigned int)mode);
+		deny(ns, EPERM);
+		return 0;
+	}
+	rc = get_umask(ns, &mask);
+	if(rc != 0)
+		return rc < 0 ? -1 : 0;
+	mode &= ~(mode_t)mask;
+	dfd = open_dirfd(ns, dirfd);
+	if(dfd < 0)
+		return 0;
+	rc = mknodat(dfd, path, mode, dev);
+	set_result(ns, rc);
+	if(rc == 0)
+		fix_mode(dfd, path, mode & 07777);
+	close(dfd);
+	if(rc == 0)
+		return record(ns, ACCESS_WRITE, full, "");
+	return 0;
+}
+
+static int deny_link(struct notify_state *ns, int dirfd, uint64_t addr)
+{
+	char path[PATH_MAX];
+	char full[PATH_MAX];
+	int rc;
+
+	rc = get_path(ns, dirfd, addr, path, full);
+	if(rc != 0)
+		return rc < 0 ? -1 : 0;
+	if(!tree_path(full) || ignore_file(full))
+		return 0;
+	fprintf(stderr, "tup error: hard links are not supported.\n");
+	deny(ns, EPERM);
+	return 0;
+}
+
+/* chmod(), chown(), truncate() and utimes() of a file in the tree are only
+ * allowed on the files and directories that this job created, or on things
+ * that tup doesn't track. They are left for the kernel to do, since a
+ * successful one doesn't change the dependencies.
+ */
+static int check_modify(struct notify_state *ns, const char *func, int dirfd, uint64_t addr)
+{
+	char path[PATH_MAX];
+	char full[PATH_MAX];
+	struct file_info *finfo = &ns->s->finfo;
+	struct tup_entry *match = NULL;
+	const char *name;
+	int ok;
+	int rc;
+
+	rc = get_path(ns, dirfd, addr, path, full);
+	if(rc != 0)
+		return rc < 0 ? -1 : 0;
+	name = tree_path(full);
+	if(!name || ignore_file(full) || is_hidden(full))
+		return 0;
+	finfo_lock(finfo);
+	ok = string_tree_search(&finfo->write_list.root, full, strlen(full)) != NULL ||
+		find_tmpdir(finfo, full) != NULL;
+	if(!ok && exclusion_match(stderr, &finfo->exclusion_root, finfo->exclusion_re, full, &match) < 0) {
+		finfo_unlock(finfo);
+		return -1;
+	}
+	finfo_unlock(finfo);
+	if(ok || match)
+		return 0;
+	fprintf(stderr, "tup error: Unable to %s() files not created by this job: %s\n", func, name);
+	deny(ns, EPERM);
+	return 0;
+}
+
+static int handle_syscall(struct notify_state *ns)
+{
+	const __u64 *args = ns->req->data.args;
+
+	switch(ns->req->data.nr) {
+#ifdef __NR_open
+		case __NR_open:
+			return emulate_open(ns, AT_FDCWD, args[0], args[1], args[2], 0);
+#endif
+#ifdef __NR_creat
+		case __NR_creat:
+			return emulate_open(ns, AT_FDCWD, args[0], O_CREAT | O_WRONLY | O_TRUNC, args[1], 0);
+#endif
+		case __NR_openat:
+			return emulate_open(ns, args[0], args[1], args[2], args[3], 0);
+#ifdef __NR_openat2
+		case __NR_openat2: {
+			struct open_how how;
+			ssize_t got;
+			int rc;
+
+			memset(&how, 0, sizeof(how));
+			if(args[3] < sizeof(how)) {
+				deny(ns, EINVAL);
+				return 0;
+			}
+			rc = read_mem(ns, args[2], &how, sizeof(how), &got);
+			if(rc != 0)
+				return rc < 0 ? -1 : 0;
+			if(got != sizeof(how)) {
+				deny(ns, EFAULT);
+				return 0;
+			}
+			return emulate_open(ns, args[0], args[1], how.flags, how.mode, how.resolve);
+		}
+#endif
+#ifdef __NR_stat
+		case __NR_stat:
+#endif
+#ifdef __NR_lstat
+		case __NR_lstat:
+#endif
+#ifdef __NR_stat64
+		case __NR_stat64:
+#endif
+#ifdef __NR_lstat64
+		case __NR_lstat64:
+#endif
+#ifdef __NR_access
+		case __NR_access:
+#endif
+#ifdef __NR_readlink
+		case __NR_readlink:
+#endif
+#ifdef __NR_statfs64
+		case __NR_statfs64:
+#endif
+		case __NR_statfs:
+		case __NR_execve:
+			return record_path(ns, ACCESS_READ, AT_FDCWD, args[0]);
+#ifdef __NR_newfstatat
+		case __NR_newfstatat:
+#endif
+#ifdef __NR_fstatat64
+		case __NR_fstatat64:
+#endif
+#ifdef __NR_statx
+		case __NR_statx:
+#endif
+#ifdef __NR_faccessat2
+		case __NR_faccessat2:
+#endif
+#ifdef __NR_execveat
+		case __NR_execveat:
+#endif
+		case __NR_faccessat:
+		case __NR_readlinkat:
+			return record_path(ns, ACCESS_READ, args[0], args[1]);
+#ifdef __NR_rename
+		case __NR_rename:
+			return emulate_rename(ns, AT_FDCWD, args[0], AT_FDCWD, args[1], 0);
+#endif
+#ifdef __NR_renameat
+		case __NR_renameat:
+			return emulate_rename(ns, args[0], args[1], args[2], args[3], 0);
+#endif
+#ifdef __NR_renameat2
+		case __NR_renameat2:
+			return emulate_rename(ns, args[0], args[1], args[2], args[3], args[4]);
+#endif
+#ifdef __NR_unlink
+		case __NR_unlink:
+			return emulate_unlink(ns, AT_FDCWD, args[0], 0);
+#endif
+#ifdef __NR_rmdir
+		case __NR_rmdir:
+			return emulate_unlink(ns, AT_FDCWD, args[0], AT_REMOVEDIR);
+#endif
+		case __NR_unlinkat:
+			return emulate_unlink(ns, args[0], args[1], args[2]);
+#ifdef __NR_symlink
+		case __NR_symlink:
+			return emulate_symlink(ns, args[0], AT_FDCWD, args[1]);
+#endif
+		case __NR_symlinkat:
+			return emulate_symlink(ns, args[0], args[1], args[2]);
+#ifdef __NR_mkdir
+		case __NR_mkdir:
+			return emulate_mkdir(ns, AT_FDCWD, args[0], args[1]);
+#endif
+		case __NR_mkdirat:
+			return emulate_mkdir(ns, args[0], args[1], args[2]);
+#ifdef __NR_mknod
+		case __NR_mknod:
+			return emulate_mknod(ns, AT_FDCWD, args[0], args[1], args[2]);
+#endif
+		case __NR_mknodat:
+			return emulate_mknod(ns, args[0], args[1], args[2], args[3]);
+#ifdef __NR_link
+		case __NR_link:
+			return deny_link(ns, AT_FDCWD, args[1]);
+#endif
+		case __NR_linkat:
+			return deny_link(ns, args[2], args[3]);
+		case __NR_truncate:
+			return check_modify(ns, "truncate", AT_FDCWD, args[0]);
+#ifdef __NR_chmod
+		case __NR_chmod:
+			return check_modify(ns, "chmod", AT_FDCWD, args[0]);
+#endif
+		case __NR_fchmodat:
+#ifdef __NR_fchmodat2
+		case __NR_fchmodat2:
+#endif
+			return check_modify(ns, "chmod", args[0], args[1]);
+#ifdef __NR_chown
+		case __NR_chown:
+#endif
+#ifdef __NR_lchown
+		case __NR_lchown:
+#endif
+#if defined(__NR_chown) || defined(__NR_lchown)
+			return check_modify(ns, "chown", AT_FDCWD, args[0]);
+#endif
+		case __NR_fchownat:
+			return check_modify(ns, "chown", args[0], args[1]);
+#ifdef __NR_utime
+		case __NR_utime:
+#endif
+#ifdef __NR_utimes
+		case __NR_utimes:
+#endif
+#if defined(__NR_utime) || defined(__NR_utimes)
+			return check_modify(ns, "utimens", AT_FDCWD, args[0]);
+#endif
+#ifdef __NR_futimesat
+		case __NR_futimesat:
+#endif
+		case __NR_utimensat:
+			/* With a NULL path these work on the fd itself. */
+			if(!args[1])
+				return 0;
+			return check_modify(ns, "utimens", args[0], args[1]);
+	}
+	return 0;
+}
+
+static int handle_notification(struct notify_state *ns)
+{
+	memset(ns->req, 0, notif_sizes.seccomp_notif);
+	if(ioctl(ns->listener, SECCOMP_IOCTL_NOTIF_RECV, ns->req) < 0) {
+		/* The process may have been killed before we got to it. */
+		if(errno == EINTR || errno == ENOENT)
+			return 0;
+		perror("ioctl(SECCOMP_IOCTL_NOTIF_RECV)");
+		return -1;
+	}
+
+	memset(ns->resp, 0, notif_sizes.seccomp_notif_resp);
+	ns->resp->id = ns->req->id;
+	ns->resp->flags = SECCOMP_USER_NOTIF_FLAG_CONTINUE;
+	ns->responded = 0;
+	/* Keep servicing the process tree so that it can finish, but the
+	 * job fails once we are done.
+	 */
+	if(handle_syscall(ns) < 0)
+		ns->failed = 1;
+	if(ns->responded)
+		return 0;
+
+	if(ioctl(ns->listener, SECCOMP_IOCTL_NOTIF_SEND, ns->resp) < 0) {
+		if(errno != ENOENT) {
+			perror("ioctl(SECCOMP_IOCTL_NOTIF_SEND)");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int supervise(struct server *s, int listener, pid_t pid, int *status)
+{
+	struct notify_state ns;
+	struct pollfd fds[2];
+	int pidfd;
+	int rc = -1;
+	int exited = 0;
+
+	ns.s = s;
+	ns.listener = listener;
+	ns.mem_fd = -1;
+	ns.mem_pid = 0;
+	ns.failed = 0;
+	ns.req = malloc(notif_sizes.seccomp_notif);
+	ns.resp = malloc(notif_sizes.seccomp_notif_resp);
+	if(!ns.req || !ns.resp) {
+		perror("malloc");
+		goto out;
+	}
+	pidfd = syscall(SYS_pidfd_open, pid, 0);
+	if(pidfd < 0) {
+		perror("pidfd_open");
+		goto out;
+	}
+
+	fds[0].fd = listener;
+	fds[0].events = POLLIN;
+	fds[1].fd = pidfd;
+	fds[1].events = POLLIN;
+	while(1) {
+		/* Once the shell has exited, only pick up what is already
+		 * queued. Anything it left running in the background isn't
+		 * part of the command anymore.
+		 */
+		if(poll(fds, exited ? 1 : 2, exited ? 0 : -1) < 0) {
+			if(errno == EINTR)
+				continue;
+			perror("poll");
+			goto out_close;
+		}
+		if(fds[0].revents & POLLIN) {
+			if(handle_notification(&ns) < 0)
+				goto out_close;
+			continue;
+		}
+		if(exited || fds[0].revents & (POLLHUP | POLLERR))
+			break;
+		if(fds[1].revents & POLLIN) {
+			if(waitpid(pid, status, 0) < 0) {
+				perror("waitpid");
+				goto out_close;
+			}
+			exited = 1;
+		}
+	}
+	if(!exited) {
+		if(waitpid(pid, status, 0) < 0) {
+			perror("waitpid");
+			goto out_close;
+		}
+	}
+	if(ns.failed) {
+		fprintf(stderr, "tup error: Unable to track all of the file accesses of the sub-process.\n");
+		goto out_close;
+	}
+	rc = 0;
+
+out_close:
+	close(pidfd);
+out:
+	if(ns.mem_fd >= 0)
+		close(ns.mem_fd);
+	free(ns.req);
+	free(ns.resp);
+	return rc;
+}
+
+static void sighandler(int sig)
+{
+	if(sig_quit == 0) {
+		clear_active(stderr);
+		fprintf(stderr, " *** tup: signal caught - waiting for jobs to finish.\n");
+		sig_quit = 1;
+		/* Signal the process group, in case tup was signalled
+		 * directly (just a vanilla ctrl-C at the command-line doesn't
+		 * need this, but a kill -INT <pid> does).
+		 */
+		kill(0, sig);
+	}
+}
@@ -43,6 +43,7 @@ void tup_fuse_set_parser_mode(int mode);
 int tup_fuse_server_get_dir_entries(const char *path, void *buf,
 				    fuse_fill_dir_t filler);
 void tup_fuse_fs_init(void);
+void tup_fuse_fs_quit(void);
 int tup_fs_inited(void);
 extern struct fuse_operations tup_fs_oper;
 
@@ -406,8 +406,8 @@ end:
 		return -1;
 	}
 
-	TAILQ_FOREACH_SAFE(fent, &s->finfo.write_list, list, tmp) {
-		if(strncmp(fent->filename, wintmpdir, strlen(wintmpdir)) == 0) {
+	TAILQ_FOREACH_SAFE(fent, &s->finfo.write_list.entries, list, tmp) {
+		if(strncmp(fent->name.s, wintmpdir, strlen(wintmpdir)) == 0) {
 			del_file_entry(&s->finfo.write_list, fent);
 		}
 	}
@@ -452,6 +452,14 @@ int server_unlink(void)
 	return 1;
 }
 
+int server_pipeline_safe(void)
+{
+	/* Directory access is serialized through the compat dir_mutex, which
+	 * is disabled while parsing.
+	 */
+	return 0;
+}
+
 int server_is_dead(void)
 {
 	return (event_got != -1);
@@ -609,25 +617,8 @@ static int process_depfile(struct server *s, HANDLE h)
 		}
 
 		if(event.at == ACCESS_WRITE) {
-			struct mapping *map;
-
-			map = malloc(sizeof *map);
-			if(!map) {
-				perror("malloc");
+			if(!add_map(&s->finfo, event1, event1))
 				return -1;
-			}
-			map->realname = strdup(event1);
-			if(!map->realname) {
-				perror("strdup");
-				return -1;
-			}
-			map->tmpname = strdup(event1);
-			if(!map->tmpname) {
-				perror("strdup");
-				return -1;
-			}
-			map->tent = NULL; /* This is used when saving deps */
-			TAILQ_INSERT_TAIL(&s->finfo.mapping_list, map, list);
 		}
 		if(handle_file(event.at, event1, event2, &s->finfo) < 0) {
 			fprintf(stderr, "tup error: Failed to call handle_file on event '%s'\n", event1);
@@ -65,6 +65,7 @@ static struct help {
 	{"refactor", "ref", "", "The refactor command can be used to help refactor Tupfiles. This will cause tup to run through the parsing phase, but not execute any commands. If any Tupfiles that are parsed result in changes to the database, these are reported as errors."},
 	{"monitor", NULL, "", "*LINUX ONLY* Starts the inotify-based file monitor. The monitor must scan the filesystem once and initialize watches on each directory. Then when you make changes to the files, the monitor will see them and write them directly into the database. With the monitor running, 'tup' does not need to do the initial scan, and can start constructing the build graph immediately."},
 	{"stop", NULL, "", "Kills the monitor if it is running."},
+	{"changes", NULL, "[clock]", "*LINUX ONLY* Asks the monitor which files and directories changed since the given clock, which comes from the first line of the output of a previous 'changes' command. The rest of the output lists one changed path per line, relative to the top of the tup hierarchy, or is a single '*' if the monitor can't tell (for example, if no clock was given or the monitor was restarted). The monitor must be running with the monitor.journal_size option set."},
 	{"variant", NULL, "foo.config [bar.config] [...]", "For each argument, this command creates a variant directory with tup.config symlinked to the specified config file."},
 	{"dbconfig", NULL, "", "Displays the current tup database configuration. These are internal values used by tup."},
 	{"options", NULL, "", "Displays all of the current tup options, as well as where they originated."},
@@ -230,6 +231,16 @@ int main(int argc, char **argv)
 		if(open_tup_top() < 0)
 			return -1;
 		return stop_monitor(TUP_MONITOR_SHUTDOWN);
+	} else if(strcmp(cmd, "changes") == 0) {
+		if(tup_drop_privs() < 0)
+			return 1;
+		if(find_tup_dir() < 0) {
+			fprintf(stderr, "No .tup directory found - unable to query the file monitor.\n");
+			return 1;
+		}
+		if(monitor_changes(argc, argv) < 0)
+			return 1;
+		return 0;
 	} else if(strcmp(cmd, "waitmon") == 0) {
 		if(tup_drop_privs() < 0)
 			return 1;
@@ -244,6 +255,14 @@ int main(int argc, char **argv)
 		return 0;
 	}
 
+	/* Let the monitor run the update if it is set up as a build server */
+	if(strcmp(cmd, "upd") == 0) {
+		rc = monitor_build(orig_argc, orig_argv, orig_argc - argc);
+		if(rc >= 0)
+			return rc;
+		rc = 0;
+	}
+
 	/* Pass all arguments so we capture any flags before the command */
 	if(tup_init(orig_argc, orig_argv) < 0)
 		return 1;
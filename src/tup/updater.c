@@ -41,6 +41,8 @@
 #include "estring.h"
 #include "logging.h"
 #include "luaparser.h"
+#include "fslurp.h"
+#include "memfile.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -54,12 +56,23 @@
 
 typedef int(*worker_function)(struct graph *g, struct node *n);
 
+/* Commands that run while the Tupfiles are still being parsed. */
+struct pipeline {
+	struct graph g;
+	pthread_t pid;
+	int started;
+	int rc;
+};
+
 static int check_full_deps_rebuild(void);
 static int run_scan(int do_scan);
 static struct tup_entry *get_rel_tent(struct tup_entry *base, struct tup_entry *tent, int do_mkdirs);
 static int process_config_nodes(int environ_check);
 static int process_create_nodes(void);
 static int process_update_nodes(int argc, char **argv, int *num_pruned);
+static int has_targets(int argc, char **argv);
+static int pipeline_start(struct pipeline *pl, struct graph *cg);
+static int pipeline_finish(struct pipeline *pl);
 static int check_config_todo(void);
 static int check_create_todo(void);
 static int check_update_todo(int argc, char **argv);
@@ -77,6 +90,7 @@ static int expand_command(char **res,
 			  struct tent_entries *group_sticky_root,
 			  struct tent_entries *used_groups_root);
 static int update(struct node *n);
+static int checkpoint(void);
 
 static int do_keep_going;
 static int num_jobs;
@@ -85,6 +99,13 @@ static int warnings;
 static int show_warnings;
 static int refactoring;
 static int verbose;
+static int commit_interval;
+static int commit_jobs;
+static int jobs_since_commit;
+static struct timespan commit_ts;
+static int pipeline;
+static int pipelining;
+static struct tupid_entries pipeline_failed_root = {NULL};
 
 static pthread_mutex_t db_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t display_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -148,8 +169,22 @@ int updater(int argc, char **argv, int phase)
 	num_jobs = tup_option_get_int("updater.num_jobs");
 	full_deps = tup_option_get_flag("updater.full_deps");
 	show_warnings = tup_option_get_flag("updater.warnings");
+	commit_interval = tup_option_get_int("updater.commit_interval");
+	commit_jobs = tup_option_get_int("updater.commit_jobs");
+	pipeline = tup_option_get_flag("updater.pipeline");
 	progress_init();
 
+	/* With db.memory, all phases run against an in-memory copy of the
+	 * database, which is written back to .tup/db once when we close it.
+	 */
+	if(strcmp(tup_option_get_string("db.memory"), "readonly") == 0) {
+		if(tup_db_use_memory(0) < 0)
+			return -1;
+	} else if(tup_option_get_flag("db.memory")) {
+		if(tup_db_use_memory(1) < 0)
+			return -1;
+	}
+
 	if(check_full_deps_rebuild() < 0)
 		return -1;
 
@@ -189,9 +224,19 @@ int updater(int argc, char **argv, int phase)
 		refactoring = 1;
 	}
 
-	if(run_scan(do_scan) < 0)
+	/* Commands can only run early in a full update, and we need at least
+	 * one job to spare alongside the parser.
+	 */
+	if(phase != 0 || num_jobs < 2 || has_targets(argc, argv) ||
+	   !server_pipeline_safe())
+		pipeline = 0;
+
+	if(tup_db_bulk_load_begin() < 0)
 		return -1;
 
+	if(run_scan(do_scan) < 0)
+		goto out;
+
 	if(process_config_nodes(environ_check) < 0)
 		goto out;
 	if(phase == 1) { /* Collect underpants */
@@ -204,8 +249,12 @@ int updater(int argc, char **argv, int phase)
 		rc = 0;
 		goto out;
 	}
+	if(!RB_EMPTY(&pipeline_failed_root) && !do_keep_going)
+		goto out;
 	if(process_update_nodes(argc, argv, &num_pruned) < 0)
 		goto out;
+	if(!RB_EMPTY(&pipeline_failed_root))
+		goto out;
 	if(num_pruned) {
 		tup_main_progress("Partial update complete:");
 		printf(" skipped %i commands.\n", num_pruned);
@@ -214,8 +263,11 @@ int updater(int argc, char **argv, int phase)
 	}
 	rc = 0;
 out:
+	free_tupid_tree(&pipeline_failed_root);
 	if(server_quit() < 0)
 		rc = -1;
+	if(tup_db_bulk_load_end() < 0)
+		rc = -1;
 	return rc; /* Profit! */
 }
 
@@ -486,6 +538,7 @@ int generate(int argc, char **argv)
 		remove_node(&g, n);
 	}
 	tup_lua_parser_cleanup();
+	parser_include_cache_free();
 	if(destroy_graph(&g) < 0)
 		return -1;
 
@@ -781,6 +834,7 @@ static int initialize_server_struct(struct server *s, struct tup_entry *tent)
 	s->need_namespacing = 0;
 	s->run_in_bash = 0;
 	s->streaming_mode = 0;
+	s->trust_depfile = 0;
 	if(init_file_info(&s->finfo, server_unlink()) < 0)
 		return -1;
 
@@ -789,6 +843,8 @@ static int initialize_server_struct(struct server *s, struct tup_entry *tent)
 			return -1;
 		if(tup_db_get_outputs(tent->tnode.tupid, &s->finfo.output_root, &s->finfo.exclusion_root, NULL) < 0)
 			return -1;
+		if(exclusion_compile(stderr, &s->finfo.exclusion_root, &s->finfo.exclusion_re) < 0)
+			return -1;
 	}
 	return 0;
 }
@@ -1079,6 +1135,7 @@ static int process_config_nodes(int environ_check)
 					goto err_rollback;
 				if(add_config_files(&s.finfo, n->tent, full_deps) < 0)
 					goto err_rollback;
+				cleanup_file_info(&s.finfo);
 				compat_lock_enable();
 
 				if(tup_db_unflag_config(n->tent->tnode.tupid) < 0)
@@ -1365,6 +1422,7 @@ err_out:
 static int process_create_nodes(void)
 {
 	struct graph g;
+	struct pipeline pl;
 	struct node *n;
 	struct node *tmp;
 	struct tent_tree *tt;
@@ -1521,12 +1579,23 @@ static int process_create_nodes(void)
 	if(tup_lua_parser_new_state() < 0) {
 		return -1;
 	}
+	pl.started = 0;
+	if(pipeline) {
+		if(pipeline_start(&pl, &g) < 0)
+			return -1;
+	}
 	/* create_work must always use only 1 thread since no locking is done */
 	compat_lock_disable();
 	rc = execute_graph(&g, 0, 1, create_work);
 	compat_lock_enable();
+	if(pl.started) {
+		int plrc = pipeline_finish(&pl);
+		if(plrc < rc)
+			rc = plrc;
+	}
 
 	tup_lua_parser_cleanup();
+	parser_include_cache_free();
 
 	if(rc == 0) {
 		if(g.gen_delete_root.count) {
@@ -1605,6 +1674,252 @@ out_destroy:
 	return 0;
 }
 
+static int has_targets(int argc, char **argv)
+{
+	int x;
+	int dashdash = 0;
+
+	for(x=0; x<argc; x++) {
+		if(!dashdash) {
+			if(strcmp(argv[x], "--") == 0) {
+				dashdash = 1;
+			}
+			if(argv[x][0] == '-')
+				continue;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+static int count_cb(void *arg, struct tup_entry *tent)
+{
+	int *count = arg;
+	if(tent) {}
+	(*count)++;
+	return 0;
+}
+
+static int mark_downstream(struct node *n, struct tent_entries *root)
+{
+	struct edge *e;
+
+	if(tent_tree_search(root, n->tent) != NULL)
+		return 0;
+	if(tent_tree_add(root, n->tent) < 0)
+		return -1;
+	LIST_FOREACH(e, &n->edges, list) {
+		if(mark_downstream(e->dest, root) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Keep every command in the graph except those in drop_root. */
+static int prune_commands(struct graph *g, struct tent_entries *drop_root)
+{
+	struct tent_entries keep_root = TENT_ENTRIES_INITIALIZER;
+	struct node *n;
+	int num_pruned;
+	int rc;
+
+	TAILQ_FOREACH(n, &g->node_list, list) {
+		if(n->tent->type == TUP_NODE_CMD &&
+		   tent_tree_search(drop_root, n->tent) == NULL) {
+			if(tent_tree_add(&keep_root, n->tent) < 0)
+				return -1;
+		}
+	}
+	rc = prune_graph_commands(g, &keep_root, &num_pruned);
+	free_tent_tree(&keep_root);
+	return rc;
+}
+
+static int in_parse(struct tent_entries *parse_root, tupid_t dt)
+{
+	return tent_tree_search_tupid(parse_root, dt) != NULL;
+}
+
+/* A command can only run before parsing is finished if nothing the parser is
+ * about to do could change it: it doesn't live in a directory being parsed,
+ * none of its inputs come from (or sit in) such a directory or a group, and
+ * none of its outputs were read by one of those Tupfiles last time.
+ */
+static int pipeline_unsafe(struct graph *cg, struct node *n,
+			   struct tent_entries *parse_root,
+			   struct tent_entries *parse_input_root)
+{
+	struct tent_entries input_root = TENT_ENTRIES_INITIALIZER;
+	struct tent_entries normal_root = TENT_ENTRIES_INITIALIZER;
+	struct tent_tree *tt;
+	struct edge *e;
+	int unsafe = 0;
+
+	if(in_parse(parse_root, n->tent->dt) || is_transient_tent(n->tent))
+		return 1;
+	LIST_FOREACH(e, &n->edges, list) {
+		struct tup_entry *tent = e->dest->tent;
+		if(in_parse(parse_root, tent->dt) ||
+		   in_parse(parse_root, tent->srcid) ||
+		   tent_tree_search(parse_input_root, tent) != NULL ||
+		   tent_tree_search(&cg->gen_delete_root, tent) != NULL)
+			return 1;
+	}
+
+	if(tup_db_get_inputs(n->tent->tnode.tupid, &input_root, NULL, NULL) < 0)
+		return -1;
+	if(tup_db_get_inputs(n->tent->tnode.tupid, NULL, &normal_root, NULL) < 0)
+		return -1;
+	RB_FOREACH(tt, tent_entries, &normal_root) {
+		if(tent_tree_add_dup(&input_root, tt->tent) < 0)
+			return -1;
+	}
+	RB_FOREACH(tt, tent_entries, &input_root) {
+		struct tup_entry *tent = tt->tent;
+		if(tent->type == TUP_NODE_GROUP ||
+		   in_parse(parse_root, tent->dt) ||
+		   (tent->type == TUP_NODE_GENERATED && in_parse(parse_root, tent->srcid)) ||
+		   tent_tree_search(&cg->gen_delete_root, tent) != NULL) {
+			unsafe = 1;
+			break;
+		}
+	}
+	free_tent_tree(&input_root);
+	free_tent_tree(&normal_root);
+	return unsafe;
+}
+
+static void *run_pipeline(void *arg)
+{
+	struct pipeline *pl = arg;
+
+	pl->rc = execute_graph(&pl->g, do_keep_going, num_jobs - 1, update_work);
+	return NULL;
+}
+
+static int pipeline_start(struct pipeline *pl, struct graph *cg)
+{
+	struct tent_entries parse_root = TENT_ENTRIES_INITIALIZER;
+	struct tent_entries parse_input_root = TENT_ENTRIES_INITIALIZER;
+	struct tent_entries unsafe_root = TENT_ENTRIES_INITIALIZER;
+	struct node *n;
+	int transients = 0;
+
+	/* Transient files are removed as soon as their last user finishes,
+	 * which is left to the normal update phase.
+	 */
+	if(tup_db_select_node_by_flags(count_cb, &transients, TUP_FLAGS_TRANSIENT) < 0)
+		return -1;
+	if(transients)
+		return 0;
+
+	TAILQ_FOREACH(n, &cg->node_list, list) {
+		struct tent_entries input_root = TENT_ENTRIES_INITIALIZER;
+		struct tent_tree *tt;
+
+		if(n->tent->type != TUP_NODE_DIR)
+			continue;
+		if(tent_tree_add(&parse_root, n->tent) < 0)
+			return -1;
+		if(tup_db_get_inputs(n->tent->tnode.tupid, NULL, &input_root, NULL) < 0)
+			return -1;
+		RB_FOREACH(tt, tent_entries, &input_root) {
+			if(tt->tent->type == TUP_NODE_GENERATED)
+				if(tent_tree_add_dup(&parse_input_root, tt->tent) < 0)
+					return -1;
+		}
+		free_tent_tree(&input_root);
+	}
+
+	if(create_graph(&pl->g, TUP_NODE_CMD) < 0)
+		return -1;
+	if(tup_db_select_node_by_flags(build_graph_non_transient_cb, &pl->g, TUP_FLAGS_MODIFY) < 0)
+		return -1;
+	if(build_graph(&pl->g) < 0)
+		return -1;
+
+	TAILQ_FOREACH(n, &pl->g.node_list, list) {
+		int rc;
+
+		if(n->tent->type != TUP_NODE_CMD)
+			continue;
+		rc = pipeline_unsafe(cg, n, &parse_root, &parse_input_root);
+		if(rc < 0)
+			return -1;
+		if(rc)
+			if(mark_downstream(n, &unsafe_root) < 0)
+				return -1;
+	}
+	/* Building the graph cached each command's stickies, but the parser
+	 * may still delete some of those inputs.
+	 */
+	TAILQ_FOREACH(n, &pl->g.node_list, list) {
+		if(n->tent->type == TUP_NODE_CMD)
+			tup_db_release_stickies(n->tent);
+	}
+	free_tent_tree(&parse_root);
+	free_tent_tree(&parse_input_root);
+
+	if(prune_commands(&pl->g, &unsafe_root) < 0)
+		return -1;
+	free_tent_tree(&unsafe_root);
+	log_graph(&pl->g, "pipeline");
+
+	if(!pl->g.num_nodes) {
+		if(destroy_graph(&pl->g) < 0)
+			return -1;
+		return 0;
+	}
+
+	tup_show_message("Executing commands while parsing...\n");
+	if(server_init(SERVER_UPDATER_MODE) < 0)
+		return -1;
+	warnings = 0;
+	pipelining = 1;
+	parser_display_mutex(&display_mutex);
+	start_progress(cg->num_nodes + pl->g.num_nodes, -1, num_jobs);
+	if(pthread_create(&pl->pid, NULL, run_pipeline, pl) != 0) {
+		perror("pthread_create");
+		return -1;
+	}
+	pl->started = 1;
+	return 0;
+}
+
+static int pipeline_finish(struct pipeline *pl)
+{
+	struct node *n;
+	int rc = 0;
+
+	pthread_join(pl->pid, NULL);
+	clear_progress();
+	parser_display_mutex(NULL);
+	pipelining = 0;
+
+	if(warnings) {
+		fprintf(stderr, "tup warning: Update resulted in %i warning%s\n", warnings, warnings == 1 ? "" : "s");
+	}
+	if(pl->rc == -2) {
+		fprintf(stderr, "tup error: execute_graph returned %i - abort. This is probably a bug.\n", pl->rc);
+		rc = -2;
+	} else if(pl->rc < 0) {
+		/* Failed jobs are left on the node_list. Remember them so the
+		 * update phase doesn't run them (or anything after them) a
+		 * second time. Commands that never started won't show up in
+		 * the progress bar either.
+		 */
+		skip_remaining();
+		TAILQ_FOREACH(n, &pl->g.node_list, list) {
+			if(n->tent->type == TUP_NODE_CMD)
+				if(tupid_tree_add_dup(&pipeline_failed_root, n->tnode.tupid) < 0)
+					rc = -2;
+		}
+	}
+	if(destroy_graph(&pl->g) < 0)
+		return -2;
+	return rc;
+}
+
 static int process_update_nodes(int argc, char **argv, int *num_pruned)
 {
 	struct graph g;
@@ -1628,6 +1943,24 @@ static int process_update_nodes(int argc, char **argv, int *num_pruned)
 	if(prune_graph(&g, argc, argv, num_pruned, GRAPH_PRUNE_GENERATED, verbose) < 0)
 		return -1;
 
+	/* With keep-going, skip anything that already failed while parsing,
+	 * along with everything that depends on it.
+	 */
+	if(!RB_EMPTY(&pipeline_failed_root)) {
+		struct tent_entries drop_root = TENT_ENTRIES_INITIALIZER;
+		struct tupid_tree *tt;
+
+		RB_FOREACH(tt, tupid_entries, &pipeline_failed_root) {
+			struct node *n = find_node(&g, tt->tupid);
+			if(n)
+				if(mark_downstream(n, &drop_root) < 0)
+					return -1;
+		}
+		if(prune_commands(&g, &drop_root) < 0)
+			return -1;
+		free_tent_tree(&drop_root);
+	}
+
 	log_graph(&g, "update");
 	if(g.num_nodes) {
 		tup_main_progress("Executing Commands...\n");
@@ -1646,6 +1979,8 @@ static int process_update_nodes(int argc, char **argv, int *num_pruned)
 	if(server_init(SERVER_UPDATER_MODE) < 0) {
 		return -1;
 	}
+	jobs_since_commit = 0;
+	timespan_start(&commit_ts);
 	rc = execute_graph(&g, do_keep_going, num_jobs, update_work);
 	if(warnings) {
 		fprintf(stderr, "tup warning: Update resulted in %i warning%s\n", warnings, warnings == 1 ? "" : "s");
@@ -1893,7 +2228,11 @@ static int execute_graph(struct graph *g, int keep_going, int jobs,
 	if(pop_node(g, root) < 0)
 		return -2;
 
-	start_progress(g->num_nodes, g->total_mtime, jobs);
+	/* While commands are pipelined with the parser, both graphs share
+	 * the progress bar.
+	 */
+	if(!pipelining)
+		start_progress(g->num_nodes, g->total_mtime, jobs);
 	/* Keep going as long as:
 	 * 1) There is work to do (plist is not empty)
 	 * 2) The server hasn't been killed
@@ -1974,7 +2313,8 @@ check_empties:
 			}
 		}
 	}
-	clear_progress();
+	if(!pipelining)
+		clear_progress();
 	if(server_is_dead()) {
 		fprintf(stderr, " *** tup: Remaining nodes skipped due to caught signal.\n");
 	} else if(failed) {
@@ -2054,6 +2394,10 @@ static void *run_thread(void *arg)
 static int create_work(struct graph *g, struct node *n)
 {
 	int rc = 0;
+
+	/* Commands running in the pipeline need the database too. */
+	if(pipelining)
+		pthread_mutex_lock(&db_mutex);
 	if(n->tent->type == TUP_NODE_DIR) {
 		if(tup_entry_variant(n->tent)->enabled) {
 			if(n->already_used) {
@@ -2061,7 +2405,9 @@ static int create_work(struct graph *g, struct node *n)
 			} else {
 				rc = parse(n, g, NULL, refactoring, 1, full_deps);
 			}
+			pthread_mutex_lock(&display_mutex);
 			show_progress(-1, TUP_NODE_DIR);
+			pthread_mutex_unlock(&display_mutex);
 		}
 	} else if(n->tent->type == TUP_NODE_VAR ||
 		  n->tent->type == TUP_NODE_FILE ||
@@ -2077,6 +2423,8 @@ static int create_work(struct graph *g, struct node *n)
 	}
 	if(tup_db_unflag_create(n->tnode.tupid) < 0)
 		rc = -1;
+	if(pipelining)
+		pthread_mutex_unlock(&db_mutex);
 
 	return rc;
 }
@@ -2148,6 +2496,9 @@ static int update_work(struct graph *g, struct node *n)
 			if(is_transient_tent(n->tent))
 				if(tup_db_unflag_transient(n->tnode.tupid) < 0)
 					rc = -1;
+			if(rc == 0 && !n->skip)
+				if(checkpoint() < 0)
+					rc = -1;
 			pthread_mutex_unlock(&db_mutex);
 		}
 	} else {
@@ -2187,6 +2538,37 @@ static int update_work(struct graph *g, struct node *n)
 	return rc;
 }
 
+/* Commit the results of the jobs that have finished so far, so that a long
+ * update doesn't build up one enormous transaction, and so an interrupted
+ * update keeps the dependency information of its completed jobs. The commands
+ * that haven't run yet are still in the modify list, so the next update picks
+ * up where this one left off. Must be called with the db_mutex held.
+ */
+static int checkpoint(void)
+{
+	/* Pipelined commands share the transaction with the parser, which
+	 * must not be committed halfway through.
+	 */
+	if(pipelining)
+		return 0;
+	jobs_since_commit++;
+	timespan_end(&commit_ts);
+	if(commit_jobs && jobs_since_commit >= commit_jobs)
+		goto do_commit;
+	if(commit_interval && timespan_seconds(&commit_ts) >= commit_interval)
+		goto do_commit;
+	return 0;
+
+do_commit:
+	if(tup_db_commit() < 0)
+		return -1;
+	if(tup_db_begin() < 0)
+		return -1;
+	jobs_since_commit = 0;
+	timespan_start(&commit_ts);
+	return 0;
+}
+
 static int generate_work(struct graph *g, struct node *n)
 {
 	char *expanded_name = NULL;
@@ -2563,6 +2945,143 @@ static int mark_transient_outputs(struct node *n)
 	return 0;
 }
 
+static int depfile_entry_path(char *dest, int len, struct tup_entry *tent)
+{
+	dest[0] = '.';
+	if(snprint_tup_entry(dest + 1, len - 1, tent) >= len - 1) {
+		fprintf(stderr, "tup error: string size too small in depfile_entry_path\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int ends_with_d(const char *s)
+{
+	int len = strlen(s);
+	return len > 2 && strcmp(s + len - 2, ".d") == 0;
+}
+
+/* Parse a Makefile-style depfile as written by gcc/clang with -MD. Everything
+ * after the ':' in a rule is a prerequisite, and is added as a read relative
+ * to the command's directory. Targets (including the phony targets from -MP)
+ * are skipped, since the outputs are already known.
+ */
+static int parse_depfile(struct server *s, struct tup_entry *dtent, char *p, char *end)
+{
+	int in_prereqs = 0;
+
+	while(p < end) {
+		char *word;
+		char *out;
+		int newline = 0;
+		int len;
+
+		if(*p == ' ' || *p == '\t' || *p == '\r') {
+			p++;
+			continue;
+		}
+		if(*p == '\n') {
+			in_prereqs = 0;
+			p++;
+			continue;
+		}
+		if(*p == '\\' && p + 1 < end && p[1] == '\n') {
+			p += 2;
+			continue;
+		}
+		if(*p == '\\' && p + 2 < end && p[1] == '\r' && p[2] == '\n') {
+			p += 3;
+			continue;
+		}
+
+		word = out = p;
+		while(p < end) {
+			if(*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+				break;
+			if(*p == '\\' && p + 1 < end) {
+				if(p[1] == '\n' || p[1] == '\r')
+					break;
+				if(p[1] == ' ' || p[1] == '#') {
+					p++;
+				}
+			} else if(*p == '$' && p + 1 < end && p[1] == '$') {
+				p++;
+			}
+			*out = *p;
+			out++;
+			p++;
+		}
+		if(p < end) {
+			if(*p == '\n')
+				newline = 1;
+			if(*p != '\\')
+				p++;
+		}
+		*out = 0;
+		len = out - word;
+
+		if(!in_prereqs) {
+			if(len > 0 && word[len-1] == ':')
+				in_prereqs = 1;
+		} else if(len > 0) {
+			if(handle_file_dtent(ACCESS_READ, dtent, word, &s->finfo) < 0)
+				return -1;
+		}
+		if(newline)
+			in_prereqs = 0;
+	}
+	return 0;
+}
+
+/* For commands with the ^d flag, the sub-process was not monitored. Its
+ * outputs are verified to exist, and its inputs come from the depfile that
+ * the compiler wrote as one of the declared outputs.
+ */
+static int ingest_depfile(FILE *f, struct server *s, struct tup_entry *tent)
+{
+	struct tent_tree *tt;
+	struct tup_entry *depfile_tent = NULL;
+	char path[PATH_MAX];
+	struct buf b;
+	int fd;
+	int rc;
+
+	RB_FOREACH(tt, tent_entries, &s->finfo.output_root) {
+		struct stat st;
+
+		if(depfile_entry_path(path, sizeof(path), tt->tent) < 0)
+			return -1;
+		if(fstatat(tup_top_fd(), path, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+			if(handle_file(ACCESS_WRITE, path, "", &s->finfo) < 0)
+				return -1;
+		}
+		if(!depfile_tent && ends_with_d(tt->tent->name.s))
+			depfile_tent = tt->tent;
+	}
+	if(!depfile_tent) {
+		fprintf(f, "tup error: Command ID=%lli uses the ^d flag, but none of its outputs is a depfile ending in '.d'. Add the compiler's depfile (eg: from gcc -MD) as an output.\n", tent->tnode.tupid);
+		return -1;
+	}
+
+	if(depfile_entry_path(path, sizeof(path), depfile_tent) < 0)
+		return -1;
+	fd = openat(tup_top_fd(), path, O_RDONLY);
+	if(fd < 0) {
+		fprintf(f, "tup error: Command ID=%lli uses the ^d flag, but the depfile '%s' was not created: %s\n", tent->tnode.tupid, path, strerror(errno));
+		return -1;
+	}
+	if(fslurp_null(fd, &b) < 0) {
+		fprintf(f, "tup error: Unable to read depfile '%s'\n", path);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	rc = parse_depfile(s, tent->parent, b.s, b.s + b.len);
+	free(b.s);
+	return rc;
+}
+
 static int process_output(struct server *s, struct node *n,
 			  struct timespan *ts,
 			  const char *expanded_name,
@@ -2582,16 +3101,17 @@ static int process_output(struct server *s, struct node *n,
 	else
 		warning_dest = NULL;
 
-	f = tmpfile();
+	f = memfile_open("tup-messages");
 	if(!f) {
 		show_result(tent, 1, NULL, NULL, 1);
-		perror("tmpfile");
 		fprintf(stderr, "tup error: Unable to open the error log for writing.\n");
 		return -1;
 	}
 	if(s->exited) {
 		if(s->exit_status == 0) {
-			if(write_files(f, tent->tnode.tupid, &s->finfo, warning_dest, CHECK_SUCCESS, full_deps, tup_entry_vardt(tent), &important_link_removed) == 0) {
+			if(s->trust_depfile && ingest_depfile(f, s, tent) < 0) {
+				/* Error message is already in f */
+			} else if(write_files(f, tent->tnode.tupid, &s->finfo, warning_dest, CHECK_SUCCESS, full_deps, tup_entry_vardt(tent), &important_link_removed) == 0) {
 				timespan_end(ts);
 				show_ts = ts;
 				ms.tv_sec = timespan_milliseconds(ts);
@@ -2908,6 +3428,7 @@ static int update(struct node *n)
 	int use_server = 0;
 	int remove_transients = 0;
 	int streaming_mode = 0;
+	int trust_depfile = 0;
 	int is_variant;
 
 	timespan_start(&ts);
@@ -2933,6 +3454,9 @@ static int update(struct node *n)
 				case 's':
 					streaming_mode = 1;
 					break;
+				case 'd':
+					trust_depfile = 1;
+					break;
 				default:
 					pthread_mutex_lock(&display_mutex);
 					show_result(n->tent, 1, NULL, NULL, 1);
@@ -2964,6 +3488,14 @@ static int update(struct node *n)
 
 	pthread_mutex_lock(&db_mutex);
 	is_variant = !tup_entry_variant(n->tent->parent)->root_variant;
+	if(is_variant && trust_depfile) {
+		pthread_mutex_lock(&display_mutex);
+		show_result(n->tent, 1, NULL, NULL, 1);
+		fprintf(stderr, "tup error: The ^d flag is not supported in a variant, since the command would run in the source directory.\n");
+		pthread_mutex_unlock(&display_mutex);
+		pthread_mutex_unlock(&db_mutex);
+		goto err_close_dfd;
+	}
 	if(is_variant) {
 		srcdfd = tup_entry_open(variant_tent_to_srctent(n->tent->parent));
 		if(srcdfd < 0) {
@@ -2980,6 +3512,7 @@ static int update(struct node *n)
 		s.need_namespacing = need_namespacing;
 		s.run_in_bash = run_in_bash;
 		s.streaming_mode = streaming_mode;
+		s.trust_depfile = trust_depfile;
 	}
 	if(rc == 0)
 		rc = tup_db_get_environ(&s.finfo.sticky_root, &s.finfo.normal_root, &newenv);
@@ -0,0 +1,15 @@
+#! /bin/sh -e
+
+# Touch every Tupfile without changing it, as a git checkout round-trip would.
+echo 'CFLAGS = -Wall' > Tuprules.tup
+for i in `seq 1 $1`; do
+	mkdir dir$i
+	echo "void foo$i(void) {}" > dir$i/foo$i.c
+	cat > dir$i/Tupfile << HERE
+include_rules
+: foreach *.c |> gcc \$(CFLAGS) -c %f -o %o |> %B.o
+HERE
+done
+tup upd
+seq 1 $1 | sed 's/^/dir/; s/$/\/Tupfile/' | xargs touch
+tup upd
@@ -0,0 +1,15 @@
+#! /bin/sh -e
+
+# Touch the Tuprules.tup that every directory includes without changing it.
+echo 'CFLAGS = -Wall' > Tuprules.tup
+for i in `seq 1 $1`; do
+	mkdir dir$i
+	echo "void foo$i(void) {}" > dir$i/foo$i.c
+	cat > dir$i/Tupfile << HERE
+include_rules
+: foreach *.c |> gcc \$(CFLAGS) -c %f -o %o |> %B.o
+HERE
+done
+tup upd
+touch Tuprules.tup
+tup upd
@@ -0,0 +1,17 @@
+#! /bin/sh -e
+
+# Parse many directories that all include the same Tuprules.tup.
+for i in `seq 1 50`; do
+	echo "CFLAGS_$i = -DFOO$i" >> Tuprules.tup
+	echo "CFLAGS += \$(CFLAGS_$i)" >> Tuprules.tup
+	echo "!cc$i = |> gcc \$(CFLAGS) -c %f -o %o |> %B.o" >> Tuprules.tup
+done
+for i in `seq 1 $1`; do
+	mkdir dir$i
+	touch dir$i/foo$i.c
+	cat > dir$i/Tupfile << HERE
+include_rules
+: foreach *.c |> !cc1 |>
+HERE
+done
+tup parse
@@ -0,0 +1,17 @@
+#! /bin/sh -e
+
+# Time how long it takes to check a command's read list against many
+# exclusion patterns. None of the patterns match, so every read has to be
+# rejected by all of them.
+for i in `seq 1 $1`; do
+	echo "#include \"foo$i.h\"" >> foo.c
+	touch foo$i.h
+done
+exclusions=""
+for i in `seq 1 50`; do
+	exclusions="$exclusions ^/nonexistent$i/ ^\\.tmp$i\$"
+done
+cat > Tupfile << HERE
+: foo.c |> gcc -c %f -o %o |> foo.o $exclusions
+HERE
+tup
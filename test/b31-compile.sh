@@ -0,0 +1,24 @@
+#! /bin/sh -e
+
+# Time a compile-heavy build, where most of the work is in the commands and
+# their file accesses. This is mostly useful to compare the servers: run it
+# with tup built for each TUP_SERVER on the same checkout.
+for i in `seq 1 20`; do
+	echo "#include <stdio.h>" > hdr$i.h
+	echo "#include <stdlib.h>" >> hdr$i.h
+	echo "#include <string.h>" >> hdr$i.h
+	echo "int hdr$i(int x);" >> hdr$i.h
+done
+for i in `seq 1 $1`; do
+	for j in `seq 1 20`; do
+		echo "#include \"hdr$j.h\"" >> $i.c
+	done
+	echo "int foo$i(void) {return hdr1($i);}" >> $i.c
+done
+echo "int hdr1(int x) {return x;}" >> 1.c
+echo "int main(void) {return 0;}" >> 1.c
+cat > Tupfile << HERE
+: foreach *.c |> gcc -c %f -o %o |> %B.o
+: *.o |> gcc %f -o %o |> prog.exe
+HERE
+tup
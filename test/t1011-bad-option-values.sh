@@ -37,6 +37,12 @@ keep_going = 3
 HERE
 update_fail_msg "Invalid value '3' for option 'updater.keep_going' - expected a boolean value {0|false|no|1|true|yes}"
 
+cat > .tup/options << HERE
+[db]
+mmap_size = -1
+HERE
+update_fail_msg "Invalid value '-1' for option 'db.mmap_size' - expected non-negative number (0, 1, 2, etc)"
+
 # Make sure all valid values work.
 cat > .tup/options << HERE
 [display]
@@ -50,6 +56,10 @@ num_jobs = 3
 keep_going = 0
 full_deps = false
 warnings = true
+
+[db]
+cache_size = 64
+mmap_size = 256
 HERE
 update
 
@@ -0,0 +1,60 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2024  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Make sure the in-memory database mode writes its results back to .tup/db,
+# and that the readonly mode does not.
+. ./tup.sh
+
+cat > .tup/options << HERE
+[db]
+memory = 1
+HERE
+
+cat > Tupfile << HERE
+: foreach *.c |> gcc -c %f -o %o |> %B.o
+HERE
+echo 'int foo(void) {return 0;}' > foo.c
+update
+check_exist foo.o
+tup_dep_exist . foo.c . 'gcc -c foo.c -o foo.o'
+check_not_exist bar.o
+
+cat > .tup/options << HERE
+[db]
+memory = readonly
+HERE
+echo 'int bar(void) {return 0;}' > bar.c
+update
+check_exist bar.o
+tup_object_no_exist . 'gcc -c bar.c -o bar.o'
+rm bar.o
+
+cat > .tup/options << HERE
+[db]
+memory = 0
+HERE
+update
+tup_dep_exist . bar.c . 'gcc -c bar.c -o bar.o'
+
+cat > .tup/options << HERE
+[db]
+memory = maybe
+HERE
+update_fail_msg "Invalid value 'maybe' for option 'db.memory'"
+
+eotup
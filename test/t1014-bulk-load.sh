@@ -0,0 +1,61 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2024  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+# The first build runs in bulk-load mode, which loads every node once. Make
+# sure the following incremental update still sees the results.
+. ./tup.sh
+
+mkdir sub
+cat > Tupfile << HERE
+: foreach *.c |> gcc -c %f -o %o |> %B.o
+: *.o |> gcc %f -o %o |> prog.exe
+HERE
+cat > sub/Tupfile << HERE
+: foreach *.c |> gcc -c %f -o %o |> %B.o
+HERE
+echo 'int main(void) {return 0;}' > foo.c
+echo '#include "missing.h"' > sub/bar.c
+touch sub/missing.h
+
+tup --debug-sql upd > .sql.txt 2>&1
+if [ "`grep -c 'from node where type=? or type=? or type=? or type=?' .sql.txt`" != "1" ]; then
+	echo "Error: Existing nodes should be loaded exactly once in a bulk load." 1>&2
+	exit 1
+fi
+if ! grep 'from node where not (type=?' .sql.txt > /dev/null; then
+	echo "Error: The first build should run in bulk-load mode." 1>&2
+	exit 1
+fi
+check_exist foo.o prog.exe sub/bar.o
+
+echo 'int x;' > baz.c
+rm sub/missing.h
+echo 'int y;' > sub/bar.c
+tup --debug-sql upd > .sql.txt 2>&1
+if grep 'from node where not (type=?' .sql.txt > /dev/null; then
+	echo "Error: An incremental update should not run in bulk-load mode." 1>&2
+	exit 1
+fi
+check_exist foo.o baz.o prog.exe sub/bar.o
+tup_dep_exist . baz.o . 'gcc baz.o foo.o -o prog.exe'
+
+rm baz.c
+update
+check_not_exist baz.o
+tup_object_exist . 'gcc foo.o -o prog.exe'
+
+eotup
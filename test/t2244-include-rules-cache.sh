@@ -0,0 +1,77 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2024  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Tuprules.tup files are evaluated once per parse and shared between
+# directories. Make sure each directory still sees the right $(TUP_CWD),
+# variables, !-macros, node-variables, and dependencies.
+
+. ./tup.sh
+
+mkdir -p a/sub b/sub c
+cat > Tuprules.tup << HERE
+CFLAGS = -Wall
+CFLAGS += -I\$(TUP_CWD)/include
+&root = include
+!cc = |> gcc \$(CFLAGS) -c %f -o %o |> %B.o
+ifeq (@(DEBUG),y)
+CFLAGS += -g
+endif
+.gitignore
+HERE
+cat > a/Tuprules.tup << HERE
+CFLAGS += -DA
+HERE
+for i in a a/sub b b/sub; do
+	cat > $i/Tupfile << HERE
+include_rules
+: foreach *.c |> !cc |>
+: |> echo &(root) > %o |> root.txt
+HERE
+	touch $i/foo.c
+done
+cat > c/Tupfile << HERE
+CFLAGS = -O2
+include_rules
+: foreach *.c |> !cc |>
+HERE
+touch c/foo.c
+mkdir include
+update
+
+tup_object_exist a 'gcc -Wall -I../include -DA -c foo.c -o foo.o'
+tup_object_exist a/sub 'gcc -Wall -I../../include -DA -c foo.c -o foo.o'
+tup_object_exist b 'gcc -Wall -I../include -c foo.c -o foo.o'
+tup_object_exist b/sub 'gcc -Wall -I../../include -c foo.c -o foo.o'
+tup_object_exist c 'gcc -Wall -I../include -c foo.c -o foo.o'
+tup_object_exist a 'echo ../include > root.txt'
+tup_object_exist b/sub 'echo ../../include > root.txt'
+check_exist a/.gitignore a/sub/.gitignore b/.gitignore b/sub/.gitignore c/.gitignore
+
+# Every directory still depends on the shared Tuprules.tup and the @-variable.
+varsetall DEBUG=y
+update
+tup_object_exist a/sub 'gcc -Wall -I../../include -g -DA -c foo.c -o foo.o'
+tup_object_exist b 'gcc -Wall -I../include -g -c foo.c -o foo.o'
+
+sed -i 's/-Wall/-W/' Tuprules.tup
+update
+tup_object_exist a 'gcc -W -I../include -g -DA -c foo.c -o foo.o'
+tup_object_exist b/sub 'gcc -W -I../../include -g -c foo.c -o foo.o'
+tup_object_exist c 'gcc -W -I../include -g -c foo.c -o foo.o'
+
+eotup
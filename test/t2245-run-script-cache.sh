@@ -0,0 +1,195 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2024  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+# The output of a run-script is re-used when the Tupfile is re-parsed but
+# none of the script's inputs have changed.
+. ./tup.sh
+check_no_windows run-script
+
+cat > gen.sh << HERE
+#! /bin/sh
+echo "gen.sh ran" 1>&2
+for i in *.c; do
+	echo ": \$i |> gcc -c %f -o %o |> %B.o"
+done
+HERE
+chmod +x gen.sh
+cat > Tupfile << HERE
+run ./gen.sh
+HERE
+touch foo.c bar.c
+# Created up front so that it isn't a new file in the directory listing.
+touch .output.txt
+update
+check_exist foo.o bar.o
+
+cat >> Tupfile << HERE
+: |> touch %o |> out.txt
+HERE
+tup parse > .output.txt 2>&1
+if grep 'gen.sh ran' .output.txt > /dev/null; then
+	echo "Error: gen.sh should not run when its inputs are unchanged." 1>&2
+	exit 1
+fi
+update
+check_exist foo.o bar.o out.txt
+tup_dep_exist . gen.sh 0 .
+
+# A new file shows up in the directory listing that the script sees.
+touch baz.c
+tup parse > .output.txt 2>&1
+if ! grep 'gen.sh ran' .output.txt > /dev/null; then
+	echo "Error: gen.sh should run when a file is added." 1>&2
+	exit 1
+fi
+update
+check_exist foo.o bar.o baz.o
+
+# Changing the script itself runs it again.
+cat > gen.sh << HERE
+#! /bin/sh
+echo "gen.sh ran" 1>&2
+echo ": foo.c |> gcc -c %f -o %o |> %B.o"
+HERE
+tup parse > .output.txt 2>&1
+if ! grep 'gen.sh ran' .output.txt > /dev/null; then
+	echo "Error: gen.sh should run when it is modified." 1>&2
+	exit 1
+fi
+update
+check_exist foo.o
+check_not_exist bar.o baz.o
+
+
+check_ran()
+{
+	if ! grep "$1 ran" .output.txt > /dev/null; then
+		echo "Error: $1 should run $2." 1>&2
+		exit 1
+	fi
+}
+
+# The script sees the outputs of the rules above it, so renaming one of them
+# runs the script again.
+mkdir gen
+cat > gen/copy.sh << HERE
+#! /bin/sh
+echo "copy.sh ran" 1>&2
+for i in *.gen; do
+	echo ": \$i |> cp %f %o |> %B.copy"
+done
+HERE
+chmod +x gen/copy.sh
+cat > gen/Tupfile << HERE
+: |> echo a > %o |> a.gen
+run ./copy.sh
+HERE
+update
+check_exist gen/a.copy
+
+cat > gen/Tupfile << HERE
+: |> echo b > %o |> b.gen
+run ./copy.sh
+HERE
+tup parse > .output.txt 2>&1
+check_ran copy.sh "when an output above it is renamed"
+update
+check_exist gen/b.copy
+check_not_exist gen/a.gen gen/a.copy
+
+# Only the command lines that still run are kept.
+cat > gen/Tupfile << HERE
+: |> echo b > %o |> b.gen
+run ./copy.sh b
+HERE
+update
+if [ "$(sqlite3 .tup/db "select cmdline from run_script where cmdline like './copy.sh%'")" != "./copy.sh b" ]; then
+	echo "Error: Expected only the new run-script command line to be stored." 1>&2
+	exit 1
+fi
+
+# A new file in a preloaded directory.
+mkdir pre pre/src
+cat > pre/list.sh << HERE
+#! /bin/sh
+echo "list.sh ran" 1>&2
+for i in src/*.c; do
+	echo ": \$i |> gcc -c %f -o %o |> %B.o"
+done
+HERE
+chmod +x pre/list.sh
+cat > pre/Tupfile << HERE
+preload src
+run ./list.sh
+HERE
+touch pre/src/a.c
+update
+check_exist pre/a.o
+
+touch pre/src/b.c
+tup parse > .output.txt 2>&1
+check_ran list.sh "when a file is added to a preloaded directory"
+update
+check_exist pre/a.o pre/b.o
+
+# A change to an exported environment variable.
+mkdir env
+cat > env/env.sh << HERE
+#! /bin/sh
+echo "env.sh ran" 1>&2
+echo ": |> echo \$FOO > %o |> \$FOO.txt"
+HERE
+chmod +x env/env.sh
+cat > env/Tupfile << HERE
+export FOO
+run ./env.sh
+HERE
+export FOO=one
+update
+check_exist env/one.txt
+
+export FOO=two
+tup parse > .output.txt 2>&1
+check_ran env.sh "when an exported variable changes"
+update
+check_exist env/two.txt
+check_not_exist env/one.txt
+
+# A script that checks for a file that doesn't exist yet, outside of any
+# directory that it lists.
+mkdir exist other
+cat > exist/check.sh << HERE
+#! /bin/sh
+echo "check.sh ran" 1>&2
+if [ -f ../other/extra.c ]; then
+	echo ": ../other/extra.c |> gcc -c %f -o %o |> %B.o"
+fi
+HERE
+chmod +x exist/check.sh
+cat > exist/Tupfile << HERE
+run ./check.sh
+HERE
+update
+check_not_exist exist/extra.o
+
+touch other/extra.c
+tup parse > .output.txt 2>&1
+check_ran check.sh "when a file it looked for is created"
+update
+check_exist exist/extra.o
+
+eotup
@@ -25,7 +25,7 @@ echo "int main(void) {}" > foo.c
 echo "void bar1(void) {}" > bar.c
 update
 
-touch Tupfile
+echo "# changed" >> Tupfile
 tup todo | grep 'Tup phase 2'
 parse
 
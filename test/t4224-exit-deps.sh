@@ -0,0 +1,53 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2022-2024  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Make sure file accesses are still recorded when a program leaves through
+# _exit(), which skips the usual exit handlers.
+. ./tup.sh
+cat > ok.c << HERE
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+int main(void)
+{
+	FILE *f = fopen("foo.txt", "r");
+	if(!f)
+		return 1;
+	fclose(f);
+	if(fork() == 0) {
+		f = fopen("bar.txt", "r");
+		if(f)
+			fclose(f);
+		_exit(0);
+	}
+	wait(NULL);
+	_exit(0);
+}
+HERE
+cat > Tupfile << HERE
+: ok.c |> gcc %f -o %o |> ok.exe
+: ok.exe |> ./ok.exe |>
+HERE
+touch foo.txt bar.txt
+update
+
+tup_dep_exist . foo.txt . ./ok.exe
+tup_dep_exist . bar.txt . ./ok.exe
+
+eotup
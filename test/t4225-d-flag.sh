@@ -0,0 +1,64 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2022-2024  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Test the 'd' flag, which reads a command's dependencies from the depfile it
+# writes instead of monitoring the sub-process.
+
+. ./tup.sh
+
+mkdir inc
+cat > foo.c << HERE
+#include "inc/foo.h"
+int foo(void) {return FOO;}
+HERE
+echo '#define FOO 3' > inc/foo.h
+
+# The depfile lists headers even though the command never reads them.
+cat > mkdep.sh << 'HERE'
+printf 'bar.o: bar.h \\\n baz\\ file.h\n' > bar.d
+touch bar.o
+HERE
+cat > Tupfile << HERE
+: foo.c |> ^d^ gcc -MD -c %f -o %o |> foo.o | foo.d
+: |> ^d^ sh mkdep.sh |> bar.o | bar.d
+HERE
+touch bar.h 'baz file.h'
+update
+
+tup_dep_exist . foo.c . 'gcc -MD -c foo.c -o foo.o'
+tup_dep_exist inc foo.h . 'gcc -MD -c foo.c -o foo.o'
+tup_dep_exist . bar.h . 'sh mkdep.sh'
+tup_dep_exist . 'baz file.h' . 'sh mkdep.sh'
+
+echo '#define FOO 4' > inc/foo.h
+update
+check_updates inc/foo.h foo.o
+
+# A missing depfile is an error.
+cat > Tupfile << HERE
+: foo.c |> ^d^ gcc -c %f -o %o |> foo.o | foo.d
+HERE
+update_fail_msg "depfile './foo.d' was not created"
+
+# So is a command that doesn't declare one.
+cat > Tupfile << HERE
+: foo.c |> ^d^ gcc -c %f -o %o |> foo.o
+HERE
+update_fail_msg "none of its outputs is a depfile"
+
+eotup
@@ -0,0 +1,57 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2022-2024  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Several commands read the same external file. Each one should get the
+# dependency, even though the path is only resolved once per update.
+. ./tup.sh
+check_no_windows tmp
+check_tup_suid
+
+set_full_deps
+
+tmpdir="/tmp/tup-t4226-$$"
+cleanup()
+{
+	cd /tmp
+	rm -rf $tmpdir
+	cd - > /dev/null
+}
+
+trap cleanup EXIT INT TERM
+cleanup
+mkdir $tmpdir
+
+echo 'hey' > $tmpdir/shared.h
+
+cat > Tupfile << HERE
+: foreach a.c b.c c.c |> cat $tmpdir/shared.h %f > %o |> %B.out
+HERE
+touch a.c b.c c.c
+update
+
+for i in a b c; do
+	tup_dep_exist $tmpdir shared.h . "cat $tmpdir/shared.h $i.c > $i.out"
+done
+
+tup fake_mtime $tmpdir/shared.h 5
+if [ "$(tup | grep -c 'cat ')" != 3 ]; then
+	echo "Error: Changing $tmpdir/shared.h should have re-run all three commands." 1>&2
+	exit 1
+fi
+
+eotup
@@ -0,0 +1,49 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2022-2024  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+
+# Make sure file reads are still recorded when a program is killed by a
+# signal before it gets a chance to send them to the server.
+. ./tup.sh
+cat > ok.c << HERE
+#include <stdio.h>
+#include <signal.h>
+
+int main(void)
+{
+	FILE *f = fopen("foo.txt", "r");
+	if(!f)
+		return 1;
+	fclose(f);
+	f = fopen("bar.txt", "r");
+	if(!f)
+		return 1;
+	fclose(f);
+	raise(SIGKILL);
+	return 0;
+}
+HERE
+cat > Tupfile << HERE
+: ok.c |> gcc %f -o %o |> ok.exe
+: ok.exe |> ./ok.exe | true |>
+HERE
+touch foo.txt bar.txt
+update
+
+tup_dep_exist . foo.txt . './ok.exe | true'
+tup_dep_exist . bar.txt . './ok.exe | true'
+
+eotup
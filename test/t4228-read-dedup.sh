@@ -0,0 +1,83 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2022-2024  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+
+# The ldpreload shim drops reads of a path it already reported. Make sure
+# that reading lots of different files (enough to fill up the set), reading
+# them repeatedly, and reading the same name from another directory or in a
+# forked child still records every dependency.
+. ./tup.sh
+cat > ok.c << HERE
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+static int readfile(const char *name)
+{
+	FILE *f = fopen(name, "r");
+	if(!f) {
+		perror(name);
+		return -1;
+	}
+	fclose(f);
+	return 0;
+}
+
+int main(void)
+{
+	char name[32];
+	int x;
+	int y;
+
+	for(y=0; y<2; y++) {
+		for(x=0; x<2500; x++) {
+			snprintf(name, sizeof(name), "files/f%i.txt", x);
+			if(readfile(name) < 0)
+				return 1;
+		}
+	}
+	if(readfile("foo.txt") < 0)
+		return 1;
+	if(fork() == 0) {
+		if(readfile("foo.txt") < 0 || readfile("bar.txt") < 0)
+			_exit(1);
+		_exit(0);
+	}
+	wait(NULL);
+	if(chdir("sub") < 0)
+		return 1;
+	if(readfile("foo.txt") < 0)
+		return 1;
+	return 0;
+}
+HERE
+cat > Tupfile << HERE
+: ok.c |> gcc %f -o %o |> ok.exe
+: ok.exe |> ./ok.exe |>
+HERE
+mkdir files sub
+for i in `seq 0 2499`; do touch files/f$i.txt; done
+touch foo.txt bar.txt sub/foo.txt
+update
+
+tup_dep_exist files f0.txt . ./ok.exe
+tup_dep_exist files f1500.txt . ./ok.exe
+tup_dep_exist files f2499.txt . ./ok.exe
+tup_dep_exist . foo.txt . ./ok.exe
+tup_dep_exist . bar.txt . ./ok.exe
+tup_dep_exist sub foo.txt . ./ok.exe
+
+eotup
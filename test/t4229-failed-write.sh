@@ -0,0 +1,53 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2022-2024  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+
+# Opening a file for writing that fails shouldn't count as a write. The
+# seccomp server sees the open before it happens, so it has to wait for the
+# result.
+. ./tup.sh
+cat > ok.c << HERE
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+
+int main(void)
+{
+	if(open("foo.txt", O_WRONLY | O_CREAT | O_EXCL, 0666) >= 0) {
+		fprintf(stderr, "Expected O_EXCL open to fail.\\n");
+		return 1;
+	}
+	if(errno != EEXIST) {
+		perror("foo.txt");
+		return 1;
+	}
+	if(open("nodir/bar.txt", O_WRONLY | O_CREAT, 0666) >= 0) {
+		fprintf(stderr, "Expected open in a missing directory to fail.\\n");
+		return 1;
+	}
+	return 0;
+}
+HERE
+cat > Tupfile << HERE
+: ok.c |> gcc %f -o %o |> ok.exe
+: ok.exe |> ./ok.exe |>
+HERE
+echo hey > foo.txt
+update
+
+echo hey | diff - foo.txt
+
+eotup
@@ -0,0 +1,62 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2022-2024  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+
+# Statically linked programs don't go through the LD_PRELOAD shim, but the
+# other servers should still see what they access.
+. ./tup.sh
+check_no_ldpreload static
+if ! echo 'int main(void) {return 0;}' | gcc -static -x c - -o /dev/null > /dev/null 2>&1; then
+	echo "No static libc found. Skipping test."
+	eotup
+fi
+cat > ok.c << HERE
+#include <stdio.h>
+
+int main(void)
+{
+	char buf[32];
+	FILE *f;
+
+	f = fopen("foo.txt", "r");
+	if(!f)
+		return 1;
+	if(!fgets(buf, sizeof(buf), f))
+		return 1;
+	fclose(f);
+	f = fopen("out.txt", "w");
+	if(!f)
+		return 1;
+	fputs(buf, f);
+	fclose(f);
+	return 0;
+}
+HERE
+cat > Tupfile << HERE
+: ok.c |> gcc -static %f -o %o |> ok.exe
+: ok.exe |> ./ok.exe |> out.txt
+HERE
+echo hey > foo.txt
+update
+
+tup_dep_exist . foo.txt . ./ok.exe
+echo hey | diff - out.txt
+
+echo there > foo.txt
+update
+echo there | diff - out.txt
+
+eotup
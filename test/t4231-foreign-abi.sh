@@ -0,0 +1,54 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2022-2024  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+
+# The seccomp server only knows the syscall numbers of the native ABI, so
+# 32-bit syscalls from an x86_64 program have to fail instead of going
+# unseen.
+. ./tup.sh
+if [ "`tup server`" != "seccomp" ]; then
+	echo "Only the seccomp server filters syscalls. Skipping test."
+	eotup
+fi
+if [ "`uname -m`" != "x86_64" ]; then
+	echo "Only x86_64 has a second syscall ABI to test. Skipping test."
+	eotup
+fi
+cat > ok.c << HERE
+#include <stdio.h>
+
+static const char name[] = "foo.txt";
+
+int main(void)
+{
+	long rc;
+
+	/* open("foo.txt", O_RDONLY) through the i386 entry point. */
+	__asm__ volatile("int \$0x80" : "=a"(rc) : "a"(5), "b"(name), "c"(0) : "memory");
+	printf("rc=%li\\n", rc);
+	return rc == -1 ? 0 : 1;
+}
+HERE
+cat > Tupfile << HERE
+: ok.c |> gcc -no-pie %f -o %o |> ok.exe
+: ok.exe |> ./ok.exe > %o |> out.txt
+HERE
+touch foo.txt
+update
+
+echo 'rc=-1' | diff - out.txt
+
+eotup
@@ -0,0 +1,35 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2022-2024  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+
+# Files a command creates get the command's umask, and a temporary directory
+# that it creates and removes again is fine.
+. ./tup.sh
+check_no_windows umask
+cat > Tupfile << HERE
+: |> umask 0; touch %o |> out.txt
+: |> mkdir tmp; echo hey > tmp/x; cat tmp/x > %o; rm tmp/x; rmdir tmp |> out2.txt
+HERE
+update
+
+if [ "`stat -c %a out.txt`" != "666" ]; then
+	echo "Error: Expected out.txt to have mode 666, got `stat -c %a out.txt`" 1>&2
+	exit 1
+fi
+echo hey | diff - out2.txt
+check_not_exist tmp
+
+eotup
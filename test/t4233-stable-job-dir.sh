@@ -0,0 +1,34 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2022-2024  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# Without namespacing, the FUSE job directory is the working directory that a
+# command sees. It needs to stay the same when the command is re-run, since
+# compilers and the like embed the cwd into their outputs.
+. ./tup.sh
+
+export TUP_NO_NAMESPACING=1
+cat > Tupfile << HERE
+: foo.txt |> cat foo.txt > /dev/null; pwd -P > %o |> out.txt
+HERE
+touch foo.txt
+update
+cp out.txt first.txt
+
+echo hey > foo.txt
+update
+diff first.txt out.txt
+
+eotup
@@ -0,0 +1,62 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2024  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Make sure that with updater.commit_jobs set, the results of completed jobs
+# are kept even if tup is killed later in the update.
+. ./tup.sh
+check_no_windows shell
+
+cat > .tup/options << HERE
+[updater]
+num_jobs = 1
+commit_jobs = 1
+HERE
+
+# Ignore errors, since the killed tup makes for a bad-looking error message.
+# We check the return value of tup below.
+exec 2>/dev/null
+
+cat > die.sh << HERE
+while [ ! -f pid.txt ]; do true; done
+kill -9 \`cat pid.txt\`
+HERE
+cat > Tupfile << HERE
+: |> echo foo > %o |> foo.txt
+: foo.txt |> sh die.sh |>
+HERE
+
+tup upd &
+pid=$!
+echo $pid > pid.txt
+
+if wait $pid; then
+	echo "Error: Expected the spawned tup process to fail." 1>&2
+	exit 1
+fi
+
+tup todo > .tup/todo.txt
+if ! grep 'The following 1 command' .tup/todo.txt > /dev/null; then
+	cat .tup/todo.txt
+	echo "Error: Expected only the killed command to remain" 1>&2
+	exit 1
+fi
+
+echo 'echo done' > die.sh
+update
+
+eotup
@@ -0,0 +1,53 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2024  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Commands that probe lots of missing files in the same directory make
+# node_select() load the whole directory from the database. Make sure the
+# ghost dependencies still work after that, both for ghosts already in the
+# database and ones that are new.
+
+. ./tup.sh
+
+mkdir inc
+cat > probe.sh << 'HERE'
+for i in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20; do
+	if [ -f inc/p$i ]; then cat inc/p$i; fi
+done
+HERE
+cat > Tupfile << HERE
+: |> sh probe.sh > %o |> out.txt
+HERE
+update
+
+tup_dep_exist inc p3 . 'sh probe.sh > out.txt'
+tup_dep_exist inc p20 . 'sh probe.sh > out.txt'
+
+# Run the command again with all the ghosts in the database.
+echo '# changed' >> probe.sh
+update
+tup_dep_exist inc p15 . 'sh probe.sh > out.txt'
+
+echo foo > inc/p15
+update
+echo foo | diff - out.txt
+
+echo bar > inc/p2
+update
+printf 'bar\nfoo\n' | diff - out.txt
+
+eotup
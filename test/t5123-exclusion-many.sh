@@ -0,0 +1,48 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2022-2024  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+
+# Ignore outputs with several exclusions, where the ones that match aren't the
+# first in the list and one uses a backreference.
+
+. ./tup.sh
+
+cat > Tupfile << HERE
+: |> sh run.sh |> output.txt ^/nomatch ^\\\\.tmp\$ ^/ignore
+HERE
+cat > run.sh << HERE
+touch output.txt
+touch foo.tmp
+touch ignore1
+HERE
+update
+
+check_exist foo.tmp ignore1
+
+cat > Tupfile << HERE
+: |> sh run.sh |> output.txt ^/nomatch ^\\\\.tmp\$ ^/(q)\\\\1\\\\.txt ^/ignore
+HERE
+echo "touch qq.txt" >> run.sh
+update
+
+check_exist qq.txt
+
+cat > Tupfile << HERE
+: |> sh run.sh |> output.txt ^/nomatch ^\\\\.tmp\$ ^/ignore
+HERE
+update_fail_msg "Unspecified output files"
+
+eotup
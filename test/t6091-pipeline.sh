@@ -0,0 +1,91 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2024  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# With updater.pipeline, commands that can't be affected by the Tupfiles being
+# parsed run early. Everything else waits for the normal update phase.
+
+. ./tup.sh
+check_pipeline_supported
+(echo "[updater]"; echo "pipeline=1"; echo "num_jobs=2") >> .tup/options
+
+mkdir sub1
+mkdir sub2
+mkdir sub3
+cat > sub1/Tupfile << HERE
+: foreach *.c |> cat %f > %o |> %B.o
+HERE
+cat > sub2/Tupfile << HERE
+: foreach *.c |> cat %f > %o |> %B.o
+: ../sub1/foo.o |> cat %f > %o |> copy.o
+HERE
+cat > sub3/Tupfile << HERE
+: foreach *.c |> cat %f > %o |> %B.o
+HERE
+echo a > sub1/foo.c
+echo b > sub2/bar.c
+echo c > sub3/baz.c
+update
+
+echo a2 > sub1/foo.c
+echo b2 > sub2/bar.c
+echo c2 > sub3/baz.c
+echo "# changed" >> sub1/Tupfile
+update --debug-logging
+
+# sub1 is re-parsed, and so is sub2 since it uses an output from sub1. Only
+# the command in sub3 can run early.
+log_graph_good pipeline 'cat baz.c'
+log_graph_bad pipeline 'cat bar.c'
+log_graph_bad pipeline 'cat foo.c'
+log_graph_bad pipeline 'copy.o'
+gitignore_good a2 sub1/foo.o
+gitignore_good a2 sub2/copy.o
+gitignore_good b2 sub2/bar.o
+gitignore_good c2 sub3/baz.o
+update_null "No more work after a pipelined update"
+
+# A parse error still fails the update, and anything that ran early is redone
+# next time.
+echo c3 > sub3/baz.c
+echo 'this is bad' > sub1/Tupfile
+update_fail_msg "Syntax error parsing Tupfile"
+tup_object_exist sub3 'cat baz.c > baz.o'
+cat > sub1/Tupfile << HERE
+: foreach *.c |> cat %f > %o |> %B.o
+HERE
+update
+check_updates sub3/baz.c sub3/baz.o
+gitignore_good c3 sub3/baz.o
+update_null "No more work after fixing the Tupfile"
+
+# A pipelined command that fails stops the update.
+echo 'true' > sub3/fail.sh
+cat > sub3/Tupfile << HERE
+: foreach *.c |> cat %f > %o |> %B.o
+: |> sh fail.sh && touch %o |> fail.out
+HERE
+update
+echo 'false' > sub3/fail.sh
+echo "# changed" >> sub1/Tupfile
+update_fail_msg "1 job failed"
+echo 'true' > sub3/fail.sh
+update
+check_exist sub3/fail.out
+update_null "No more work after fixing the command"
+
+eotup
@@ -0,0 +1,76 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2009-2024  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Creating or deleting a file should only re-parse the directories that
+# globbed a matching name.
+. ./tup.sh
+
+check_no_create()
+{
+	if ! tup create_flags_exists; then
+		echo "*** No directories should be flagged for re-parsing after $1" 1>&2
+		exit 1
+	fi
+}
+
+check_create()
+{
+	if tup create_flags_exists; then
+		echo "*** Expected a directory to be flagged for re-parsing after $1" 1>&2
+		exit 1
+	fi
+}
+
+mkdir sub
+cat > Tupfile << HERE
+: foreach *.c |> gcc -c %f -o %o |> %B.o
+HERE
+cat > sub/Tupfile << HERE
+: foreach ../*.h |> cp %f %o |> %b
+HERE
+touch foo.c bar.h
+update
+check_exist foo.o sub/bar.h
+
+touch .foo.c.swp foo.c~
+tup scan
+check_no_create "creating unrelated files"
+
+rm .foo.c.swp foo.c~
+tup scan
+check_no_create "deleting unrelated files"
+
+touch baz.c
+tup scan
+check_create "creating baz.c"
+update
+check_exist baz.o
+
+touch new.h
+tup scan
+check_create "creating new.h"
+update
+check_exist sub/new.h
+
+rm baz.c new.h
+tup scan
+check_create "deleting baz.c and new.h"
+update
+check_not_exist baz.o sub/new.h
+
+eotup
@@ -0,0 +1,70 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2009-2024  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Touching a Tupfile or an included file without changing its contents should
+# not re-parse the directories that read it.
+. ./tup.sh
+
+check_no_create()
+{
+	if ! tup create_flags_exists; then
+		echo "*** No directories should be flagged for re-parsing after $1" 1>&2
+		exit 1
+	fi
+}
+
+check_create()
+{
+	if tup create_flags_exists; then
+		echo "*** Expected a directory to be flagged for re-parsing after $1" 1>&2
+		exit 1
+	fi
+}
+
+mkdir sub
+cat > Tuprules.tup << HERE
+CFLAGS = -Wall
+HERE
+cat > sub/Tupfile << HERE
+include_rules
+: foreach *.c |> gcc \$(CFLAGS) -c %f -o %o |> %B.o
+HERE
+touch sub/foo.c
+update
+check_exist sub/foo.o
+
+# Give the mtime a chance to change.
+sleep 1
+touch sub/Tupfile Tuprules.tup
+tup scan
+check_no_create "touching the Tupfile and Tuprules.tup"
+update
+
+echo 'CFLAGS = -Wall -O0' > Tuprules.tup
+tup scan
+check_create "changing Tuprules.tup"
+update
+tup_object_exist sub 'gcc -Wall -O0 -c foo.c -o foo.o'
+
+echo ': foreach *.c |> gcc -c %f -o %o |> %B.o' > sub/Tupfile
+tup scan
+check_create "changing the Tupfile"
+update
+tup_object_exist sub 'gcc -c foo.c -o foo.o'
+
+eotup
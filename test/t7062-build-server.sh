@@ -0,0 +1,85 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2024  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Run updates through the monitor's build server.
+
+. ./tup.sh
+check_monitor_supported
+(echo "[monitor]"; echo "build_server=1"; echo "metrics_file=.tup/monitor.prom") >> .tup/options
+monitor
+
+if [ ! -S .tup/monitor.sock ]; then
+	echo "Error: Build server socket not created." 1>&2
+	exit 1
+fi
+
+mkdir sub
+cat > sub/Tupfile << HERE
+export FOO
+: foreach *.txt |> (echo \$FOO; cat %f) > %o |> %B.out
+HERE
+echo hey > sub/a.txt
+export FOO=one
+update
+
+(echo one; echo hey) | diff - sub/a.out
+
+# The environment and working directory come from the client
+echo there > sub/b.txt
+export FOO=two
+cd sub
+update
+cd ..
+(echo two; echo hey) | diff - sub/a.out
+(echo two; echo there) | diff - sub/b.out
+
+# New and deleted files are picked up by the build server
+rm sub/a.txt
+echo new > sub/c.txt
+update
+check_not_exist sub/a.out
+check_exist sub/b.out sub/c.out
+
+# Failures are passed back to the client
+cat > sub/Tupfile << HERE
+: |> false |> bad.out
+HERE
+update_fail_msg "failed with return value 1"
+
+# Make sure the monitor ran all of the updates, rather than the client falling
+# back to running them itself. The metrics file is written at most once a
+# second.
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	if grep '^tup_monitor_builds_served_total{.*} 4$' .tup/monitor.prom > /dev/null 2>&1; then
+		break
+	fi
+	sleep 0.5
+done
+if ! grep '^tup_monitor_builds_served_total{.*} 4$' .tup/monitor.prom > /dev/null; then
+	echo "Error: Expected the build server to run 4 updates." 1>&2
+	cat .tup/monitor.prom 1>&2
+	exit 1
+fi
+
+stop_monitor
+if [ -S .tup/monitor.sock ]; then
+	echo "Error: Build server socket not removed." 1>&2
+	exit 1
+fi
+
+eotup
@@ -0,0 +1,55 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2024  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# When the monitor restarts, directories that haven't changed since it last
+# scanned them are only validated by stat. Make sure changes made while the
+# monitor was off are still picked up.
+
+. ./tup.sh
+check_monitor_supported
+
+mkdir a b c
+for i in a b c; do
+	echo ': foreach *.c |> cp %f %o |> %B.o' > $i/Tupfile
+done
+echo foo > a/foo.c
+echo bar > b/bar.c
+echo baz > c/baz.c
+update
+
+# Directory mtimes that are too recent aren't saved.
+sleep 2
+monitor
+stop_monitor
+
+echo foo2 > a/foo.c
+echo new > b/new.c
+rm c/baz.c
+monitor
+update
+echo foo2 | diff - a/foo.o
+echo new | diff - b/new.o
+check_not_exist c/baz.o
+stop_monitor
+
+# Nothing changed this time.
+monitor
+update_null "No files should have changed"
+stop_monitor
+
+eotup
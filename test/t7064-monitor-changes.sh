@@ -0,0 +1,133 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2024  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Ask the monitor what changed with 'tup changes'.
+
+. ./tup.sh
+check_monitor_supported
+(echo "[monitor]"; echo "journal_size=4") >> .tup/options
+mkdir sub
+touch foo.c sub/bar.c
+monitor
+tup flush
+
+# Without a clock, the client has to assume everything changed. The output
+# goes in .tup so it doesn't show up as a change itself.
+tup changes > .tup/out.txt
+if [ "$(sed -n 2p .tup/out.txt)" != "*" ]; then
+	echo "Error: Expected '*' without a clock." 1>&2
+	exit 1
+fi
+clock=$(head -n 1 .tup/out.txt)
+
+# Nothing changed yet
+tup changes $clock > .tup/out.txt
+if [ "$(wc -l < .tup/out.txt)" != "1" ]; then
+	echo "Error: Expected no changes." 1>&2
+	cat .tup/out.txt 1>&2
+	exit 1
+fi
+clock=$(head -n 1 .tup/out.txt)
+
+echo hey > foo.c
+touch sub/new.c
+tup flush
+tup changes $clock > .tup/out.txt
+clock2=$(head -n 1 .tup/out.txt)
+sed 1d .tup/out.txt | sort > .tup/sorted.txt
+(echo foo.c; echo sub/new.c) | diff - .tup/sorted.txt
+
+# Changes are only reported since the clock we pass in, and each path is only
+# listed once.
+echo hey >> sub/bar.c
+echo there >> sub/bar.c
+mv sub/new.c sub/moved.c
+tup flush
+tup changes $clock2 > .tup/out.txt
+sed 1d .tup/out.txt | sort > .tup/sorted.txt
+(echo sub/bar.c; echo sub/moved.c; echo sub/new.c) | diff - .tup/sorted.txt
+
+# The older clock still sees everything.
+tup changes $clock > .tup/out.txt
+sed 1d .tup/out.txt | sort > .tup/sorted.txt
+(echo foo.c; echo sub/bar.c; echo sub/moved.c; echo sub/new.c) | diff - .tup/sorted.txt
+
+# Once the journal fills up, the oldest clock can't be answered anymore.
+touch a.c b.c
+tup flush
+tup changes $clock > .tup/out.txt
+if [ "$(sed -n 2p .tup/out.txt)" != "*" ]; then
+	echo "Error: Expected '*' after the journal dropped changes." 1>&2
+	exit 1
+fi
+
+# A client that sends part of a request and then stops doesn't hold up anyone
+# else. It only exits once the monitor drops it.
+cat > .tup/stuck.c << HERE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+int main(void)
+{
+	struct sockaddr_un addr;
+	char c;
+	int sd;
+
+	sd = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, ".tup/monitor.sock");
+	if(connect(sd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		perror("connect");
+		return 1;
+	}
+	if(write(sd, "x", 1) != 1) {
+		perror("write");
+		return 1;
+	}
+	close(open(".tup/connected", O_WRONLY | O_CREAT, 0666));
+	while(read(sd, &c, 1) > 0) {}
+	return 0;
+}
+HERE
+gcc .tup/stuck.c -o .tup/stuck.exe
+.tup/stuck.exe &
+stuck_pid=$!
+while [ ! -f .tup/connected ]; do sleep 0.1; done
+tup changes $clock > .tup/out.txt
+if ! kill -0 $stuck_pid 2>/dev/null; then
+	echo "Error: Expected 'tup changes' to be answered while another client is stuck." 1>&2
+	exit 1
+fi
+wait $stuck_pid
+
+# A clock from a different monitor isn't valid.
+stop_monitor
+monitor
+tup changes $clock2 > .tup/out.txt
+if [ "$(sed -n 2p .tup/out.txt)" != "*" ]; then
+	echo "Error: Expected '*' after the monitor restarted." 1>&2
+	exit 1
+fi
+stop_monitor
+
+eotup
@@ -0,0 +1,52 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2024  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Have the monitor write out its metrics.
+
+. ./tup.sh
+check_monitor_supported
+(echo "[monitor]"; echo "metrics_file=.tup/monitor.prom") >> .tup/options
+monitor
+tup flush
+
+touch foo.c
+tup flush
+
+# The file is written at most once a second.
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	if grep '^tup_monitor_events_received_total{.*} [1-9]' .tup/monitor.prom > /dev/null 2>&1; then
+		break
+	fi
+	sleep 0.5
+done
+if ! grep '^tup_monitor_events_received_total{.*} [1-9]' .tup/monitor.prom > /dev/null; then
+	echo "Error: Expected events to be counted in the metrics file." 1>&2
+	exit 1
+fi
+for i in tup_monitor_watches tup_monitor_locked; do
+	if ! grep "^$i{top=\".*\"} 1\$" .tup/monitor.prom > /dev/null; then
+		echo "Error: Expected $i to be 1." 1>&2
+		cat .tup/monitor.prom 1>&2
+		exit 1
+	fi
+done
+
+stop_monitor
+check_not_exist .tup/monitor.prom
+
+eotup
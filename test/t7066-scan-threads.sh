@@ -0,0 +1,100 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2022-2024  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# Scan and monitor a deep tree with several scanner threads, and make sure every
+# directory and file ends up in the database and the monitor watches every
+# directory.
+. ./tup.sh
+check_monitor_supported
+(echo "[updater]"; echo "num_jobs=4") >> .tup/options
+(echo "[monitor]"; echo "metrics_file=.tup/monitor.prom") >> .tup/options
+
+depth=25
+dirs=0
+for top in a b c d; do
+	path=$top
+	for i in `seq 1 $depth`; do
+		mkdir -p $path/side
+		touch $path/f1.c $path/f2.c $path/side/s.c
+		path=$path/d$i
+		dirs=$((dirs + 2))
+	done
+done
+
+check_tree()
+{
+	for top in a b c d; do
+		path=$top
+		for i in `seq 1 $depth`; do
+			tup_object_exist $path f1.c f2.c side
+			if [ $i -lt $depth ]; then
+				tup_object_exist $path d$i
+			fi
+			tup_object_exist $path/side s.c
+			path=$path/d$i
+		done
+	done
+}
+
+tup scan
+check_tree
+
+# Remove and add files deep in the tree.
+rm a/d1/d2/d3/d4/d5/d6/d7/d8/d9/d10/f1.c
+rm -rf b/d1/d2/d3/d4/d5/d6/d7/d8/d9/d10/side
+touch c/d1/d2/d3/d4/d5/d6/d7/d8/d9/d10/new.c
+tup scan
+tup_object_no_exist a/d1/d2/d3/d4/d5/d6/d7/d8/d9/d10 f1.c
+tup_object_no_exist b/d1/d2/d3/d4/d5/d6/d7/d8/d9/d10 side
+tup_object_exist c/d1/d2/d3/d4/d5/d6/d7/d8/d9/d10 new.c
+touch a/d1/d2/d3/d4/d5/d6/d7/d8/d9/d10/f1.c
+mkdir b/d1/d2/d3/d4/d5/d6/d7/d8/d9/d10/side
+touch b/d1/d2/d3/d4/d5/d6/d7/d8/d9/d10/side/s.c
+tup scan
+check_tree
+
+# The monitor's initial scan uses the same threads, and has to add a watch for
+# every directory (plus the top) before it picks up changes.
+monitor
+rm d/d1/d2/d3/d4/d5/d6/d7/d8/d9/d10/d11/d12/d13/d14/d15/d16/d17/d18/d19/d20/f2.c
+mkdir d/d1/d2/d3/d4/d5/d6/d7/d8/d9/d10/d11/d12/d13/d14/d15/d16/d17/d18/d19/d20/late
+touch d/d1/d2/d3/d4/d5/d6/d7/d8/d9/d10/d11/d12/d13/d14/d15/d16/d17/d18/d19/d20/late/x.c
+tup flush
+tup_object_no_exist d/d1/d2/d3/d4/d5/d6/d7/d8/d9/d10/d11/d12/d13/d14/d15/d16/d17/d18/d19/d20 f2.c
+tup_object_exist d/d1/d2/d3/d4/d5/d6/d7/d8/d9/d10/d11/d12/d13/d14/d15/d16/d17/d18/d19/d20/late x.c
+
+# The metrics file is written at most once a second.
+expected=$((dirs + 2))
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	if grep "^tup_monitor_watches{.*} $expected\$" .tup/monitor.prom > /dev/null 2>&1; then
+		break
+	fi
+	sleep 0.5
+done
+if ! grep "^tup_monitor_watches{.*} $expected\$" .tup/monitor.prom > /dev/null; then
+	echo "Error: Expected $expected watches." 1>&2
+	cat .tup/monitor.prom 1>&2
+	exit 1
+fi
+stop_monitor
+
+touch d/d1/d2/d3/d4/d5/d6/d7/d8/d9/d10/d11/d12/d13/d14/d15/d16/d17/d18/d19/d20/f2.c
+rm -rf d/d1/d2/d3/d4/d5/d6/d7/d8/d9/d10/d11/d12/d13/d14/d15/d16/d17/d18/d19/d20/late
+tup scan
+check_tree
+tup_object_no_exist d/d1/d2/d3/d4/d5/d6/d7/d8/d9/d10/d11/d12/d13/d14/d15/d16/d17/d18/d19/d20 late
+
+eotup
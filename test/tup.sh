@@ -669,19 +669,42 @@ check_windows()
 	eotup
 }
 
+check_pipeline_supported()
+{
+	case `tup server` in
+	ldpreload|seccomp)
+		;;
+	*)
+		echo "Pipelining is not supported by this server. Skipping test."
+		eotup
+	esac
+}
+
 check_no_ldpreload()
 {
 	case `tup server` in
 	ldpreload)
 		echo "[33mSkipping test for LD_PRELOAD shim in Linux: $1[0m"
 		eotup
+		;;
+	seccomp)
+		# The seccomp server sees syscalls like mkdir and chmod, and
+		# static binaries, but commands still run on the real
+		# filesystem.
+		case $1 in
+		mozilla-unneeded|static)
+			;;
+		*)
+			echo "[33mSkipping test for seccomp server: $1[0m"
+			eotup
+		esac
 	esac
 }
 
 check_no_windows()
 {
 	case `tup server` in
-	ldpreload)
+	ldpreload|seccomp)
 		# The LD_PRELOAD shim doesn't support run-scripts or the client library.
 		for var in "$@"; do
 			if [ "$var" = "run-script" ]; then